@@ -2,6 +2,8 @@
 #include <QString>
 #include <QVariant>
 
+#include <opencv2/highgui.hpp>
+
 #include "WorkerThread.hpp"
 #include "camera_control.hpp"
 
@@ -11,14 +13,12 @@ void WorkerThread::setConfig(const QMap<QString, QVariant> & config) {
 
 void WorkerThread::run() {
 
-    bool cool_down = (mConfig["camera-cool-down"].toString() == "1");
-    bool warm_up   = (mConfig["camera-warm-up"].toString() == "1");
+    // Show previews in the window created by main().
+    CaptureCallbacks callbacks;
+    callbacks.preview = [](const cv::Mat & preview) {
+        cv::imshow("display_window", preview);
+        cv::waitKey(1);
+    };
 
-    if(cool_down || warm_up) {
-        runCooler(mConfig);
-    } else {
-        takeExposures(mConfig);
-    }
+    runCapture(mConfig, callbacks);
 }
-
-
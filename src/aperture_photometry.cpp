@@ -0,0 +1,234 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "aperture_photometry.hpp"
+#include "datetime_utilities.hpp"
+
+namespace {
+/// Sub-pixels per axis used to find the fraction of an edge pixel inside the aperture.
+const int EDGE_SUBSAMPLES = 5;
+
+/// Refinement steps for the centroid.
+const int CENTROID_ITERATIONS = 3;
+
+/// Modified Julian Date of the UNIX epoch.
+const double MJD_UNIX_EPOCH = 40587.0;
+
+double toMJD(const std::chrono::time_point<std::chrono::high_resolution_clock> & t) {
+    double seconds = std::chrono::duration<double>(t.time_since_epoch()).count();
+    return MJD_UNIX_EPOCH + seconds / 86400.0;
+}
+}
+
+AperturePhotometry::AperturePhotometry(int search_radius, double aperture, double annulus_inner, double annulus_outer,
+                                       double electrons_per_adu)
+    : mSearchRadius(std::max(search_radius, 1)), mAperture(aperture),
+      mAnnulusInner(std::max(annulus_inner, aperture)), mAnnulusOuter(std::max(annulus_outer, annulus_inner + 1)),
+      mElectronsPerADU(electrons_per_adu > 0 ? electrons_per_adu : 1) {
+}
+
+cv::Point2d AperturePhotometry::centroid(const cv::Mat & image, const cv::Point2d & guess) const {
+
+    cv::Rect search(guess.x - mSearchRadius, guess.y - mSearchRadius, 2 * mSearchRadius + 1, 2 * mSearchRadius + 1);
+    search &= cv::Rect(0, 0, image.cols, image.rows);
+    if(search.empty())
+        return cv::Point2d(-1, -1);
+
+    // Start from the brightest point of a smoothed copy so hot pixels are ignored.
+    cv::Mat smoothed;
+    cv::GaussianBlur(image(search), smoothed, cv::Size(5, 5), 0);
+    cv::Point peak;
+    cv::minMaxLoc(smoothed, nullptr, nullptr, nullptr, &peak);
+    cv::Point2d center(search.x + peak.x, search.y + peak.y);
+
+    // Refine with the background subtracted first moment inside the aperture.
+    double background = cv::mean(image(search))[0];
+    for(int iteration = 0; iteration < CENTROID_ITERATIONS; iteration++) {
+        int radius = std::ceil(mAperture);
+        cv::Rect box(std::floor(center.x) - radius, std::floor(center.y) - radius, 2 * radius + 2, 2 * radius + 2);
+        box &= cv::Rect(0, 0, image.cols, image.rows);
+
+        double flux = 0, mx = 0, my = 0;
+        for(int y = box.y; y < box.y + box.height; y++) {
+            const float * row = image.ptr<float>(y);
+            for(int x = box.x; x < box.x + box.width; x++) {
+                double dx = x - center.x;
+                double dy = y - center.y;
+                double value = row[x] - background;
+                if(value > 0 && dx * dx + dy * dy <= mAperture * mAperture) {
+                    flux += value;
+                    mx += value * x;
+                    my += value * y;
+                }
+            }
+        }
+        if(flux <= 0)
+            break;
+
+        center = cv::Point2d(mx / flux, my / flux);
+    }
+
+    return center;
+}
+
+cv::Mat AperturePhotometry::apertureWeights(const cv::Point2d & center, const cv::Rect & box) const {
+
+    cv::Mat weights = cv::Mat::zeros(box.height, box.width, CV_32F);
+
+    // Pixels whose corners are all inside (outside) the circle get a weight of
+    // one (zero). Only pixels crossed by the edge are subsampled.
+    const double half_diagonal = M_SQRT1_2;
+    const double step = 1.0 / EDGE_SUBSAMPLES;
+    for(int y = 0; y < box.height; y++) {
+        float * row = weights.ptr<float>(y);
+        for(int x = 0; x < box.width; x++) {
+            double dx = box.x + x - center.x;
+            double dy = box.y + y - center.y;
+            double r = std::sqrt(dx * dx + dy * dy);
+
+            if(r <= mAperture - half_diagonal) {
+                row[x] = 1;
+            } else if(r < mAperture + half_diagonal) {
+                int inside = 0;
+                for(int sy = 0; sy < EDGE_SUBSAMPLES; sy++) {
+                    double py = dy - 0.5 + (sy + 0.5) * step;
+                    for(int sx = 0; sx < EDGE_SUBSAMPLES; sx++) {
+                        double px = dx - 0.5 + (sx + 0.5) * step;
+                        inside += (px * px + py * py <= mAperture * mAperture);
+                    }
+                }
+                row[x] = (float) inside / (EDGE_SUBSAMPLES * EDGE_SUBSAMPLES);
+            }
+        }
+    }
+
+    return weights;
+}
+
+PhotometryResult AperturePhotometry::measure(const cv::Mat & image, const cv::Point2d & guess) const {
+
+    PhotometryResult result;
+
+    cv::Mat gray;
+    if(image.channels() == 3)
+        cv::cvtColor(image, gray, cv::COLOR_BGR2GRAY);
+    else
+        gray = image;
+
+    // Only convert the region that can contribute to the measurement.
+    int margin = mSearchRadius + std::ceil(mAnnulusOuter) + 1;
+    cv::Rect region(guess.x - margin, guess.y - margin, 2 * margin + 1, 2 * margin + 1);
+    region &= cv::Rect(0, 0, gray.cols, gray.rows);
+    if(region.empty())
+        return result;
+
+    cv::Mat frame;
+    gray(region).convertTo(frame, CV_32F);
+
+    cv::Point2d center = centroid(frame, guess - cv::Point2d(region.x, region.y));
+    if(center.x < 0)
+        return result;
+
+    // The annulus must lie entirely inside the region.
+    int outer = std::ceil(mAnnulusOuter);
+    cv::Rect box(std::floor(center.x) - outer, std::floor(center.y) - outer, 2 * outer + 2, 2 * outer + 2);
+    if((box & cv::Rect(0, 0, frame.cols, frame.rows)) != box)
+        return result;
+
+    // Sky: median and RMS of the annulus.
+    std::vector<float> sky_values;
+    sky_values.reserve(box.area());
+    for(int y = box.y; y < box.y + box.height; y++) {
+        const float * row = frame.ptr<float>(y);
+        for(int x = box.x; x < box.x + box.width; x++) {
+            double dx = x - center.x;
+            double dy = y - center.y;
+            double r2 = dx * dx + dy * dy;
+            if(r2 >= mAnnulusInner * mAnnulusInner && r2 <= mAnnulusOuter * mAnnulusOuter)
+                sky_values.push_back(row[x]);
+        }
+    }
+    if(sky_values.empty())
+        return result;
+
+    size_t middle = sky_values.size() / 2;
+    std::nth_element(sky_values.begin(), sky_values.begin() + middle, sky_values.end());
+    double sky = sky_values[middle];
+
+    double sum_sq = 0;
+    for(float value : sky_values)
+        sum_sq += (value - sky) * (value - sky);
+    double sky_rms = std::sqrt(sum_sq / sky_values.size());
+
+    // Aperture: the weighted sum is a dot product, which OpenCV vectorizes.
+    cv::Mat weights = apertureWeights(center, box);
+    double area = cv::sum(weights)[0];
+    double total = frame(box).dot(weights);
+
+    result.valid = true;
+    result.x = region.x + center.x;
+    result.y = region.y + center.y;
+    result.sky = sky;
+    result.sky_rms = sky_rms;
+    result.area = area;
+    result.sky_pixels = sky_values.size();
+    result.flux = total - sky * area;
+
+    // Shot noise of the source, sky noise in the aperture and the error of the sky estimate.
+    double source_variance = std::max(result.flux, 0.0) / mElectronsPerADU;
+    double sky_variance = area * sky_rms * sky_rms;
+    double sky_mean_variance = area * area * sky_rms * sky_rms / sky_values.size();
+    result.flux_err = std::sqrt(source_variance + sky_variance + sky_mean_variance);
+
+    return result;
+}
+
+LightCurveWriter::LightCurveWriter(const std::string & filename) {
+
+    mFile.open(filename, std::ios::out | std::ios::app);
+    if(!mFile.is_open())
+        return;
+
+    // A new file gets the column names.
+    mFile.seekp(0, std::ios::end);
+    if(mFile.tellp() == 0) {
+        mFile << "date_beg,date_end,mjd_mid,exptime,filter,object,file,"
+              << "x,y,flux,flux_err,sky,sky_rms,area,mag_inst,mag_err\n";
+        mFile.flush();
+    }
+}
+
+void LightCurveWriter::append(const CVFITS & metadata, const std::string & filename, const PhotometryResult & result) {
+
+    if(!mFile.is_open())
+        return;
+
+    double mjd_mid = (toMJD(metadata.exposure_start) + toMJD(metadata.exposure_end)) / 2;
+
+    // Instrumental magnitude normalized to one second.
+    double mag = NAN;
+    double mag_err = NAN;
+    if(result.valid && result.flux > 0 && metadata.exposure_duration_sec > 0) {
+        mag = -2.5 * std::log10(result.flux / metadata.exposure_duration_sec);
+        mag_err = 2.5 / std::log(10.0) * result.flux_err / result.flux;
+    }
+
+    mFile << to_iso_8601(metadata.exposure_start) << ","
+          << to_iso_8601(metadata.exposure_end) << ","
+          << std::fixed << std::setprecision(8) << mjd_mid << ","
+          << std::setprecision(6) << metadata.exposure_duration_sec << ","
+          << metadata.filter_name << ","
+          << metadata.object_name << ","
+          << filename << ","
+          << std::setprecision(3) << result.x << "," << result.y << ","
+          << result.flux << "," << result.flux_err << ","
+          << result.sky << "," << result.sky_rms << "," << result.area << ","
+          << std::setprecision(4) << mag << "," << mag_err << "\n";
+    mFile.flush();
+}
@@ -0,0 +1,78 @@
+#ifndef APERTURE_PHOTOMETRY_H
+#define APERTURE_PHOTOMETRY_H
+
+#include <fstream>
+#include <string>
+
+#include <opencv2/core/mat.hpp>
+
+#include "cvfits.hpp"
+
+/// The result of measuring one target with AperturePhotometry.
+struct PhotometryResult {
+    bool valid = false;     ///< Whether a source was found and measured
+    double x = 0;           ///< Centroid, X (pixels)
+    double y = 0;           ///< Centroid, Y (pixels)
+    double flux = 0;        ///< Sky subtracted flux in the aperture (ADU)
+    double flux_err = 0;    ///< Uncertainty of the flux (ADU)
+    double sky = 0;         ///< Sky level per pixel from the annulus (ADU)
+    double sky_rms = 0;     ///< RMS of the annulus pixels (ADU)
+    double area = 0;        ///< Effective aperture area (pixels)
+    int sky_pixels = 0;     ///< Number of pixels in the annulus
+};
+
+/// @brief Measures the flux of a single target with a circular aperture.
+///
+/// The target is centroided inside a search box around the expected
+/// position. Pixels on the aperture edge are weighted by the fraction of
+/// their area that lies inside the circle, and the sky level is the median of
+/// a surrounding annulus.
+class AperturePhotometry {
+
+protected:
+    int mSearchRadius = 50;
+    double mAperture = 8;
+    double mAnnulusInner = 12;
+    double mAnnulusOuter = 18;
+    double mElectronsPerADU = 1;
+
+    cv::Point2d centroid(const cv::Mat & image, const cv::Point2d & guess) const;
+    cv::Mat apertureWeights(const cv::Point2d & center, const cv::Rect & box) const;
+
+public:
+    /// @brief Creates a photometer.
+    /// @param search_radius Half width of the box searched for the target (pixels).
+    /// @param aperture Radius of the measurement aperture (pixels).
+    /// @param annulus_inner Inner radius of the sky annulus (pixels).
+    /// @param annulus_outer Outer radius of the sky annulus (pixels).
+    /// @param electrons_per_adu Detector gain used for the shot noise estimate.
+    AperturePhotometry(int search_radius, double aperture, double annulus_inner, double annulus_outer,
+                       double electrons_per_adu);
+
+    /// @brief Finds the target near a position and measures its flux.
+    /// @param image A single or three channel image of any depth.
+    /// @param guess Expected position of the target (pixels).
+    PhotometryResult measure(const cv::Mat & image, const cv::Point2d & guess) const;
+};
+
+/// @brief Appends photometry results to a light-curve CSV file.
+class LightCurveWriter {
+
+protected:
+    std::ofstream mFile;
+
+public:
+    /// @brief Opens the file for appending and writes the column names if it is new.
+    LightCurveWriter(const std::string & filename);
+
+    /// \return true if the file is open.
+    bool isOpen() const { return mFile.is_open(); }
+
+    /// @brief Appends one measurement and flushes it to disk.
+    /// @param metadata Exposure information for the frame.
+    /// @param filename Name of the FITS file the frame was written to.
+    /// @param result The measurement.
+    void append(const CVFITS & metadata, const std::string & filename, const PhotometryResult & result);
+};
+
+#endif // APERTURE_PHOTOMETRY_H
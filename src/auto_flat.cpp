@@ -0,0 +1,257 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <map>
+#include <numeric>
+#include <sstream>
+
+#include <opencv2/core.hpp>
+
+#include "auto_flat.hpp"
+
+namespace {
+/// Pixels sampled for the level of a frame.
+const double LEVEL_SAMPLES = 65536;
+
+/// Brightness measurements used for the trend. Older ones no longer describe the sky.
+const size_t MAX_SAMPLES = 12;
+
+/// Frames with a median at this fraction of full scale are saturated and say nothing about the sky.
+const double SATURATED = 0.98;
+
+/// Frames with less signal than this fraction of the target are too noisy to measure.
+const double MIN_SIGNAL = 0.01;
+
+/// Waits while the sky moves into the usable range (seconds).
+const double MIN_WAIT = 1;
+const double DEFAULT_WAIT = 10;
+const double MAX_WAIT = 60;
+
+template <typename T>
+double histogramMedian(const cv::Mat & image, int shift) {
+
+    std::vector<uint32_t> histogram((std::numeric_limits<T>::max() >> shift) + 1, 0);
+
+    // An odd step visits every color of a Bayer mosaic.
+    const int step = std::max(1, (int) std::sqrt(image.total() / LEVEL_SAMPLES)) | 1;
+    uint32_t samples = 0;
+    for(int y = step / 2; y < image.rows; y += step) {
+        const T * row = image.ptr<T>(y);
+        for(int x = step / 2; x < image.cols; x += step) {
+            histogram[row[x] >> shift]++;
+            samples++;
+        }
+    }
+
+    uint32_t cumulative = 0;
+    size_t bin = 0;
+    for(; bin + 1 < histogram.size(); bin++) {
+        cumulative += histogram[bin];
+        if(2 * cumulative >= samples)
+            break;
+    }
+
+    // The middle of the bin.
+    return (bin << shift) + ((1 << shift) - 1) / 2.0;
+}
+}
+
+AutoFlat::AutoFlat(const AutoFlatSettings & settings, Source source)
+    : mSettings(settings), mSource(source), mOrigin(std::chrono::system_clock::now()) {
+}
+
+std::vector<int> AutoFlat::filterOrder(const std::vector<double> & throughputs, Source source, size_t filters) {
+
+    std::vector<int> order(filters);
+    std::iota(order.begin(), order.end(), 0);
+    if(throughputs.size() != filters || source == SOURCE_PANEL)
+        return order;
+
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+        return (source == SOURCE_DUSK) ? throughputs[a] < throughputs[b] : throughputs[a] > throughputs[b];
+    });
+
+    return order;
+}
+
+double AutoFlat::medianLevel(const cv::Mat & raw_image) {
+
+    if(raw_image.empty() || raw_image.channels() != 1)
+        return 0;
+
+    if(raw_image.depth() == CV_8U)
+        return histogramMedian<uint8_t>(raw_image, 0);
+    if(raw_image.depth() == CV_16U)
+        return histogramMedian<uint16_t>(raw_image, 4);
+
+    return 0;
+}
+
+double AutoFlat::seconds(std::chrono::system_clock::time_point time) const {
+    return std::chrono::duration<double>(time - mOrigin).count();
+}
+
+double AutoFlat::slope() const {
+
+    if(mSource == SOURCE_PANEL)
+        return 0;
+
+    // Each filter has its own brightness, but the sky changes at the same rate
+    // through all of them, so the slope is fitted around the mean of each filter.
+    std::map<int, std::pair<double, double>> sums;
+    std::map<int, int> counts;
+    for(const Sample & sample : mSamples) {
+        sums[sample.filter].first += sample.time;
+        sums[sample.filter].second += sample.log_rate;
+        counts[sample.filter]++;
+    }
+
+    double numerator = 0;
+    double denominator = 0;
+    for(const Sample & sample : mSamples) {
+        const int n = counts[sample.filter];
+        const double dt = sample.time - sums[sample.filter].first / n;
+        numerator += dt * (sample.log_rate - sums[sample.filter].second / n);
+        denominator += dt * dt;
+    }
+
+    // Measurements less than a second apart say nothing about the trend.
+    return (denominator < 1) ? 0 : numerator / denominator;
+}
+
+bool AutoFlat::predict(double now, double & exposure_sec) const {
+
+    const double k = slope();
+    auto meanOf = [this](int filter, double & time, double & log_rate) {
+        int n = 0;
+        time = log_rate = 0;
+        for(const Sample & sample : mSamples) {
+            if(sample.filter == filter) {
+                time += sample.time;
+                log_rate += sample.log_rate;
+                n++;
+            }
+        }
+        if(n == 0)
+            return false;
+        time /= n;
+        log_rate /= n;
+        return true;
+    };
+
+    // The brightness through this filter now, from its own frames or, when the
+    // throughputs are known, from the frames of the previous filter.
+    double time, log_rate;
+    if(!meanOf(mFilter, time, log_rate)) {
+        auto known = std::find_if(mSamples.rbegin(), mSamples.rend(),
+                                  [](const Sample & sample) { return sample.throughput > 0; });
+        if(mThroughput <= 0 || known == mSamples.rend())
+            return false;
+        meanOf(known->filter, time, log_rate);
+        log_rate += std::log(mThroughput / known->throughput);
+    }
+    const double rate = std::exp(log_rate + k * (now - time));
+
+    // The exposure over which the changing brightness adds up to the target.
+    const double signal = mSettings.target - mSettings.bias;
+    if(std::abs(k) < 1e-6) {
+        exposure_sec = signal / rate;
+    } else {
+        const double x = 1 + k * signal / rate;
+        exposure_sec = (x > 0) ? std::log(x) / k : INFINITY;
+    }
+
+    return true;
+}
+
+AutoFlat::Plan AutoFlat::outOfRange(double exposure_sec, bool too_bright) {
+
+    Plan plan;
+    const bool improving = (too_bright && mSource == SOURCE_DUSK) || (!too_bright && mSource == SOURCE_DAWN);
+    if(!improving) {
+        plan.action = ACTION_NEXT_FILTER;
+        return plan;
+    }
+
+    // The exposure shrinks as exp(-k t) when the sky changes as exp(k t).
+    const double limit = too_bright ? mSettings.min_exposure : mSettings.max_exposure;
+    const double k = slope();
+    double wait_sec = (k != 0) ? std::log(exposure_sec / limit) / k : 0;
+    if(!std::isfinite(wait_sec) || wait_sec <= 0)
+        wait_sec = DEFAULT_WAIT;
+
+    // Afterwards try the limit, even if the trend is not known well enough.
+    plan.action = ACTION_WAIT;
+    plan.wait_sec = std::max(MIN_WAIT, std::min(wait_sec, MAX_WAIT));
+    mProbe = limit;
+    mRejectsInRow = 0;
+
+    return plan;
+}
+
+void AutoFlat::beginFilter(int filter, double throughput, double first_exposure) {
+    mFilter = filter;
+    mThroughput = throughput;
+    mFirstExposure = first_exposure;
+    mProbe = 0;
+    mRejectsInRow = 0;
+}
+
+AutoFlat::Plan AutoFlat::plan(std::chrono::system_clock::time_point now) {
+
+    Plan plan;
+    if(mRejectsInRow >= mSettings.max_rejects) {
+        plan.action = ACTION_NEXT_FILTER;
+        return plan;
+    }
+
+    double exposure_sec = mFirstExposure;
+    if(mProbe > 0)
+        exposure_sec = mProbe;
+    else
+        predict(seconds(now), exposure_sec);
+
+    if(exposure_sec < mSettings.min_exposure)
+        return outOfRange(exposure_sec, true);
+    if(exposure_sec > mSettings.max_exposure)
+        return outOfRange(exposure_sec, false);
+
+    plan.exposure_sec = exposure_sec;
+    return plan;
+}
+
+bool AutoFlat::addFrame(const cv::Mat & raw_image, std::chrono::system_clock::time_point exposure_start,
+                        double exposure_sec, std::string & reason) {
+
+    mLevel = medianLevel(raw_image);
+    exposure_sec = std::max(exposure_sec, 1e-6);
+
+    const double target_signal = mSettings.target - mSettings.bias;
+    const double signal = mLevel - mSettings.bias;
+    std::stringstream ss;
+
+    if(mLevel >= SATURATED * mSettings.full_scale) {
+        mProbe = exposure_sec / 10;
+        ss << "saturated at " << mLevel << " ADU";
+    } else if(signal < MIN_SIGNAL * target_signal) {
+        mProbe = exposure_sec * 10;
+        ss << "no signal at " << mLevel << " ADU";
+    } else {
+        mProbe = 0;
+        mSamples.push_back({seconds(exposure_start) + exposure_sec / 2, std::log(signal / exposure_sec),
+                            mFilter, mThroughput});
+        if(mSamples.size() > MAX_SAMPLES)
+            mSamples.pop_front();
+
+        if(std::abs(signal - target_signal) <= mSettings.tolerance * target_signal) {
+            mRejectsInRow = 0;
+            return true;
+        }
+        ss << "level " << mLevel << " ADU, target " << mSettings.target << " +/- "
+           << mSettings.tolerance * target_signal << " ADU";
+    }
+
+    reason = ss.str();
+    mRejectsInRow++;
+    return false;
+}
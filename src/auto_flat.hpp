@@ -0,0 +1,122 @@
+#ifndef AUTO_FLAT_H
+#define AUTO_FLAT_H
+
+#include <chrono>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <opencv2/core/mat.hpp>
+
+/// Settings of the AutoFlat exposure planner.
+struct AutoFlatSettings {
+    double target = 30000;      ///< Median level of a good flat (ADU)
+    double tolerance = 0.15;    ///< Accepted deviation from the target, as a fraction of the bias subtracted target
+    double bias = 0;            ///< Pedestal removed before levels are compared with exposure times (ADU)
+    double full_scale = 65535;  ///< Largest pixel value
+    double min_exposure = 0.01; ///< Shortest usable exposure (seconds), limited by shutter and readout gradients
+    double max_exposure = 30;   ///< Longest usable exposure (seconds)
+    int max_rejects = 5;        ///< Rejected frames in a row before a filter is given up
+};
+
+/// @brief Chooses exposure times for sky and panel flats.
+///
+/// The median level of every frame, taken from a subsampled histogram, gives
+/// the sky brightness through the current filter in ADU per second. Twilight
+/// brightness changes exponentially, so a line is fitted to the logarithm of
+/// the recent brightness measurements, with one slope shared by all filters,
+/// and the next exposure time is the one whose integrated brightness reaches
+/// the target. Frames whose level is outside the tolerance are rejected.
+///
+/// When the exposure needed is outside the allowed range the planner waits
+/// if the sky is moving towards the range and otherwise gives up the filter.
+class AutoFlat {
+
+public:
+    /// The light source of the flats.
+    enum Source {
+        SOURCE_DUSK,    ///< Evening twilight, getting darker
+        SOURCE_DAWN,    ///< Morning twilight, getting brighter
+        SOURCE_PANEL,   ///< A panel of constant brightness
+    };
+
+    /// What to do before the next exposure.
+    enum Action {
+        ACTION_EXPOSE,      ///< Expose for Plan::exposure_sec.
+        ACTION_WAIT,        ///< Wait for Plan::wait_sec, then ask again.
+        ACTION_NEXT_FILTER, ///< Give up the current filter.
+    };
+
+    struct Plan {
+        Action action = ACTION_EXPOSE;
+        double exposure_sec = 0;
+        double wait_sec = 0;
+    };
+
+protected:
+    struct Sample {
+        double time;            ///< Middle of the exposure, seconds since the planner was created
+        double log_rate;        ///< ln(ADU per second)
+        int filter;
+        double throughput;      ///< Relative throughput of the filter, 0 if unknown
+    };
+
+    AutoFlatSettings mSettings;
+    Source mSource = SOURCE_DUSK;
+    std::chrono::system_clock::time_point mOrigin;
+    std::deque<Sample> mSamples;
+
+    int mFilter = -1;
+    double mThroughput = 0;
+    double mFirstExposure = 1;
+    double mProbe = 0;          ///< Exposure to try next when the last frame could not be measured
+    int mRejectsInRow = 0;
+    double mLevel = 0;
+
+    double seconds(std::chrono::system_clock::time_point time) const;
+    double slope() const;
+    bool predict(double now, double & exposure_sec) const;
+    Plan outOfRange(double exposure_sec, bool too_bright);
+
+public:
+    /// @brief Creates a planner.
+    /// @param settings Target level and limits.
+    /// @param source Whether the light is getting darker, brighter or neither.
+    AutoFlat(const AutoFlatSettings & settings, Source source);
+
+    /// @brief Orders the filters so each meets the sky when it is bright enough.
+    ///
+    /// At dusk the filters passing the least light go first, at dawn last.
+    /// @param throughputs Relative throughput of each filter. Empty keeps the given order.
+    /// @return Indices into the filter list.
+    static std::vector<int> filterOrder(const std::vector<double> & throughputs, Source source, size_t filters);
+
+    /// @brief Returns the median level of a frame from a histogram of about 64k pixels.
+    static double medianLevel(const cv::Mat & raw_image);
+
+    /// @brief Starts the flats of a filter.
+    /// @param filter Index of the filter.
+    /// @param throughput Relative throughput of the filter, 0 if unknown.
+    /// @param first_exposure Exposure tried when nothing is known about the filter yet (seconds).
+    void beginFilter(int filter, double throughput, double first_exposure);
+
+    /// @brief Decides what to do before the next exposure.
+    Plan plan(std::chrono::system_clock::time_point now);
+
+    /// @brief Measures a frame and updates the brightness model.
+    /// @param raw_image The frame as read out from the camera.
+    /// @param exposure_start When the exposure started.
+    /// @param exposure_sec The exposure time.
+    /// @param reason Returns why the frame was rejected.
+    /// @return true if the level is within the tolerance.
+    bool addFrame(const cv::Mat & raw_image, std::chrono::system_clock::time_point exposure_start,
+                  double exposure_sec, std::string & reason);
+
+    /// \return The median level of the last frame (ADU).
+    double level() const { return mLevel; }
+
+    /// \return The fitted change in sky brightness, in e-foldings per minute.
+    double trend() const { return 60 * slope(); }
+};
+
+#endif // AUTO_FLAT_H
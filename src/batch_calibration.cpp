@@ -0,0 +1,445 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <set>
+#include <thread>
+
+#include <QDir>
+#include <QFileInfo>
+
+#include <opencv2/core.hpp>
+
+#include "async_fits_writer.hpp"
+#include "batch_calibration.hpp"
+#include "fits_index.hpp"
+#include "pixel_pipeline.hpp"
+
+namespace {
+/// Gains and exposure times closer than this are considered equal.
+const double MATCH_TOLERANCE = 1e-3;
+
+/// @return The value of a header keyword read by scanFITSHeaders.
+const std::string & headerValue(const FITSHeaderValues & header, const char * name) {
+    static const std::string missing;
+    const std::vector<FITSIndexKeyword> & columns = fitsIndexColumns();
+    for(size_t i = 0; i < columns.size(); i++) {
+        if(name == std::string(columns[i].name))
+            return header.values[i];
+    }
+    return missing;
+}
+
+double headerNumber(const FITSHeaderValues & header, const char * name, double fallback) {
+    const std::string & value = headerValue(header, name);
+    return value.empty() ? fallback : atof(value.c_str());
+}
+
+/// @return The type of a master, from IMAGETYP or else the file name.
+bool classifyMaster(const std::string & image_type, const std::string & path, CalibrationMasterType & type) {
+    for(QString text : {QString::fromStdString(image_type), QFileInfo(QString::fromStdString(path)).fileName()}) {
+        text = text.toLower();
+        if(text.contains("bias") || text.contains("zero")) {
+            type = MASTER_BIAS;
+            return true;
+        }
+        if(text.contains("dark")) {
+            type = MASTER_DARK;
+            return true;
+        }
+        if(text.contains("flat")) {
+            type = MASTER_FLAT;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool sameSetup(const CalibrationMaster & master, const CVFITS & frame) {
+    return master.xbinning == frame.xbinning && master.ybinning == frame.ybinning
+        && master.cols == frame.image.cols && master.rows == frame.image.rows;
+}
+
+/// @brief A queue that blocks producers once it holds `capacity` items.
+template <typename T>
+class BoundedQueue {
+
+protected:
+    std::deque<T> mItems;
+    size_t mCapacity;
+    bool mClosed = false;
+    std::mutex mMutex;
+    std::condition_variable mNotEmpty;
+    std::condition_variable mNotFull;
+
+public:
+    BoundedQueue(size_t capacity) : mCapacity(std::max<size_t>(capacity, 1)) {}
+
+    void push(T item) {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mNotFull.wait(lock, [&] { return mItems.size() < mCapacity; });
+        mItems.push_back(std::move(item));
+        mNotEmpty.notify_one();
+    }
+
+    /// @return false once the queue is closed and empty.
+    bool pop(T & item) {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mNotEmpty.wait(lock, [&] { return mClosed || !mItems.empty(); });
+        if(mItems.empty())
+            return false;
+        item = std::move(mItems.front());
+        mItems.pop_front();
+        mNotFull.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mClosed = true;
+        mNotEmpty.notify_all();
+    }
+};
+
+/// A frame read from disk, waiting for the compute pool.
+struct ReadFrame {
+    size_t index = 0;
+    CVFITS frame;
+};
+}
+
+CalibrationLibrary::CalibrationLibrary(size_t cache_bytes) : mCacheLimit(cache_bytes) {
+}
+
+bool CalibrationLibrary::load(const std::string & directory, std::string & error) {
+
+    QDir dir(QString::fromStdString(directory));
+    if(!dir.exists()) {
+        error = "Calibration library " + directory + " does not exist";
+        return false;
+    }
+
+    mMasters.clear();
+    QStringList names = dir.entryList({"*.fits", "*.fit", "*.fts", "*.FITS", "*.FIT", "*.FTS"}, QDir::Files, QDir::Name);
+    for(const QString & name : names) {
+        std::string path = dir.absoluteFilePath(name).toStdString();
+
+        // Only the headers are needed until a master is used.
+        std::vector<FITSHeaderValues> hdus;
+        std::string scan_error;
+        if(!scanFITSHeaders(path, hdus, scan_error) || hdus.empty())
+            continue;
+
+        const FITSHeaderValues & header = hdus.front();
+        CalibrationMaster master;
+        if(!classifyMaster(headerValue(header, "IMAGETYP"), path, master.type))
+            continue;
+
+        master.path = path;
+        master.filter = headerValue(header, "FILTER");
+        master.xbinning = headerNumber(header, "XBINNING", 1);
+        master.ybinning = headerNumber(header, "YBINNING", 1);
+        master.cols = headerNumber(header, "NAXIS1", 0);
+        master.rows = headerNumber(header, "NAXIS2", 0);
+        master.gain = headerNumber(header, "GAIN", 0);
+        master.exposure_sec = headerNumber(header, "EXPTIME", 0);
+        master.temperature = headerNumber(header, "TEMP", 0);
+        mMasters.push_back(master);
+    }
+
+    if(mMasters.empty()) {
+        error = "No bias, dark or flat masters found in " + directory;
+        return false;
+    }
+
+    return true;
+}
+
+CalibrationMatch CalibrationLibrary::match(const CVFITS & frame) const {
+
+    CalibrationMatch match;
+    auto closer = [&](const CalibrationMaster * current, const CalibrationMaster & candidate) {
+        return current == nullptr ||
+               std::abs(candidate.temperature - frame.temperature) < std::abs(current->temperature - frame.temperature);
+    };
+
+    for(const CalibrationMaster & master : mMasters) {
+        if(!sameSetup(master, frame))
+            continue;
+
+        bool same_gain = std::abs(master.gain - frame.gain) < MATCH_TOLERANCE;
+        if(master.type == MASTER_BIAS && same_gain && closer(match.bias, master))
+            match.bias = &master;
+        else if(master.type == MASTER_FLAT && master.filter == frame.filter_name && closer(match.flat, master))
+            match.flat = &master;
+    }
+
+    // Prefer a dark of the same exposure. Otherwise scale the nearest one,
+    // which needs a bias to tell the offset from the dark current.
+    const CalibrationMaster * nearest = nullptr;
+    for(const CalibrationMaster & master : mMasters) {
+        if(master.type != MASTER_DARK || !sameSetup(master, frame) || std::abs(master.gain - frame.gain) >= MATCH_TOLERANCE)
+            continue;
+
+        double difference = std::abs(master.exposure_sec - frame.exposure_duration_sec);
+        if(difference < MATCH_TOLERANCE) {
+            if(closer(match.dark, master))
+                match.dark = &master;
+        } else if(master.exposure_sec > 0 &&
+                  (nearest == nullptr || difference < std::abs(nearest->exposure_sec - frame.exposure_duration_sec))) {
+            nearest = &master;
+        }
+    }
+
+    if(match.dark == nullptr && nearest != nullptr && match.bias != nullptr) {
+        match.dark = nearest;
+        match.dark_scale = frame.exposure_duration_sec / nearest->exposure_sec;
+    }
+
+    return match;
+}
+
+cv::Mat CalibrationLibrary::cached(const std::string & key, const std::function<cv::Mat()> & load) {
+
+    // Masters are loaded under the lock. There are few of them and each is
+    // loaded once, so other threads rarely wait.
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    auto found = mCacheIndex.find(key);
+    if(found != mCacheIndex.end()) {
+        mCache.splice(mCache.begin(), mCache, found->second);
+        return found->second->image;
+    }
+
+    cv::Mat image = load();
+    size_t bytes = image.total() * image.elemSize();
+    mCache.push_front({key, image});
+    mCacheIndex[key] = mCache.begin();
+    mCacheBytes += bytes;
+
+    // Frames still using an evicted master keep their reference to it.
+    while(mCacheBytes > mCacheLimit && mCache.size() > 1) {
+        const CacheEntry & oldest = mCache.back();
+        mCacheBytes -= oldest.image.total() * oldest.image.elemSize();
+        mCacheIndex.erase(oldest.key);
+        mCache.pop_back();
+    }
+
+    return image;
+}
+
+cv::Mat CalibrationLibrary::master(const CalibrationMaster & master) {
+    return cached("master:" + master.path, [&]() {
+        cv::Mat image;
+        CVFITS fits(master.path);
+        fits.image.convertTo(image, CV_32F);
+        return image;
+    });
+}
+
+cv::Mat CalibrationLibrary::darkFrame(const CalibrationMatch & match) {
+
+    if(match.dark == nullptr && match.bias == nullptr)
+        return cv::Mat();
+    if(match.dark == nullptr)
+        return master(*match.bias);
+    if(match.bias == nullptr || match.dark_scale == 1)
+        return master(*match.dark);
+
+    // The masters are fetched first, the cache lock is not reentrant.
+    cv::Mat dark = master(*match.dark);
+    cv::Mat bias = master(*match.bias);
+    std::string key = "dark:" + match.dark->path + ":" + match.bias->path + ":" + std::to_string(match.dark_scale);
+    return cached(key, [&]() {
+        if(dark.size() != bias.size() || dark.type() != bias.type())
+            return cv::Mat();
+
+        // bias + (dark - bias) * scale
+        cv::Mat scaled;
+        cv::addWeighted(dark, match.dark_scale, bias, 1 - match.dark_scale, 0, scaled);
+        return scaled;
+    });
+}
+
+cv::Mat CalibrationLibrary::flatFrame(const CalibrationMatch & match) {
+
+    if(match.flat == nullptr)
+        return cv::Mat();
+
+    cv::Mat image = master(*match.flat);
+    return cached("flat:" + match.flat->path, [&]() {
+        // Each color of a debayered flat has its own level.
+        cv::Mat flat;
+        cv::Scalar mean = cv::mean(image);
+        cv::Scalar scale = cv::Scalar::all(1);
+        for(int c = 0; c < image.channels(); c++) {
+            if(mean[c] > 0)
+                scale[c] = 1 / mean[c];
+        }
+        cv::multiply(image, scale, flat);
+        return flat;
+    });
+}
+
+bool calibrateFrame(CVFITS & frame, CalibrationLibrary & library, std::string & error) {
+
+    CalibrationMatch match = library.match(frame);
+    if(match.bias == nullptr && match.dark == nullptr && match.flat == nullptr) {
+        error = "No calibration masters match";
+        return false;
+    }
+
+    cv::Mat dark = library.darkFrame(match);
+    cv::Mat flat = library.flatFrame(match);
+    for(const cv::Mat & calibration : {dark, flat}) {
+        if(!calibration.empty() && (calibration.size() != frame.image.size() || calibration.channels() != frame.image.channels())) {
+            error = "Calibration masters do not fit the frame";
+            return false;
+        }
+    }
+
+    cv::Mat calibrated(frame.image.rows, frame.image.cols, CV_32FC(frame.image.channels()));
+    switch(frame.image.depth()) {
+        case CV_8U: {
+            PixelPipeline<CalibrateStage<uint8_t, float>, StoreStage> pipeline{
+                CalibrateStage<uint8_t, float>(dark, flat), StoreStage(calibrated)};
+            pipeline.run(frame.image);
+        }
+        break;
+        case CV_16U: {
+            PixelPipeline<CalibrateStage<uint16_t, float>, StoreStage> pipeline{
+                CalibrateStage<uint16_t, float>(dark, flat), StoreStage(calibrated)};
+            pipeline.run(frame.image);
+        }
+        break;
+        case CV_32F: {
+            PixelPipeline<CalibrateStage<float>, StoreStage> pipeline{
+                CalibrateStage<float>(dark, flat), StoreStage(calibrated)};
+            pipeline.run(frame.image);
+        }
+        break;
+        default:
+            error = "Unsupported pixel type";
+            return false;
+    }
+    frame.image = calibrated;
+
+    auto name = [](const CalibrationMaster * master) {
+        return QFileInfo(QString::fromStdString(master->path)).fileName().toStdString();
+    };
+    // A dark of the same exposure already holds the bias.
+    if(match.bias && (match.dark == nullptr || match.dark_scale != 1))
+        frame.history.push_back("qhy-calibrate: bias " + name(match.bias));
+    if(match.dark)
+        frame.history.push_back("qhy-calibrate: dark " + name(match.dark) +
+                                (match.dark_scale != 1 ? " scaled by " + std::to_string(match.dark_scale) : ""));
+    if(match.flat)
+        frame.history.push_back("qhy-calibrate: flat " + name(match.flat));
+
+    return true;
+}
+
+BatchCalibrator::BatchCalibrator(CalibrationLibrary & library, const BatchCalibrationOptions & options)
+    : mLibrary(library), mOptions(options) {
+}
+
+BatchCalibrationResult BatchCalibrator::run(const std::vector<std::string> & files, const std::vector<std::string> & outputs,
+                                            const std::function<void(const std::string &)> & log) {
+
+    const auto t_start = std::chrono::steady_clock::now();
+    BatchCalibrationResult result;
+    std::mutex mutex;
+
+    auto report = [&](const std::string & message) {
+        std::lock_guard<std::mutex> lock(mutex);
+        log(message);
+    };
+
+    // Outputs finished by an earlier run.
+    std::set<std::string> finished;
+    if(mOptions.resume && !mOptions.journal.empty()) {
+        std::ifstream journal_in(mOptions.journal);
+        std::string line;
+        while(std::getline(journal_in, line))
+            finished.insert(line);
+    }
+
+    std::vector<size_t> pending;
+    for(size_t i = 0; i < files.size(); i++) {
+        if(finished.count(outputs[i]) && QFileInfo::exists(QString::fromStdString(outputs[i])))
+            result.skipped++;
+        else
+            pending.push_back(i);
+    }
+
+    std::ofstream journal;
+    if(!mOptions.journal.empty())
+        journal.open(mOptions.journal, mOptions.resume ? std::ios::app : std::ios::trunc);
+
+    // Outputs are journaled only once they are closed, so an interrupted
+    // write is redone by the next run.
+    AsyncFITSWriter writer(AsyncFITSWriter::BACKEND_THREADS, mOptions.write_threads, mOptions.write_buffer_bytes,
+                           AsyncFITSWriter::SYNC_NONE);
+    writer.setWrittenCallback([&](const std::string & filename, bool ok) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(ok) {
+            result.calibrated++;
+            if(journal.is_open())
+                journal << filename << std::endl;
+        } else {
+            result.failed++;
+            log(filename + ": could not be written");
+        }
+    });
+
+    // Readers run ahead of the compute pool by at most prefetch_frames frames.
+    BoundedQueue<ReadFrame> read_queue(mOptions.prefetch_frames);
+    std::atomic<size_t> next_file(0);
+    auto reader = [&]() {
+        for(size_t i = next_file++; i < pending.size(); i = next_file++) {
+            ReadFrame item;
+            item.index = pending[i];
+            item.frame = CVFITS(files[item.index]);
+            read_queue.push(std::move(item));
+        }
+    };
+
+    auto worker = [&]() {
+        ReadFrame item;
+        while(read_queue.pop(item)) {
+            const std::string & input = files[item.index];
+            std::string error;
+            if(item.frame.image.empty()) {
+                error = "could not be read";
+            } else if(calibrateFrame(item.frame, mLibrary, error)) {
+                QDir().mkpath(QFileInfo(QString::fromStdString(outputs[item.index])).absolutePath());
+                writer.enqueue(item.frame, outputs[item.index], true);
+                continue;
+            }
+
+            report(input + ": " + error);
+            std::lock_guard<std::mutex> lock(mutex);
+            result.failed++;
+        }
+    };
+
+    std::vector<std::thread> readers;
+    for(int i = 0; i < std::max(1, mOptions.read_threads); i++)
+        readers.emplace_back(reader);
+    std::vector<std::thread> workers;
+    for(int i = 0; i < std::max(1, mOptions.compute_threads); i++)
+        workers.emplace_back(worker);
+
+    for(std::thread & thread : readers)
+        thread.join();
+    read_queue.close();
+    for(std::thread & thread : workers)
+        thread.join();
+    writer.close();
+
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+    return result;
+}
@@ -0,0 +1,146 @@
+#ifndef BATCH_CALIBRATION_H
+#define BATCH_CALIBRATION_H
+
+#include <functional>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <opencv2/core/mat.hpp>
+
+#include "cvfits.hpp"
+
+/// Kinds of master calibration frames.
+enum CalibrationMasterType {
+    MASTER_BIAS,
+    MASTER_DARK,
+    MASTER_FLAT,
+};
+
+/// @brief A master frame of the calibration library, as described by its header.
+struct CalibrationMaster {
+    std::string path;
+    CalibrationMasterType type = MASTER_BIAS;
+    std::string filter;
+    int xbinning = 1;
+    int ybinning = 1;
+    int cols = 0;
+    int rows = 0;
+    double gain = 0;
+    double exposure_sec = 0;
+    double temperature = 0;
+};
+
+/// @brief The masters chosen for one frame. Any of them may be missing.
+struct CalibrationMatch {
+    const CalibrationMaster * bias = nullptr;
+    const CalibrationMaster * dark = nullptr;
+    const CalibrationMaster * flat = nullptr;
+    double dark_scale = 1;      ///< Factor applied to the bias subtracted dark current
+};
+
+/// @brief A directory of master bias, dark and flat frames.
+///
+/// Masters are classified by their IMAGETYP keyword or, failing that, by
+/// "bias", "dark" or "flat" in the file name, and matched to frames by the
+/// XBINNING, GAIN, EXPTIME and FILTER keywords that CVFITS writes. Loaded
+/// masters, and darks scaled to an exposure time, are kept in a cache of
+/// bounded size that is shared by every thread.
+class CalibrationLibrary {
+
+protected:
+    struct CacheEntry {
+        std::string key;
+        cv::Mat image;
+    };
+
+    std::vector<CalibrationMaster> mMasters;
+    size_t mCacheLimit = 0;
+    size_t mCacheBytes = 0;
+
+    mutable std::mutex mMutex;
+    std::list<CacheEntry> mCache;       ///< Most recently used first
+    std::map<std::string, std::list<CacheEntry>::iterator> mCacheIndex;
+
+    cv::Mat cached(const std::string & key, const std::function<cv::Mat()> & load);
+    cv::Mat master(const CalibrationMaster & master);
+
+public:
+    /// \param cache_bytes Memory used for loaded masters before the least recently used are dropped.
+    CalibrationLibrary(size_t cache_bytes = (size_t) 2 << 30);
+
+    /// @brief Reads the headers of the masters in a directory.
+    /// \return false if the directory holds no usable masters.
+    bool load(const std::string & directory, std::string & error);
+
+    /// \return The masters found by load().
+    const std::vector<CalibrationMaster> & masters() const { return mMasters; }
+
+    /// @brief Chooses the masters for a frame.
+    ///
+    /// The bias must match the binning, gain and size of the frame, the dark
+    /// also its exposure time, and the flat its binning, size and filter.
+    /// Without a dark of the same exposure time, the nearest one is scaled if
+    /// a bias is available to separate the bias from the dark current. Ties
+    /// go to the master closest in sensor temperature.
+    CalibrationMatch match(const CVFITS & frame) const;
+
+    /// \return The frame to subtract for a match: the dark, the scaled dark
+    /// plus the bias, or the bias alone. Empty if there is neither. CV_32F.
+    cv::Mat darkFrame(const CalibrationMatch & match);
+
+    /// \return The flat with each channel normalized to a mean of one, or an empty matrix. CV_32F.
+    cv::Mat flatFrame(const CalibrationMatch & match);
+};
+
+/// @brief Calibrates a frame in place.
+///
+/// The image becomes CV_32F and the masters used are recorded as HISTORY.
+/// \return false, with the reason in error, if no master matches or a master
+/// does not fit the frame.
+bool calibrateFrame(CVFITS & frame, CalibrationLibrary & library, std::string & error);
+
+/// @brief Settings of a BatchCalibrator.
+struct BatchCalibrationOptions {
+    int read_threads = 2;               ///< Threads reading input files ahead of the compute pool
+    int compute_threads = 2;            ///< Frames calibrated at once. Each also runs on OpenCV's pool.
+    int write_threads = 2;              ///< Threads of the asynchronous writer
+    size_t prefetch_frames = 8;         ///< Frames read but not yet calibrated
+    size_t write_buffer_bytes = (size_t) 512 << 20;  ///< Calibrated frames waiting to be written
+    std::string journal;                ///< Records finished outputs so an interrupted run can resume
+    bool resume = true;                 ///< Skip outputs recorded in the journal
+};
+
+/// @brief Counters of a batch run.
+struct BatchCalibrationResult {
+    size_t calibrated = 0;
+    size_t skipped = 0;         ///< Already calibrated in an earlier run
+    size_t failed = 0;
+    double seconds = 0;
+};
+
+/// @brief Calibrates many files with reads, computation and writes overlapped.
+///
+/// Reader threads stay a bounded number of frames ahead of the compute pool,
+/// and the calibrated frames go to an AsyncFITSWriter that blocks the pool
+/// once its buffer is full, so memory use does not grow with the number of
+/// files. Every finished output is appended to a journal, and a new run
+/// skips the files recorded there.
+class BatchCalibrator {
+
+protected:
+    CalibrationLibrary & mLibrary;
+    BatchCalibrationOptions mOptions;
+
+public:
+    BatchCalibrator(CalibrationLibrary & library, const BatchCalibrationOptions & options);
+
+    /// @brief Calibrates files[i] into outputs[i].
+    /// \param log Receives progress and error messages. Called from several threads, one call at a time.
+    BatchCalibrationResult run(const std::vector<std::string> & files, const std::vector<std::string> & outputs,
+                               const std::function<void(const std::string &)> & log);
+};
+
+#endif // BATCH_CALIBRATION_H
@@ -0,0 +1,126 @@
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDir>
+#include <QDirIterator>
+#include <QFileInfo>
+
+#include <algorithm>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "batch_calibration.hpp"
+
+/// Journal of finished outputs, kept in the output directory.
+const char * JOURNAL_NAME = ".qhy-calibrate.journal";
+
+/// @brief Lists the FITS files below a directory, skipping those below `exclude`.
+std::vector<std::string> find_fits_files(const QString & directory, bool recursive, const QString & exclude) {
+    QDirIterator::IteratorFlags flags = recursive ? QDirIterator::Subdirectories : QDirIterator::NoIteratorFlags;
+    QDirIterator it(directory, {"*.fits", "*.fit", "*.fts", "*.FITS", "*.FIT", "*.FTS"}, QDir::Files, flags);
+
+    std::vector<std::string> files;
+    while(it.hasNext()) {
+        QString path = QFileInfo(it.next()).absoluteFilePath();
+        if(!path.startsWith(exclude + "/"))
+            files.push_back(path.toStdString());
+    }
+    std::sort(files.begin(), files.end());
+
+    return files;
+}
+
+int main(int argc, char *argv[])
+{
+    using namespace std;
+
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("qhy-calibrate");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Applies bias, dark and flat masters to every frame in a directory.\n"
+                                     "Masters are matched by XBINNING, GAIN, EXPTIME and FILTER. An interrupted\n"
+                                     "run continues where it stopped unless --restart is given.");
+    parser.addHelpOption();
+    parser.addPositionalArgument("directory", "Directory of raw frames");
+    parser.addOption({"library", "Directory of master bias, dark and flat frames", "library"});
+    parser.addOption({"output", "Directory for the calibrated frames. Default: <directory>/calibrated", "output"});
+    parser.addOption({"no-recursive", "Do not calibrate frames in subdirectories"});
+    parser.addOption({"threads", "Frames calibrated at once. Default: 2", "threads"});
+    parser.addOption({"read-threads", "Threads reading frames ahead. Default: 2", "read-threads"});
+    parser.addOption({"write-threads", "Threads writing calibrated frames. Default: 2", "write-threads"});
+    parser.addOption({"prefetch", "Frames read ahead of the calibration. Default: 8", "prefetch"});
+    parser.addOption({"write-buffer", "Calibrated frames waiting to be written, in MB. Default: 512", "write-buffer"});
+    parser.addOption({"cache", "Memory for loaded masters, in MB. Default: 2048", "cache"});
+    parser.addOption({"restart", "Calibrate every frame again, ignoring the earlier run"});
+    parser.addOption({"dry-run", "Print the masters chosen for each frame without calibrating"});
+    parser.process(app);
+
+    if(parser.positionalArguments().size() != 1 || !parser.isSet("library"))
+        parser.showHelp(-1);
+
+    QString input_dir = QDir(parser.positionalArguments().first()).absolutePath();
+    QString output_dir = parser.value("output");
+    output_dir = QDir(output_dir.isEmpty() ? input_dir + "/calibrated" : output_dir).absolutePath();
+    if(output_dir == input_dir) {
+        cerr << "The output directory must differ from the input directory" << endl;
+        return -1;
+    }
+
+    size_t cache_mb = parser.isSet("cache") ? parser.value("cache").toULongLong() : 2048;
+    CalibrationLibrary library(cache_mb << 20);
+    string error;
+    if(!library.load(parser.value("library").toStdString(), error)) {
+        cerr << error << endl;
+        return -1;
+    }
+    cerr << "Calibration library: " << library.masters().size() << " masters" << endl;
+
+    // Outputs keep the layout of the input directory.
+    vector<string> files = find_fits_files(input_dir, !parser.isSet("no-recursive"), output_dir);
+    vector<string> outputs;
+    for(const string & file : files) {
+        QString relative = QDir(input_dir).relativeFilePath(QString::fromStdString(file));
+        outputs.push_back((output_dir + "/" + relative).toStdString());
+    }
+
+    if(parser.isSet("dry-run")) {
+        auto name = [](const CalibrationMaster * master) {
+            return master ? QFileInfo(QString::fromStdString(master->path)).fileName().toStdString() : string("-");
+        };
+        for(const string & file : files) {
+            CVFITS frame(file);
+            CalibrationMatch match = library.match(frame);
+            cout << file << "\t" << name(match.bias) << "\t" << name(match.dark) << "\t" << match.dark_scale
+                 << "\t" << name(match.flat) << endl;
+        }
+        return 0;
+    }
+
+    QDir().mkpath(output_dir);
+
+    BatchCalibrationOptions options;
+    if(parser.isSet("threads"))
+        options.compute_threads = parser.value("threads").toInt();
+    if(parser.isSet("read-threads"))
+        options.read_threads = parser.value("read-threads").toInt();
+    if(parser.isSet("write-threads"))
+        options.write_threads = parser.value("write-threads").toInt();
+    if(parser.isSet("prefetch"))
+        options.prefetch_frames = parser.value("prefetch").toInt();
+    if(parser.isSet("write-buffer"))
+        options.write_buffer_bytes = parser.value("write-buffer").toULongLong() << 20;
+    options.journal = (output_dir + "/" + JOURNAL_NAME).toStdString();
+    options.resume = !parser.isSet("restart");
+
+    BatchCalibrator calibrator(library, options);
+    BatchCalibrationResult result = calibrator.run(files, outputs, [](const string & message) {
+        cerr << message << endl;
+    });
+
+    cerr << "Calibrated " << result.calibrated << " frames in " << result.seconds << " s ("
+         << result.skipped << " done earlier, " << result.failed << " failed) to "
+         << output_dir.toStdString() << endl;
+
+    return result.failed > 0 ? 1 : 0;
+}
@@ -1,24 +1,54 @@
-#include <QApplication>
 #include <QDebug>
 #include <QDateTime>
 #include <QFileInfo>
 #include <QDir>
+#include <QProcess>
 
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
 #include <signal.h>
 
-#include <opencv2/opencv.hpp>
-#include <opencv2/highgui.hpp>
+#include <opencv2/core.hpp>
 #include <opencv2/core/mat.hpp>
 #include <opencv2/imgproc.hpp>
 
 #include "camera_control.hpp"
 #include "cli_parser.hpp"
+#include "aperture_photometry.hpp"
+#include "auto_flat.hpp"
+#include "camera_profile.hpp"
+#include "capture_stages.hpp"
+#include "cooler_control.hpp"
+#include "focus_history.hpp"
+#include "frame_spool.hpp"
+#include "framebus.hpp"
+#include "guider.hpp"
+#include "live_stack.hpp"
+#include "lucky_imaging.hpp"
+#include "pixel_pipeline.hpp"
+#include "quality_gate.hpp"
+#include "session_recording.hpp"
+#include "star_detection.hpp"
+#include "streak_detection.hpp"
+#include "usb_tuner.hpp"
 #include "cvfits.hpp"
+#include "async_fits_writer.hpp"
+#include "fits_sequence_writer.hpp"
+#include "ser_writer.hpp"
 #include "image_calibration.hpp"
+#include "hot_pixels.hpp"
 
-bool keep_running = true;
+std::atomic<bool> keep_running{true};
+
+/// Background tile of the star detector inside the focus window (pixels).
+static const int FOCUS_STAR_TILE = 32;
+
+/// Stars measured per frame inside the focus window.
+static const size_t FOCUS_MAX_STARS = 20;
 
 
 enum BayerOrder {
@@ -29,7 +59,102 @@ enum BayerOrder {
     BAYER_ORDER_NONE,
 };
 
-int takeExposures(const QMap<QString, QVariant> & config) {
+/// @return The OpenCV conversion from the sensor's Bayer mosaic to BGR, or -1 for monochrome sensors.
+static int bayerConversionCode(BayerOrder bayer_order) {
+
+    if(bayer_order == BAYER_ORDER_GBRG) {
+        return cv::COLOR_BayerGBRG2BGR;
+    } else if (bayer_order == BAYER_ORDER_GRBG) {
+        return cv::COLOR_BayerGRBG2BGR;
+    } else if (bayer_order == BAYER_ORDER_BGGR) {
+        return cv::COLOR_BayerBGGR2BGR;
+    } else if (bayer_order == BAYER_ORDER_RGGB) {
+        return cv::COLOR_BayerRGGB2BGR;
+    }
+
+    return -1;
+}
+
+/// @brief Returns the SER pixel layout of a frame.
+/// @param bayer_order The sensor's Bayer order.
+/// @param debayered Whether the frame has already been converted to BGR.
+static SERWriter::ColorID serColorID(BayerOrder bayer_order, bool debayered) {
+    if(debayered)
+        return SERWriter::COLOR_BGR;
+
+    switch(bayer_order) {
+        case BAYER_ORDER_GBRG: return SERWriter::COLOR_BAYER_GBRG;
+        case BAYER_ORDER_GRBG: return SERWriter::COLOR_BAYER_GRBG;
+        case BAYER_ORDER_BGGR: return SERWriter::COLOR_BAYER_BGGR;
+        case BAYER_ORDER_RGGB: return SERWriter::COLOR_BAYER_RGGB;
+        default: return SERWriter::COLOR_MONO;
+    }
+}
+
+/// @brief Converts a raw frame to a BGR image if the sensor has a Bayer filter.
+/// @param raw_image The raw frame.
+/// @param color_image Buffer that receives the debayered image.
+/// @param bayer_order Bayer order of the sensor.
+/// @return color_image for color sensors, otherwise raw_image.
+static cv::Mat debayerImage(const cv::Mat & raw_image, cv::Mat & color_image, BayerOrder bayer_order) {
+
+    int code = bayerConversionCode(bayer_order);
+    if(code < 0) {
+        // not a bayer image, just swap buffers
+        return raw_image;
+    }
+
+    cv::cvtColor(raw_image, color_image, code);
+    return color_image;
+}
+
+/// @brief Debayers a raw frame and measures it in a single pass over cache-sized tiles.
+/// @param raw_image The raw frame, with pixels of type T.
+/// @param color_image Buffer that receives the debayered image.
+/// @param bayer_order Bayer order of the sensor.
+/// @param measure Measure monochrome frames too. Color frames are always measured.
+/// @param stats Receives the per-channel statistics.
+/// @return color_image for color sensors, otherwise raw_image.
+template <typename T>
+static cv::Mat developImage(const cv::Mat & raw_image, cv::Mat & color_image, BayerOrder bayer_order,
+                            bool measure, FrameStatistics & stats) {
+
+    int code = bayerConversionCode(bayer_order);
+    if(code < 0) {
+        if(measure) {
+            PixelPipeline<StatisticsStage<T>> pipeline{StatisticsStage<T>()};
+            pipeline.run(raw_image);
+            stats = pipeline.template stage<0>().statistics();
+        }
+        return raw_image;
+    }
+
+    // The statistics are taken while the debayered tile is still in the cache.
+    color_image.create(raw_image.rows, raw_image.cols, CV_MAKETYPE(raw_image.depth(), 3));
+    PixelPipeline<DebayerStage, StatisticsStage<T>, StoreStage> pipeline{
+        DebayerStage(code), StatisticsStage<T>(), StoreStage(color_image)};
+    pipeline.run(raw_image);
+    stats = pipeline.template stage<1>().statistics();
+    return color_image;
+}
+
+/// Returns the usb-traffic setting, resolving "auto" to the value qhy-capture
+/// --tune-usb stored for this camera on this host, or 0 if it was never tuned.
+/// The tuning is stored under the bin mode that was applied, so call this after
+/// setCameraBinMode with the mode it returned.
+static int usbTraffic(const QMap<QString, QVariant> & config, const std::string & camera_id, int transfer_bits,
+                      const QString & bin_mode) {
+    if(config["usb-traffic"] != "auto")
+        return config["usb-traffic"].toInt();
+
+    QString tuning_file = config["usb-tuning-file"].toString();
+    int usb_traffic = 0;
+    if(loadUSBTuning(tuning_file, QString::fromStdString(camera_id), transfer_bits, bin_mode, usb_traffic))
+        qDebug() << "Using tuned usb-traffic" << usb_traffic << "from" << tuning_file;
+    return usb_traffic;
+}
+
+int takeExposures(const QMap<QString, QVariant> & config, const CaptureCallbacks & callbacks) {
 
     using namespace std;
 
@@ -53,17 +178,116 @@ int takeExposures(const QMap<QString, QVariant> & config) {
     bool enable_gui = (config["no-gui"] == "0");
     bool save_fits =  (config["no-save"] == "0");
     QString save_dir        = config["save-dir"].toString();
+    QString fits_writer_mode = config["fits-writer"].toString();
+    QString fits_container  = config["fits-container"].toString();
+    bool ser_mode           = (config["ser"] == "1");
+    bool ser_debayer        = (config["ser-debayer"] == "1");
+
+    // Unpack burst capture settings
+    bool burst_mode         = (config["burst"] == "1");
+    size_t burst_frames     = config["burst-frames"].toULongLong();
+    double burst_ram_fraction = config["burst-ram-fraction"].toDouble();
+    bool burst_huge_pages   = (config["burst-hugepages"] == "1");
+    QString burst_drain     = config["burst-drain"].toString();
+
+    // Unpack lucky imaging settings
+    bool lucky_mode         = (config["lucky"] == "1");
+    LuckyImaging::Metric lucky_metric = (config["lucky-metric"] == "fwhm") ?
+        LuckyImaging::METRIC_FWHM : LuckyImaging::METRIC_LAPLACIAN;
+    size_t lucky_keep       = config["lucky-keep"].toULongLong();
+    double lucky_keep_percent = config["lucky-keep-percent"].toDouble();
+    int lucky_roi           = config["lucky-roi"].toInt();
+    int lucky_downsample    = config["lucky-downsample"].toInt();
+    bool lucky_stack        = (config["lucky-stack"] == "1");
+    size_t lucky_max_memory = config["lucky-max-memory"].toULongLong() << 20;
+
+    // Unpack live stacking settings
+    bool live_stack_mode    = (config["live-stack"] == "1");
+    LiveStack::Mode live_stack_combine = (config["live-stack-mode"] == "sigma-clip") ?
+        LiveStack::MODE_SIGMA_CLIP : LiveStack::MODE_MEAN;
+    double live_stack_sigma = config["live-stack-sigma"].toDouble();
+    int live_stack_downsample = config["live-stack-downsample"].toInt();
+    double live_stack_min_response = config["live-stack-min-response"].toDouble();
+
+    // Unpack star detection settings
+    bool star_detect        = (config["star-detect"] == "1");
+    double star_threshold   = config["star-threshold"].toDouble();
+    int star_tile           = config["star-tile"].toInt();
+    int star_min_area       = config["star-min-area"].toInt();
+    size_t star_max         = config["star-max"].toULongLong();
+    double star_budget_ms   = config["star-budget-ms"].toDouble();
+    bool star_list          = (config["star-list"] == "1");
+
+    // Unpack streak detection settings
+    bool streak_detect      = (config["streak-detect"] == "1");
+    int streak_bin          = config["streak-bin"].toInt();
+    double streak_threshold = config["streak-threshold"].toDouble();
+    double streak_min_length = config["streak-min-length"].toDouble();
+    int streak_tile         = config["streak-tile"].toInt();
+    size_t streak_max       = config["streak-max"].toULongLong();
+    QString streak_exec     = config["streak-exec"].toString();
+
+    // Unpack photometry settings
+    bool photometry_mode    = (config["photometry"] == "1");
+    int phot_search         = config["phot-search"].toInt();
+    double phot_aperture    = config["phot-aperture"].toDouble();
+    double phot_annulus_inner = config["phot-annulus-inner"].toDouble();
+    double phot_annulus_outer = config["phot-annulus-outer"].toDouble();
+    double phot_egain       = config["phot-egain"].toDouble();
+    QString phot_lightcurve = config["phot-lightcurve"].toString();
+
+    // Unpack quality gate settings
+    bool quality_gate_mode  = (config["gate"] == "1");
+    QualityThresholds gate_thresholds;
+    gate_thresholds.max_background = config["gate-max-background"].toDouble();
+    gate_thresholds.min_stars = config["gate-min-stars"].toULongLong();
+    gate_thresholds.max_fwhm = config["gate-max-fwhm"].toDouble();
+    gate_thresholds.max_saturation = config["gate-max-saturation"].toDouble();
+    gate_thresholds.saturation_level = config["gate-saturation-level"].toInt();
+    QualityGate::Action gate_action = (config["gate-action"] == "drop") ?
+        QualityGate::ACTION_DROP : QualityGate::ACTION_QUARANTINE;
+    QString quarantine_dir  = config["gate-quarantine-dir"].toString();
+
+    // Unpack auto flat settings
+    bool auto_flat_mode     = (config["flat"] == "1");
+    AutoFlat::Source flat_source = (config["flat-source"] == "dawn") ? AutoFlat::SOURCE_DAWN :
+        (config["flat-source"] == "panel") ? AutoFlat::SOURCE_PANEL : AutoFlat::SOURCE_DUSK;
+    AutoFlatSettings flat_settings;
+    flat_settings.target = config["flat-target"].toDouble();
+    flat_settings.tolerance = config["flat-tolerance"].toDouble();
+    flat_settings.bias = config["flat-bias"].toDouble();
+    flat_settings.min_exposure = config["flat-min-exposure"].toDouble();
+    flat_settings.max_exposure = config["flat-max-exposure"].toDouble();
+    std::vector<double> flat_throughputs;
+    for(const QString & throughput : config["flat-throughputs"].toStringList())
+        flat_throughputs.push_back(throughput.toDouble());
+
+    // Unpack frame bus settings
+    bool framebus_mode      = (config["framebus"] == "1");
+    QString framebus_name   = config["framebus-name"].toString();
+    uint32_t framebus_slots = config["framebus-slots"].toUInt();
+    bool framebus_raw       = (config["framebus-stage"] == "raw");
+
+    // Unpack session recording and replay settings
+    QString record_file     = config["record"].toString();
+    QString replay_file     = config["replay"].toString();
+    bool replay_realtime    = (config["replay-speed"] == "recorded");
 
     // Unpack the camera configuration settings
     string camera_id        = config["camera-id"].toString().toStdString();
     int usb_transferbit     = config["usb-transferbit"].toInt();
-    int usb_traffic         = config["usb-traffic"].toInt();
+    int pixel_depth         = (usb_transferbit == 8) ? CV_8U : CV_16U;
     QStringList filter_names= config["filter-names"].toStringList();
     QString cal_dir         = config["camera-cal-dir"].toString();
+    QString hot_pixel_file  = config["hot-pixel-map"].toString();
     QString requestedBinMode = config["camera-bin-mode"].toString();
     QString setBinMode      = "1x1";
     int binX = 1;
     int binY = 1;
+    bool use_profile_cache  = (config["no-profile-cache"] == "0");
+    QString profile_cache_dir = config["profile-cache-dir"].toString();
+    if(profile_cache_dir.isEmpty())
+        profile_cache_dir = defaultProfileCacheDir();
 
     // Unpack exposure configuration settings.
     QStringList quantities  = config["exp-quantities"].toStringList();
@@ -80,101 +304,452 @@ int takeExposures(const QMap<QString, QVariant> & config) {
     // Unpack optional settings
     bool draw_circle = config["draw-circle"].toBool();
 
-    // Initalize the camera
-    int status = QHYCCD_SUCCESS;
-    status = InitQHYCCDResource();
-    qhyccd_handle * handle = OpenQHYCCD((char*) camera_id.c_str());
-
-    // Set to single frame mode.
-    status = SetQHYCCDStreamMode(handle, 0);
+    // Unpack cooler regulation settings
+    bool wait_for_cooler    = (config["wait-for-cooler"] == "1");
+    double cooler_setpoint  = config["camera-temperature"].toDouble();
+    double cooler_ramp_rate = config["camera-temp-ramp"].toDouble();
+    double cooler_tolerance = config["camera-temp-tolerance"].toDouble();
+    double cooler_settle    = config["camera-temp-settle"].toDouble();
+    double cooler_timeout   = config["camera-temp-timeout"].toDouble();
 
-    status = InitQHYCCD(handle);
-    if(status != QHYCCD_SUCCESS) {
-        qCritical() << "Camera cannot be initialized. Is it plugged in?";
-        exit(-1);
-    }
+    int status = QHYCCD_SUCCESS;
+    qhyccd_handle * handle = nullptr;
+
+    // Close the camera however the sequence ends, after everything declared
+    // below that still uses it, such as the cooler, has been destroyed.
+    struct CameraCloser {
+        qhyccd_handle *& handle;
+        ~CameraCloser() {
+            if(handle) {
+                CloseQHYCCD(handle);
+                ReleaseQHYCCDResource();
+            }
+        }
+    } camera_closer{handle};
 
-    // Verify the camera supports the modes we will be using.
-    status = IsQHYCCDControlAvailable(handle, CAM_SINGLEFRAMEMODE);
-    if(status != QHYCCD_SUCCESS) {
-        qCritical() << "Camera does not support single frame exposures";
-        exit(-1);
-    }
-
-    // Determine if we can get the temperature
-    bool can_get_temperature = (IsQHYCCDControlAvailable(handle, CONTROL_CURTEMP) == QHYCCD_SUCCESS);
-
-    // If this is a color camera, get the Bayer ordering.
-    if(IsQHYCCDControlAvailable(handle, CAM_IS_COLOR) == QHYCCD_SUCCESS) {
-        qDebug() << "Device is a color camera";
-        int qhy_bayer_order = IsQHYCCDControlAvailable(handle, CAM_COLOR);
-        switch(qhy_bayer_order) {
-            case BAYER_GB:
-                bayer_order = BAYER_ORDER_GBRG;
-                qDebug() << "Bayer Order: BAYER_ORDER_GBRG";
-            break;
-            case BAYER_GR:
-                bayer_order = BAYER_ORDER_GRBG;
-                qDebug() << "Bayer Order: BAYER_ORDER_GRBG";
-            break;
-            case BAYER_BG:
-                bayer_order = BAYER_ORDER_BGGR;
-                qDebug() << "Bayer Order: BAYER_ORDER_BGGR";
-            break;
-            case BAYER_RG:
-                bayer_order = BAYER_ORDER_RGGB;
-                qDebug() << "Bayer Order: BAYER_ORDER_RGGB";
-            break;
-            default:
-                bayer_order = BAYER_ORDER_NONE;
-                qDebug() << "Bayer Order: BAYER_ORDER_NONE";
-        }
-    }
-
-    // Get the maximum image size, ignoring the overscan area, in 1x1 binning mode.
-    // Use this as the default image size.
-    GetQHYCCDEffectiveArea(handle, &roiStartX, &roiStartY, &roiSizeX, &roiSizeY);
-
-    // Setup the filter wheel
+    bool can_get_temperature = false;
     char fw_cmd_position[8] = {0};
     char fw_act_position[8] = {0};
-    bool filter_wheel_exists = (IsQHYCCDCFWPlugged(handle) == QHYCCD_SUCCESS);
-    qDebug() << "Filter wheel exists?:" << filter_wheel_exists;
+    bool filter_wheel_exists = false;
     int filter_wheel_max_slots = 0;
-    if(filter_wheel_exists) {
-        filter_wheel_max_slots = GetQHYCCDParam(handle, CONTROL_CFWSLOTSNUM);
-        qDebug() << "Filter wheel slots:" << filter_wheel_max_slots;
-    }
 
-    // Configure camera settings that are in common to all images
-    status  = SetQHYCCDParam(handle, CONTROL_TRANSFERBIT, usb_transferbit);
-    status |= SetQHYCCDParam(handle, CONTROL_USBTRAFFIC, usb_traffic);
-    status |= SetQHYCCDResolution(handle, roiStartX, roiStartY, roiSizeX, roiSizeY);
-    status |= setCameraBinMode(handle, requestedBinMode, setBinMode, binX, binY);
-    status |= SetQHYCCDBitsMode(handle, 16);
-    if(status != QHYCCD_SUCCESS) {
-        qCritical() << "Camera configuration failed";
-        exit(-1);
+    // In replay mode the frames come from a capture file instead of the camera.
+    std::unique_ptr<SessionReader> replay;
+    if(!replay_file.isEmpty()) {
+        replay.reset(new SessionReader(replay_file.toStdString()));
+        if(!replay->isOpen()) {
+            qCritical() << "Could not read the capture file" << replay_file;
+            return -1;
+        }
+
+        const SessionHeader & header = replay->header();
+        if(header.cv_type != CV_8U && header.cv_type != CV_16U) {
+            qCritical() << "Capture file" << replay_file << "does not contain 8 or 16-bit frames";
+            return -1;
+        }
+        pixel_depth = header.cv_type;
+
+        camera_id = header.detector_name;
+        bayer_order = (BayerOrder) header.bayer_order;
+        setBinMode = header.bin_mode_name;
+        binX = header.xbinning;
+        binY = header.ybinning;
+        roiSizeX = header.cols * binX;
+        roiSizeY = header.rows * binY;
+
+        // Replace the exposure sequence with the recorded one, one entry per
+        // run of frames taken with the same settings.
+        quantities.clear();
+        durations.clear();
+        filters.clear();
+        gains.clear();
+        offsets.clear();
+        filter_names.clear();
+        const SessionFrame * previous = nullptr;
+        for(const SessionFrame & frame : replay->frames()) {
+            QString filter_name = frame.filter_name;
+            if(previous == nullptr || filter_name != previous->filter_name || frame.duration_sec != previous->duration_sec ||
+               frame.gain != previous->gain || frame.offset != previous->offset) {
+                quantities.append("0");
+                durations.append(QString::number(frame.duration_sec, 'g', 17));
+                filters.append(filter_name);
+                gains.append(QString::number(frame.gain, 'g', 17));
+                offsets.append(QString::number(frame.offset));
+            }
+            quantities.last() = QString::number(quantities.last().toInt() + 1);
+            if(!filter_names.contains(filter_name))
+                filter_names.append(filter_name);
+            previous = &frame;
+        }
+
+        qDebug() << "Replaying" << replay->frames().size() << "frames from" << replay_file
+                 << (replay_realtime ? "at the recorded speed" : "as fast as possible");
+
+        if(wait_for_cooler) {
+            qWarning() << "Replaying a capture file, ignoring the cooler";
+            wait_for_cooler = false;
+        }
+    } else {
+        // Initalize the camera
+        status = InitQHYCCDResource();
+        handle = OpenQHYCCD((char*) camera_id.c_str());
+
+        // Set to single frame mode.
+        status = SetQHYCCDStreamMode(handle, 0);
+
+        status = InitQHYCCD(handle);
+        if(status != QHYCCD_SUCCESS) {
+            qCritical() << "Camera cannot be initialized. Is it plugged in?";
+            return -1;
+        }
+
+        // Look up the camera capabilities. The cached profile saves probing
+        // every control unless the firmware has changed.
+        CameraProfile profile;
+        if(use_profile_cache) {
+            bool from_cache = false;
+            profile = loadCameraProfile(handle, camera_id, profile_cache_dir, from_cache);
+            qDebug() << (from_cache ? "Loaded cached camera profile, firmware" : "Probed camera profile, firmware")
+                     << QString::fromStdString(profile.firmware);
+        } else {
+            profile = probeCameraProfile(handle, camera_id);
+        }
+
+        // Verify the camera supports the modes we will be using.
+        if(!profile.single_frame) {
+            qCritical() << "Camera does not support single frame exposures";
+            return -1;
+        }
+        if(pixel_depth == CV_8U && !profile.controls.count("CAM_8BITS")) {
+            qCritical() << "Camera does not support 8-bit transfers";
+            return -1;
+        }
+
+        // Determine if we can get the temperature
+        can_get_temperature = profile.can_get_temperature;
+
+        // If this is a color camera, get the Bayer ordering.
+        if(profile.is_color) {
+            qDebug() << "Device is a color camera";
+            switch(profile.bayer_pattern) {
+                case BAYER_GB:
+                    bayer_order = BAYER_ORDER_GBRG;
+                    qDebug() << "Bayer Order: BAYER_ORDER_GBRG";
+                break;
+                case BAYER_GR:
+                    bayer_order = BAYER_ORDER_GRBG;
+                    qDebug() << "Bayer Order: BAYER_ORDER_GRBG";
+                break;
+                case BAYER_BG:
+                    bayer_order = BAYER_ORDER_BGGR;
+                    qDebug() << "Bayer Order: BAYER_ORDER_BGGR";
+                break;
+                case BAYER_RG:
+                    bayer_order = BAYER_ORDER_RGGB;
+                    qDebug() << "Bayer Order: BAYER_ORDER_RGGB";
+                break;
+                default:
+                    bayer_order = BAYER_ORDER_NONE;
+                    qDebug() << "Bayer Order: BAYER_ORDER_NONE";
+            }
+        }
+
+        // Get the maximum image size, ignoring the overscan area, in 1x1 binning mode.
+        // Use this as the default image size.
+        roiStartX = profile.effective_x;
+        roiStartY = profile.effective_y;
+        roiSizeX = profile.effective_width;
+        roiSizeY = profile.effective_height;
+
+        // Setup the filter wheel
+        filter_wheel_exists = profile.filter_wheel;
+        qDebug() << "Filter wheel exists?:" << filter_wheel_exists;
+        if(filter_wheel_exists) {
+            filter_wheel_max_slots = profile.filter_wheel_slots;
+            qDebug() << "Filter wheel slots:" << filter_wheel_max_slots;
+        }
+
+        // Configure camera settings that are in common to all images
+        status  = SetQHYCCDParam(handle, CONTROL_TRANSFERBIT, usb_transferbit);
+        status |= setCameraGeometry(handle, roiStartX, roiStartY, roiSizeX, roiSizeY,
+                                    requestedBinMode, setBinMode, binX, binY, &profile);
+        status |= SetQHYCCDParam(handle, CONTROL_USBTRAFFIC, usbTraffic(config, camera_id, usb_transferbit, setBinMode));
+        status |= SetQHYCCDBitsMode(handle, usb_transferbit);
+        if(status != QHYCCD_SUCCESS) {
+            qCritical() << "Camera configuration failed";
+            return -1;
+        }
     }
 
     // Calculate the size of the resulting image
     uint32_t imageSizeX = roiSizeX / binX;
     uint32_t imageSizeY = roiSizeY / binY;
 
-    // Allocate a buffers to store the images
-    cv::Mat raw_image(imageSizeY, imageSizeX, CV_16U);
-    cv::Mat color_image(imageSizeY / 2, imageSizeX / 2, CV_16UC3);
-    cv::Mat display_image;
+    // Allocate a buffers to store the images. 8-bit transfers keep 8-bit
+    // pixels all the way to the FITS file.
+    cv::Mat raw_image(imageSizeY, imageSizeX, CV_MAKETYPE(pixel_depth, 1));
+    cv::Mat color_image(imageSizeY, imageSizeX, CV_MAKETYPE(pixel_depth, 3));
 
     CVFITS cvfits;
 
+    // Record the raw frames and their timings so the session can be replayed later.
+    std::unique_ptr<SessionRecorder> recorder;
+    if(!record_file.isEmpty()) {
+        SessionHeader header;
+        header.rows = raw_image.rows;
+        header.cols = raw_image.cols;
+        header.cv_type = raw_image.type();
+        header.bayer_order = bayer_order;
+        header.xbinning = binX;
+        header.ybinning = binY;
+        strncpy(header.detector_name, camera_id.c_str(), sizeof(header.detector_name) - 1);
+        strncpy(header.bin_mode_name, setBinMode.toStdString().c_str(), sizeof(header.bin_mode_name) - 1);
+
+        recorder.reset(new SessionRecorder(record_file.toStdString(), header));
+        if(!recorder->isOpen()) {
+            qCritical() << "Could not create the capture file" << record_file;
+            return -1;
+        }
+        qDebug() << "Recording the session to" << record_file;
+    }
+
+    // Replay statistics: how long the processing stages took per frame.
+    size_t replay_frames = 0;
+    double replay_processing_ms = 0;
+    double replay_processing_max_ms = 0;
+    std::chrono::steady_clock::time_point replay_origin;
+    int64_t recorded_origin_ns = 0;
+
+    // Write the frames to FITS files, FITS containers or SER videos.
+    std::unique_ptr<CaptureWriter> capture_writer;
+    if(save_fits) {
+        // Write FITS files from background threads unless synchronous writes were requested.
+        std::unique_ptr<AsyncFITSWriter> writer;
+        if(fits_writer_mode != "sync")
+            writer = createFITSWriter(config);
+
+        // Append frames to a few large files instead of creating one file per frame.
+        std::unique_ptr<FITSSequenceWriter> sequence;
+        if(fits_container != "file")
+            sequence = createFITSSequenceWriter(config);
+
+        capture_writer.reset(new CaptureWriter(std::move(writer), std::move(sequence), fits_container));
+
+        // Write SER videos instead of FITS files, one per filter.
+        if(ser_mode) {
+            size_t ser_expected_frames = 0;
+            for(const QString & quantity : quantities)
+                ser_expected_frames = std::max<size_t>(ser_expected_frames, quantity.toInt());
+            capture_writer->useSER(ser_debayer, ser_expected_frames,
+                                   serColorID(bayer_order, false), serColorID(bayer_order, true));
+        }
+    }
+
+    // In burst mode frames are read out into a preallocated RAM spool and
+    // written to disk by a background thread. cli_parser has already turned
+    // off the options that need the frames during capture.
+    std::unique_ptr<FrameSpool> spool;
+    if(burst_mode && save_fits) {
+        size_t frame_bytes = raw_image.total() * raw_image.elemSize();
+        size_t max_frames = FrameSpool::maxFrames(frame_bytes, burst_ram_fraction);
+        size_t requested_frames = burst_frames;
+        if(requested_frames == 0) {
+            for(const QString & quantity : quantities)
+                requested_frames += quantity.toInt();
+        }
+
+        qDebug() << "Maximum burst length that fits in memory:" << max_frames << "frames"
+                 << "(" << FrameSpool::availableMemory() / (1 << 20) << "MB available)";
+        if(requested_frames > max_frames) {
+            qWarning() << "Requested burst of" << requested_frames << "frames exceeds the memory limit."
+                       << "Frames beyond" << max_frames << "will wait for the disk.";
+        }
+
+        size_t spool_frames = std::min(max_frames, requested_frames);
+        if(spool_frames == 0) {
+            qCritical() << "Not enough memory for a burst spool";
+            return -1;
+        }
+
+        spool.reset(new FrameSpool(imageSizeY, imageSizeX, pixel_depth, spool_frames, burst_huge_pages));
+        if(!spool->isAllocated())
+            return -1;
+
+        qDebug() << "Burst spool holds" << spool->capacity() << "frames"
+                 << (spool->usesHugePages() ? "in huge pages" : "");
+        if(enable_gui)
+            qDebug() << "Display is disabled during bursts";
+
+        // Debayer and write spooled frames on the drain thread.
+        CaptureWriter * spool_writer = capture_writer.get();
+        spool->startDrain([bayer_order, spool_writer](
+                              const cv::Mat & spooled_image, CVFITS & metadata, const std::string & filename) {
+            cv::Mat spooled_color;
+            if(spool_writer->needsDevelopedImage())
+                metadata.image = debayerImage(spooled_image, spooled_color, bayer_order);
+            spool_writer->write(metadata, spooled_image, filename);
+        }, burst_drain == "after");
+    }
+
+    // Regulate the sensor temperature in the background and hold off the
+    // sequence until it has settled at the set point.
+    std::unique_ptr<CoolerController> cooler;
+    if(wait_for_cooler) {
+        if(cooler_setpoint >= 40) {
+            qWarning() << "Cooling is disabled by the camera temperature setting, not waiting for the cooler";
+        } else {
+            cooler.reset(new CoolerController(handle, cooler_setpoint, cooler_ramp_rate,
+                                              cooler_tolerance, cooler_settle));
+            if(cooler->start() == QHYCCD_SUCCESS) {
+                if(cooler->waitUntilStable(cooler_timeout)) {
+                    qDebug() << "Sensor temperature stable after" << cooler->timeToStable() << "seconds";
+                } else if(keep_running) {
+                    qWarning() << "Starting exposures before the sensor temperature is stable";
+                }
+            } else {
+                cooler.reset();
+            }
+        }
+    }
+
+    // The processing stages each frame passes through, in order.
+    std::vector<std::unique_ptr<CaptureStage>> stages;
+
+    // Measure the stars in every frame and record the statistics in the FITS header.
+    // The quality gate needs the star statistics, so it enables detection too.
+    if(star_detect || quality_gate_mode) {
+        stages.emplace_back(new StarStage(star_threshold, star_tile, star_min_area, star_max, star_budget_ms));
+    }
+
+    // Search every frame for satellite and debris tracks.
+    if(streak_detect) {
+        stages.emplace_back(new StreakStage(streak_bin, streak_threshold, streak_min_length, streak_tile, streak_max));
+    }
+
+    // Publish every frame to other processes through shared memory, before it is written.
+    if(framebus_mode) {
+        size_t slot_bytes = raw_image.total() * raw_image.elemSize();
+        if(!framebus_raw && bayer_order != BAYER_ORDER_NONE)
+            slot_bytes *= 3;
+
+        std::unique_ptr<FrameBusStage> framebus(new FrameBusStage(framebus_name.toStdString(), framebus_slots,
+                                                                  slot_bytes, framebus_raw));
+        if(!framebus->isOpen()) {
+            qCritical() << "Could not create the frame bus" << framebus_name;
+            return -1;
+        }
+        qDebug() << "Publishing" << (framebus_raw ? "raw" : "processed") << "frames on" << framebus_name
+                 << "with" << framebus_slots << "slots";
+        stages.push_back(std::move(framebus));
+    }
+
+    // Hand every frame to the embedding application.
+    if(callbacks.frame) {
+        stages.emplace_back(new FrameCallbackStage(callbacks.frame));
+    }
+
+    // Keep poor frames out of the save directory.
+    if(quality_gate_mode) {
+        // The saturation level is given for 16-bit frames.
+        if(pixel_depth == CV_8U && gate_thresholds.saturation_level > 255) {
+            gate_thresholds.saturation_level = gate_thresholds.saturation_level * 255 / 65535;
+            qDebug() << "Quality gate saturation level for 8-bit frames:" << gate_thresholds.saturation_level;
+        }
+        if(gate_action == QualityGate::ACTION_QUARANTINE && save_fits && !QDir().mkpath(quarantine_dir)) {
+            qCritical() << "Could not create the quarantine directory" << quarantine_dir;
+            return -1;
+        }
+        stages.emplace_back(new QualityGateStage(gate_thresholds, gate_action, quarantine_dir));
+    }
+
+    // Measure the target at the image center and append it to a light curve.
+    if(photometry_mode) {
+        if(phot_lightcurve.isEmpty())
+            phot_lightcurve = save_dir + "lightcurve_" + catalog_name + "_" + object_id + ".csv";
+        std::unique_ptr<PhotometryStage> photometry(new PhotometryStage(phot_search, phot_aperture,
+            phot_annulus_inner, phot_annulus_outer, phot_egain, phot_lightcurve.toStdString()));
+        if(!photometry->isOpen()) {
+            qCritical() << "Could not open the light curve" << phot_lightcurve;
+            return -1;
+        }
+        qDebug() << "Appending photometry to" << phot_lightcurve;
+        stages.push_back(std::move(photometry));
+    }
+
+    // In lucky imaging mode only the sharpest frames of each filter are written.
+    if(lucky_mode) {
+        size_t frame_bytes = raw_image.total() * raw_image.elemSize();
+        if(bayer_order != BAYER_ORDER_NONE)
+            frame_bytes *= 3;
+        stages.emplace_back(new LuckyStage(lucky_metric, lucky_keep, lucky_keep_percent, lucky_roi, lucky_downsample,
+                                           lucky_stack, frame_bytes, lucky_max_memory, capture_writer.get()));
+    }
+
+    // Write the star and streak lists next to the frames.
+    bool write_star_list = star_list && (star_detect || quality_gate_mode);
+    if(save_fits && (write_star_list || streak_detect)) {
+        stages.emplace_back(new SidecarStage(write_star_list, streak_detect, streak_exec));
+    }
+
+    if(capture_writer) {
+        stages.emplace_back(new WriteStage(capture_writer.get()));
+    }
+
+    // Fold every frame of a filter into a running stack, which replaces the single frame on screen.
+    if(live_stack_mode) {
+        stages.emplace_back(new LiveStackStage(live_stack_combine, live_stack_sigma, live_stack_downsample,
+                                               live_stack_min_response, capture_writer.get()));
+    }
+
+    // Repair the sensor's hot pixels in the raw frame before anything measures or debayers it.
+    std::unique_ptr<HotPixelMap> hot_pixels;
+    if(!hot_pixel_file.isEmpty()) {
+        hot_pixels.reset(new HotPixelMap());
+        std::string error;
+        if(!hot_pixels->load(hot_pixel_file.toStdString(), error)) {
+            qCritical() << "Could not load the hot pixel map:" << error.c_str();
+            return -1;
+        }
+        if(hot_pixels->cols() != (int) imageSizeX || hot_pixels->rows() != (int) imageSizeY) {
+            qCritical() << "The hot pixel map is" << hot_pixels->cols() << "x" << hot_pixels->rows()
+                        << "but frames are" << imageSizeX << "x" << imageSizeY;
+            return -1;
+        }
+        if(hot_pixels->cfa() != (bayer_order != BAYER_ORDER_NONE))
+            qWarning() << "The hot pixel map was made for a" << (hot_pixels->cfa() ? "color" : "monochrome") << "sensor";
+        qDebug() << "Repairing" << hot_pixels->pixels().size() << "hot pixels from" << hot_pixel_file;
+    }
+
+    // Choose flat exposure times from the sky brightness and take the filters
+    // in the order the twilight sky suits them.
+    std::unique_ptr<AutoFlat> auto_flat;
+    std::vector<int> filter_order = AutoFlat::filterOrder({}, flat_source, filters.length());
+    if(auto_flat_mode) {
+        // The target and bias are given for 16-bit frames.
+        if(pixel_depth == CV_8U) {
+            flat_settings.full_scale = 255;
+            if(flat_settings.target > 255) {
+                flat_settings.target = flat_settings.target * 255 / 65535;
+                flat_settings.bias = flat_settings.bias * 255 / 65535;
+                qDebug() << "Auto flat target for 8-bit frames:" << flat_settings.target;
+            }
+        }
+        auto_flat.reset(new AutoFlat(flat_settings, flat_source));
+        filter_order = AutoFlat::filterOrder(flat_throughputs, flat_source, filters.length());
+        if(flat_throughputs.empty() && flat_source != AutoFlat::SOURCE_PANEL)
+            qWarning() << "No flat-throughputs given, taking the filters in the order listed";
+    }
+
     cv::Point2d image_center(imageSizeX / 2, imageSizeY / 2);
     cv::Scalar white_color(255, 255, 255);
     cv::Scalar black_color(0,0,0);
 
     // Set up the camera and take images.
-    for(int idx = 0; keep_running && idx < filters.length(); idx++) {
+    // A failed exposure ends the sequence, but what was taken is still written.
+    bool capture_failed = false;
+    for(int filter_step = 0; keep_running && !capture_failed && filter_step < filters.length(); filter_step++) {
 
+        int idx = filter_order[filter_step];
         int quantity = quantities[idx].toInt();
         double duration_sec  = durations[idx].toDouble();
         double duration_usec = duration_sec * 1E6;
@@ -188,7 +763,7 @@ int takeExposures(const QMap<QString, QVariant> & config) {
         }
 
         // Load the flat file for this filter
-        cv::Mat flat_image = cv::Mat::ones(imageSizeY, imageSizeX, CV_16U);
+        cv::Mat flat_image = cv::Mat::ones(imageSizeY, imageSizeX, pixel_depth);
         //QString flatFileName = cal_dir + QDir::separator() + "average_flat_" + filter_name + ".fits";
         QString flatFileName = "None.fits";
         QFileInfo flatFileInfo(flatFileName);
@@ -200,13 +775,17 @@ int takeExposures(const QMap<QString, QVariant> & config) {
         }
 
         // Configure exposure settings unique to this filter.
-        status |= SetQHYCCDParam(handle, CONTROL_GAIN, gain);
-        status |= SetQHYCCDParam(handle, CONTROL_OFFSET, offset);
-        status |= SetQHYCCDParam(handle, CONTROL_EXPOSURE, duration_usec);
+        if(!replay) {
+            status |= SetQHYCCDParam(handle, CONTROL_GAIN, gain);
+            status |= SetQHYCCDParam(handle, CONTROL_OFFSET, offset);
+            status |= SetQHYCCDParam(handle, CONTROL_EXPOSURE, duration_usec);
+        }
 
         // Change the filter
+        double filter_move_sec = 0;
         if(filter_wheel_exists && filter_wheel_max_slots > 0) {
             qDebug() << "Commanding filter wheel to change to" << filter_name << "slot" << filter_idx;
+            const auto t_move = std::chrono::steady_clock::now();
 
             snprintf(fw_cmd_position, 8, "%X", filter_idx);
             status = SendOrder2QHYCCDCFW(handle, fw_cmd_position, 1);
@@ -220,105 +799,231 @@ int takeExposures(const QMap<QString, QVariant> & config) {
             // Wait an additional second for the filter wheel motion to complete.
             std::this_thread::sleep_for(1s);
 
+            filter_move_sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_move).count();
             qDebug() << "Filter change to" << filter_name << "successful";
         }
 
+        // The configured duration is the first guess for a filter nothing is known about.
+        if(auto_flat) {
+            auto_flat->beginFilter(idx, flat_throughputs.empty() ? 0 : flat_throughputs[idx], duration_sec);
+        }
+
+        // Lucky imaging and live stacking start over for each filter.
+        for(auto & stage : stages)
+            stage->beginFilter(quantity);
+
         // take images
-        for(int exposure_idx = 0; keep_running && exposure_idx < quantity; exposure_idx++) {
+        for(int exposure_idx = 0; keep_running && !capture_failed && exposure_idx < quantity; exposure_idx++) {
+
+            // Auto flats predict each exposure time, or wait for the sky to reach the usable range.
+            if(auto_flat) {
+                AutoFlat::Plan plan = auto_flat->plan(std::chrono::system_clock::now());
+                if(plan.action == AutoFlat::ACTION_NEXT_FILTER) {
+                    qWarning() << "Auto flats: the sky is out of range for" << filter_name << "after"
+                               << exposure_idx << "/" << quantity << "flats";
+                    break;
+                }
+                if(plan.action == AutoFlat::ACTION_WAIT) {
+                    qDebug() << "Auto flats: waiting" << plan.wait_sec << "seconds for the sky";
+                    const auto until = std::chrono::steady_clock::now() + std::chrono::duration<double>(plan.wait_sec);
+                    while(keep_running && std::chrono::steady_clock::now() < until)
+                        std::this_thread::sleep_for(100ms);
+                    exposure_idx--;
+                    continue;
+                }
+                duration_sec = plan.exposure_sec;
+                duration_usec = duration_sec * 1E6;
+                if(!replay)
+                    SetQHYCCDParam(handle, CONTROL_EXPOSURE, duration_usec);
+            }
+
             qDebug() << "Starting exposure" << exposure_idx + 1 << "/" << quantity
                      << "with a duration of" << duration_usec / 1E6 << "seconds";
 
             int64_t time_remaining_ms = duration_usec / 1E3;
 
-            // Start the exposure
-            const auto t_a = std::chrono::system_clock::now();
-            status = ExpQHYCCDSingleFrame(handle);
-            if(status != QHYCCD_SUCCESS) {
-                qCritical() << "Exposure failed to start";
-                exit(-1);
-            }
+            // In burst mode the camera reads out directly into the spool. Claim
+            // the slot before exposing so a full spool never delays a readout.
+            cv::Mat frame_buffer = spool ? spool->acquire() : raw_image;
+
+            std::chrono::system_clock::time_point t_a, t_b, t_c;
+            SessionFrame recorded;
+            if(replay) {
+                // Take the next recorded frame and its timings.
+                if(!replay->next(recorded, frame_buffer)) {
+                    qCritical() << "Could not read frame" << replay_frames + 1 << "from" << replay_file;
+                    capture_failed = true;
+                    break;
+                }
 
-            // Wake up every 10 milliseconds to check on exposure progress.
-            do {
-                std::this_thread::sleep_for(10ms);
-                time_remaining_ms -= 10;
-            } while (keep_running && time_remaining_ms > 100);
-
-            // If we are instructed to exit, abort the exposure and readout.
-            if(!keep_running) {
-                qDebug() << "Aborting exposure and readout";
-                status = CancelQHYCCDExposingAndReadout(handle);
-                break;
-            }
+                // At the recorded speed, deliver frames with the recorded spacing.
+                if(replay_realtime) {
+                    if(replay_frames == 0) {
+                        replay_origin = std::chrono::steady_clock::now();
+                        recorded_origin_ns = recorded.readout_end_ns;
+                    }
+                    auto due = replay_origin + std::chrono::nanoseconds(recorded.readout_end_ns - recorded_origin_ns);
+                    while(keep_running && std::chrono::steady_clock::now() + 10ms < due)
+                        std::this_thread::sleep_for(10ms);
+                    if(!keep_running)
+                        break;
+                    std::this_thread::sleep_until(due);
+                } else if(replay_frames == 0) {
+                    replay_origin = std::chrono::steady_clock::now();
+                }
 
-            // Transfer the image. This is a blocking call.
-            const auto t_b = std::chrono::system_clock::now();
-            status = GetQHYCCDSingleFrame(handle, &retSizeX, &retSizeY, &bpp, &channels, raw_image.ptr());
-            const auto t_c = std::chrono::system_clock::now();
+                auto to_time_point = [](int64_t ns) {
+                    return std::chrono::system_clock::time_point(
+                        std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::nanoseconds(ns)));
+                };
+                t_a = to_time_point(recorded.exposure_start_ns);
+                t_b = to_time_point(recorded.readout_start_ns);
+                t_c = to_time_point(recorded.readout_end_ns);
+                temperature = recorded.temperature;
+                if(recorded.filter_move_sec > 0)
+                    qDebug() << "Recorded filter move took" << recorded.filter_move_sec << "seconds";
+            } else {
+                // Start the exposure
+                t_a = std::chrono::system_clock::now();
+                status = ExpQHYCCDSingleFrame(handle);
+                if(status != QHYCCD_SUCCESS) {
+                    qCritical() << "Exposure failed to start";
+                    capture_failed = true;
+                    break;
+                }
+
+                // Wake up every 10 milliseconds to check on exposure progress.
+                do {
+                    std::this_thread::sleep_for(10ms);
+                    time_remaining_ms -= 10;
+                } while (keep_running && time_remaining_ms > 100);
+
+                // If we are instructed to exit, abort the exposure and readout.
+                if(!keep_running) {
+                    qDebug() << "Aborting exposure and readout";
+                    status = CancelQHYCCDExposingAndReadout(handle);
+                    break;
+                }
 
-            if(roiSizeX / binX != retSizeX || roiSizeY / binY != retSizeY) {
-                qFatal("Predicted vs. actual image size mismatch!");
+                // Transfer the image. This is a blocking call.
+                t_b = std::chrono::system_clock::now();
+                status = GetQHYCCDSingleFrame(handle, &retSizeX, &retSizeY, &bpp, &channels, frame_buffer.ptr());
+                t_c = std::chrono::system_clock::now();
+
+                if(roiSizeX / binX != retSizeX || roiSizeY / binY != retSizeY) {
+                    qCritical() << "Predicted vs. actual image size mismatch!";
+                    capture_failed = true;
+                    break;
+                }
+
+                // Get additional time-dependent information from the camera.
+                if(cooler)
+                    temperature = cooler->temperature();
+                else if(can_get_temperature)
+                    temperature = GetQHYCCDParam(handle, CONTROL_CURTEMP);
+            }
+            const auto t_frame = std::chrono::steady_clock::now();
+
+            // Append the raw frame to the capture file.
+            if(recorder) {
+                SessionFrame frame;
+                strncpy(frame.filter_name, filter_name.toStdString().c_str(), sizeof(frame.filter_name) - 1);
+                frame.exposure_start_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(t_a.time_since_epoch()).count();
+                frame.exposure_end_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(t_b.time_since_epoch()).count();
+                frame.readout_start_ns = frame.exposure_end_ns;
+                frame.readout_end_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(t_c.time_since_epoch()).count();
+                frame.duration_sec = duration_sec;
+                frame.gain = gain;
+                frame.offset = offset;
+                frame.temperature = temperature;
+                frame.filter_move_sec = replay ? recorded.filter_move_sec : (exposure_idx == 0 ? filter_move_sec : 0);
+                if(!recorder->record(frame, frame_buffer))
+                    qWarning() << "Could not record the frame to" << record_file;
             }
 
-            // Get additional time-dependent information from the camera.
-            if(can_get_temperature)
-                temperature = GetQHYCCDParam(handle, CONTROL_CURTEMP);
-
-            // De-bayer the image if needed
-            if(bayer_order == BAYER_ORDER_GBRG) {
-                cv::cvtColor(raw_image, color_image, cv::COLOR_BayerGBRG2BGR);
-                display_image = color_image;
-            } else if (bayer_order == BAYER_ORDER_GRBG) {
-                cv::cvtColor(raw_image, color_image, cv::COLOR_BayerGRBG2BGR);
-                display_image = color_image;
-            } else if (bayer_order == BAYER_ORDER_BGGR) {
-                cv::cvtColor(raw_image, color_image, cv::COLOR_BayerBGGR2BGR);
-                display_image = color_image;
-            } else if (bayer_order == BAYER_ORDER_RGGB) {
-                cv::cvtColor(raw_image, color_image, cv::COLOR_BayerRGGB2BGR);
-                display_image = color_image;
-            } else {
-                // not a bayer image, just swap buffers
-                display_image = raw_image;
+            // Replace the hot pixels with the median of their neighbours.
+            cvfits.history.clear();
+            if(hot_pixels && hot_pixels->repair(frame_buffer)) {
+                cvfits.history.push_back("Repaired " + std::to_string(hot_pixels->pixels().size()) +
+                                         " hot pixels from " + QFileInfo(hot_pixel_file).fileName().toStdString());
             }
 
-            // Save FITS files when instructed.
-            if(save_fits) {
-                // Save the image data
-                QString filename = QDateTime::currentDateTimeUtc().toString(Qt::ISODate) +
-                    "_" + catalog_name + "_" + object_id + "_" + filter_name + ".fits";
-                // replace colons in the filename with hypens
-                std::replace(filename.begin(), filename.end(), ':', '-');
-
-                QString full_path = save_dir + filename;
-
-                cvfits.image = display_image;
-                cvfits.detector_name = camera_id;
-                cvfits.filter_name = filter_name.toStdString();
-                cvfits.bin_mode_name = setBinMode.toStdString();
-                cvfits.xbinning = binX;
-                cvfits.ybinning = binY;
-                cvfits.exposure_start = t_a;
-                cvfits.exposure_end = t_b;
-                cvfits.readout_start = t_b;
-                cvfits.readout_end = t_c;
-                cvfits.exposure_duration_sec = duration_sec;
-                cvfits.catalog_name = catalog_name.toStdString();
-                cvfits.object_name = object_id.toStdString();
-                cvfits.latitude = latitude;
-                cvfits.longitude = longitude;
-                cvfits.altitude = altitude;
-                cvfits.temperature = temperature;
-                cvfits.gain = gain;
-
-                cvfits.saveToFITS(full_path.toStdString());
+            // Flats outside the tolerance are not written and do not count towards the quantity.
+            bool flat_accepted = true;
+            if(auto_flat) {
+                std::string reason;
+                flat_accepted = auto_flat->addFrame(frame_buffer, t_a, duration_sec, reason);
+                if(flat_accepted) {
+                    qDebug() << "Auto flats: level" << auto_flat->level() << "ADU, sky trend"
+                             << auto_flat->trend() << "per minute";
+                } else {
+                    qWarning() << "Auto flats: rejected the frame," << reason.c_str();
+                    exposure_idx--;
+                }
+            }
+
+            // Describe the exposure.
+            QString filename = QDateTime::currentDateTimeUtc().toString((spool || replay) ? Qt::ISODateWithMs : Qt::ISODate) +
+                "_" + catalog_name + "_" + object_id + "_" + filter_name + ".fits";
+            // replace colons in the filename with hypens
+            std::replace(filename.begin(), filename.end(), ':', '-');
+
+            QString full_path = save_dir + filename;
+
+            cvfits.detector_name = camera_id;
+            cvfits.filter_name = filter_name.toStdString();
+            cvfits.bin_mode_name = setBinMode.toStdString();
+            cvfits.xbinning = binX;
+            cvfits.ybinning = binY;
+            cvfits.exposure_start = t_a;
+            cvfits.exposure_end = t_b;
+            cvfits.readout_start = t_b;
+            cvfits.readout_end = t_c;
+            cvfits.exposure_duration_sec = duration_sec;
+            cvfits.catalog_name = catalog_name.toStdString();
+            cvfits.object_name = object_id.toStdString();
+            cvfits.latitude = latitude;
+            cvfits.longitude = longitude;
+            cvfits.altitude = altitude;
+            cvfits.temperature = temperature;
+            cvfits.gain = gain;
+
+            // In burst mode the frame stays in the spool until the drain thread writes it.
+            if(spool) {
+                spool->commit(cvfits, full_path.toStdString());
+                continue;
             }
 
+            // De-bayer the image if needed, measuring it for the preview in the same pass.
+            CaptureFrame frame;
+            const bool show_preview = enable_gui && callbacks.preview;
+            frame.raw_image = raw_image;
+            if(pixel_depth == CV_8U)
+                frame.image = developImage<uint8_t>(raw_image, color_image, bayer_order, show_preview, frame.stats);
+            else
+                frame.image = developImage<uint16_t>(raw_image, color_image, bayer_order, show_preview, frame.stats);
+            frame.display_image = frame.image;
+            frame.stats_valid = show_preview;
+
+            // Hand the frame to the stages. Flats outside the tolerance are not written.
+            frame.metadata = cvfits;
+            frame.filename = filename.toStdString();
+            frame.path = full_path.toStdString();
+            frame.accepted = flat_accepted;
+            frame.writable = save_fits && flat_accepted;
+
+            for(auto & stage : stages)
+                stage->process(frame);
+
             // Display the image when instructed.
-            if(enable_gui) {
+            if(show_preview) {
 
                 //display_image /= flat_image;
-                display_image = scaleImageLinear(display_image);
+                cv::Mat display_image;
+                if(frame.stats_valid)
+                    display_image = scaleImageLinear(frame.display_image, frame.stats);
+                else
+                    display_image = scaleImageLinear(frame.display_image);
 
                 // Draw a circle for the image center.
                 if(draw_circle) {
@@ -332,21 +1037,119 @@ int takeExposures(const QMap<QString, QVariant> & config) {
                     cv::circle(display_image, image_center, outer_ring + ring_width, black_color, ring_width);
                 }
 
+                // Let the stages mark what they measured.
+                for(const auto & stage : stages)
+                    stage->annotate(display_image);
+
                 // Show the image.
-                cv::imshow("display_window", display_image);
-                cv::waitKey(1);
+                callbacks.preview(display_image);
+            }
+
+            // Time the processing stages so replays can compare changes to them.
+            if(replay) {
+                double processing_ms = std::chrono::duration<double, std::milli>(
+                    std::chrono::steady_clock::now() - t_frame).count();
+                replay_frames++;
+                replay_processing_ms += processing_ms;
+                replay_processing_max_ms = std::max(replay_processing_max_ms, processing_ms);
             }
         }
+
+        // Write the lucky imaging winners and the stacks of this filter.
+        for(auto & stage : stages)
+            stage->endFilter(duration_sec);
+    }
+
+    // Flush the burst spool, then wait for outstanding FITS files to reach the disk.
+    if(spool) {
+        qDebug() << "Draining" << spool->pending() << "spooled frames to disk";
+        spool->finish();
+        qDebug() << "Burst spool high water mark:" << spool->highWater() << "/" << spool->capacity() << "frames";
+        spool.reset();
+    }
+    for(auto & stage : stages)
+        stage->finish();
+    if(capture_writer)
+        capture_writer->close();
+    if(recorder) {
+        qDebug() << "Recorded" << recorder->frames() << "frames," << recorder->bytes() / (1 << 20)
+                 << "MB, to" << record_file;
+    }
+    if(replay && replay_frames > 0) {
+        double elapsed_sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - replay_origin).count();
+        qDebug() << "Replayed" << replay_frames << "frames in" << elapsed_sec << "seconds,"
+                 << "processing mean:" << replay_processing_ms / replay_frames << "ms"
+                 << "max:" << replay_processing_max_ms << "ms";
     }
 
     // shutdown cleanly
-    CloseQHYCCD(handle);
-    ReleaseQHYCCDResource();
+    if(cooler) {
+        qDebug() << "Time to stable temperature:" << cooler->timeToStable() << "seconds";
+        cooler->stop();
+    }
 
-    return 0;
+    return capture_failed ? -1 : 0;
 }
 
-int setCameraBinMode(qhyccd_handle * handle, const QString & requestedMode, QString & setMode, int & binX, int & binY) {
+std::unique_ptr<FITSSequenceWriter> createFITSSequenceWriter(const QMap<QString, QVariant> & config) {
+
+    QString container   = config["fits-container"].toString();
+    size_t max_frames   = config["fits-container-frames"].toULongLong();
+    size_t max_bytes    = config["fits-container-size"].toULongLong() << 20;
+
+    FITSSequenceWriter::Layout layout = (container == "cube") ? FITSSequenceWriter::LAYOUT_CUBE
+                                                              : FITSSequenceWriter::LAYOUT_MEF;
+
+    qDebug() << "Appending frames to" << container << "files of up to" << max_frames << "frames and"
+             << (max_bytes >> 20) << "MB";
+
+    return std::unique_ptr<FITSSequenceWriter>(new FITSSequenceWriter(layout, max_frames, max_bytes));
+}
+
+std::unique_ptr<AsyncFITSWriter> createFITSWriter(const QMap<QString, QVariant> & config) {
+
+    QString mode            = config["fits-writer"].toString();
+    int num_threads         = config["fits-writer-threads"].toInt();
+    size_t max_inflight     = config["fits-writer-max-inflight"].toULongLong() << 20;
+    QString sync_mode       = config["fits-sync"].toString();
+    int sync_batch          = config["fits-sync-batch"].toInt();
+
+    AsyncFITSWriter::Backend backend = AsyncFITSWriter::BACKEND_THREADS;
+    if(mode == "io_uring") {
+        if(AsyncFITSWriter::ioUringAvailable())
+            backend = AsyncFITSWriter::BACKEND_IO_URING;
+        else
+            qWarning() << "io_uring support was not compiled in, using the thread pool FITS writer";
+    }
+
+    AsyncFITSWriter::SyncPolicy sync_policy = AsyncFITSWriter::SYNC_BATCH;
+    if(sync_mode == "none")
+        sync_policy = AsyncFITSWriter::SYNC_NONE;
+    else if(sync_mode == "file")
+        sync_policy = AsyncFITSWriter::SYNC_FILE;
+
+    qDebug() << "Starting FITS writer:" << mode << "threads:" << num_threads
+             << "sync:" << sync_mode;
+
+    return std::unique_ptr<AsyncFITSWriter>(
+        new AsyncFITSWriter(backend, num_threads, max_inflight, sync_policy, sync_batch));
+}
+
+void reportFITSWriterMetrics(const AsyncFITSWriterMetrics & metrics) {
+    qDebug() << "FITS files written:" << metrics.files_written
+             << "(" << metrics.bytes_written / (1 << 20) << "MB)"
+             << "errors:" << metrics.errors;
+    qDebug() << "FITS write latency mean:" << metrics.mean_latency_ms << "ms"
+             << "max:" << metrics.max_latency_ms << "ms"
+             << "producer blocked:" << metrics.producer_wait_ms << "ms";
+    qDebug() << "FITS writer queue depth:" << metrics.queue_depth
+             << "max:" << metrics.max_queue_depth;
+    if(metrics.errors > 0)
+        qWarning() << "Last FITS write error:" << QString::fromStdString(metrics.last_error);
+}
+
+int setCameraBinMode(qhyccd_handle * handle, const QString & requestedMode, QString & setMode, int & binX, int & binY,
+                     const CameraProfile * profile) {
 
     // default to 1x1 binning
     binX = 1;
@@ -407,10 +1210,11 @@ int setCameraBinMode(qhyccd_handle * handle, const QString & requestedMode, QStr
 
     // For all other binning modes, verify that the binning mode is supported.
     // If it isn't supported, issue a warning and call this function recursively to set things.
-    bool modeSupported = (IsQHYCCDControlAvailable(handle, control_id) == QHYCCD_SUCCESS);
+    bool modeSupported = profile ? profile->supportsBinMode(setMode.toStdString()) :
+        (IsQHYCCDControlAvailable(handle, control_id) == QHYCCD_SUCCESS);
     if(!modeSupported) {
         qWarning() << "Warning: Binning" << requestedMode << "is not supported, reverting to 1x1 binning";
-        return setCameraBinMode(handle, "1x1", setMode, binX, binY);
+        return setCameraBinMode(handle, "1x1", setMode, binX, binY, profile);
     }
 
     // If the binning mode is supported, go ahead and set it.
@@ -418,6 +1222,14 @@ int setCameraBinMode(qhyccd_handle * handle, const QString & requestedMode, QStr
     return SetQHYCCDBinMode(handle, binX, binY);
 }
 
+int setCameraGeometry(qhyccd_handle * handle, uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+                      const QString & requestedMode, QString & setMode, int & binX, int & binY,
+                      const CameraProfile * profile) {
+    int status = SetQHYCCDResolution(handle, x, y, width, height);
+    status |= setCameraBinMode(handle, requestedMode, setMode, binX, binY, profile);
+    return status;
+}
+
 void setTemperature(qhyccd_handle * handle, double setPointC) {
 
     int status = QHYCCD_SUCCESS;
@@ -454,6 +1266,10 @@ int runCooler(const QMap<QString, QVariant> & config) {
     bool cool_down   = (config["camera-cool-down"].toString() == "1");
     double temperature = config["camera-temperature"].toDouble();
     string camera_id   = config["camera-id"].toString().toStdString();
+    double ramp_rate   = config["camera-temp-ramp"].toDouble();
+    double tolerance   = config["camera-temp-tolerance"].toDouble();
+    double settle_time = config["camera-temp-settle"].toDouble();
+    double timeout     = config["camera-temp-timeout"].toDouble();
 
     // Initalize the camera
     int status = QHYCCD_SUCCESS;
@@ -476,13 +1292,477 @@ int runCooler(const QMap<QString, QVariant> & config) {
         return -1;
     }
 
+    // Ramp the set point to limit thermal stress on the sensor. When cooling,
+    // wait for the temperature to settle so the time to stable can be reported.
     qDebug() << "Setting temperature to" << temperature;
-    setTemperature(handle, temperature);
-    //monitorTemperature(handle);
+    CoolerController cooler(handle, temperature, ramp_rate, tolerance, settle_time);
+    if(cooler.start() != QHYCCD_SUCCESS) {
+        qCritical() << "Could not start the cooler. Aborting.";
+        CloseQHYCCD(handle);
+        ReleaseQHYCCDResource();
+        return -1;
+    }
+    if(cool_down) {
+        if(cooler.waitUntilStable(timeout))
+            qDebug() << "Sensor temperature stable after" << cooler.timeToStable() << "seconds";
+    } else {
+        cooler.waitForRamp(timeout);
+    }
+    cooler.stop();
+
+    // shutdown cleanly
+    CloseQHYCCD(handle);
+    ReleaseQHYCCDResource();
+
+    return 0;
+}
+
+int runGuider(const QMap<QString, QVariant> & config) {
+    using namespace std;
+
+    string camera_id    = config["guide-camera-id"].toString().toStdString();
+    if(camera_id.empty())
+        camera_id       = config["camera-id"].toString().toStdString();
+    int roi_center_x    = config["guide-roi-x"].toInt();
+    int roi_center_y    = config["guide-roi-y"].toInt();
+    uint32_t roi_size   = config["guide-roi-size"].toUInt();
+    double exposure_ms  = config["guide-exposure"].toDouble();
+    double gain         = config["guide-gain"].toDouble();
+    int window_radius   = config["guide-window"].toInt();
+    double min_snr      = config["guide-min-snr"].toDouble();
+    string output_path  = config["guide-output"].toString().toStdString();
+    GuidePublisher::Transport transport = (config["guide-output-type"] == "fifo") ?
+        GuidePublisher::TRANSPORT_FIFO : GuidePublisher::TRANSPORT_SOCKET;
+
+    GuidePublisher publisher(transport, output_path);
+    if(!publisher.isOpen()) {
+        qCritical() << "Could not open the guide output" << output_path.c_str();
+        return -1;
+    }
+    GuideCentroider centroider(window_radius, min_snr);
+
+    // Initalize the camera in live mode so frames stream without a per-frame exposure request.
+    int status = QHYCCD_SUCCESS;
+    status = InitQHYCCDResource();
+    qhyccd_handle * handle = OpenQHYCCD((char*) camera_id.c_str());
+
+    status  = SetQHYCCDStreamMode(handle, 1);
+    status |= InitQHYCCD(handle);
+    if(status != QHYCCD_SUCCESS) {
+        qCritical() << "Camera cannot be initialized. Is it plugged in?";
+        return -1;
+    }
+
+    if(IsQHYCCDControlAvailable(handle, CAM_LIVEVIDEOMODE) != QHYCCD_SUCCESS) {
+        qCritical() << "Camera does not support live video mode";
+        CloseQHYCCD(handle);
+        ReleaseQHYCCDResource();
+        return -1;
+    }
+
+    // Center the guide window on the requested position, defaulting to the
+    // middle of the sensor, and keep it inside the effective area.
+    uint32_t area_x = 0, area_y = 0, area_width = 0, area_height = 0;
+    GetQHYCCDEffectiveArea(handle, &area_x, &area_y, &area_width, &area_height);
+    roi_size = min(roi_size, min(area_width, area_height));
+    if(roi_center_x < 0)
+        roi_center_x = area_width / 2;
+    if(roi_center_y < 0)
+        roi_center_y = area_height / 2;
+    uint32_t roi_x = area_x + min<uint32_t>(max(roi_center_x - (int) roi_size / 2, 0), area_width - roi_size);
+    uint32_t roi_y = area_y + min<uint32_t>(max(roi_center_y - (int) roi_size / 2, 0), area_height - roi_size);
+
+    QString setBinMode;
+    int binX = 1;
+    int binY = 1;
+    // The centroider works on 16-bit frames; the window is small enough that
+    // an 8-bit transfer would gain little.
+    status  = SetQHYCCDParam(handle, CONTROL_TRANSFERBIT, 16);
+    status |= setCameraGeometry(handle, roi_x, roi_y, roi_size, roi_size, "1x1", setBinMode, binX, binY);
+    status |= SetQHYCCDParam(handle, CONTROL_USBTRAFFIC, usbTraffic(config, camera_id, 16, setBinMode));
+    status |= SetQHYCCDBitsMode(handle, 16);
+    status |= SetQHYCCDParam(handle, CONTROL_GAIN, gain);
+    status |= SetQHYCCDParam(handle, CONTROL_EXPOSURE, exposure_ms * 1000);
+    if(status != QHYCCD_SUCCESS) {
+        qCritical() << "Camera configuration failed";
+        CloseQHYCCD(handle);
+        ReleaseQHYCCDResource();
+        return -1;
+    }
+
+    qDebug() << "Guiding on a" << roi_size << "x" << roi_size << "window at" << roi_x << roi_y
+             << "with" << exposure_ms << "ms exposures";
+
+    // Everything the loop touches is allocated up front.
+    vector<uint16_t> frame(roi_size * roi_size);
+    uint32_t retSizeX = 0, retSizeY = 0, bpp = 0, channels = 0;
+    bool locked = false;
+    double lock_x = 0, lock_y = 0;
+    size_t num_frames = 0, num_valid = 0;
+    double latency_sum_ms = 0, latency_max_ms = 0;
+    auto last_report = chrono::steady_clock::now();
+
+    BeginQHYCCDLive(handle);
+
+    while(keep_running) {
+        status = GetQHYCCDLiveFrame(handle, &retSizeX, &retSizeY, &bpp, &channels, (uint8_t *) frame.data());
+        if(status != QHYCCD_SUCCESS) {
+            std::this_thread::sleep_for(200us);
+            continue;
+        }
+
+        const auto t_frame = chrono::steady_clock::now();
+        timespec wall_clock;
+        clock_gettime(CLOCK_REALTIME, &wall_clock);
+        double timestamp = wall_clock.tv_sec + wall_clock.tv_nsec * 1E-9;
+
+        if(retSizeX != roi_size || retSizeY != roi_size)
+            continue;
+
+        // The first star found defines the lock position.
+        GuideCentroid centroid = centroider.measure(frame.data(), retSizeX, retSizeY);
+        if(centroid.valid && !locked) {
+            lock_x = centroid.x;
+            lock_y = centroid.y;
+            locked = true;
+        }
+
+        bool valid = centroid.valid && locked;
+        publisher.publish(timestamp, valid ? centroid.x - lock_x : 0, valid ? centroid.y - lock_y : 0, valid);
+
+        double latency_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t_frame).count();
+        latency_sum_ms += latency_ms;
+        latency_max_ms = max(latency_max_ms, latency_ms);
+        num_frames++;
+        num_valid += valid;
+
+        // Report once per second, outside the latency measurement.
+        if(t_frame - last_report >= 1s) {
+            qDebug() << "Guide error:" << centroid.x - lock_x << centroid.y - lock_y
+                     << "SNR:" << centroid.snr << "frames:" << num_frames
+                     << "mean latency:" << latency_sum_ms / num_frames << "ms";
+            last_report = t_frame;
+        }
+    }
+
+    StopQHYCCDLive(handle);
+
+    qDebug() << "Guider processed" << num_frames << "frames," << num_valid << "with a guide star";
+    if(num_frames > 0) {
+        qDebug() << "Frame to correction latency: mean" << latency_sum_ms / num_frames
+                 << "ms, max" << latency_max_ms << "ms";
+    }
+    qDebug() << "Corrections sent:" << publisher.sent() << "dropped:" << publisher.dropped();
 
     // shutdown cleanly
     CloseQHYCCD(handle);
     ReleaseQHYCCDResource();
 
     return 0;
-}
\ No newline at end of file
+}
+
+/// Reads one frame in live mode, waiting at most `timeout`.
+static bool readLiveFrame(qhyccd_handle * handle, cv::Mat & frame, std::chrono::milliseconds timeout) {
+    using namespace std;
+
+    uint32_t retSizeX = 0, retSizeY = 0, bpp = 0, channels = 0;
+    const auto deadline = chrono::steady_clock::now() + timeout;
+    while(keep_running && chrono::steady_clock::now() < deadline) {
+        if(GetQHYCCDLiveFrame(handle, &retSizeX, &retSizeY, &bpp, &channels, frame.ptr()) == QHYCCD_SUCCESS)
+            return ((int) retSizeX == frame.cols && (int) retSizeY == frame.rows);
+        std::this_thread::sleep_for(1ms);
+    }
+    return false;
+}
+
+int runFocus(const QMap<QString, QVariant> & config, const CaptureCallbacks & callbacks) {
+    using namespace std;
+
+    string camera_id    = config["camera-id"].toString().toStdString();
+    int usb_transferbit = config["usb-transferbit"].toInt();
+    int pixel_depth     = (usb_transferbit == 8) ? CV_8U : CV_16U;
+    QString requestedBinMode = config["camera-bin-mode"].toString();
+    bool enable_gui     = (config["no-gui"] == "0");
+    uint32_t roi_size   = config["focus-roi-size"].toUInt();
+    double exposure_ms  = config["focus-exposure"].toDouble();
+    double gain         = config["focus-gain"].toDouble();
+    size_t history_size = config["focus-history"].toULongLong();
+    double star_threshold = config["star-threshold"].toDouble();
+    int star_tile       = config["star-tile"].toInt();
+    int star_min_area   = config["star-min-area"].toInt();
+    size_t star_max     = config["star-max"].toULongLong();
+    double star_budget_ms = config["star-budget-ms"].toDouble();
+
+    // Initalize the camera in live mode.
+    int status = QHYCCD_SUCCESS;
+    status = InitQHYCCDResource();
+    qhyccd_handle * handle = OpenQHYCCD((char*) camera_id.c_str());
+
+    status  = SetQHYCCDStreamMode(handle, 1);
+    status |= InitQHYCCD(handle);
+    if(status != QHYCCD_SUCCESS) {
+        qCritical() << "Camera cannot be initialized. Is it plugged in?";
+        return -1;
+    }
+
+    if(IsQHYCCDControlAvailable(handle, CAM_LIVEVIDEOMODE) != QHYCCD_SUCCESS) {
+        qCritical() << "Camera does not support live video mode";
+        CloseQHYCCD(handle);
+        ReleaseQHYCCDResource();
+        return -1;
+    }
+
+    uint32_t area_x = 0, area_y = 0, area_width = 0, area_height = 0;
+    GetQHYCCDEffectiveArea(handle, &area_x, &area_y, &area_width, &area_height);
+
+    QString setBinMode;
+    int binX = 1;
+    int binY = 1;
+    status  = SetQHYCCDParam(handle, CONTROL_TRANSFERBIT, usb_transferbit);
+    status |= SetQHYCCDBitsMode(handle, usb_transferbit);
+    status |= SetQHYCCDParam(handle, CONTROL_GAIN, gain);
+    status |= SetQHYCCDParam(handle, CONTROL_EXPOSURE, exposure_ms * 1000);
+    status |= setCameraGeometry(handle, area_x, area_y, area_width, area_height,
+                                requestedBinMode, setBinMode, binX, binY);
+    status |= SetQHYCCDParam(handle, CONTROL_USBTRAFFIC, usbTraffic(config, camera_id, usb_transferbit, setBinMode));
+    if(status != QHYCCD_SUCCESS) {
+        qCritical() << "Camera configuration failed";
+        CloseQHYCCD(handle);
+        ReleaseQHYCCDResource();
+        return -1;
+    }
+
+    // Locate the brightest star on one full frame, falling back to the sensor center.
+    StarDetector detector(star_threshold, star_tile, star_min_area, star_max, star_budget_ms);
+    double star_x = area_width / 2.0;
+    double star_y = area_height / 2.0;
+    {
+        cv::Mat full_frame(area_height / binY, area_width / binX, pixel_depth);
+        chrono::milliseconds timeout((int64_t) exposure_ms + 5000);
+
+        BeginQHYCCDLive(handle);
+        bool have_frame = readLiveFrame(handle, full_frame, timeout);
+        StopQHYCCDLive(handle);
+
+        if(have_frame) {
+            StarField field = detector.detect(full_frame);
+            auto brightest = max_element(field.stars.begin(), field.stars.end(),
+                [](const Star & a, const Star & b) { return a.flux < b.flux; });
+            if(brightest != field.stars.end()) {
+                star_x = brightest->x * binX;
+                star_y = brightest->y * binY;
+            } else {
+                qWarning() << "No star found, focusing on the sensor center";
+            }
+        } else {
+            qWarning() << "No full frame received, focusing on the sensor center";
+        }
+    }
+
+    // Switch to an unbinned window around the star.
+    roi_size = min(roi_size, min(area_width, area_height));
+    uint32_t roi_x = area_x + min<uint32_t>(max((int) star_x - (int) roi_size / 2, 0), area_width - roi_size);
+    uint32_t roi_y = area_y + min<uint32_t>(max((int) star_y - (int) roi_size / 2, 0), area_height - roi_size);
+
+    // The USB traffic is tuned per bin mode, so apply it again for the 1x1 window.
+    status  = setCameraGeometry(handle, roi_x, roi_y, roi_size, roi_size, "1x1", setBinMode, binX, binY);
+    status |= SetQHYCCDParam(handle, CONTROL_USBTRAFFIC, usbTraffic(config, camera_id, usb_transferbit, setBinMode));
+    if(status != QHYCCD_SUCCESS) {
+        qCritical() << "Could not set the focus window";
+        CloseQHYCCD(handle);
+        ReleaseQHYCCDResource();
+        return -1;
+    }
+
+    qDebug() << "Focusing on a" << roi_size << "x" << roi_size << "window at" << roi_x << roi_y
+             << "with" << exposure_ms << "ms exposures";
+
+    // Small tiles and a tight budget keep the metric well inside the frame time.
+    StarDetector roi_detector(star_threshold, FOCUS_STAR_TILE, star_min_area, FOCUS_MAX_STARS,
+                              min(star_budget_ms, exposure_ms / 2));
+    FocusHistory history(history_size);
+    cv::Mat frame(roi_size, roi_size, pixel_depth);
+    chrono::milliseconds timeout((int64_t) exposure_ms + 2000);
+    auto t_previous = chrono::steady_clock::now();
+    double cycle_ms = 0;
+
+    BeginQHYCCDLive(handle);
+
+    while(keep_running) {
+        if(!readLiveFrame(handle, frame, timeout))
+            continue;
+
+        auto t_frame = chrono::steady_clock::now();
+        cycle_ms = chrono::duration<double, milli>(t_frame - t_previous).count();
+        t_previous = t_frame;
+
+        StarField field = roi_detector.detect(frame);
+        history.add(field.median_hfr, field.median_fwhm);
+
+        if(history.samples() % 10 == 0) {
+            qDebug() << "HFR:" << field.median_hfr << "FWHM:" << field.median_fwhm
+                     << "best HFR:" << history.bestHFR() << "cycle:" << cycle_ms << "ms";
+        }
+
+        // Show the window next to the metric history.
+        if(enable_gui && callbacks.preview) {
+            cv::Mat view;
+            cv::cvtColor(scaleImageLinear(frame), view, cv::COLOR_GRAY2BGR);
+            cv::resize(view, view, cv::Size(400, 400), 0, 0, cv::INTER_NEAREST);
+
+            cv::Mat canvas;
+            cv::hconcat(view, history.plot(600, 400), canvas);
+            callbacks.preview(canvas);
+        }
+    }
+
+    StopQHYCCDLive(handle);
+
+    qDebug() << "Focus loop processed" << history.samples() << "frames, best HFR" << history.bestHFR();
+
+    // shutdown cleanly
+    CloseQHYCCD(handle);
+    ReleaseQHYCCDResource();
+
+    return 0;
+}
+
+int runUSBTuner(const QMap<QString, QVariant> & config) {
+    using namespace std;
+
+    string camera_id     = config["camera-id"].toString().toStdString();
+    QString requestedBinMode = config["camera-bin-mode"].toString();
+    QStringList tune_bits = config["tune-usb-bits"].toStringList();
+    int frames_per_step  = config["tune-usb-frames"].toInt();
+    int max_steps        = config["tune-usb-steps"].toInt();
+    double exposure_ms   = config["tune-usb-exposure"].toDouble();
+    QString tuning_file  = config["usb-tuning-file"].toString();
+    bool use_profile_cache  = (config["no-profile-cache"] == "0");
+    QString profile_cache_dir = config["profile-cache-dir"].toString();
+    if(profile_cache_dir.isEmpty())
+        profile_cache_dir = defaultProfileCacheDir();
+
+    // Initalize the camera in single frame mode, as takeExposures uses it.
+    int status = QHYCCD_SUCCESS;
+    status = InitQHYCCDResource();
+    qhyccd_handle * handle = OpenQHYCCD((char*) camera_id.c_str());
+
+    status  = SetQHYCCDStreamMode(handle, 0);
+    status |= InitQHYCCD(handle);
+    if(status != QHYCCD_SUCCESS) {
+        qCritical() << "Camera cannot be initialized. Is it plugged in?";
+        return -1;
+    }
+
+    CameraProfile profile;
+    if(use_profile_cache) {
+        bool from_cache = false;
+        profile = loadCameraProfile(handle, camera_id, profile_cache_dir, from_cache);
+    } else {
+        profile = probeCameraProfile(handle, camera_id);
+    }
+
+    auto traffic_control = profile.controls.find("CONTROL_USBTRAFFIC");
+    if(!profile.single_frame || traffic_control == profile.controls.end()) {
+        qCritical() << "Camera does not support single frame exposures with a USB traffic setting";
+        CloseQHYCCD(handle);
+        ReleaseQHYCCDResource();
+        return -1;
+    }
+    vector<int> traffic_values = usbTrafficSweep(traffic_control->second, max_steps);
+
+    int tuned = 0;
+    for(const QString & bits : tune_bits) {
+        int transfer_bits = bits.toInt();
+        int pixel_depth = (transfer_bits == 8) ? CV_8U : CV_16U;
+        if(transfer_bits == 8 && !profile.controls.count("CAM_8BITS")) {
+            qWarning() << "Camera does not support 8-bit transfers, skipping";
+            continue;
+        }
+
+        QString setBinMode;
+        int binX = 1;
+        int binY = 1;
+        status  = SetQHYCCDParam(handle, CONTROL_TRANSFERBIT, transfer_bits);
+        status |= setCameraGeometry(handle, profile.effective_x, profile.effective_y,
+                                    profile.effective_width, profile.effective_height,
+                                    requestedBinMode, setBinMode, binX, binY, &profile);
+        status |= SetQHYCCDBitsMode(handle, transfer_bits);
+        status |= SetQHYCCDParam(handle, CONTROL_EXPOSURE, exposure_ms * 1000);
+        if(status != QHYCCD_SUCCESS) {
+            qCritical() << "Camera configuration failed";
+            CloseQHYCCD(handle);
+            ReleaseQHYCCDResource();
+            return -1;
+        }
+
+        uint32_t imageSizeX = profile.effective_width / binX;
+        uint32_t imageSizeY = profile.effective_height / binY;
+        cv::Mat frame(imageSizeY, imageSizeX, pixel_depth);
+
+        qDebug() << "Tuning" << transfer_bits << "bit," << setBinMode << "transfers over"
+                 << traffic_values.size() << "USB traffic settings";
+
+        vector<USBTuningResult> results;
+        for(int traffic : traffic_values) {
+            if(!keep_running)
+                break;
+
+            SetQHYCCDParam(handle, CONTROL_USBTRAFFIC, traffic);
+
+            USBTuningResult result;
+            result.usb_traffic = traffic;
+            result.transfer_bits = transfer_bits;
+            result.bin_mode = setBinMode;
+
+            // The first frame after a change may still be read with the old setting.
+            auto t_start = chrono::steady_clock::now();
+            for(int i = -1; i < frames_per_step && keep_running; i++) {
+                if(i == 0)
+                    t_start = chrono::steady_clock::now();
+
+                memset(frame.data, USB_TUNER_SENTINEL, frame.total() * frame.elemSize());
+
+                uint32_t retSizeX = 0, retSizeY = 0, bpp = 0, channels = 0;
+                status = ExpQHYCCDSingleFrame(handle);
+                auto t_readout = chrono::steady_clock::now();
+                if(status == QHYCCD_SUCCESS)
+                    status = GetQHYCCDSingleFrame(handle, &retSizeX, &retSizeY, &bpp, &channels, frame.ptr());
+                double readout_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t_readout).count();
+
+                bool ok = (status == QHYCCD_SUCCESS)
+                    && retSizeX == imageSizeX && retSizeY == imageSizeY
+                    && untransferredRows(frame) == 0;
+                if(i >= 0)
+                    result.addReadout(readout_ms, ok);
+            }
+            double elapsed_sec = chrono::duration<double>(chrono::steady_clock::now() - t_start).count();
+            result.fps = (elapsed_sec > 0) ? result.frames / elapsed_sec : 0;
+
+            qDebug() << "  usb-traffic" << traffic << "readout" << result.readout_ms << "ms (max"
+                     << result.readout_max_ms << "ms)" << result.fps << "fps" << result.errors << "errors";
+            results.push_back(result);
+        }
+
+        int best = selectUSBTuning(results);
+        if(best < 0) {
+            qWarning() << "No USB traffic setting transferred" << transfer_bits << "bit frames without errors";
+            continue;
+        }
+
+        const USBTuningResult & chosen = results[best];
+        if(!saveUSBTuning(tuning_file, QString::fromStdString(camera_id), chosen)) {
+            qCritical() << "Could not write the USB tuning to" << tuning_file;
+            continue;
+        }
+        qDebug() << "Stored usb-traffic" << chosen.usb_traffic << "for" << transfer_bits << "bit," << setBinMode
+                 << "transfers:" << chosen.fps << "fps in" << tuning_file;
+        tuned++;
+    }
+
+    // shutdown cleanly
+    CloseQHYCCD(handle);
+    ReleaseQHYCCDResource();
+
+    return (tuned > 0) ? 0 : -1;
+}
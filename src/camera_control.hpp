@@ -4,13 +4,31 @@
 #include <QString>
 #include <QVariant>
 
+#include <atomic>
+#include <memory>
+
 #include <qhyccd.h>
 
+#include "async_fits_writer.hpp"
+#include "camera_profile.hpp"
+#include "fits_sequence_writer.hpp"
+#include "qhycapture.hpp"
+
+/// Cleared to stop every capture loop and background thread. Set from signal
+/// handlers and read by the cooler and writer threads, so it must be atomic.
+extern std::atomic<bool> keep_running;
+
+/// @brief Runs the mode selected in the configuration: cooler, guider, focus, USB tuning, or exposures.
+/// @param config The requested configuration as generated by cli_parser
+/// @param callbacks Receivers for frames and previews.
+/// @return 0 on success, otherwise on failure.
+int runCapture(const QMap<QString, QVariant> & config, const CaptureCallbacks & callbacks);
 
 /// @brief Instructs th camera to take an exposure
 /// @param config The requested camera and exposure configuration as generated by cli_parser
+/// @param callbacks Receivers for frames and previews.
 /// @return 0 on success, otherwise on failure.
-int takeExposures(const QMap<QString, QVariant> & config);
+int takeExposures(const QMap<QString, QVariant> & config, const CaptureCallbacks & callbacks);
 
 /// @brief Sets the camera's binning mode from a string like "1x1"
 /// @param handle Handle to the QHY Camera
@@ -18,8 +36,33 @@ int takeExposures(const QMap<QString, QVariant> & config);
 /// @param setMode Returns the bin mode that was actually set.
 /// @param binX Returns the x-scale of the bin mode that was actually set.
 /// @param binY Returns the y-scale of the bin mode that was actually set.
+/// @param profile Capabilities of the camera. If null, the camera is queried.
 /// \return QHYCCD_SUCCESS on success, -1 otherwise.
-int setCameraBinMode(qhyccd_handle * handle, const QString & requestedMode, QString & setMode, int & binX, int & binY);
+int setCameraBinMode(qhyccd_handle * handle, const QString & requestedMode, QString & setMode, int & binX, int & binY,
+                     const CameraProfile * profile = nullptr);
+
+/// @brief Sets the readout area and then the bin mode.
+///
+/// The area is given in unbinned sensor pixels, whatever the bin mode; the
+/// frames read out are then (width / binX) x (height / binY) pixels.
+/// @param x, y, width, height The readout area in unbinned sensor pixels.
+/// The remaining parameters are those of setCameraBinMode.
+/// \return QHYCCD_SUCCESS on success, an error code otherwise.
+int setCameraGeometry(qhyccd_handle * handle, uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+                      const QString & requestedMode, QString & setMode, int & binX, int & binY,
+                      const CameraProfile * profile = nullptr);
+
+/// @brief Creates an asynchronous FITS writer from the `fits-writer*` and `fits-sync*` settings.
+/// @param config The application configuration as generated by cli_parser
+/// @return The writer. Its threads are already running.
+std::unique_ptr<AsyncFITSWriter> createFITSWriter(const QMap<QString, QVariant> & config);
+
+/// @brief Creates a writer that appends frames to MEF or cube files from the `fits-container*` settings.
+/// @param config The application configuration as generated by cli_parser
+std::unique_ptr<FITSSequenceWriter> createFITSSequenceWriter(const QMap<QString, QVariant> & config);
+
+/// @brief Prints the summary counters of an asynchronous FITS writer.
+void reportFITSWriterMetrics(const AsyncFITSWriterMetrics & metrics);
 
 void setTemperature(qhyccd_handle * handle, double setPointC);
 
@@ -27,4 +70,23 @@ void monitorTemperature(qhyccd_handle * handle);
 
 int runCooler(const QMap<QString, QVariant> & config);
 
+/// @brief Streams a small window around a guide star in live mode and
+/// publishes its offset from the lock position after every frame.
+/// @param config The requested camera and guider configuration as generated by cli_parser
+/// @return 0 on success, otherwise on failure.
+int runGuider(const QMap<QString, QVariant> & config);
+
+/// @brief Loops short exposures on a small window around the brightest star
+/// and plots its HFR and FWHM in the preview.
+/// @param config The requested camera and focus configuration as generated by cli_parser
+/// @param callbacks Receives the preview.
+/// @return 0 on success, otherwise on failure.
+int runFocus(const QMap<QString, QVariant> & config, const CaptureCallbacks & callbacks);
+
+/// @brief Measures single frame readouts at a range of USB traffic settings and
+/// stores the fastest stable setting for this camera and host in the USB tuning file.
+/// @param config The requested camera and tuning configuration as generated by cli_parser
+/// @return 0 if a setting was stored, otherwise on failure.
+int runUSBTuner(const QMap<QString, QVariant> & config);
+
 #endif // CAMERA_CONTROL_H
\ No newline at end of file
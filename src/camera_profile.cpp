@@ -0,0 +1,393 @@
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QStandardPaths>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+
+#include "camera_profile.hpp"
+
+namespace {
+struct ControlName {
+    CONTROL_ID id;
+    const char * name;
+};
+
+/// Controls recorded in the profile, in the order qhy-list-cameras prints them.
+const ControlName CONTROLS[] = {
+    {CONTROL_BRIGHTNESS, "CONTROL_BRIGHTNESS"},
+    {CONTROL_CONTRAST, "CONTROL_CONTRAST"},
+    {CONTROL_WBR, "CONTROL_WBR"},
+    {CONTROL_WBB, "CONTROL_WBB"},
+    {CONTROL_WBG, "CONTROL_WBG"},
+    {CONTROL_GAMMA, "CONTROL_GAMMA"},
+    {CONTROL_GAIN, "CONTROL_GAIN"},
+    {CONTROL_OFFSET, "CONTROL_OFFSET"},
+    {CONTROL_EXPOSURE, "CONTROL_EXPOSURE"},
+    {CONTROL_SPEED, "CONTROL_SPEED"},
+    {CONTROL_TRANSFERBIT, "CONTROL_TRANSFERBIT"},
+    {CONTROL_CHANNELS, "CONTROL_CHANNELS"},
+    {CONTROL_USBTRAFFIC, "CONTROL_USBTRAFFIC"},
+    {CONTROL_ROWNOISERE, "CONTROL_ROWNOISERE"},
+    {CONTROL_CURTEMP, "CONTROL_CURTEMP"},
+    {CONTROL_CURPWM, "CONTROL_CURPWM"},
+    {CONTROL_MANULPWM, "CONTROL_MANULPWM"},
+    {CONTROL_CFWPORT, "CONTROL_CFWPORT"},
+    {CONTROL_COOLER, "CONTROL_COOLER"},
+    {CONTROL_ST4PORT, "CONTROL_ST4PORT"},
+    {CAM_BIN1X1MODE, "CAM_BIN1X1MODE"},
+    {CAM_BIN2X2MODE, "CAM_BIN2X2MODE"},
+    {CAM_BIN3X3MODE, "CAM_BIN3X3MODE"},
+    {CAM_BIN4X4MODE, "CAM_BIN4X4MODE"},
+    {CAM_MECHANICALSHUTTER, "CAM_MECHANICALSHUTTER"},
+    {CAM_TRIGER_INTERFACE, "CAM_TRIGER_INTERFACE"},
+    {CAM_TECOVERPROTECT_INTERFACE, "CAM_TECOVERPROTECT_INTERFACE"},
+    {CAM_SINGNALCLAMP_INTERFACE, "CAM_SINGNALCLAMP_INTERFACE"},
+    {CAM_FINETONE_INTERFACE, "CAM_FINETONE_INTERFACE"},
+    {CAM_SHUTTERMOTORHEATING_INTERFACE, "CAM_SHUTTERMOTORHEATING_INTERFACE"},
+    {CAM_CALIBRATEFPN_INTERFACE, "CAM_CALIBRATEFPN_INTERFACE"},
+    {CAM_CHIPTEMPERATURESENSOR_INTERFACE, "CAM_CHIPTEMPERATURESENSOR_INTERFACE"},
+    {CAM_USBREADOUTSLOWEST_INTERFACE, "CAM_USBREADOUTSLOWEST_INTERFACE"},
+    {CAM_8BITS, "CAM_8BITS"},
+    {CAM_16BITS, "CAM_16BITS"},
+    {CAM_GPS, "CAM_GPS"},
+    {CAM_IGNOREOVERSCAN_INTERFACE, "CAM_IGNOREOVERSCAN_INTERFACE"},
+    {QHYCCD_3A_AUTOEXPOSURE, "QHYCCD_3A_AUTOEXPOSURE"},
+    {QHYCCD_3A_AUTOFOCUS, "QHYCCD_3A_AUTOFOCUS"},
+    {CONTROL_AMPV, "CONTROL_AMPV"},
+    {CONTROL_VCAM, "CONTROL_VCAM"},
+    {CAM_VIEW_MODE, "CAM_VIEW_MODE"},
+    {CONTROL_CFWSLOTSNUM, "CONTROL_CFWSLOTSNUM"},
+    {IS_EXPOSING_DONE, "IS_EXPOSING_DONE"},
+    {ScreenStretchB, "SCREENSTRETCHB"},
+    {ScreenStretchW, "SCREENSTRETCHW"},
+    {CONTROL_DDR, "CONTROL_DDR"},
+    {CAM_LIGHT_PERFORMANCE_MODE, "CAM_LIGHT_PERFORMANCE_MODE"},
+    {CAM_QHY5II_GUIDE_MODE, "CAM_QHY5II_GUIDE_MODE"},
+    {DDR_BUFFER_CAPACITY, "DDR_BUFFER_CAPACITY"},
+    {DDR_BUFFER_READ_THRESHOLD, "DDR_BUFFER_READ_THRESHOLD"},
+    {DefaultGain, "DEFAULTGAIN"},
+    {DefaultOffset, "DEFAULTOFFSET"},
+    {OutputDataActualBits, "OUTPUTDATAACTUALBITS"},
+    {OutputDataAlignment, "OUTPUTDATAALIGNMENT"},
+    {CAM_SINGLEFRAMEMODE, "CAM_SINGLEFRAMEMODE"},
+    {CAM_LIVEVIDEOMODE, "CAM_LIVEVIDEOMODE"},
+    {CAM_IS_COLOR, "CAM_IS_COLOR"},
+    {hasHardwareFrameCounter, "HASHARDWAREFRAMECOUNTER"},
+    {CONTROL_MAX_ID_Error, "CONTROL_MAX_ID_ERROR"},
+    {CAM_HUMIDITY, "CAM_HUMIDITY"},
+    {CAM_PRESSURE, "CAM_PRESSURE"},
+    {CONTROL_VACUUM_PUMP, "CONTROL_VACUUM_PUMP"},
+    {CONTROL_SensorChamberCycle_PUMP, "CONTROL_SENSORCHAMBERCYCLE_PUMP"},
+    {CAM_32BITS, "CAM_32BITS"},
+    {CAM_Sensor_ULVO_Status, "CAM_SENSOR_ULVO_STATUS"},
+    {CAM_SensorPhaseReTrain, "CAM_SENSORPHASERETRAIN"},
+    {CAM_InitConfigFromFlash, "CAM_INITCONFIGFROMFLASH"},
+    {CAM_TRIGER_MODE, "CAM_TRIGER_MODE"},
+    {CAM_TRIGER_OUT, "CAM_TRIGER_OUT"},
+    {CAM_BURST_MODE, "CAM_BURST_MODE"},
+    {CAM_SPEAKER_LED_ALARM, "CAM_SPEAKER_LED_ALARM"},
+    {CAM_WATCH_DOG_FPGA, "CAM_WATCH_DOG_FPGA"},
+    {CAM_BIN6X6MODE, "CAM_BIN6X6MODE"},
+    {CAM_BIN8X8MODE, "CAM_BIN8X8MODE"},
+    {CAM_GlobalSensorGPSLED, "CAM_GLOBALSENSORGPSLED"},
+    {CONTROL_ImgProc, "CONTROL_IMGPROC"},
+    {CONTROL_RemoveRBI, "CONTROL_REMOVERBI"},
+    {CONTROL_GlobalReset, "CONTROL_GLOBALRESET"},
+    {CONTROL_FrameDetect, "CONTROL_FRAMEDETECT"},
+    {CAM_GainDBConversion, "CAM_GAINDBCONVERSION"},
+    {CAM_CurveSystemGain, "CAM_CURVESYSTEMGAIN"},
+    {CAM_CurveFullWell, "CAM_CURVEFULLWELL"},
+    {CAM_CurveReadoutNoise, "CAM_CURVEREADOUTNOISE"},
+    {CONTROL_MAX_ID, "CONTROL_MAX_ID"},
+    {CONTROL_AUTOWHITEBALANCE, "CONTROL_AUTOWHITEBALANCE"},
+    {CONTROL_AUTOEXPOSURE, "CONTROL_AUTOEXPOSURE"},
+    {CONTROL_AUTOEXPmessureValue, "CONTROL_AUTOEXPMESSUREVALUE"},
+    {CONTROL_AUTOEXPmessureMethod, "CONTROL_AUTOEXPMESSUREMETHOD"},
+    {CONTROL_ImageStabilization, "CONTROL_IMAGESTABILIZATION"},
+    {CONTROL_GAINdB, "CONTROL_GAINDB"},
+    {CONTROL_DPC, "CONTROL_DPC"},
+    {CONTROL_DPC_value, "CONTROL_DPC_VALUE"},
+};
+
+/// Bin modes and the control that reports them.
+const char * const BIN_MODES[][2] = {
+    {"CAM_BIN1X1MODE", "1x1"},
+    {"CAM_BIN2X2MODE", "2x2"},
+    {"CAM_BIN3X3MODE", "3x3"},
+    {"CAM_BIN4X4MODE", "4x4"},
+    {"CAM_BIN6X6MODE", "6x6"},
+    {"CAM_BIN8X8MODE", "8x8"},
+};
+
+QJsonArray toJsonArray(const std::vector<std::string> & values) {
+    QJsonArray array;
+    for(const std::string & value : values)
+        array.append(QString::fromStdString(value));
+    return array;
+}
+
+std::vector<std::string> fromJsonArray(const QJsonValue & value) {
+    std::vector<std::string> values;
+    for(const QJsonValue & entry : value.toArray())
+        values.push_back(entry.toString().toStdString());
+    return values;
+}
+}
+
+const std::vector<std::string> & profileControlNames() {
+    static const std::vector<std::string> names = [] {
+        std::vector<std::string> names;
+        for(const ControlName & control : CONTROLS)
+            names.push_back(control.name);
+        return names;
+    }();
+    return names;
+}
+
+bool CameraProfile::supportsBinMode(const std::string & mode) const {
+    return std::find(bin_modes.begin(), bin_modes.end(), mode) != bin_modes.end();
+}
+
+std::string readFirmwareVersion(qhyccd_handle * handle) {
+
+    uint8_t buffer[32] = {0};
+    if(GetQHYCCDFWVersion(handle, buffer) != QHYCCD_SUCCESS)
+        return "";
+
+    // The SDK packs the firmware build date into the first two bytes.
+    int year = buffer[0] >> 4;
+    if(year <= 9)
+        year += 0x10;
+    int month = buffer[0] & 0x0F;
+    int day = buffer[1];
+
+    char version[32];
+    snprintf(version, sizeof(version), "20%d_%d_%d", year, month, day);
+    return version;
+}
+
+CameraProfile probeCameraProfile(qhyccd_handle * handle, const std::string & camera_id) {
+
+    CameraProfile profile;
+    profile.camera_id = camera_id;
+    profile.firmware = readFirmwareVersion(handle);
+
+    char text[256] = {0};
+    if(GetQHYCCDModel((char*) camera_id.c_str(), text) == QHYCCD_SUCCESS)
+        profile.model = text;
+    text[0] = '\0';
+    if(GetQHYCCDSensorName(handle, text) == QHYCCD_SUCCESS)
+        profile.sensor = text;
+
+    GetQHYCCDChipInfo(handle, &profile.chip_width, &profile.chip_height, &profile.image_width,
+                      &profile.image_height, &profile.pixel_width, &profile.pixel_height, &profile.bit_depth);
+    profile.mem_length = GetQHYCCDMemLength(handle);
+    GetQHYCCDEffectiveArea(handle, &profile.effective_x, &profile.effective_y,
+                           &profile.effective_width, &profile.effective_height);
+
+    uint32_t num_modes = 0;
+    GetQHYCCDNumberOfReadModes(handle, &num_modes);
+    for(uint32_t mode_idx = 0; mode_idx < num_modes; mode_idx++) {
+        char read_mode_name[MAX_READMODE_NAME] = {0};
+        GetQHYCCDReadModeName(handle, mode_idx, read_mode_name);
+        profile.read_modes.push_back(read_mode_name);
+    }
+
+    for(const ControlName & control : CONTROLS) {
+        if(IsQHYCCDControlAvailable(handle, control.id) == QHYCCD_SUCCESS) {
+            ControlRange range;
+            GetQHYCCDParamMinMaxStep(handle, control.id, &range.min, &range.max, &range.step);
+            profile.controls[control.name] = range;
+        }
+    }
+
+    for(const auto & mode : BIN_MODES) {
+        if(profile.controls.count(mode[0]))
+            profile.bin_modes.push_back(mode[1]);
+    }
+
+    profile.single_frame = profile.controls.count("CAM_SINGLEFRAMEMODE");
+    profile.live_mode = profile.controls.count("CAM_LIVEVIDEOMODE");
+    profile.can_get_temperature = profile.controls.count("CONTROL_CURTEMP");
+    profile.has_cooler = profile.controls.count("CONTROL_COOLER");
+    profile.is_color = profile.controls.count("CAM_IS_COLOR");
+    if(profile.is_color)
+        profile.bayer_pattern = IsQHYCCDControlAvailable(handle, CAM_COLOR);
+
+    probeFilterWheel(handle, profile);
+
+    return profile;
+}
+
+void probeFilterWheel(qhyccd_handle * handle, CameraProfile & profile) {
+    profile.filter_wheel = (IsQHYCCDCFWPlugged(handle) == QHYCCD_SUCCESS);
+    profile.filter_wheel_slots = profile.filter_wheel ? (int) GetQHYCCDParam(handle, CONTROL_CFWSLOTSNUM) : 0;
+}
+
+QJsonObject cameraProfileToJson(const CameraProfile & profile) {
+
+    QJsonObject json;
+    json["version"] = CAMERA_PROFILE_VERSION;
+    json["camera_id"] = QString::fromStdString(profile.camera_id);
+    json["model"] = QString::fromStdString(profile.model);
+    json["firmware"] = QString::fromStdString(profile.firmware);
+    json["sensor"] = QString::fromStdString(profile.sensor);
+
+    QJsonObject chip;
+    chip["width_mm"] = profile.chip_width;
+    chip["height_mm"] = profile.chip_height;
+    chip["pixel_width_um"] = profile.pixel_width;
+    chip["pixel_height_um"] = profile.pixel_height;
+    chip["image_width"] = (qint64) profile.image_width;
+    chip["image_height"] = (qint64) profile.image_height;
+    chip["bit_depth"] = (qint64) profile.bit_depth;
+    chip["mem_length"] = (qint64) profile.mem_length;
+    json["chip"] = chip;
+
+    QJsonObject effective;
+    effective["x"] = (qint64) profile.effective_x;
+    effective["y"] = (qint64) profile.effective_y;
+    effective["width"] = (qint64) profile.effective_width;
+    effective["height"] = (qint64) profile.effective_height;
+    json["effective_area"] = effective;
+
+    json["single_frame"] = profile.single_frame;
+    json["live_mode"] = profile.live_mode;
+    json["can_get_temperature"] = profile.can_get_temperature;
+    json["has_cooler"] = profile.has_cooler;
+    json["is_color"] = profile.is_color;
+    json["bayer_pattern"] = profile.bayer_pattern;
+    json["bin_modes"] = toJsonArray(profile.bin_modes);
+    json["read_modes"] = toJsonArray(profile.read_modes);
+    json["filter_wheel"] = profile.filter_wheel;
+    json["filter_wheel_slots"] = profile.filter_wheel_slots;
+
+    QJsonObject controls;
+    for(const auto & control : profile.controls) {
+        QJsonObject range;
+        range["min"] = control.second.min;
+        range["max"] = control.second.max;
+        range["step"] = control.second.step;
+        controls[QString::fromStdString(control.first)] = range;
+    }
+    json["controls"] = controls;
+
+    return json;
+}
+
+bool cameraProfileFromJson(const QJsonObject & json, CameraProfile & profile) {
+
+    if(json["version"].toInt() != CAMERA_PROFILE_VERSION)
+        return false;
+
+    profile = CameraProfile();
+    profile.camera_id = json["camera_id"].toString().toStdString();
+    profile.model = json["model"].toString().toStdString();
+    profile.firmware = json["firmware"].toString().toStdString();
+    profile.sensor = json["sensor"].toString().toStdString();
+
+    QJsonObject chip = json["chip"].toObject();
+    profile.chip_width = chip["width_mm"].toDouble();
+    profile.chip_height = chip["height_mm"].toDouble();
+    profile.pixel_width = chip["pixel_width_um"].toDouble();
+    profile.pixel_height = chip["pixel_height_um"].toDouble();
+    profile.image_width = chip["image_width"].toInteger();
+    profile.image_height = chip["image_height"].toInteger();
+    profile.bit_depth = chip["bit_depth"].toInteger();
+    profile.mem_length = chip["mem_length"].toInteger();
+
+    QJsonObject effective = json["effective_area"].toObject();
+    profile.effective_x = effective["x"].toInteger();
+    profile.effective_y = effective["y"].toInteger();
+    profile.effective_width = effective["width"].toInteger();
+    profile.effective_height = effective["height"].toInteger();
+
+    profile.single_frame = json["single_frame"].toBool();
+    profile.live_mode = json["live_mode"].toBool();
+    profile.can_get_temperature = json["can_get_temperature"].toBool();
+    profile.has_cooler = json["has_cooler"].toBool();
+    profile.is_color = json["is_color"].toBool();
+    profile.bayer_pattern = json["bayer_pattern"].toInt();
+    profile.bin_modes = fromJsonArray(json["bin_modes"]);
+    profile.read_modes = fromJsonArray(json["read_modes"]);
+    profile.filter_wheel = json["filter_wheel"].toBool();
+    profile.filter_wheel_slots = json["filter_wheel_slots"].toInt();
+
+    QJsonObject controls = json["controls"].toObject();
+    for(const QString & name : controls.keys()) {
+        QJsonObject range = controls[name].toObject();
+        ControlRange control;
+        control.min = range["min"].toDouble();
+        control.max = range["max"].toDouble();
+        control.step = range["step"].toDouble();
+        profile.controls[name.toStdString()] = control;
+    }
+
+    // A profile without an imaging area is of no use.
+    return !profile.camera_id.empty() && profile.effective_width > 0 && profile.effective_height > 0;
+}
+
+QString defaultProfileCacheDir() {
+    return QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation)
+        + QDir::separator() + "qhyccd-tuis" + QDir::separator() + "profiles";
+}
+
+QString profileCachePath(const QString & cache_dir, const std::string & camera_id) {
+
+    // Camera IDs contain characters that are awkward in file names.
+    std::string name = camera_id;
+    for(char & c : name) {
+        if(!isalnum((unsigned char) c) && c != '-' && c != '_')
+            c = '_';
+    }
+
+    return cache_dir + QDir::separator() + QString::fromStdString(name) + ".json";
+}
+
+bool saveCameraProfile(const CameraProfile & profile, const QString & cache_dir) {
+
+    if(!QDir().mkpath(cache_dir))
+        return false;
+
+    QFile file(profileCachePath(cache_dir, profile.camera_id));
+    if(!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        return false;
+
+    QByteArray data = QJsonDocument(cameraProfileToJson(profile)).toJson();
+    return file.write(data) == data.size();
+}
+
+CameraProfile loadCameraProfile(qhyccd_handle * handle, const std::string & camera_id,
+                                const QString & cache_dir, bool & from_cache) {
+
+    from_cache = false;
+    CameraProfile profile;
+
+    // Reading the firmware version is a single request, and tells us whether
+    // the cached capabilities still apply.
+    std::string firmware = readFirmwareVersion(handle);
+
+    QString path = profileCachePath(cache_dir, camera_id);
+    QFile file(path);
+    if(!firmware.empty() && file.open(QIODevice::ReadOnly)) {
+        QJsonDocument document = QJsonDocument::fromJson(file.readAll());
+        if(cameraProfileFromJson(document.object(), profile) &&
+           profile.camera_id == camera_id && profile.firmware == firmware) {
+            probeFilterWheel(handle, profile);
+            from_cache = true;
+            return profile;
+        }
+        qDebug() << "Camera profile" << path << "is out of date, probing the camera";
+    }
+
+    profile = probeCameraProfile(handle, camera_id);
+    if(!saveCameraProfile(profile, cache_dir))
+        qWarning() << "Could not write the camera profile" << path;
+
+    return profile;
+}
@@ -0,0 +1,108 @@
+#ifndef CAMERA_PROFILE_H
+#define CAMERA_PROFILE_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <QJsonObject>
+#include <QString>
+
+#include <qhyccd.h>
+
+/// Layout version of the JSON profile. Profiles with another version are re-probed.
+const int CAMERA_PROFILE_VERSION = 1;
+
+/// Limits of a camera control.
+struct ControlRange {
+    double min = 0;
+    double max = 0;
+    double step = 0;
+};
+
+/// @brief The capabilities of a camera, as reported by the QHYCCD SDK.
+///
+/// Probing all of this costs many USB round trips, so the profile is cached on
+/// disk and only probed again when the camera firmware changes.
+struct CameraProfile {
+    std::string camera_id;
+    std::string model;
+    std::string firmware;           ///< Firmware version, e.g. "2023_4_12"
+    std::string sensor;
+
+    double chip_width = 0;          ///< mm
+    double chip_height = 0;         ///< mm
+    double pixel_width = 0;         ///< um
+    double pixel_height = 0;        ///< um
+    uint32_t image_width = 0;
+    uint32_t image_height = 0;
+    uint32_t bit_depth = 0;
+    uint32_t mem_length = 0;        ///< Size of the image buffer the SDK requires (bytes)
+
+    /// Imaging area without overscan, in unbinned pixels.
+    uint32_t effective_x = 0;
+    uint32_t effective_y = 0;
+    uint32_t effective_width = 0;
+    uint32_t effective_height = 0;
+
+    bool single_frame = false;      ///< Supports single frame exposures
+    bool live_mode = false;         ///< Supports live (streaming) exposures
+    bool can_get_temperature = false;
+    bool has_cooler = false;
+    bool is_color = false;
+    int bayer_pattern = 0;          ///< BAYER_GB, BAYER_GR, BAYER_BG or BAYER_RG for color sensors
+
+    std::vector<std::string> bin_modes;     ///< Supported bin modes, e.g. "1x1", "2x2"
+    std::vector<std::string> read_modes;    ///< Read mode names by index
+
+    /// The filter wheel can be plugged in or removed without a firmware change,
+    /// so it is probed again whenever a cached profile is loaded.
+    bool filter_wheel = false;
+    int filter_wheel_slots = 0;
+
+    std::map<std::string, ControlRange> controls; ///< Available controls by name
+
+    /// \return true if the bin mode, e.g. "2x2", is supported.
+    bool supportsBinMode(const std::string & mode) const;
+};
+
+/// \return The names of the controls a profile records, in probing order.
+const std::vector<std::string> & profileControlNames();
+
+/// @brief Reads the firmware version of an open camera.
+std::string readFirmwareVersion(qhyccd_handle * handle);
+
+/// @brief Queries every capability of an open, initialized camera.
+CameraProfile probeCameraProfile(qhyccd_handle * handle, const std::string & camera_id);
+
+/// @brief Detects the filter wheel of an open camera and records it in the profile.
+void probeFilterWheel(qhyccd_handle * handle, CameraProfile & profile);
+
+/// @brief Converts a profile to JSON.
+QJsonObject cameraProfileToJson(const CameraProfile & profile);
+
+/// @brief Reads a profile from JSON.
+/// @return false if the JSON is not a profile of the current version.
+bool cameraProfileFromJson(const QJsonObject & json, CameraProfile & profile);
+
+/// \return The default directory of the profile cache, inside the user's cache directory.
+QString defaultProfileCacheDir();
+
+/// \return The file that holds the cached profile of a camera.
+QString profileCachePath(const QString & cache_dir, const std::string & camera_id);
+
+/// @brief Writes a profile to the cache, creating the directory if needed.
+bool saveCameraProfile(const CameraProfile & profile, const QString & cache_dir);
+
+/// @brief Returns the cached profile of an open camera, probing and caching it
+/// if there is no cached profile for the camera's current firmware. The filter
+/// wheel is always probed.
+/// @param handle The open, initialized camera.
+/// @param camera_id ID of the camera.
+/// @param cache_dir Directory of the profile cache.
+/// @param from_cache Set to true if the profile was loaded from the cache.
+CameraProfile loadCameraProfile(qhyccd_handle * handle, const std::string & camera_id,
+                                const QString & cache_dir, bool & from_cache);
+
+#endif // CAMERA_PROFILE_H
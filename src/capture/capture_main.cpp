@@ -0,0 +1,40 @@
+#include <QCoreApplication>
+#include <QDebug>
+#include <signal.h>
+
+#include "cli_parser.hpp"
+#include "camera_control.hpp"
+#include "qhycapture.hpp"
+
+/// Headless capture: the same options as qhy-camera-control, without a display.
+
+void sig_handler(int signal){
+    stopCapture();
+
+    if(signal == SIGINT)
+        qDebug() << "Received SIGINT, exiting";
+}
+
+int main(int argc, char *argv[]) {
+
+    // Register interrupt handlers
+    struct sigaction sigIntHandler;
+    sigIntHandler.sa_handler = sig_handler;
+    sigemptyset(&sigIntHandler.sa_mask);
+    sigIntHandler.sa_flags = 0;
+    sigaction(SIGINT, &sigIntHandler, NULL);
+    sigaction(SIGTERM, &sigIntHandler, NULL);
+
+    // Configure the application
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setOrganizationName("Kloppenborg.net");
+    QCoreApplication::setOrganizationDomain("kloppenborg.net");
+    QCoreApplication::setApplicationName("qhyccd-tuis");
+
+    // parse the command line arguments.
+    QMap<QString, QVariant> config = parse_cli(app);
+    config["no-gui"] = "1";
+
+    // Run on the main thread; there is no event loop to service.
+    return runCapture(config, CaptureCallbacks());
+}
@@ -0,0 +1,45 @@
+#include <QString>
+#include <QVariant>
+
+#include "qhycapture.hpp"
+#include "camera_control.hpp"
+#include "cli_parser.hpp"
+
+int runCapture(const QMap<QString, QVariant> & config, const CaptureCallbacks & callbacks) {
+
+    bool cool_down = (config["camera-cool-down"].toString() == "1");
+    bool warm_up   = (config["camera-warm-up"].toString() == "1");
+    bool guide     = (config["guide"].toString() == "1");
+    bool focus     = (config["focus"].toString() == "1");
+    bool tune_usb  = (config["tune-usb"].toString() == "1");
+
+    // A stop only ends the run it was meant for.
+    keep_running = true;
+
+    if(cool_down || warm_up) {
+        return runCooler(config);
+    } else if(guide) {
+        return runGuider(config);
+    } else if(focus) {
+        return runFocus(config, callbacks);
+    } else if(tune_usb) {
+        return runUSBTuner(config);
+    }
+
+    return takeExposures(config, callbacks);
+}
+
+int runCapture(const CaptureSettings & settings, const CaptureCallbacks & callbacks) {
+
+    QMap<QString, QVariant> config = defaultConfig();
+    for(const auto & setting : settings)
+        config[QString::fromStdString(setting.first)] = QString::fromStdString(setting.second);
+
+    checkConfig(config);
+
+    return runCapture(config, callbacks);
+}
+
+void stopCapture() {
+    keep_running = false;
+}
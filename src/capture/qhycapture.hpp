@@ -0,0 +1,44 @@
+#ifndef QHYCAPTURE_H
+#define QHYCAPTURE_H
+
+#include <functional>
+#include <map>
+#include <string>
+
+#include <opencv2/core/mat.hpp>
+
+#include "cvfits.hpp"
+
+/// @brief Settings for a capture run.
+///
+/// Keys are the long option names of qhy-camera-control (e.g. "camera-id",
+/// "exp-durations"), values are written as in its configuration file: lists
+/// are comma separated and flags are "1" or "0". Keys that are not given keep
+/// their defaults.
+typedef std::map<std::string, std::string> CaptureSettings;
+
+/// @brief Receives the output of a capture run.
+///
+/// Callbacks run on the thread that called runCapture() and delay the next
+/// frame, so long running work should be handed to another thread.
+struct CaptureCallbacks {
+    /// Called for every processed frame before it is written. `frame.image` holds the pixels.
+    std::function<void(const CVFITS & frame)> frame;
+
+    /// Called with the annotated 8-bit preview image when `no-gui` is "0".
+    std::function<void(const cv::Mat & preview)> preview;
+};
+
+/// @brief Runs the mode selected by the settings (exposures, cooler, guider, focus, or USB tuning) to completion.
+/// @param settings The capture settings. Invalid settings end the process with an error message.
+/// @param callbacks Receivers for frames and previews. Either may be empty.
+/// @return 0 on success, otherwise on failure, e.g. when the camera, an input file or an
+///         output cannot be opened or an exposure fails. The camera is closed either way.
+int runCapture(const CaptureSettings & settings, const CaptureCallbacks & callbacks);
+
+/// @brief Asks a running capture to stop after the current frame. Safe to call from a signal handler.
+///
+/// The next runCapture() starts afresh.
+void stopCapture();
+
+#endif // QHYCAPTURE_H
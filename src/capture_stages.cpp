@@ -0,0 +1,459 @@
+#include <QDebug>
+#include <QProcess>
+
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "capture_stages.hpp"
+#include "camera_control.hpp"
+
+namespace {
+const cv::Scalar WHITE(255, 255, 255);
+
+/// @brief Describes a frame for the frame bus.
+/// @param cvfits Metadata of the exposure.
+/// @param image The pixels that will be published. Must be continuous.
+FrameMetadata toFrameMetadata(const CVFITS & cvfits, const cv::Mat & image) {
+
+    auto to_ns = [](const std::chrono::time_point<std::chrono::high_resolution_clock> & t) {
+        return (int64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+    };
+
+    FrameMetadata metadata;
+    metadata.rows = image.rows;
+    metadata.cols = image.cols;
+    metadata.cv_type = image.type();
+    metadata.stride = image.step[0];
+    metadata.bytes = image.total() * image.elemSize();
+    metadata.aborted = cvfits.aborted;
+
+    strncpy(metadata.filter_name, cvfits.filter_name.c_str(), sizeof(metadata.filter_name) - 1);
+    strncpy(metadata.detector_name, cvfits.detector_name.c_str(), sizeof(metadata.detector_name) - 1);
+    strncpy(metadata.bin_mode_name, cvfits.bin_mode_name.c_str(), sizeof(metadata.bin_mode_name) - 1);
+    strncpy(metadata.catalog_name, cvfits.catalog_name.c_str(), sizeof(metadata.catalog_name) - 1);
+    strncpy(metadata.object_name, cvfits.object_name.c_str(), sizeof(metadata.object_name) - 1);
+    metadata.xbinning = cvfits.xbinning;
+    metadata.ybinning = cvfits.ybinning;
+
+    metadata.exposure_start_ns = to_ns(cvfits.exposure_start);
+    metadata.exposure_end_ns = to_ns(cvfits.exposure_end);
+    metadata.readout_start_ns = to_ns(cvfits.readout_start);
+    metadata.readout_end_ns = to_ns(cvfits.readout_end);
+    metadata.exposure_duration_sec = cvfits.exposure_duration_sec;
+
+    metadata.latitude = cvfits.latitude;
+    metadata.longitude = cvfits.longitude;
+    metadata.altitude = cvfits.altitude;
+    metadata.temperature = cvfits.temperature;
+    metadata.gain = cvfits.gain;
+
+    metadata.ra_dec_set = cvfits.ra_dec_set;
+    metadata.azm_alt_set = cvfits.azm_alt_set;
+    metadata.ra = cvfits.ra;
+    metadata.dec = cvfits.dec;
+    metadata.azm = cvfits.azm;
+    metadata.alt = cvfits.alt;
+
+    metadata.star_stats_set = cvfits.star_stats_set;
+    metadata.nstars = cvfits.nstars;
+    metadata.fwhm = cvfits.fwhm;
+    metadata.bkg_mean = cvfits.bkg_mean;
+    metadata.bkg_rms = cvfits.bkg_rms;
+
+    return metadata;
+}
+}
+
+CaptureWriter::CaptureWriter(std::unique_ptr<AsyncFITSWriter> writer, std::unique_ptr<FITSSequenceWriter> sequence,
+                             const QString & container)
+    : mWriter(std::move(writer)), mSequence(std::move(sequence)), mContainer(container) {
+}
+
+void CaptureWriter::useSER(bool debayer, size_t expected_frames, SERWriter::ColorID raw_color, SERWriter::ColorID color) {
+    mSER.reset(new SERWriter());
+    mSERDebayer = debayer;
+    mSERExpectedFrames = expected_frames;
+    mSERRawColor = raw_color;
+    mSERColor = color;
+}
+
+void CaptureWriter::appendSER(const cv::Mat & frame, const CVFITS & metadata, const std::string & filename) {
+    std::lock_guard<std::mutex> lock(mSERMutex);
+    std::string error;
+
+    // Start a new video when the filter changes.
+    if(mSER->isOpen() && metadata.filter_name != mSERFilter) {
+        qDebug() << "Wrote" << mSER->frames() << "frames to" << mSER->filename().c_str();
+        if(!mSER->close(error))
+            qWarning() << "Could not finish the SER file:" << error.c_str();
+    }
+
+    if(!mSER->isOpen()) {
+        QString ser_path = QString::fromStdString(filename);
+        ser_path.replace(".fits", ".ser");
+        SERWriter::ColorID color = (frame.channels() == 3) ? mSERColor : mSERRawColor;
+        if(!mSER->open(ser_path.toStdString(), frame.rows, frame.cols, frame.type(), color,
+                       metadata.detector_name, mSERExpectedFrames, error)) {
+            qWarning() << "Could not create the SER file:" << error.c_str();
+            return;
+        }
+        mSERFilter = metadata.filter_name;
+        qDebug() << "Writing frames to" << ser_path << (mSER->directIO() ? "bypassing the page cache" : "");
+    }
+
+    if(!mSER->append(frame, metadata.exposure_start, error))
+        qWarning() << "Could not append the frame:" << error.c_str();
+}
+
+void CaptureWriter::write(CVFITS & frame, const cv::Mat & raw_image, const std::string & path, bool own_file) {
+
+    if(mSER && !own_file) {
+        appendSER(mSERDebayer ? frame.image : raw_image, frame, path);
+    } else if(mSequence && !own_file) {
+        std::string error;
+        if(!mSequence->append(frame, path, error))
+            qWarning() << "Could not append the frame:" << error.c_str();
+    } else {
+        save(frame, path);
+        if(mWriter) {
+            AsyncFITSWriterMetrics metrics = mWriter->metrics();
+            qDebug() << "FITS writer queue depth:" << metrics.queue_depth
+                     << "in-flight:" << metrics.inflight_bytes / (1 << 20) << "MB"
+                     << "last write latency:" << metrics.last_latency_ms << "ms";
+        }
+    }
+}
+
+void CaptureWriter::save(CVFITS & image, const std::string & path) {
+    if(mWriter)
+        mWriter->enqueue(image, path);
+    else
+        image.saveToFITS(path);
+}
+
+void CaptureWriter::close() {
+
+    if(mSER && mSER->isOpen()) {
+        std::string error;
+        qDebug() << "Wrote" << mSER->frames() << "frames to" << mSER->filename().c_str();
+        if(!mSER->close(error))
+            qWarning() << "Could not finish the SER file:" << error.c_str();
+    }
+    if(mSequence) {
+        std::string error;
+        if(!mSequence->close(error))
+            qWarning() << "Could not finish the FITS file:" << error.c_str();
+        qDebug() << "Appended" << mSequence->framesWritten() << "frames," << mSequence->bytesWritten() / (1 << 20)
+                 << "MB, to" << mSequence->filesWritten() << mContainer << "files";
+    }
+    if(mWriter) {
+        mWriter->close();
+        reportFITSWriterMetrics(mWriter->metrics());
+    }
+}
+
+StarStage::StarStage(double threshold, int tile_size, int min_area, size_t max_stars, double time_budget_ms)
+    : mDetector(threshold, tile_size, min_area, max_stars, time_budget_ms), mBudgetMs(time_budget_ms) {
+}
+
+void StarStage::process(CaptureFrame & frame) {
+
+    // Measured before the frame is written so the statistics reach the header.
+    frame.stars = mDetector.detect(frame.image);
+    const StarField & field = frame.stars;
+    frame.metadata.star_stats_set = true;
+    frame.metadata.nstars = field.stars.size();
+    frame.metadata.fwhm = field.median_fwhm;
+    frame.metadata.bkg_mean = field.bkg_mean;
+    frame.metadata.bkg_rms = field.bkg_rms;
+
+    mStars = field.stars.size();
+    mFWHM = field.median_fwhm;
+    mHFR = field.median_hfr;
+
+    qDebug() << "Stars:" << field.stars.size() << "of" << field.candidates
+             << "FWHM:" << field.median_fwhm << "HFR:" << field.median_hfr
+             << "background:" << field.bkg_mean << "+/-" << field.bkg_rms
+             << "in" << field.elapsed_ms << "ms";
+    if(field.truncated)
+        qWarning() << "Star measurement stopped at the" << mBudgetMs << "ms time budget";
+}
+
+void StarStage::annotate(cv::Mat & preview) const {
+    QString label = QString("Stars: %1  FWHM: %2  HFR: %3")
+        .arg(mStars)
+        .arg(mFWHM, 0, 'f', 2)
+        .arg(mHFR, 0, 'f', 2);
+    cv::putText(preview, label.toStdString(), cv::Point(20, 40), cv::FONT_HERSHEY_SIMPLEX, 1.0, WHITE, 2);
+}
+
+StreakStage::StreakStage(int bin, double threshold, double min_length, int tile_size, size_t max_streaks)
+    : mDetector(bin, threshold, min_length, tile_size, max_streaks) {
+}
+
+void StreakStage::process(CaptureFrame & frame) {
+
+    // Searched before the frame is written so the streaks reach the header.
+    mStreaks = mDetector.detect(frame.image);
+    frame.metadata.streaks = mStreaks;
+    frame.metadata.streaks_set = true;
+    for(const Streak & streak : mStreaks) {
+        qWarning() << "Streak from" << streak.x1 << streak.y1 << "to" << streak.x2 << streak.y2
+                   << "length" << streak.length << "angle" << streak.angle << "flux" << streak.flux;
+    }
+}
+
+void StreakStage::annotate(cv::Mat & preview) const {
+    for(const Streak & streak : mStreaks)
+        cv::line(preview, cv::Point(streak.x1, streak.y1), cv::Point(streak.x2, streak.y2), WHITE, 2);
+}
+
+FrameBusStage::FrameBusStage(const std::string & name, uint32_t slot_count, size_t slot_capacity, bool raw)
+    : mPublisher(name, slot_count, slot_capacity), mRaw(raw) {
+}
+
+void FrameBusStage::process(CaptureFrame & frame) {
+    const cv::Mat & image = mRaw ? frame.raw_image : frame.image;
+    if(!mPublisher.publish(toFrameMetadata(frame.metadata, image), image.ptr()))
+        qWarning() << "Frame does not fit in the frame bus, not published";
+}
+
+FrameCallbackStage::FrameCallbackStage(const std::function<void(const CVFITS & frame)> & callback)
+    : mCallback(callback) {
+}
+
+void FrameCallbackStage::process(CaptureFrame & frame) {
+    frame.metadata.image = frame.image;
+    mCallback(frame.metadata);
+}
+
+QualityGateStage::QualityGateStage(const QualityThresholds & thresholds, QualityGate::Action action,
+                                   const QString & quarantine_dir)
+    : mGate(thresholds, action), mAction(action), mQuarantineDir(quarantine_dir) {
+}
+
+void QualityGateStage::process(CaptureFrame & frame) {
+
+    // Rejected auto flats are not judged again.
+    if(!frame.accepted)
+        return;
+
+    std::string reason;
+    frame.accepted = mGate.check(frame.raw_image, frame.stars, reason);
+    if(frame.accepted)
+        return;
+
+    // Rejected frames are quarantined or not written at all.
+    qWarning() << "Quality gate rejected the frame:" << reason.c_str();
+    if(mAction == QualityGate::ACTION_DROP)
+        frame.writable = false;
+    else
+        frame.path = (mQuarantineDir + QString::fromStdString(frame.filename)).toStdString();
+}
+
+void QualityGateStage::finish() {
+    qDebug() << "Quality gate accepted" << mGate.accepted() << "and rejected" << mGate.rejected() << "frames";
+}
+
+SidecarStage::SidecarStage(bool stars, bool streaks, const QString & streak_exec)
+    : mStars(stars), mStreaks(streaks), mStreakExec(streak_exec) {
+}
+
+void SidecarStage::process(CaptureFrame & frame) {
+
+    if(!frame.writable)
+        return;
+
+    if(mStars && !frame.claimed) {
+        QString list_path = QString::fromStdString(frame.path);
+        list_path.replace(".fits", "_stars.csv");
+        if(!StarDetector::writeStarList(frame.stars, list_path.toStdString()))
+            qWarning() << "Could not write the star list" << list_path;
+    }
+
+    // Describe the streaks in a file of their own and hand it to the follow-up command.
+    if(mStreaks && !frame.metadata.streaks.empty()) {
+        QString streak_path = QString::fromStdString(frame.path);
+        streak_path.replace(".fits", "_streaks.csv");
+        if(!StreakDetector::writeStreakList(frame.metadata.streaks, streak_path.toStdString())) {
+            qWarning() << "Could not write the streak list" << streak_path;
+        } else if(!mStreakExec.isEmpty() && !QProcess::startDetached(mStreakExec, {streak_path})) {
+            qWarning() << "Could not start" << mStreakExec;
+        }
+    }
+}
+
+PhotometryStage::PhotometryStage(int search_radius, double aperture, double annulus_inner, double annulus_outer,
+                                 double electrons_per_adu, const std::string & light_curve)
+    : mPhotometry(search_radius, aperture, annulus_inner, annulus_outer, electrons_per_adu),
+      mLightCurve(light_curve), mAperture(aperture), mAnnulusInner(annulus_inner), mAnnulusOuter(annulus_outer) {
+}
+
+void PhotometryStage::process(CaptureFrame & frame) {
+
+    // Only frames that passed the quality gate are measured.
+    if(!frame.accepted)
+        return;
+
+    cv::Point2d image_center(frame.image.cols / 2, frame.image.rows / 2);
+    mResult = mPhotometry.measure(frame.image, image_center);
+    if(mResult.valid) {
+        qDebug() << "Target at" << mResult.x << mResult.y << "flux:" << mResult.flux
+                 << "+/-" << mResult.flux_err << "sky:" << mResult.sky;
+    } else {
+        qWarning() << "Photometry: no measurable target near the image center";
+    }
+    mLightCurve.append(frame.metadata, frame.writable ? frame.path : "", mResult);
+}
+
+void PhotometryStage::annotate(cv::Mat & preview) const {
+    if(!mResult.valid)
+        return;
+
+    // Mark the aperture and sky annulus.
+    cv::Point target(mResult.x, mResult.y);
+    cv::circle(preview, target, mAperture, WHITE, 1);
+    cv::circle(preview, target, mAnnulusInner, WHITE, 1);
+    cv::circle(preview, target, mAnnulusOuter, WHITE, 1);
+}
+
+LuckyStage::LuckyStage(LuckyImaging::Metric metric, size_t keep, double keep_percent, int roi_size, int downsample,
+                       bool stack, size_t frame_bytes, size_t max_memory, CaptureWriter * writer)
+    : mMetric(metric), mKeep(keep), mKeepPercent(keep_percent), mRoiSize(roi_size), mDownsample(downsample),
+      mStack(stack), mFrameBytes(frame_bytes), mMaxMemory(max_memory), mWriter(writer) {
+}
+
+void LuckyStage::beginFilter(int quantity) {
+
+    size_t keep = mKeep;
+    if(keep == 0)
+        keep = std::ceil(quantity * mKeepPercent / 100.0);
+
+    // Retained frames are held in memory until the filter is done. Bound them.
+    if(mWriter) {
+        size_t max_keep = LuckyImaging::maxRetained(mFrameBytes, mMaxMemory);
+        if(keep > max_keep) {
+            qWarning() << "Lucky imaging: keeping" << keep << "frames needs"
+                       << (keep * mFrameBytes >> 20) << "MB, more than lucky-max-memory."
+                       << "Keeping the best" << max_keep << "instead";
+            keep = max_keep;
+        }
+    }
+
+    mLucky.reset(new LuckyImaging(mMetric, keep, mRoiSize, mDownsample, mWriter != nullptr));
+    qDebug() << "Lucky imaging: keeping the best" << keep << "of" << quantity << "frames";
+}
+
+void LuckyStage::process(CaptureFrame & frame) {
+
+    // Frames are scored and only the winners are written, at the end of the filter.
+    frame.claimed = true;
+    if(frame.accepted) {
+        double frame_score = mLucky->addFrame(frame.image, frame.metadata, frame.path);
+        qDebug() << "Frame score:" << frame_score;
+    }
+}
+
+void LuckyStage::endFilter(double duration_sec) {
+
+    size_t frames_scored = mLucky->framesScored();
+    std::vector<LuckyImaging::Candidate> winners = mLucky->takeWinners();
+    qDebug() << "Lucky imaging kept" << winners.size() << "of" << frames_scored << "frames";
+
+    // Without a writer only the scores were kept. Report which frames won.
+    if(!mWriter) {
+        for(const LuckyImaging::Candidate & winner : winners)
+            qDebug() << "Lucky frame" << winner.index + 1 << "score:" << winner.score;
+        return;
+    }
+
+    for(LuckyImaging::Candidate & winner : winners)
+        mWriter->save(winner.frame, winner.filename);
+
+    // Optionally write the winners aligned and averaged.
+    if(mStack && !winners.empty()) {
+        CVFITS stacked = winners[0].frame;
+        stacked.image = mLucky->shiftAndAdd(winners);
+        stacked.star_stats_set = false;
+        stacked.streaks_set = false;
+        stacked.streaks.clear();
+        stacked.exposure_duration_sec = duration_sec * winners.size();
+
+        QString stack_path = QString::fromStdString(winners[0].filename);
+        stack_path.replace(".fits", "_stack.fits");
+        mWriter->save(stacked, stack_path.toStdString());
+    }
+}
+
+LiveStackStage::LiveStackStage(LiveStack::Mode mode, double sigma, int downsample, double min_response,
+                               CaptureWriter * writer)
+    : mMode(mode), mSigma(sigma), mDownsample(downsample), mMinResponse(min_response), mWriter(writer) {
+}
+
+void LiveStackStage::beginFilter(int quantity) {
+    mStack.reset(new LiveStack(mMode, mSigma, mDownsample, mMinResponse));
+    mMetadata = CVFITS();
+    mPath.clear();
+}
+
+void LiveStackStage::process(CaptureFrame & frame) {
+
+    if(!frame.accepted) {
+        qDebug() << "Live stack: skipping the rejected frame";
+    } else if(mStack->addFrame(frame.image)) {
+        // The stack is described by its first frame.
+        if(mStack->frameCount() == 1) {
+            mMetadata = frame.metadata;
+            mMetadata.image = cv::Mat();
+            mMetadata.star_stats_set = false;
+            mMetadata.streaks_set = false;
+            mMetadata.streaks.clear();
+            mPath = frame.path;
+        }
+        qDebug() << "Live stack:" << mStack->frameCount() << "frames, shift"
+                 << mStack->lastShift().x << mStack->lastShift().y;
+    } else {
+        qWarning() << "Live stack: frame rejected, registration response" << mStack->lastResponse();
+    }
+
+    // Until a frame is stacked the single frame stays on screen.
+    if(mStack->frameCount() > 0) {
+        frame.display_image = mStack->result();
+        frame.stats_valid = false;
+    }
+}
+
+void LiveStackStage::endFilter(double duration_sec) {
+
+    if(mStack->frameCount() == 0)
+        return;
+
+    qDebug() << "Live stack combined" << mStack->frameCount() << "frames, rejected" << mStack->rejectedCount();
+
+    if(mWriter) {
+        mMetadata.image = mStack->result();
+        mMetadata.exposure_duration_sec = duration_sec * mStack->frameCount();
+
+        QString stack_path = QString::fromStdString(mPath);
+        stack_path.replace(".fits", "_livestack.fits");
+        mWriter->save(mMetadata, stack_path.toStdString());
+    }
+}
+
+WriteStage::WriteStage(CaptureWriter * writer)
+    : mWriter(writer) {
+}
+
+void WriteStage::process(CaptureFrame & frame) {
+
+    if(frame.claimed || !frame.writable)
+        return;
+
+    // Quarantined frames are still written to files of their own.
+    frame.metadata.image = frame.image;
+    mWriter->write(frame.metadata, frame.raw_image, frame.path, !frame.accepted);
+}
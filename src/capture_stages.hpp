@@ -0,0 +1,315 @@
+#ifndef CAPTURE_STAGES_H
+#define CAPTURE_STAGES_H
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <QString>
+
+#include <opencv2/core/mat.hpp>
+
+#include "aperture_photometry.hpp"
+#include "async_fits_writer.hpp"
+#include "cvfits.hpp"
+#include "fits_sequence_writer.hpp"
+#include "framebus.hpp"
+#include "live_stack.hpp"
+#include "lucky_imaging.hpp"
+#include "pixel_pipeline.hpp"
+#include "quality_gate.hpp"
+#include "ser_writer.hpp"
+#include "star_detection.hpp"
+#include "streak_detection.hpp"
+
+/// A frame on its way through the capture stages.
+struct CaptureFrame {
+    cv::Mat raw_image;          ///< The frame as read out, hot pixels repaired
+    cv::Mat image;              ///< The developed (debayered) frame
+    cv::Mat display_image;      ///< What the preview shows, `image` unless a stage replaces it
+    FrameStatistics stats;      ///< Statistics of `display_image` for the preview, if `stats_valid`
+    bool stats_valid = false;
+
+    CVFITS metadata;            ///< Exposure information, and what the stages measured
+    StarField stars;            ///< Stars measured by the StarStage
+    std::string filename;       ///< File name, without the directory
+    std::string path;           ///< Where the frame is written. The quality gate may redirect it.
+
+    bool accepted = true;       ///< Passed the auto flat level and the quality gate
+    bool writable = true;       ///< Is to be written to disk
+    bool claimed = false;       ///< A stage writes the frame itself, e.g. lucky imaging
+};
+
+/// @brief A processing step of the capture loop.
+///
+/// The capture loop develops every frame and hands it to the registered stages
+/// in the order they were registered. Stages read and update the frame, draw
+/// on the preview, and can write results at the end of each filter and of the
+/// sequence.
+class CaptureStage {
+
+public:
+    virtual ~CaptureStage() {}
+
+    /// @brief Called before the first frame of a filter.
+    /// @param quantity Number of frames requested for the filter.
+    virtual void beginFilter(int quantity) {}
+
+    /// @brief Processes a frame.
+    virtual void process(CaptureFrame & frame) = 0;
+
+    /// @brief Draws on the 8-bit preview image.
+    virtual void annotate(cv::Mat & preview) const {}
+
+    /// @brief Called after the last frame of a filter.
+    /// @param duration_sec Exposure time of the last frame.
+    virtual void endFilter(double duration_sec) {}
+
+    /// @brief Called after the last filter.
+    virtual void finish() {}
+};
+
+/// @brief Writes frames to FITS files, FITS containers or SER videos.
+///
+/// Frames of the sequence go to the SER video of their filter or to a FITS
+/// container when those are in use, otherwise each to a FITS file of its own,
+/// from the background writer if there is one. Safe to use from the burst
+/// spool's drain thread.
+class CaptureWriter {
+
+protected:
+    std::unique_ptr<AsyncFITSWriter> mWriter;
+    std::unique_ptr<FITSSequenceWriter> mSequence;
+    QString mContainer;
+
+    std::unique_ptr<SERWriter> mSER;
+    std::mutex mSERMutex;
+    std::string mSERFilter;
+    size_t mSERExpectedFrames = 0;
+    bool mSERDebayer = false;
+    SERWriter::ColorID mSERRawColor = SERWriter::COLOR_MONO;
+    SERWriter::ColorID mSERColor = SERWriter::COLOR_MONO;
+
+    void appendSER(const cv::Mat & frame, const CVFITS & metadata, const std::string & filename);
+
+public:
+    /// @brief Creates a writer.
+    /// @param writer Background FITS writer, or null to write from the calling thread.
+    /// @param sequence FITS container writer, or null to write one file per frame.
+    /// @param container Name of the container layout, for the summary.
+    CaptureWriter(std::unique_ptr<AsyncFITSWriter> writer, std::unique_ptr<FITSSequenceWriter> sequence,
+                  const QString & container);
+
+    /// @brief Writes the frames to SER videos, one per filter, instead.
+    /// @param debayer Write the developed frames rather than the raw ones.
+    /// @param expected_frames Frames per video, to size the file up front.
+    /// @param raw_color Layout of the raw frames.
+    /// @param color Layout of the developed frames.
+    void useSER(bool debayer, size_t expected_frames, SERWriter::ColorID raw_color, SERWriter::ColorID color);
+
+    /// \return true if write() uses the developed frame, false if it only needs the raw one.
+    bool needsDevelopedImage() const { return !mSER || mSERDebayer; }
+
+    /// @brief Writes a frame of the sequence.
+    /// @param frame The frame, with the developed image unless needsDevelopedImage() is false.
+    /// @param raw_image The frame as read out.
+    /// @param path Output file.
+    /// @param own_file Write a FITS file of its own, e.g. for a quarantined frame.
+    void write(CVFITS & frame, const cv::Mat & raw_image, const std::string & path, bool own_file = false);
+
+    /// @brief Writes an image, e.g. a stack, to a FITS file of its own.
+    void save(CVFITS & image, const std::string & path);
+
+    /// @brief Finishes the open files, waits for the background writer and reports what was written.
+    void close();
+};
+
+/// @brief Measures the stars in every frame and records the statistics in the FITS header.
+class StarStage : public CaptureStage {
+
+protected:
+    StarDetector mDetector;
+    double mBudgetMs;
+
+    /// Statistics of the last frame, for the preview.
+    size_t mStars = 0;
+    double mFWHM = 0;
+    double mHFR = 0;
+
+public:
+    StarStage(double threshold, int tile_size, int min_area, size_t max_stars, double time_budget_ms);
+
+    void process(CaptureFrame & frame) override;
+    void annotate(cv::Mat & preview) const override;
+};
+
+/// @brief Searches every frame for satellite and debris tracks.
+class StreakStage : public CaptureStage {
+
+protected:
+    StreakDetector mDetector;
+    std::vector<Streak> mStreaks;
+
+public:
+    StreakStage(int bin, double threshold, double min_length, int tile_size, size_t max_streaks);
+
+    void process(CaptureFrame & frame) override;
+    void annotate(cv::Mat & preview) const override;
+};
+
+/// @brief Publishes every frame to other processes through shared memory.
+class FrameBusStage : public CaptureStage {
+
+protected:
+    FrameBusPublisher mPublisher;
+    bool mRaw;
+
+public:
+    /// @param raw Publish the raw frames rather than the developed ones.
+    FrameBusStage(const std::string & name, uint32_t slot_count, size_t slot_capacity, bool raw);
+
+    /// \return true if the bus was created.
+    bool isOpen() const { return mPublisher.isOpen(); }
+
+    void process(CaptureFrame & frame) override;
+};
+
+/// @brief Hands every frame to the embedding application.
+class FrameCallbackStage : public CaptureStage {
+
+protected:
+    std::function<void(const CVFITS & frame)> mCallback;
+
+public:
+    FrameCallbackStage(const std::function<void(const CVFITS & frame)> & callback);
+
+    void process(CaptureFrame & frame) override;
+};
+
+/// @brief Keeps poor frames out of the save directory.
+///
+/// Needs the stars, so it is registered after a StarStage.
+class QualityGateStage : public CaptureStage {
+
+protected:
+    QualityGate mGate;
+    QualityGate::Action mAction;
+    QString mQuarantineDir;
+
+public:
+    QualityGateStage(const QualityThresholds & thresholds, QualityGate::Action action, const QString & quarantine_dir);
+
+    void process(CaptureFrame & frame) override;
+    void finish() override;
+};
+
+/// @brief Writes the star and streak lists next to the frames that are written.
+///
+/// Registered after a LuckyStage, it skips the star lists of the frames lucky
+/// imaging claimed.
+class SidecarStage : public CaptureStage {
+
+protected:
+    bool mStars;
+    bool mStreaks;
+    QString mStreakExec;
+
+public:
+    /// @param stars Write the star list.
+    /// @param streaks Write the streak list of frames with streaks.
+    /// @param streak_exec Command started with the path of each streak list. Empty for none.
+    SidecarStage(bool stars, bool streaks, const QString & streak_exec);
+
+    void process(CaptureFrame & frame) override;
+};
+
+/// @brief Measures the target at the image center of accepted frames and appends it to a light curve.
+class PhotometryStage : public CaptureStage {
+
+protected:
+    AperturePhotometry mPhotometry;
+    LightCurveWriter mLightCurve;
+    double mAperture;
+    double mAnnulusInner;
+    double mAnnulusOuter;
+    PhotometryResult mResult;
+
+public:
+    PhotometryStage(int search_radius, double aperture, double annulus_inner, double annulus_outer,
+                    double electrons_per_adu, const std::string & light_curve);
+
+    /// \return true if the light curve could be opened.
+    bool isOpen() const { return mLightCurve.isOpen(); }
+
+    void process(CaptureFrame & frame) override;
+    void annotate(cv::Mat & preview) const override;
+};
+
+/// @brief Keeps only the sharpest frames of each filter and writes them, and
+/// optionally their aligned stack, once the filter is done.
+class LuckyStage : public CaptureStage {
+
+protected:
+    LuckyImaging::Metric mMetric;
+    size_t mKeep;
+    double mKeepPercent;
+    int mRoiSize;
+    int mDownsample;
+    bool mStack;
+    size_t mFrameBytes;
+    size_t mMaxMemory;
+    CaptureWriter * mWriter;
+    std::unique_ptr<LuckyImaging> mLucky;
+
+public:
+    /// @param keep Frames kept per filter, 0 to keep `keep_percent` of them.
+    /// @param frame_bytes Memory one retained frame takes.
+    /// @param max_memory Memory the retained frames may take.
+    /// @param writer Writes the winners. Null only reports them, and no pixels are retained.
+    LuckyStage(LuckyImaging::Metric metric, size_t keep, double keep_percent, int roi_size, int downsample,
+               bool stack, size_t frame_bytes, size_t max_memory, CaptureWriter * writer);
+
+    void beginFilter(int quantity) override;
+    void process(CaptureFrame & frame) override;
+    void endFilter(double duration_sec) override;
+};
+
+/// @brief Registers every accepted frame of a filter and folds it into a
+/// running stack, which replaces the single frame on screen.
+class LiveStackStage : public CaptureStage {
+
+protected:
+    LiveStack::Mode mMode;
+    double mSigma;
+    int mDownsample;
+    double mMinResponse;
+    CaptureWriter * mWriter;
+
+    std::unique_ptr<LiveStack> mStack;
+    CVFITS mMetadata;
+    std::string mPath;
+
+public:
+    /// @param writer Writes the stack of each filter. Null does not write it.
+    LiveStackStage(LiveStack::Mode mode, double sigma, int downsample, double min_response, CaptureWriter * writer);
+
+    void beginFilter(int quantity) override;
+    void process(CaptureFrame & frame) override;
+    void endFilter(double duration_sec) override;
+};
+
+/// @brief Writes the frames that no other stage has claimed.
+class WriteStage : public CaptureStage {
+
+protected:
+    CaptureWriter * mWriter;
+
+public:
+    WriteStage(CaptureWriter * writer);
+
+    void process(CaptureFrame & frame) override;
+};
+
+#endif // CAPTURE_STAGES_H
@@ -1,8 +1,12 @@
+#include <QList>
+#include <QPair>
 #include <QSettings>
 #include <QtDebug>
 #include <QVariant>
 #include <QFileInfo>
 #include <QDir>
+#include <QStandardPaths>
+#include <QSysInfo>
 
 #include "cli_parser.hpp"
 
@@ -156,7 +160,19 @@ void checkMatchingLength(const QStringList & A, const QStringList & B, const QSt
     }
 }
 
-QMap<QString, QVariant> parse_cli(const QCoreApplication & app) {
+QString defaultUSBTuningFile() {
+    return QStandardPaths::writableLocation(QStandardPaths::GenericConfigLocation)
+        + QDir::separator() + "qhyccd-tuis" + QDir::separator() + "usb-tuning.ini";
+}
+
+QString usbTuningGroup(const QString & camera_id, int transfer_bits, const QString & bin_mode) {
+    QString host = QSysInfo::machineHostName();
+    if(host.isEmpty())
+        host = "localhost";
+    return host + "/" + camera_id + "/" + QString::number(transfer_bits) + "bit-" + bin_mode;
+}
+
+QMap<QString, QVariant> defaultConfig() {
 
     // Configure the QMap with parameters that are relevant to the application
     QMap<QString, QVariant> config;
@@ -166,6 +182,94 @@ QMap<QString, QVariant> parse_cli(const QCoreApplication & app) {
     config["no-gui"] = "0";
     config["no-save"] = "0";
     config["save-dir"] = ".";
+    config["fits-writer"] = "sync";             // sync, threads, or io_uring
+    config["fits-writer-threads"] = "2";
+    config["fits-writer-max-inflight"] = "256"; // MB of images queued before acquisition blocks
+    config["fits-sync"] = "batch";              // none, file, or batch
+    config["fits-sync-batch"] = "10";           // files between syncs for the batch policy
+    config["fits-container"] = "file";          // file, mef, or cube
+    config["fits-container-frames"] = "1000";   // frames per mef or cube file, 0 for no limit
+    config["fits-container-size"] = "4096";     // MB per mef or cube file, 0 for no limit
+    config["ser"] = "0";                        // write SER videos instead of FITS files
+    config["ser-debayer"] = "0";                // write debayered BGR frames to SER instead of the raw mosaic
+    config["burst"] = "0";
+    config["burst-frames"] = "0";               // frames to spool, 0 uses the total exposure count
+    config["burst-ram-fraction"] = "0.5";       // fraction of available memory the spool may use
+    config["burst-hugepages"] = "0";
+    config["burst-drain"] = "background";       // background or after
+    config["lucky"] = "0";
+    config["lucky-metric"] = "laplacian";       // laplacian or fwhm
+    config["lucky-keep"] = "0";                 // frames to keep per filter, 0 uses lucky-keep-percent
+    config["lucky-keep-percent"] = "10";
+    config["lucky-roi"] = "512";                // side of the centered scoring region, 0 uses the full frame
+    config["lucky-downsample"] = "2";
+    config["lucky-stack"] = "0";
+    config["lucky-max-memory"] = "4096";        // MB for the frames kept in memory until a filter is done
+    config["live-stack"] = "0";
+    config["live-stack-mode"] = "mean";         // mean or sigma-clip
+    config["live-stack-sigma"] = "3";           // rejection threshold for sigma-clip, in standard deviations
+    config["live-stack-downsample"] = "4";      // downsampling factor used for registration
+    config["live-stack-min-response"] = "0.05"; // frames with a weaker phase correlation peak are skipped
+    config["star-detect"] = "0";
+    config["star-threshold"] = "5";             // detection threshold in units of the background RMS
+    config["star-tile"] = "64";                 // side of the background estimation tiles
+    config["star-min-area"] = "5";              // smallest number of connected pixels accepted as a star
+    config["star-max"] = "500";                 // largest number of stars measured per frame
+    config["star-budget-ms"] = "250";           // time after which no further stars are measured
+    config["star-list"] = "0";
+    config["streak-detect"] = "0";
+    config["streak-bin"] = "4";                 // binning applied before the search
+    config["streak-threshold"] = "3";           // detection threshold in units of the background RMS
+    config["streak-min-length"] = "100";        // shortest streak reported, in pixels
+    config["streak-tile"] = "256";              // side of the Hough search tiles, in binned pixels
+    config["streak-max"] = "20";                // largest number of streaks reported per frame
+    config["streak-exec"] = "";                 // command started with the streak list of each frame
+    config["photometry"] = "0";
+    config["phot-search"] = "50";               // half width of the box searched for the target, in pixels
+    config["phot-aperture"] = "8";              // aperture radius, in pixels
+    config["phot-annulus-inner"] = "12";        // sky annulus inner radius, in pixels
+    config["phot-annulus-outer"] = "18";        // sky annulus outer radius, in pixels
+    config["phot-egain"] = "1";                 // detector gain in e-/ADU for the noise estimate
+    config["phot-lightcurve"] = "";             // defaults to lightcurve_<catalog>_<object>.csv in save-dir
+    config["guide"] = "0";
+    config["guide-camera-id"] = "";             // defaults to camera-id
+    config["guide-roi-x"] = "-1";               // center of the guide window, -1 uses the sensor center
+    config["guide-roi-y"] = "-1";
+    config["guide-roi-size"] = "64";            // side of the guide window, in pixels
+    config["guide-exposure"] = "50";            // milliseconds
+    config["guide-gain"] = "0";
+    config["guide-window"] = "8";               // half width of the centroid window, in pixels
+    config["guide-min-snr"] = "5";              // fainter guide stars are reported as lost
+    config["guide-output"] = "/tmp/qhy-guide.sock";
+    config["guide-output-type"] = "socket";     // socket or fifo
+    config["focus"] = "0";
+    config["focus-roi-size"] = "256";           // side of the focus window, in pixels
+    config["focus-exposure"] = "100";           // milliseconds
+    config["focus-gain"] = "0";
+    config["focus-history"] = "200";            // frames shown in the metric plot
+    config["flat"] = "0";
+    config["flat-source"] = "dusk";             // dusk, dawn or panel
+    config["flat-target"] = "30000";            // median level of a good flat, in ADU
+    config["flat-tolerance"] = "0.15";          // accepted deviation, as a fraction of the target above flat-bias
+    config["flat-bias"] = "0";                  // pedestal subtracted before the level is scaled, in ADU
+    config["flat-min-exposure"] = "0.01";       // seconds
+    config["flat-max-exposure"] = "30";         // seconds
+    config["flat-throughputs"] = "";            // relative throughput of each exposure filter, empty if unknown
+    config["gate"] = "0";
+    config["gate-action"] = "quarantine";       // quarantine or drop
+    config["gate-quarantine-dir"] = "";         // defaults to quarantine/ inside save-dir
+    config["gate-max-background"] = "0";        // ADU, 0 disables the check
+    config["gate-min-stars"] = "0";             // 0 disables the check
+    config["gate-max-fwhm"] = "0";              // pixels, 0 disables the check
+    config["gate-max-saturation"] = "0";        // fraction of pixels, 0 disables the check
+    config["gate-saturation-level"] = "65000";  // ADU
+    config["framebus"] = "0";
+    config["framebus-name"] = "/qhy-framebus";  // POSIX shared memory name
+    config["framebus-slots"] = "8";             // frames kept in the ring
+    config["framebus-stage"] = "processed";     // raw or processed
+    config["record"] = "";                      // capture file that receives the raw frames and timings
+    config["replay"] = "";                      // capture file replayed instead of using the camera
+    config["replay-speed"] = "recorded";        // recorded or fast
 
     // Site configurations, often specified in a site block.
     config["latitude"] = "0"; /// < Telescope latitude in degrees
@@ -176,12 +280,26 @@ QMap<QString, QVariant> parse_cli(const QCoreApplication & app) {
     config["camera-id"] =  "None";
     config["filter-names"] =  "None";   // an ordered list of filter names corresponding to slot numbers
     config["usb-transferbit"] =  "16";
-    config["usb-traffic"] =  "0";
+    config["usb-traffic"] =  "auto";     // "auto" uses the tuned value for this camera and host, or 0.
+    config["usb-tuning-file"] = "";     // Empty uses the user's config directory.
+    config["tune-usb"] = "0";
+    config["tune-usb-frames"] = "10";   // Frames measured per USB traffic setting
+    config["tune-usb-exposure"] = "1";  // Exposure of the measured frames (milliseconds)
+    config["tune-usb-steps"] = "12";    // Largest number of USB traffic settings measured
+    config["tune-usb-bits"] = "";       // Transfer bit depths to tune. Empty tunes usb-transferbit.
     config["camera-bin-mode"] = "1x1";
+    config["no-profile-cache"] = "0";
+    config["profile-cache-dir"] = "";       // Empty uses the user's cache directory.
     config["camera-temperature"] = "40"; // Values >= 40 imply active cooling should be disabled.
     config["camera-cool-down"] = "0";
     config["camera-warm-up"] = "0";
+    config["camera-temp-ramp"] = "5";        // Maximum set point change in Celsius per minute. Zero disables ramping.
+    config["camera-temp-tolerance"] = "0.5"; // Half-width of the stability band in Celsius.
+    config["camera-temp-settle"] = "60";     // Seconds the temperature must remain in the band.
+    config["camera-temp-timeout"] = "1800";  // Maximum seconds to wait for the cooler. Zero waits indefinitely.
+    config["wait-for-cooler"] = "0";
     config["camera-cal-dir"] = "";
+    config["hot-pixel-map"] = "";           // Map written by qhy-hot-pixels. Empty disables the repair.
 
     // Configuration options typically specified in a exposure configuration block
     config["exp-quantities"] = "10";
@@ -194,6 +312,350 @@ QMap<QString, QVariant> parse_cli(const QCoreApplication & app) {
     config["catalog"] =  "None";
     config["object-id"] =  "None";
 
+    return config;
+}
+
+void checkConfig(QMap<QString, QVariant> & config) {
+
+    // Check the FITS writer settings
+    QStringList allowed_writers = {"sync", "threads", "io_uring"};
+    if(allowed_writers.indexOf(config["fits-writer"].toString()) == -1) {
+        qCritical() << "fits-writer must be one of " << allowed_writers;
+        exit(-1);
+    }
+    QStringList allowed_sync = {"none", "file", "batch"};
+    if(allowed_sync.indexOf(config["fits-sync"].toString()) == -1) {
+        qCritical() << "fits-sync must be one of " << allowed_sync;
+        exit(-1);
+    }
+    checkIntegerType(config["fits-writer-threads"].toString(), "fits-writer-threads must be an integer value.");
+    checkIntegerType(config["fits-writer-max-inflight"].toString(), "fits-writer-max-inflight must be an integer value.");
+    checkIntegerType(config["fits-sync-batch"].toString(), "fits-sync-batch must be an integer value.");
+    QStringList allowed_containers = {"file", "mef", "cube"};
+    if(allowed_containers.indexOf(config["fits-container"].toString()) == -1) {
+        qCritical() << "fits-container must be one of " << allowed_containers;
+        exit(-1);
+    }
+    checkIntegerType(config["fits-container-frames"].toString(), "fits-container-frames must be an integer value.");
+    checkIntegerType(config["fits-container-size"].toString(), "fits-container-size must be an integer value.");
+
+    // Check the burst capture settings
+    checkIntegerType(config["burst-frames"].toString(), "burst-frames must be an integer value.");
+    checkNumericType(config["burst-ram-fraction"].toString(), "burst-ram-fraction must be a numeric value.");
+    QStringList allowed_drain = {"background", "after"};
+    if(allowed_drain.indexOf(config["burst-drain"].toString()) == -1) {
+        qCritical() << "burst-drain must be one of " << allowed_drain;
+        exit(-1);
+    }
+
+    // Bursts spool the raw frames and write them later, so nothing that needs
+    // the frames during capture can run with them.
+    if(config["burst"] == "1" && config["no-save"] == "1") {
+        qWarning() << "Burst mode requires saving FITS files, ignoring burst mode";
+        config["burst"] = "0";
+    } else if(config["burst"] == "1") {
+        const QList<QPair<QString, QString>> burst_incompatible = {
+            {"flat", "auto flats"},
+            {"lucky", "lucky imaging"},
+            {"star-detect", "star detection"},
+            {"streak-detect", "streak detection"},
+            {"photometry", "photometry"},
+            {"gate", "the quality gate"},
+            {"live-stack", "live stacking"},
+            {"framebus", "the frame bus"},
+        };
+        for(const auto & option : burst_incompatible) {
+            if(config[option.first] == "1") {
+                qWarning() << "Burst mode does not process frames during capture, ignoring" << option.second;
+                config[option.first] = "0";
+            }
+        }
+    }
+    if(config["flat"] == "1" && config["lucky"] == "1") {
+        qWarning() << "Auto flats write every frame within the tolerance, ignoring lucky imaging";
+        config["lucky"] = "0";
+    }
+
+    // Check the lucky imaging settings
+    QStringList allowed_metrics = {"laplacian", "fwhm"};
+    if(allowed_metrics.indexOf(config["lucky-metric"].toString()) == -1) {
+        qCritical() << "lucky-metric must be one of " << allowed_metrics;
+        exit(-1);
+    }
+    checkIntegerType(config["lucky-keep"].toString(), "lucky-keep must be an integer value.");
+    checkNumericType(config["lucky-keep-percent"].toString(), "lucky-keep-percent must be a numeric value.");
+    checkIntegerType(config["lucky-roi"].toString(), "lucky-roi must be an integer value.");
+    checkIntegerType(config["lucky-downsample"].toString(), "lucky-downsample must be an integer value.");
+    checkIntegerType(config["lucky-max-memory"].toString(), "lucky-max-memory must be an integer value.");
+
+    // Check the live stacking settings
+    QStringList allowed_stack_modes = {"mean", "sigma-clip"};
+    if(allowed_stack_modes.indexOf(config["live-stack-mode"].toString()) == -1) {
+        qCritical() << "live-stack-mode must be one of " << allowed_stack_modes;
+        exit(-1);
+    }
+    checkNumericType(config["live-stack-sigma"].toString(), "live-stack-sigma must be a numeric value.");
+    checkIntegerType(config["live-stack-downsample"].toString(), "live-stack-downsample must be an integer value.");
+    checkNumericType(config["live-stack-min-response"].toString(), "live-stack-min-response must be a numeric value.");
+
+    // Check the star detection settings
+    checkNumericType(config["star-threshold"].toString(), "star-threshold must be a numeric value.");
+    checkIntegerType(config["star-tile"].toString(), "star-tile must be an integer value.");
+    checkIntegerType(config["star-min-area"].toString(), "star-min-area must be an integer value.");
+    checkIntegerType(config["star-max"].toString(), "star-max must be an integer value.");
+    checkNumericType(config["star-budget-ms"].toString(), "star-budget-ms must be a numeric value.");
+
+    // Check the streak detection settings
+    checkIntegerType(config["streak-bin"].toString(), "streak-bin must be an integer value.");
+    checkNumericType(config["streak-threshold"].toString(), "streak-threshold must be a numeric value.");
+    checkNumericType(config["streak-min-length"].toString(), "streak-min-length must be a numeric value.");
+    checkIntegerType(config["streak-tile"].toString(), "streak-tile must be an integer value.");
+    checkIntegerType(config["streak-max"].toString(), "streak-max must be an integer value.");
+
+    // Check the photometry settings
+    checkIntegerType(config["phot-search"].toString(), "phot-search must be an integer value.");
+    checkNumericType(config["phot-aperture"].toString(), "phot-aperture must be a numeric value.");
+    checkNumericType(config["phot-annulus-inner"].toString(), "phot-annulus-inner must be a numeric value.");
+    checkNumericType(config["phot-annulus-outer"].toString(), "phot-annulus-outer must be a numeric value.");
+    checkNumericType(config["phot-egain"].toString(), "phot-egain must be a numeric value.");
+    if(config["phot-annulus-inner"].toDouble() < config["phot-aperture"].toDouble() ||
+       config["phot-annulus-outer"].toDouble() <= config["phot-annulus-inner"].toDouble()) {
+        qCritical() << "The sky annulus must lie outside the photometry aperture.";
+        exit(-1);
+    }
+
+    // Check the guider settings
+    checkIntegerType(config["guide-roi-x"].toString(), "guide-roi-x must be an integer value.");
+    checkIntegerType(config["guide-roi-y"].toString(), "guide-roi-y must be an integer value.");
+    checkIntegerType(config["guide-roi-size"].toString(), "guide-roi-size must be an integer value.");
+    checkNumericType(config["guide-exposure"].toString(), "guide-exposure must be a numeric value.");
+    checkNumericType(config["guide-gain"].toString(), "guide-gain must be a numeric value.");
+    checkIntegerType(config["guide-window"].toString(), "guide-window must be an integer value.");
+    checkNumericType(config["guide-min-snr"].toString(), "guide-min-snr must be a numeric value.");
+    QStringList allowed_guide_outputs = {"socket", "fifo"};
+    if(allowed_guide_outputs.indexOf(config["guide-output-type"].toString()) == -1) {
+        qCritical() << "guide-output-type must be one of " << allowed_guide_outputs;
+        exit(-1);
+    }
+
+    // Check the focus settings
+    checkIntegerType(config["focus-roi-size"].toString(), "focus-roi-size must be an integer value.");
+    checkNumericType(config["focus-exposure"].toString(), "focus-exposure must be a numeric value.");
+    checkNumericType(config["focus-gain"].toString(), "focus-gain must be a numeric value.");
+    checkIntegerType(config["focus-history"].toString(), "focus-history must be an integer value.");
+
+    // Check the auto flat settings
+    QStringList allowed_flat_sources = {"dusk", "dawn", "panel"};
+    if(allowed_flat_sources.indexOf(config["flat-source"].toString()) == -1) {
+        qCritical() << "flat-source must be one of " << allowed_flat_sources;
+        exit(-1);
+    }
+    checkNumericType(config["flat-target"].toString(), "flat-target must be a numeric value.");
+    checkNumericType(config["flat-tolerance"].toString(), "flat-tolerance must be a numeric value.");
+    checkNumericType(config["flat-bias"].toString(), "flat-bias must be a numeric value.");
+    checkNumericType(config["flat-min-exposure"].toString(), "flat-min-exposure must be a numeric value.");
+    checkNumericType(config["flat-max-exposure"].toString(), "flat-max-exposure must be a numeric value.");
+    if(config["flat-target"].toDouble() <= config["flat-bias"].toDouble()) {
+        qCritical() << "flat-target must be above flat-bias.";
+        exit(-1);
+    }
+    if(config["flat-min-exposure"].toDouble() <= 0 ||
+       config["flat-max-exposure"].toDouble() < config["flat-min-exposure"].toDouble()) {
+        qCritical() << "flat-min-exposure must be positive and no larger than flat-max-exposure.";
+        exit(-1);
+    }
+
+    // Check the quality gate settings
+    QStringList allowed_gate_actions = {"quarantine", "drop"};
+    if(allowed_gate_actions.indexOf(config["gate-action"].toString()) == -1) {
+        qCritical() << "gate-action must be one of " << allowed_gate_actions;
+        exit(-1);
+    }
+    checkNumericType(config["gate-max-background"].toString(), "gate-max-background must be a numeric value.");
+    checkIntegerType(config["gate-min-stars"].toString(), "gate-min-stars must be an integer value.");
+    checkNumericType(config["gate-max-fwhm"].toString(), "gate-max-fwhm must be a numeric value.");
+    checkNumericType(config["gate-max-saturation"].toString(), "gate-max-saturation must be a numeric value.");
+    checkIntegerType(config["gate-saturation-level"].toString(), "gate-saturation-level must be an integer value.");
+
+    // Check the frame bus settings
+    if(!config["framebus-name"].toString().startsWith("/")) {
+        qCritical() << "framebus-name must start with a slash, e.g. /qhy-framebus";
+        exit(-1);
+    }
+    checkIntegerType(config["framebus-slots"].toString(), "framebus-slots must be an integer value.");
+    if(config["framebus-slots"].toInt() < 2) {
+        qCritical() << "framebus-slots must be at least 2";
+        exit(-1);
+    }
+    QStringList allowed_framebus_stages = {"raw", "processed"};
+    if(allowed_framebus_stages.indexOf(config["framebus-stage"].toString()) == -1) {
+        qCritical() << "framebus-stage must be one of " << allowed_framebus_stages;
+        exit(-1);
+    }
+
+    // Check the session replay settings
+    QStringList allowed_replay_speeds = {"recorded", "fast"};
+    if(allowed_replay_speeds.indexOf(config["replay-speed"].toString()) == -1) {
+        qCritical() << "replay-speed must be one of " << allowed_replay_speeds;
+        exit(-1);
+    }
+    bool replay_set = !config["replay"].toString().isEmpty();
+    if(replay_set && !QFileInfo(config["replay"].toString()).isFile()) {
+        qCritical() << "Capture file" << config["replay"].toString() << "does not exist";
+        exit(-1);
+    }
+    if(replay_set && config["replay"].toString() == config["record"].toString()) {
+        qCritical() << "Cannot record to the capture file that is being replayed";
+        exit(-1);
+    }
+
+    // Check the transfer settings
+    QStringList allowed_transfer_bits = {"8", "16"};
+    if(allowed_transfer_bits.indexOf(config["usb-transferbit"].toString()) == -1) {
+        qCritical() << "usb-transferbit must be one of " << allowed_transfer_bits;
+        exit(-1);
+    }
+    if(config["usb-tuning-file"].toString().isEmpty())
+        config["usb-tuning-file"] = defaultUSBTuningFile();
+    // "auto" is looked up once the camera has applied the bin mode, see usbTraffic().
+    if(config["usb-traffic"] != "auto")
+        checkIntegerType(config["usb-traffic"].toString(), "usb-traffic must be an integer value or auto.");
+
+    // Check the USB tuning settings
+    if(config["tune-usb-bits"].toString().isEmpty())
+        config["tune-usb-bits"] = config["usb-transferbit"].toString();
+    QStringList tune_bits = toStringList(config["tune-usb-bits"]);
+    for(const QString & bits : tune_bits) {
+        if(allowed_transfer_bits.indexOf(bits) == -1) {
+            qCritical() << "tune-usb-bits must be a list of " << allowed_transfer_bits;
+            exit(-1);
+        }
+    }
+    config["tune-usb-bits"] = tune_bits;
+    checkIntegerType(config["tune-usb-frames"].toString(), "tune-usb-frames must be an integer value.");
+    checkIntegerType(config["tune-usb-steps"].toString(), "tune-usb-steps must be an integer value.");
+    checkNumericType(config["tune-usb-exposure"].toString(), "tune-usb-exposure must be a numeric value.");
+    if(config["tune-usb-frames"].toInt() < 1 || config["tune-usb-steps"].toInt() < 1) {
+        qCritical() << "tune-usb-frames and tune-usb-steps must be at least 1";
+        exit(-1);
+    }
+    if(config["tune-usb"] == "1")
+        config["no-gui"] = "1"; // shut off the GUI, it isn't needed.
+
+        // Check that the camera is specified
+    bool guide_camera_set = (config["guide"] == "1" && !config["guide-camera-id"].toString().isEmpty());
+    if(config["camera-id"] == "None" && !guide_camera_set && !replay_set) {
+        qCritical() << "Critical: Camera ID not specified. Exiting.";
+        exit(-1);
+    }
+
+    // Convert the number of exposures to a QStringList. Verify that they are integers.
+    const QStringList quantities = toStringList(config["exp-quantities"]);
+    checkIntegerType(quantities, "exp-quantities must be a comma separated list of integer values without any spaces.");
+    config["exp-quantities"] = quantities;
+
+    // Convert the duration information to a QStringList. Enforce length matching to exposures.
+    const QStringList durations = toStringList(config["exp-durations"]);
+    checkNumericType(durations, "exp-durations must be a comma separated list of numeric values without any spaces");
+    checkMatchingLength(quantities, durations, "The number of durations does match the number of exposures");
+    config["exp-durations"] = durations;
+
+    // Convert the filter information to a QStringList. Enforce length matching to exposures.
+    QStringList exp_filters = toStringList(config["exp-filters"]);
+    const QStringList filter_names = toStringList(config["filter-names"]);
+    // If the user didn't specify a filter, select the default filter for them automatically
+    if(exp_filters.length() == 1 && exp_filters[0] == "" && filter_names.length() > 0) {
+        exp_filters[0] = filter_names[0];
+    }
+    checkMatchingLength(quantities, exp_filters, "The number of filters does match the number of exposures");
+    config["exp-filters"] = exp_filters;
+
+    // Convert the gain information to a QStringList. Require that at least one gain was specified.
+    // Replicate the gain to all filters if necessary.
+    QStringList gains = toStringList(config["exp-gains"]);
+    checkNumericType(gains, "exp-gains must be a comma separated list of numeric values without any spaces");
+    if(gains.length() == 0) {
+        qCritical() << "The number of gains specified cannot be zero";
+    }
+    for(int i = gains.length(); i < quantities.length(); i++) {
+        gains.append(gains.at(0));
+    }
+    config["exp-gains"] = gains;
+
+    // Convert the offset information to a QStringList. Require that at least one gain was specified.
+    // Replicate the offset to all filters if necessary.
+    QStringList offsets = toStringList(config["exp-offsets"]);
+    checkIntegerType(offsets, "exp-offsets must be a comma separated list of integer values without any spaces.");
+    if(gains.length() == 0) {
+        qCritical() << "The number of offsets specified cannot be zero";
+        exit(-1);
+    }
+    for(int i = offsets.length(); i < quantities.length() ; i++) {
+        offsets.append(offsets.at(0));
+    }
+    config["exp-offsets"] = offsets;
+
+    // Convert the auto flat throughputs to a QStringList. When given there must be one per filter.
+    QStringList throughputs = toStringList(config["flat-throughputs"]);
+    if(throughputs.length() == 1 && throughputs[0] == "")
+        throughputs.clear();
+    checkNumericType(throughputs, "flat-throughputs must be a comma separated list of numeric values without any spaces");
+    if(throughputs.length() > 0)
+        checkMatchingLength(quantities, throughputs, "The number of flat throughputs does match the number of exposures");
+    config["flat-throughputs"] = throughputs;
+
+    // Check that the binning mode is allowed.
+    QStringList allowed_bin_modes = {"1x1", "2x2", "3x3", "4x4", "5x5", "6x6", "7x7", "8x8", "9x9"};
+    if(allowed_bin_modes.indexOf(config["camera-bin-mode"]) == -1) {
+        qCritical() << "Binning mode must be one of " << allowed_bin_modes;
+        exit(-1);
+    }
+
+    // Handle cooling / temperature settings.
+    checkNumericType(config["camera-temperature"].toString(), "Camera temperature must be a numeric value.");
+    checkNumericType(config["camera-temp-ramp"].toString(), "camera-temp-ramp must be a numeric value.");
+    checkNumericType(config["camera-temp-tolerance"].toString(), "camera-temp-tolerance must be a numeric value.");
+    checkNumericType(config["camera-temp-settle"].toString(), "camera-temp-settle must be a numeric value.");
+    checkNumericType(config["camera-temp-timeout"].toString(), "camera-temp-timeout must be a numeric value.");
+    // Ensure `camera-cool-down` and `camera-warm-up` are mutually exclusive.
+    bool cool_down = (config["camera-cool-down"] == "1");
+    bool warm_up   = (config["camera-warm-up"] == "1");
+    if (warm_up) {
+        config["camera-cool-down"] = "0";
+        config["camera-warm-up"]   = "1";
+        config["no-gui"] = "1"; // shut off the GUI, it isn't needed.
+    } else if(cool_down) {
+        config["camera-cool-down"] = "1";
+        config["camera-warm-up"]   = "0";
+        config["no-gui"] = "1"; // shut off the GUI, it isn't needed.
+    }
+
+    // Figure out where the camera stores its calibration files.
+    QString cal_rel_dir = config["camera-cal-dir"].toString();
+    if(cal_rel_dir.length() > 0) {
+        QFileInfo configFile(config["config-file"].toString());
+        QDir calDir(configFile.absoluteDir().absolutePath() + QDir::separator() + config["camera-cal-dir"].toString());
+        config["camera-cal-dir"] = calDir.absolutePath();
+    }
+
+    // Resolve the save directory to an absolute path
+    QFileInfo saveDir(config["save-dir"].toString() + QDir::separator());
+    QDir calDir(saveDir.absoluteDir().absolutePath());
+    config["save-dir"] = calDir.absolutePath() + QDir::separator();
+
+    // Resolve the quarantine directory, defaulting to a subdirectory of the save directory.
+    if(config["gate-quarantine-dir"].toString().isEmpty()) {
+        config["gate-quarantine-dir"] = config["save-dir"].toString() + "quarantine" + QDir::separator();
+    } else {
+        QDir quarantineDir(config["gate-quarantine-dir"].toString());
+        config["gate-quarantine-dir"] = quarantineDir.absolutePath() + QDir::separator();
+    }
+}
+
+QMap<QString, QVariant> parse_cli(const QCoreApplication & app) {
+
+    QMap<QString, QVariant> config = defaultConfig();
+
     // Set up a command line parser to accept a subset of the parameters.
     QCommandLineParser parser;
     parser.setApplicationDescription("Camera Configuration Example");
@@ -207,6 +669,94 @@ QMap<QString, QVariant> parse_cli(const QCoreApplication & app) {
     parser.addOption({"no-gui", "Disable all GUI elements"});   // boolean
     parser.addOption({{"no-save", "preview"}, "Disable saving FITS files"});   // boolean
     parser.addOption({{"save-dir", "sd"},       "Directory in which files will be saved", "save-dir"});
+    parser.addOption({"fits-writer", "FITS writer backend. Options: sync, threads, io_uring", "fits-writer"});
+    parser.addOption({"fits-writer-threads", "Number of FITS writer threads", "fits-writer-threads"});
+    parser.addOption({"fits-writer-max-inflight", "Queued image data (MB) before acquisition waits for the writer", "fits-writer-max-inflight"});
+    parser.addOption({"fits-sync", "When to flush FITS files to disk. Options: none, file, batch", "fits-sync"});
+    parser.addOption({"fits-sync-batch", "Number of files between flushes for the batch policy", "fits-sync-batch"});
+    parser.addOption({"fits-container", "How frames are stored. Options: file (one per frame), mef (one extension per frame), cube", "fits-container"});
+    parser.addOption({"fits-container-frames", "Frames per mef or cube file before a new one is started (0 for no limit)", "fits-container-frames"});
+    parser.addOption({"fits-container-size", "Size (MB) of a mef or cube file before a new one is started (0 for no limit)", "fits-container-size"});
+    parser.addOption({"ser", "Write the frames of each filter to a SER video instead of FITS files"}); // boolean
+    parser.addOption({"ser-debayer", "Write debayered color frames to SER videos instead of the raw mosaic"}); // boolean
+    parser.addOption({"burst", "Capture into a RAM spool and write FITS files in the background"}); // boolean
+    parser.addOption({"burst-frames", "Number of frames to spool, 0 spools the whole sequence", "burst-frames"});
+    parser.addOption({"burst-ram-fraction", "Fraction of available memory the burst spool may use", "burst-ram-fraction"});
+    parser.addOption({"burst-hugepages", "Back the burst spool with huge pages"}); // boolean
+    parser.addOption({"burst-drain", "When to write spooled frames. Options: background, after", "burst-drain"});
+    parser.addOption({"lucky", "Lucky imaging: only write the sharpest frames of each filter"}); // boolean
+    parser.addOption({"lucky-metric", "Lucky imaging sharpness metric. Options: laplacian, fwhm", "lucky-metric"});
+    parser.addOption({"lucky-keep", "Number of frames to keep per filter", "lucky-keep"});
+    parser.addOption({"lucky-keep-percent", "Percentage of frames to keep per filter when lucky-keep is 0", "lucky-keep-percent"});
+    parser.addOption({"lucky-roi", "Side length of the centered scoring region (pixels)", "lucky-roi"});
+    parser.addOption({"lucky-downsample", "Downsampling factor applied before scoring", "lucky-downsample"});
+    parser.addOption({"lucky-stack", "Shift-and-add the kept frames into a stack"}); // boolean
+    parser.addOption({"lucky-max-memory", "Memory for the kept frames of a filter (MB)", "lucky-max-memory"});
+    parser.addOption({"live-stack", "Register and stack frames as they arrive and display the stack"}); // boolean
+    parser.addOption({"live-stack-mode", "Live stack combination. Options: mean, sigma-clip", "live-stack-mode"});
+    parser.addOption({"live-stack-sigma", "Sigma clipping threshold (standard deviations)", "live-stack-sigma"});
+    parser.addOption({"live-stack-downsample", "Downsampling factor applied before registration", "live-stack-downsample"});
+    parser.addOption({"live-stack-min-response", "Minimum phase correlation response to accept a frame", "live-stack-min-response"});
+    parser.addOption({"star-detect", "Detect stars and record NSTARS, FWHM, BKGMEAN and BKGRMS"}); // boolean
+    parser.addOption({"star-threshold", "Star detection threshold (background RMS)", "star-threshold"});
+    parser.addOption({"star-tile", "Side length of the background estimation tiles (pixels)", "star-tile"});
+    parser.addOption({"star-min-area", "Smallest number of connected pixels accepted as a star", "star-min-area"});
+    parser.addOption({"star-max", "Largest number of stars measured per frame", "star-max"});
+    parser.addOption({"star-budget-ms", "Time budget for measuring stars in a frame (ms)", "star-budget-ms"});
+    parser.addOption({"star-list", "Write a CSV list of the stars next to each FITS file"}); // boolean
+    parser.addOption({"streak-detect", "Detect satellite and debris streaks in each frame"}); // boolean
+    parser.addOption({"streak-bin", "Binning factor applied before the streak search", "streak-bin"});
+    parser.addOption({"streak-threshold", "Streak detection threshold (background RMS)", "streak-threshold"});
+    parser.addOption({"streak-min-length", "Shortest streak reported (pixels)", "streak-min-length"});
+    parser.addOption({"streak-tile", "Side length of the streak search tiles (binned pixels)", "streak-tile"});
+    parser.addOption({"streak-max", "Largest number of streaks reported per frame", "streak-max"});
+    parser.addOption({"streak-exec", "Command started with the path of each streak list", "streak-exec"});
+    parser.addOption({"photometry", "Measure the target at the image center and append it to a light curve"}); // boolean
+    parser.addOption({"phot-search", "Half width of the box searched for the target (pixels)", "phot-search"});
+    parser.addOption({"phot-aperture", "Photometry aperture radius (pixels)", "phot-aperture"});
+    parser.addOption({"phot-annulus-inner", "Sky annulus inner radius (pixels)", "phot-annulus-inner"});
+    parser.addOption({"phot-annulus-outer", "Sky annulus outer radius (pixels)", "phot-annulus-outer"});
+    parser.addOption({"phot-egain", "Detector gain for the noise estimate (e-/ADU)", "phot-egain"});
+    parser.addOption({"phot-lightcurve", "Light curve CSV file", "phot-lightcurve"});
+    parser.addOption({"guide", "Stream a guide window and publish guide corrections"}); // boolean
+    parser.addOption({"guide-camera-id", "QHY Camera Identifier of the guide camera", "guide-camera-id"});
+    parser.addOption({"guide-roi-x", "X center of the guide window (pixels)", "guide-roi-x"});
+    parser.addOption({"guide-roi-y", "Y center of the guide window (pixels)", "guide-roi-y"});
+    parser.addOption({"guide-roi-size", "Side length of the guide window (pixels)", "guide-roi-size"});
+    parser.addOption({"guide-exposure", "Guide exposure duration (ms)", "guide-exposure"});
+    parser.addOption({"guide-gain", "Guide camera gain", "guide-gain"});
+    parser.addOption({"guide-window", "Half width of the centroid window (pixels)", "guide-window"});
+    parser.addOption({"guide-min-snr", "Smallest signal to noise ratio of a usable guide star", "guide-min-snr"});
+    parser.addOption({"guide-output", "Unix socket or FIFO receiving the corrections", "guide-output"});
+    parser.addOption({"guide-output-type", "Guide output type. Options: socket, fifo", "guide-output-type"});
+    parser.addOption({"focus", "Loop short exposures around the brightest star and plot HFR/FWHM"}); // boolean
+    parser.addOption({"focus-roi-size", "Side length of the focus window (pixels)", "focus-roi-size"});
+    parser.addOption({"focus-exposure", "Focus exposure duration (ms)", "focus-exposure"});
+    parser.addOption({"focus-gain", "Camera gain while focusing", "focus-gain"});
+    parser.addOption({"focus-history", "Number of frames shown in the focus plot", "focus-history"});
+    parser.addOption({"flat", "Auto flats: choose each exposure time from the sky brightness trend"}); // boolean
+    parser.addOption({"flat-source", "Light source of the flats. Options: dusk, dawn, panel", "flat-source"});
+    parser.addOption({"flat-target", "Median level of a good flat (ADU)", "flat-target"});
+    parser.addOption({"flat-tolerance", "Accepted deviation from the target (fraction)", "flat-tolerance"});
+    parser.addOption({"flat-bias", "Bias level subtracted before scaling exposures (ADU)", "flat-bias"});
+    parser.addOption({"flat-min-exposure", "Shortest flat exposure (seconds)", "flat-min-exposure"});
+    parser.addOption({"flat-max-exposure", "Longest flat exposure (seconds)", "flat-max-exposure"});
+    parser.addOption({"flat-throughputs", "Relative throughput of each filter, used to order them", "flat-throughputs"});
+    parser.addOption({"gate", "Check frame quality before writing"}); // boolean
+    parser.addOption({"gate-action", "What to do with rejected frames. Options: quarantine, drop", "gate-action"});
+    parser.addOption({"gate-quarantine-dir", "Directory for rejected frames", "gate-quarantine-dir"});
+    parser.addOption({"gate-max-background", "Largest acceptable sky background (ADU)", "gate-max-background"});
+    parser.addOption({"gate-min-stars", "Smallest acceptable number of stars", "gate-min-stars"});
+    parser.addOption({"gate-max-fwhm", "Largest acceptable median FWHM (pixels)", "gate-max-fwhm"});
+    parser.addOption({"gate-max-saturation", "Largest acceptable fraction of saturated pixels", "gate-max-saturation"});
+    parser.addOption({"gate-saturation-level", "Pixel value treated as saturated (ADU)", "gate-saturation-level"});
+    parser.addOption({"framebus", "Publish frames to other processes through shared memory"}); // boolean
+    parser.addOption({"framebus-name", "Name of the shared memory segment", "framebus-name"});
+    parser.addOption({"framebus-slots", "Number of frames kept in the shared memory ring", "framebus-slots"});
+    parser.addOption({"framebus-stage", "Which frames to publish. Options: raw, processed", "framebus-stage"});
+    parser.addOption({"record", "Record raw frames and timings to a capture file", "record"});
+    parser.addOption({"replay", "Process frames from a capture file instead of the camera", "replay"});
+    parser.addOption({"replay-speed", "Replay speed. Options: recorded, fast", "replay-speed"});
 
     // Site options
     parser.addOption({{"latitude", "lat"}, "Object identifier", "latitude"});
@@ -218,13 +768,27 @@ QMap<QString, QVariant> parse_cli(const QCoreApplication & app) {
     parser.addOption({{"object-id", "object"}, "Object identifier", "object-id"});
     parser.addOption({"camera-id", "QHY Camera Identifier", "camera-id"});
     parser.addOption({"filter-names", "List of filters in the camera", ""});
-    parser.addOption({"usb-traffic", "QHY USB Traffic Setting", "usb-traffic"});
-    parser.addOption({"usb-transferbit", "Bits for image transfer. Options are 8 or 16", "usb-transferbit"});
+    parser.addOption({"usb-traffic", "QHY USB Traffic Setting, or auto for the tuned value", "usb-traffic"});
+    parser.addOption({"usb-transferbit", "Bits per pixel for transfer, processing and FITS output. Options are 8 or 16", "usb-transferbit"});
+    parser.addOption({"usb-tuning-file", "File of the tuned USB traffic settings", "usb-tuning-file"});
+    parser.addOption({"tune-usb", "Measure the readout at each USB traffic setting and store the fastest stable one"}); // boolean
+    parser.addOption({"tune-usb-frames", "Frames measured per USB traffic setting", "tune-usb-frames"});
+    parser.addOption({"tune-usb-exposure", "Exposure of the measured frames (milliseconds)", "tune-usb-exposure"});
+    parser.addOption({"tune-usb-steps", "Largest number of USB traffic settings measured", "tune-usb-steps"});
+    parser.addOption({"tune-usb-bits", "Transfer bit depths to tune, e.g. 8,16", "tune-usb-bits"});
+    parser.addOption({"no-profile-cache", "Probe the camera capabilities instead of using the cached profile"}); // boolean
+    parser.addOption({"profile-cache-dir", "Directory of the cached camera profiles", "profile-cache-dir"});
     parser.addOption({{"camera-bin-mode", "cb"}, "Binning mode. Options: 1x1 - 9x9 further restricted by camera.", "camera-bin-mode"});
     parser.addOption({{"camera-temperature", "ct"}, "Set point for active cooling (Celsius)", "camera-temperature"});
     parser.addOption({{"camera-cool-down", "cool-down"}, "Instruct the camera to begin cooling to the temperature in `camera-temperature`."});
     parser.addOption({{"camera-warm-up", "warm-up", "cw"}, "Instruct the camera to begin warming up."});
+    parser.addOption({"camera-temp-ramp", "Maximum cooler set point change (Celsius per minute)", "camera-temp-ramp"});
+    parser.addOption({"camera-temp-tolerance", "Temperature band considered stable (+/- Celsius)", "camera-temp-tolerance"});
+    parser.addOption({"camera-temp-settle", "Time the temperature must remain in the band (seconds)", "camera-temp-settle"});
+    parser.addOption({"camera-temp-timeout", "Maximum time to wait for a stable temperature (seconds)", "camera-temp-timeout"});
+    parser.addOption({"wait-for-cooler", "Regulate the cooler and wait for a stable temperature before exposing"}); // boolean
     parser.addOption({{"camera-cal-dir", "cd"}, "Location for camera calibration images", "camera-cal-dir"});
+    parser.addOption({"hot-pixel-map", "Repair the hot pixels listed in this map before processing", "hot-pixel-map"});
 
     // Exposure options
     parser.addOption({{"exp-quantities", "eq"}, "Number of exposures per filter", "exp-quantities"});
@@ -286,93 +850,70 @@ QMap<QString, QVariant> parse_cli(const QCoreApplication & app) {
     else
         config["draw-circle"] = "0";
 
+    if(parser.isSet("wait-for-cooler"))
+        config["wait-for-cooler"] = "1";
 
-        // Check that the camera is specified
-    if(config["camera-id"] == "None") {
-        qCritical() << "Critical: Camera ID not specified. Exiting.";
-        exit(-1);
-    }
+    if(parser.isSet("burst"))
+        config["burst"] = "1";
 
-    // Convert the number of exposures to a QStringList. Verify that they are integers.
-    const QStringList quantities = toStringList(config["exp-quantities"]);
-    checkIntegerType(quantities, "exp-quantities must be a comma separated list of integer values without any spaces.");
-    config["exp-quantities"] = quantities;
+    if(parser.isSet("burst-hugepages"))
+        config["burst-hugepages"] = "1";
 
-    // Convert the duration information to a QStringList. Enforce length matching to exposures.
-    const QStringList durations = toStringList(config["exp-durations"]);
-    checkNumericType(durations, "exp-durations must be a comma separated list of numeric values without any spaces");
-    checkMatchingLength(quantities, durations, "The number of durations does match the number of exposures");
-    config["exp-durations"] = durations;
+    if(parser.isSet("lucky"))
+        config["lucky"] = "1";
 
-    // Convert the filter information to a QStringList. Enforce length matching to exposures.
-    QStringList exp_filters = toStringList(config["exp-filters"]);
-    const QStringList filter_names = toStringList(config["filter-names"]);
-    // If the user didn't specify a filter, select the default filter for them automatically
-    if(exp_filters.length() == 1 && exp_filters[0] == "" && filter_names.length() > 0) {
-        exp_filters[0] = filter_names[0];
-    }
-    checkMatchingLength(quantities, exp_filters, "The number of filters does match the number of exposures");
-    config["exp-filters"] = exp_filters;
+    if(parser.isSet("lucky-stack"))
+        config["lucky-stack"] = "1";
 
-    // Convert the gain information to a QStringList. Require that at least one gain was specified.
-    // Replicate the gain to all filters if necessary.
-    QStringList gains = toStringList(config["exp-gains"]);
-    checkNumericType(gains, "exp-gains must be a comma separated list of numeric values without any spaces");
-    if(gains.length() == 0) {
-        qCritical() << "The number of gains specified cannot be zero";
-    }
-    for(int i = gains.length(); i < quantities.length(); i++) {
-        gains.append(gains.at(0));
-    }
-    config["exp-gains"] = gains;
+    if(parser.isSet("live-stack"))
+        config["live-stack"] = "1";
 
-    // Convert the offset information to a QStringList. Require that at least one gain was specified.
-    // Replicate the offset to all filters if necessary.
-    QStringList offsets = toStringList(config["exp-offsets"]);
-    checkIntegerType(offsets, "exp-offsets must be a comma separated list of integer values without any spaces.");
-    if(gains.length() == 0) {
-        qCritical() << "The number of offsets specified cannot be zero";
-        exit(-1);
-    }
-    for(int i = offsets.length(); i < quantities.length() ; i++) {
-        offsets.append(offsets.at(0));
-    }
-    config["exp-offsets"] = offsets;
+    if(parser.isSet("star-detect"))
+        config["star-detect"] = "1";
 
-    // Check that the binning mode is allowed.
-    QStringList allowed_bin_modes = {"1x1", "2x2", "3x3", "4x4", "5x5", "6x6", "7x7", "8x8", "9x9"};
-    if(allowed_bin_modes.indexOf(config["camera-bin-mode"]) == -1) {
-        qCritical() << "Binning mode must be one of " << allowed_bin_modes;
-        exit(-1);
-    }
+    if(parser.isSet("star-list"))
+        config["star-list"] = "1";
 
-    // Handle cooling / temperature settings.
-    checkNumericType(config["camera-temperature"].toString(), "Camera temperature must be a numeric value.");
-    // Ensure `camera-cool-down` and `camera-warm-up` are mutually exclusive.
-    bool cool_down = parser.isSet("camera-cool-down");
-    bool warm_up   = parser.isSet("camera-warm-up");
-    if (warm_up) {
-        config["camera-cool-down"] = "0";
-        config["camera-warm-up"]   = "1";
-        config["no-gui"] = "1"; // shut off the GUI, it isn't needed.
-    } else if(cool_down) {
+    if(parser.isSet("streak-detect"))
+        config["streak-detect"] = "1";
+
+    if(parser.isSet("photometry"))
+        config["photometry"] = "1";
+
+    if(parser.isSet("guide"))
+        config["guide"] = "1";
+
+    if(parser.isSet("focus"))
+        config["focus"] = "1";
+
+    if(parser.isSet("flat"))
+        config["flat"] = "1";
+
+    if(parser.isSet("gate"))
+        config["gate"] = "1";
+
+    if(parser.isSet("framebus"))
+        config["framebus"] = "1";
+
+    if(parser.isSet("no-profile-cache"))
+        config["no-profile-cache"] = "1";
+
+    if(parser.isSet("ser"))
+        config["ser"] = "1";
+
+    if(parser.isSet("ser-debayer"))
+        config["ser-debayer"] = "1";
+
+    if(parser.isSet("tune-usb"))
+        config["tune-usb"] = "1";
+
+    if(parser.isSet("camera-cool-down"))
         config["camera-cool-down"] = "1";
-        config["camera-warm-up"]   = "0";
-        config["no-gui"] = "1"; // shut off the GUI, it isn't needed.
-    }
 
-    // Figure out where the camera stores its calibration files.
-    QString cal_rel_dir = config["camera-cal-dir"].toString();
-    if(cal_rel_dir.length() > 0) {
-        QFileInfo configFile(config["config-file"].toString());
-        QDir calDir(configFile.absoluteDir().absolutePath() + QDir::separator() + config["camera-cal-dir"].toString());
-        config["camera-cal-dir"] = calDir.absolutePath();
-    }
+    if(parser.isSet("camera-warm-up"))
+        config["camera-warm-up"] = "1";
 
-    // Resolve the save directory to an absolute path
-    QFileInfo saveDir(config["save-dir"].toString() + QDir::separator());
-    QDir calDir(saveDir.absoluteDir().absolutePath());
-    config["save-dir"] = calDir.absolutePath() + QDir::separator();
+    checkConfig(config);
 
     // Clean up the configuration by removing child configurations
     for(const QString & key: config.keys()) {
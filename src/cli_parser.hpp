@@ -18,6 +18,12 @@ void updateConfigFromFile(QMap<QString, QVariant> & config, const QString& fileP
 
 void printConfig(const QMap<QString, QVariant> & config);
 
+// Returns the default value of every setting
+QMap<QString, QVariant> defaultConfig();
+
+// Validates the settings and converts them to the form used by the camera code. Exits on errors.
+void checkConfig(QMap<QString, QVariant> & config);
+
 QMap<QString, QVariant> parse_cli(const QCoreApplication & app);
 
 void checkIntegerType(const QString & str, const QString & errorMessage);
@@ -30,4 +36,10 @@ QStringList toStringList(const QVariant & var);
 
 void checkMatchingLength(const QStringList & A, const QStringList & B, const QString & errorMessage);
 
+// Returns the default USB tuning file, inside the user's config directory.
+QString defaultUSBTuningFile();
+
+// Returns the tuning file group of a camera on this host at a transfer bit depth and bin mode.
+QString usbTuningGroup(const QString & camera_id, int transfer_bits, const QString & bin_mode);
+
 #endif // CLI_PARSER_H
\ No newline at end of file
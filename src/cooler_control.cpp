@@ -0,0 +1,183 @@
+#include <QDebug>
+
+#include <cmath>
+#include <system_error>
+
+#include "cooler_control.hpp"
+
+extern std::atomic<bool> keep_running;
+
+CoolerController::CoolerController(qhyccd_handle * handle, double setPointC, double rampRateCPerMin,
+                                   double toleranceC, double settleTimeSec)
+    : mHandle(handle), mTargetC(setPointC), mRampRateCPerMin(rampRateCPerMin),
+      mToleranceC(toleranceC), mSettleTimeSec(settleTimeSec), mCommandedC(setPointC) {
+}
+
+CoolerController::~CoolerController() {
+    stop();
+}
+
+int CoolerController::start() {
+
+    int status = QHYCCD_SUCCESS;
+    status  = IsQHYCCDControlAvailable(mHandle, CONTROL_COOLER);
+    status |= IsQHYCCDControlAvailable(mHandle, CONTROL_CURTEMP);
+    if(status != QHYCCD_SUCCESS) {
+        qWarning() << "Camera does not support cooling";
+        return -1;
+    }
+
+    // Ramp from the current sensor temperature so that the first set point
+    // we command is not a step change.
+    mTemperatureC = GetQHYCCDParam(mHandle, CONTROL_CURTEMP);
+    mCommandedC = (mRampRateCPerMin > 0) ? mTemperatureC : mTargetC;
+    mRampComplete = false;
+    mStable = false;
+    mTimeToStableSec = -1;
+
+    qDebug() << "Cooler regulating from" << mTemperatureC << "to" << mTargetC << "C"
+             << "at" << mRampRateCPerMin << "C/min";
+
+    mRunning = true;
+    try {
+        mThread = std::thread(&CoolerController::run, this);
+    } catch(const std::system_error & e) {
+        qCritical() << "Could not start the cooler thread:" << e.what();
+        mRunning = false;
+        return -1;
+    }
+
+    return QHYCCD_SUCCESS;
+}
+
+void CoolerController::stop() {
+    mRunning = false;
+    if(mThread.joinable())
+        mThread.join();
+}
+
+void CoolerController::run() {
+    using namespace std;
+
+    const auto t_start = std::chrono::steady_clock::now();
+    auto t_last = t_start;
+    auto t_in_band = t_start;
+    bool in_band = false;
+
+    while(mRunning && keep_running) {
+        const auto t_now = std::chrono::steady_clock::now();
+        double dt_sec = std::chrono::duration<double>(t_now - t_last).count();
+        t_last = t_now;
+
+        double temperature = GetQHYCCDParam(mHandle, CONTROL_CURTEMP);
+        double commanded = 0;
+
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mTemperatureC = temperature;
+
+            // Move the commanded set point towards the target at the permitted rate.
+            if(mRampRateCPerMin > 0) {
+                double max_step = mRampRateCPerMin * dt_sec / 60.0;
+                double delta = mTargetC - mCommandedC;
+                if(std::fabs(delta) <= max_step)
+                    mCommandedC = mTargetC;
+                else
+                    mCommandedC += std::copysign(max_step, delta);
+            } else {
+                mCommandedC = mTargetC;
+            }
+            mRampComplete = (mCommandedC == mTargetC);
+            commanded = mCommandedC;
+
+            // The temperature is only stable once it has stayed in the band for the settle time.
+            if(mRampComplete && std::fabs(temperature - mTargetC) <= mToleranceC) {
+                if(!in_band) {
+                    in_band = true;
+                    t_in_band = t_now;
+                }
+
+                double in_band_sec = std::chrono::duration<double>(t_now - t_in_band).count();
+                if(!mStable && in_band_sec >= mSettleTimeSec) {
+                    mStable = true;
+                    if(mTimeToStableSec < 0) {
+                        mTimeToStableSec = std::chrono::duration<double>(t_now - t_start).count();
+                        qDebug() << "Cooler stable at" << temperature << "C after" << mTimeToStableSec << "seconds";
+                    }
+                }
+            } else {
+                if(mStable)
+                    qWarning() << "Cooler left the stability band, temperature:" << temperature;
+                in_band = false;
+                mStable = false;
+            }
+        }
+
+        SetQHYCCDParam(mHandle, CONTROL_COOLER, commanded);
+
+        // The SDK expects the cooler to be serviced about once per second. Sleep in
+        // short intervals so that stop requests are handled promptly.
+        for(int i = 0; i < 10 && mRunning && keep_running; i++)
+            std::this_thread::sleep_for(100ms);
+    }
+}
+
+bool CoolerController::waitUntilStable(double timeoutSec) {
+    using namespace std;
+
+    const auto t_start = std::chrono::steady_clock::now();
+    int iteration = 0;
+
+    while(keep_running && !isStable()) {
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+        if(timeoutSec > 0 && elapsed > timeoutSec) {
+            qWarning() << "Cooler did not stabilize within" << timeoutSec << "seconds";
+            return false;
+        }
+
+        // Report progress every ten seconds
+        if(iteration++ % 100 == 0)
+            qDebug() << "Waiting for cooler, temperature:" << temperature() << "target:" << mTargetC;
+
+        std::this_thread::sleep_for(100ms);
+    }
+
+    return isStable();
+}
+
+bool CoolerController::waitForRamp(double timeoutSec) {
+    using namespace std;
+
+    const auto t_start = std::chrono::steady_clock::now();
+
+    while(keep_running) {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            if(mRampComplete)
+                return true;
+        }
+
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+        if(timeoutSec > 0 && elapsed > timeoutSec)
+            return false;
+
+        std::this_thread::sleep_for(100ms);
+    }
+
+    return false;
+}
+
+bool CoolerController::isStable() const {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mStable;
+}
+
+double CoolerController::temperature() const {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mTemperatureC;
+}
+
+double CoolerController::timeToStable() const {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mTimeToStableSec;
+}
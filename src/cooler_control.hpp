@@ -0,0 +1,77 @@
+#ifndef COOLER_CONTROL_H
+#define COOLER_CONTROL_H
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+#include <qhyccd.h>
+
+/// @brief Regulates the sensor temperature from a background thread.
+///
+/// The controller moves the commanded set point towards the target at a limited
+/// rate to avoid thermal stress on the sensor and reports when the measured
+/// temperature has remained within a tolerance band for a minimum amount of time.
+class CoolerController {
+
+    qhyccd_handle * mHandle = nullptr;
+
+    double mTargetC = 40;           ///< Final set point (Celsius)
+    double mRampRateCPerMin = 0;    ///< Maximum set point change rate. Values <= 0 disable ramping.
+    double mToleranceC = 0.5;       ///< Half-width of the stability band (Celsius)
+    double mSettleTimeSec = 60;     ///< Time the temperature must remain in the band (seconds)
+
+    std::thread mThread;
+    std::atomic<bool> mRunning{false};
+
+    mutable std::mutex mMutex;
+    double mCommandedC = 40;        ///< Set point currently sent to the camera
+    double mTemperatureC = -999;    ///< Most recent sensor temperature
+    bool mRampComplete = false;
+    bool mStable = false;
+    double mTimeToStableSec = -1;
+
+    void run();
+
+public:
+    /// @brief Creates a controller for an initialized camera.
+    /// @param handle Handle to the QHY Camera
+    /// @param setPointC The target sensor temperature (Celsius)
+    /// @param rampRateCPerMin Maximum set point change per minute. Values <= 0 set the target immediately.
+    /// @param toleranceC Half-width of the band in which the temperature is considered stable.
+    /// @param settleTimeSec Time the temperature must remain within the band before it is considered stable.
+    CoolerController(qhyccd_handle * handle, double setPointC, double rampRateCPerMin,
+                     double toleranceC, double settleTimeSec);
+
+    /// Stops the regulation thread. The last commanded set point remains active on the camera.
+    ~CoolerController();
+
+    /// @brief Starts regulating the temperature in a background thread.
+    /// \return QHYCCD_SUCCESS on success, -1 if the camera does not support cooling or the thread could not start.
+    int start();
+
+    /// Stops the regulation thread.
+    void stop();
+
+    /// @brief Blocks until the temperature is stable, the timeout expires, or the application is stopped.
+    /// @param timeoutSec Maximum time to wait in seconds. Values <= 0 wait indefinitely.
+    /// \return true if the temperature is stable.
+    bool waitUntilStable(double timeoutSec);
+
+    /// @brief Blocks until the commanded set point has reached the target.
+    /// @param timeoutSec Maximum time to wait in seconds. Values <= 0 wait indefinitely.
+    /// \return true if the ramp completed.
+    bool waitForRamp(double timeoutSec);
+
+    /// \return true if the temperature has remained within the tolerance band for the settle time.
+    bool isStable() const;
+
+    /// \return The most recent sensor temperature in Celsius.
+    double temperature() const;
+
+    /// \return Seconds from start() until the temperature became stable, or -1 if it is not yet stable.
+    double timeToStable() const;
+};
+
+#endif // COOLER_CONTROL_H
@@ -0,0 +1,403 @@
+// local includes
+#include "async_fits_writer.hpp"
+
+// system includes
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+namespace {
+
+/// Writes the entire buffer at the specified offset, retrying short writes.
+bool pwriteAll(int fd, const char * data, size_t size, off_t offset, std::string & error) {
+  while(size > 0) {
+    ssize_t ret = pwrite(fd, data, size, offset);
+    if(ret < 0) {
+      if(errno == EINTR)
+        continue;
+      error = strerror(errno);
+      return false;
+    }
+    data += ret;
+    size -= ret;
+    offset += ret;
+  }
+
+  return true;
+}
+
+#ifdef HAVE_LIBURING
+const unsigned URING_QUEUE_DEPTH = 16;
+
+/// One submission ring per writer thread, created on first use.
+struct ThreadRing {
+  struct io_uring ring;
+  bool initialized = false;
+
+  ThreadRing() { initialized = (io_uring_queue_init(URING_QUEUE_DEPTH, &ring, 0) == 0); }
+  ~ThreadRing() { if(initialized) io_uring_queue_exit(&ring); }
+};
+
+ThreadRing & threadRingState() {
+  static thread_local ThreadRing thread_ring;
+  return thread_ring;
+}
+
+struct io_uring * threadRing() {
+  ThreadRing & thread_ring = threadRingState();
+  return thread_ring.initialized ? &thread_ring.ring : nullptr;
+}
+
+/// Drops this thread's ring. Later writes on the thread use pwrite.
+void closeThreadRing() {
+  ThreadRing & thread_ring = threadRingState();
+  if(thread_ring.initialized)
+    io_uring_queue_exit(&thread_ring.ring);
+  thread_ring.initialized = false;
+}
+#endif
+
+} // namespace
+
+AsyncFITSWriter::AsyncFITSWriter(Backend backend, int num_threads, size_t max_inflight_bytes,
+                                 SyncPolicy sync_policy, int sync_batch)
+  : mBackend(backend), mSyncPolicy(sync_policy), mSyncBatch(std::max(sync_batch, 1)),
+    mMaxInflightBytes(max_inflight_bytes) {
+
+  if(mBackend == BACKEND_IO_URING && !ioUringAvailable())
+    mBackend = BACKEND_THREADS;
+
+  num_threads = std::max(num_threads, 1);
+  for(int i = 0; i < num_threads; i++)
+    mThreads.emplace_back(&AsyncFITSWriter::workerLoop, this);
+}
+
+AsyncFITSWriter::~AsyncFITSWriter() {
+  close();
+}
+
+bool AsyncFITSWriter::ioUringAvailable() {
+#ifdef HAVE_LIBURING
+  return true;
+#else
+  return false;
+#endif
+}
+
+void AsyncFITSWriter::enqueue(const CVFITS & image, const std::string & filename, bool overwrite) {
+
+  size_t image_bytes = image.image.total() * image.image.elemSize();
+
+  // Apply backpressure before copying the pixels so the memory held by the
+  // writer never exceeds the limit by more than one frame.
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+    const auto t_wait = std::chrono::steady_clock::now();
+    mSpaceCondition.wait(lock, [&] {
+      return mMaxInflightBytes == 0 || mMetrics.inflight_bytes == 0 ||
+             mMetrics.inflight_bytes + image_bytes <= mMaxInflightBytes;
+    });
+    mMetrics.producer_wait_ms +=
+      std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t_wait).count();
+    mMetrics.inflight_bytes += image_bytes;
+  }
+
+  Job job;
+  job.image = image;
+  job.image.image = image.image.clone();
+  job.filename = filename;
+  job.overwrite = overwrite;
+  job.image_bytes = image_bytes;
+  job.t_enqueue = std::chrono::steady_clock::now();
+
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mQueue.push_back(std::move(job));
+    mMetrics.queue_depth++;
+    mMetrics.max_queue_depth = std::max(mMetrics.max_queue_depth, mMetrics.queue_depth);
+  }
+  mQueueCondition.notify_one();
+}
+
+void AsyncFITSWriter::flush() {
+  std::unique_lock<std::mutex> lock(mMutex);
+  mSpaceCondition.wait(lock, [&] { return mMetrics.queue_depth == 0; });
+}
+
+void AsyncFITSWriter::close() {
+
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mStopping = true;
+  }
+  mQueueCondition.notify_all();
+
+  for(std::thread & thread : mThreads) {
+    if(thread.joinable())
+      thread.join();
+  }
+  mThreads.clear();
+
+  // Persist the files of an incomplete batch.
+  std::vector<std::pair<int, std::string>> unsynced;
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    unsynced.swap(mUnsynced);
+  }
+  syncFiles(unsynced);
+}
+
+void AsyncFITSWriter::syncFiles(const std::vector<std::pair<int, std::string>> & files) {
+
+  for(const auto & file : files) {
+    std::string error;
+    if(fdatasync(file.first) != 0)
+      error = strerror(errno);
+    if(::close(file.first) != 0 && error.empty())
+      error = strerror(errno);
+
+    if(!error.empty()) {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mMetrics.errors++;
+      mMetrics.last_error = file.second + ": " + error;
+    }
+  }
+}
+
+AsyncFITSWriterMetrics AsyncFITSWriter::metrics() const {
+  std::lock_guard<std::mutex> lock(mMutex);
+  return mMetrics;
+}
+
+void AsyncFITSWriter::workerLoop() {
+
+  while(true) {
+    Job job;
+    {
+      std::unique_lock<std::mutex> lock(mMutex);
+      mQueueCondition.wait(lock, [&] { return mStopping || !mQueue.empty(); });
+      if(mQueue.empty())
+        return;
+
+      job = std::move(mQueue.front());
+      mQueue.pop_front();
+    }
+
+    // Serialize the file in memory, then hand the finished buffer to the kernel.
+    std::string error;
+    void * buffer = nullptr;
+    size_t size = job.image.saveToMemory(&buffer);
+    bool ok = false;
+    if(size == 0)
+      error = "CFITSIO failed to serialize the image";
+    else
+      ok = writeFile(job.filename, job.overwrite, (const char *) buffer, size, error);
+    free(buffer);
+
+    double latency_ms =
+      std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - job.t_enqueue).count();
+
+    // Report the file before it leaves the queue, so that it is accounted for once flush() returns.
+    if(mOnWritten)
+      mOnWritten(job.filename, ok);
+
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mMetrics.queue_depth--;
+      mMetrics.inflight_bytes -= job.image_bytes;
+      if(ok) {
+        mMetrics.files_written++;
+        mMetrics.bytes_written += size;
+        mMetrics.last_latency_ms = latency_ms;
+        mMetrics.max_latency_ms = std::max(mMetrics.max_latency_ms, latency_ms);
+        mTotalLatencyMs += latency_ms;
+        mMetrics.mean_latency_ms = mTotalLatencyMs / mMetrics.files_written;
+      } else {
+        mMetrics.errors++;
+        mMetrics.last_error = job.filename + ": " + error;
+      }
+    }
+    mSpaceCondition.notify_all();
+  }
+}
+
+bool AsyncFITSWriter::writeFile(const std::string & filename, bool overwrite, const char * data, size_t size,
+                                std::string & error) {
+
+  // Match fits_create_file, which refuses to replace an existing file.
+  int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (overwrite ? O_TRUNC : O_EXCL);
+  int fd = open(filename.c_str(), flags, 0644);
+  if(fd < 0) {
+    error = strerror(errno);
+    return false;
+  }
+
+  // Reserve the whole file up front so the filesystem can allocate it in as
+  // few extents as possible. Not every filesystem supports this.
+  if(fallocate(fd, 0, 0, size) != 0 && errno != EOPNOTSUPP && errno != ENOSYS) {
+    error = strerror(errno);
+    ::close(fd);
+    return false;
+  }
+
+  bool sync_file = (mSyncPolicy == SYNC_FILE);
+  bool ok = false;
+  if(mBackend == BACKEND_IO_URING)
+    ok = writeIOUring(fd, data, size, sync_file, error);
+  else
+    ok = writeThreads(fd, data, size, sync_file, error);
+
+  // Batched files stay open until the batch is full, then only their data is
+  // flushed, leaving other writers on the filesystem alone.
+  if(ok && mSyncPolicy == SYNC_BATCH) {
+    std::vector<std::pair<int, std::string>> batch;
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mUnsynced.emplace_back(fd, filename);
+      if((int) mUnsynced.size() >= mSyncBatch)
+        batch.swap(mUnsynced);
+    }
+    syncFiles(batch);
+    return true;
+  }
+
+  if(::close(fd) != 0 && ok) {
+    error = strerror(errno);
+    ok = false;
+  }
+
+  return ok;
+}
+
+bool AsyncFITSWriter::writeThreads(int fd, const char * data, size_t size, bool sync, std::string & error) {
+
+  for(size_t offset = 0; offset < size; offset += mChunkSize) {
+    size_t length = std::min(mChunkSize, size - offset);
+    if(!pwriteAll(fd, data + offset, length, offset, error))
+      return false;
+  }
+
+  if(sync && fdatasync(fd) != 0) {
+    error = strerror(errno);
+    return false;
+  }
+
+  return true;
+}
+
+bool AsyncFITSWriter::writeIOUring(int fd, const char * data, size_t size, bool sync, std::string & error) {
+#ifdef HAVE_LIBURING
+  struct io_uring * ring = threadRing();
+  if(ring == nullptr)
+    return writeThreads(fd, data, size, sync, error);
+
+  // Keep up to URING_QUEUE_DEPTH chunk writes in flight at once.
+  size_t num_chunks = (size + mChunkSize - 1) / mChunkSize;
+  size_t next_chunk = 0;
+  size_t inflight = 0;
+  bool ok = true;
+
+  while(next_chunk < num_chunks || inflight > 0) {
+    while(ok && next_chunk < num_chunks && inflight < URING_QUEUE_DEPTH) {
+      struct io_uring_sqe * sqe = io_uring_get_sqe(ring);
+      if(sqe == nullptr)
+        break;
+
+      size_t offset = next_chunk * mChunkSize;
+      size_t length = std::min(mChunkSize, size - offset);
+      io_uring_prep_write(sqe, fd, data + offset, length, offset);
+      io_uring_sqe_set_data(sqe, (void *) (uintptr_t) next_chunk);
+      next_chunk++;
+      inflight++;
+    }
+
+    if(inflight == 0)
+      break;
+
+    int ret = io_uring_submit_and_wait(ring, 1);
+    if(ret < 0 && ret != -EINTR) {
+      error = strerror(-ret);
+      ok = false;
+      break;
+    }
+
+    unsigned head;
+    unsigned count = 0;
+    struct io_uring_cqe * cqe;
+    io_uring_for_each_cqe(ring, head, cqe) {
+      size_t chunk = (uintptr_t) io_uring_cqe_get_data(cqe);
+      size_t offset = chunk * mChunkSize;
+      size_t length = std::min(mChunkSize, size - offset);
+
+      if(cqe->res < 0) {
+        error = strerror(-cqe->res);
+        ok = false;
+      } else if((size_t) cqe->res < length) {
+        // Finish short writes synchronously.
+        ok &= pwriteAll(fd, data + offset + cqe->res, length - cqe->res, offset + cqe->res, error);
+      }
+      count++;
+    }
+    io_uring_cq_advance(ring, count);
+    inflight -= count;
+
+    if(!ok)
+      next_chunk = num_chunks;
+  }
+
+  // The chunks still in flight point into the caller's buffer and file.
+  // Reap them all before returning, so none completes against the next file.
+  while(inflight > 0) {
+    if(io_uring_sq_ready(ring) > 0 && io_uring_submit(ring) < 0 && io_uring_sq_ready(ring) == inflight)
+      break;
+
+    struct io_uring_cqe * cqe;
+    int ret = io_uring_wait_cqe(ring, &cqe);
+    if(ret == -EINTR)
+      continue;
+    if(ret < 0)
+      break;
+    io_uring_cqe_seen(ring, cqe);
+    inflight--;
+  }
+  // The ring failed with chunks it cannot submit. Drop it so their
+  // completions cannot be taken for the next file's.
+  if(inflight > 0)
+    closeThreadRing();
+
+  if(ok && sync) {
+    struct io_uring_sqe * sqe = io_uring_get_sqe(ring);
+    if(sqe == nullptr) {
+      // No room in the submission queue, flush the data directly.
+      if(fdatasync(fd) != 0) {
+        error = strerror(errno);
+        ok = false;
+      }
+    } else {
+      io_uring_prep_fsync(sqe, fd, IORING_FSYNC_DATASYNC);
+      io_uring_submit(ring);
+
+      struct io_uring_cqe * cqe;
+      if(io_uring_wait_cqe(ring, &cqe) == 0) {
+        if(cqe->res < 0) {
+          error = strerror(-cqe->res);
+          ok = false;
+        }
+        io_uring_cqe_seen(ring, cqe);
+      }
+    }
+  }
+
+  return ok;
+#else
+  return writeThreads(fd, data, size, sync, error);
+#endif
+}
@@ -0,0 +1,130 @@
+#ifndef ASYNC_FITS_WRITER_H
+#define ASYNC_FITS_WRITER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "cvfits.hpp"
+
+/// Counters describing the state and performance of an AsyncFITSWriter.
+struct AsyncFITSWriterMetrics {
+  size_t queue_depth = 0;         ///< Files waiting to be serialized or written
+  size_t max_queue_depth = 0;     ///< Most files that were waiting at once
+  size_t inflight_bytes = 0;      ///< Image bytes accepted but not yet on disk
+  size_t files_written = 0;       ///< Files successfully written
+  size_t bytes_written = 0;       ///< Bytes successfully written
+  size_t errors = 0;              ///< Files that failed to write
+  double last_latency_ms = 0;     ///< Enqueue to close latency of the most recent file
+  double mean_latency_ms = 0;     ///< Mean enqueue to close latency
+  double max_latency_ms = 0;      ///< Worst enqueue to close latency
+  double producer_wait_ms = 0;    ///< Total time producers were blocked by backpressure
+  std::string last_error = "";    ///< Description of the most recent failure
+};
+
+/// Writes FITS files from background threads so that disk I/O does not stall acquisition.
+///
+/// Each file is serialized into a preallocated memory buffer, the file size is
+/// reserved on disk with fallocate, and the buffer is written in large aligned
+/// chunks either with pwrite from a thread pool or through io_uring when the
+/// library was built with liburing.
+class AsyncFITSWriter {
+
+public:
+  /// How file data is submitted to the kernel.
+  enum Backend {
+    BACKEND_THREADS,  ///< Blocking pwrite calls from a pool of worker threads.
+    BACKEND_IO_URING, ///< Batched io_uring submissions from each worker thread.
+  };
+
+  /// When file data is forced to stable storage.
+  enum SyncPolicy {
+    SYNC_NONE,  ///< Leave flushing to the kernel.
+    SYNC_FILE,  ///< fdatasync every file before closing it.
+    SYNC_BATCH, ///< Keep files open and fdatasync them sync_batch files at a time.
+  };
+
+protected:
+  struct Job {
+    CVFITS image;
+    std::string filename;
+    bool overwrite = false;
+    size_t image_bytes = 0;
+    std::chrono::steady_clock::time_point t_enqueue;
+  };
+
+  Backend mBackend = BACKEND_THREADS;
+  SyncPolicy mSyncPolicy = SYNC_BATCH;
+  int mSyncBatch = 10;
+  size_t mMaxInflightBytes = 0;
+  size_t mChunkSize = 4 << 20;
+
+  std::function<void(const std::string &, bool)> mOnWritten;
+
+  std::vector<std::thread> mThreads;
+  std::deque<Job> mQueue;
+  bool mStopping = false;
+
+  mutable std::mutex mMutex;
+  std::condition_variable mQueueCondition;   ///< Signals workers that jobs are available.
+  std::condition_variable mSpaceCondition;   ///< Signals producers that in-flight bytes were released.
+  AsyncFITSWriterMetrics mMetrics;
+  double mTotalLatencyMs = 0;
+
+  /// Files of the current SYNC_BATCH batch, kept open until they are synced.
+  std::vector<std::pair<int, std::string>> mUnsynced;
+
+  void workerLoop();
+  void syncFiles(const std::vector<std::pair<int, std::string>> & files);
+  bool writeFile(const std::string & filename, bool overwrite, const char * data, size_t size, std::string & error);
+  bool writeThreads(int fd, const char * data, size_t size, bool sync, std::string & error);
+  bool writeIOUring(int fd, const char * data, size_t size, bool sync, std::string & error);
+
+public:
+  /// Starts the writer threads.
+  /// \param backend Requested backend. Falls back to BACKEND_THREADS if io_uring is unavailable.
+  /// \param num_threads Number of worker threads.
+  /// \param max_inflight_bytes Producers block once this many image bytes are queued. 0 disables backpressure.
+  /// \param sync_policy When to force data to stable storage.
+  /// \param sync_batch Number of files between syncs for SYNC_BATCH.
+  AsyncFITSWriter(Backend backend = BACKEND_THREADS, int num_threads = 2, size_t max_inflight_bytes = 256 << 20,
+                  SyncPolicy sync_policy = SYNC_BATCH, int sync_batch = 10);
+
+  /// Drains the queue and stops the writer threads.
+  ~AsyncFITSWriter();
+
+  /// Sets a function called from a writer thread after each file is closed,
+  /// with the file name and whether it was written successfully. Set it
+  /// before the first enqueue.
+  void setWrittenCallback(std::function<void(const std::string & filename, bool ok)> callback) { mOnWritten = callback; }
+
+  /// Queues an image for writing. The pixel data is copied so the caller may reuse its buffers.
+  /// Blocks while the in-flight byte limit is exceeded.
+  /// \param image Image and metadata to write.
+  /// \param filename Name of the output file.
+  /// \param overwrite Whether or not the file should overwrite an existing image.
+  void enqueue(const CVFITS & image, const std::string & filename, bool overwrite = false);
+
+  /// Blocks until every queued file has been written.
+  void flush();
+
+  /// Drains the queue, syncs the files of an incomplete batch, and stops the writer threads.
+  void close();
+
+  /// Returns a snapshot of the writer metrics.
+  AsyncFITSWriterMetrics metrics() const;
+
+  /// Returns the backend actually in use.
+  Backend backend() const { return mBackend; }
+
+  /// Returns true if the io_uring backend was compiled in.
+  static bool ioUringAvailable();
+};
+
+#endif // ASYNC_FITS_WRITER_H
@@ -1,5 +1,7 @@
 // system includes
 #include <cmath>
+#include <cstdio>
+#include <cstdlib>
 #include <ctgmath>
 #include <iomanip>
 #include <sstream>
@@ -89,6 +91,35 @@ namespace CoordinateConversion {
     return ss.str();
   }
 
+  /// Parses "<sign><a><sep1> <b><sep2> <c><sep3>" into sign * (a + b/60 + c/3600).
+  bool ParseSexagesimal(const std::string & text, char sep1, char sep2, double & value) {
+    int a = 0, b = 0, c = 0;
+    char s1 = 0, s2 = 0;
+    if(sscanf(text.c_str(), " %d%c %d%c %d", &a, &s1, &b, &s2, &c) != 5 || s1 != sep1 || s2 != sep2)
+      return false;
+
+    // The sign belongs to the whole angle, including -0d.
+    bool negative = (text.find('-') != std::string::npos);
+    value = std::abs(a) + double(b) / 60 + double(c) / 3600;
+    if(negative)
+      value = -value;
+    return true;
+  }
+
+  bool DMSToRad(const std::string & text, double & value) {
+    if(!ParseSexagesimal(text, 'd', 'm', value))
+      return false;
+    value = value * M_PI / 180.0;
+    return true;
+  }
+
+  bool HMSToRad(const std::string & text, double & value) {
+    if(!ParseSexagesimal(text, 'h', 'm', value))
+      return false;
+    value = value * M_PI / 12.0;
+    return true;
+  }
+
   double AsecToRad(double value) { return value / 206265; }
 
   double RadToAsec(double value) { return value * 206265; }
@@ -24,6 +24,12 @@ namespace CoordinateConversion {
 
   std::string RadToHMS(double value);
 
+  /// Parses an angle written by RadToDMS, e.g. "-12d 34m 56s". Returns false if it is malformed.
+  bool DMSToRad(const std::string & text, double & value);
+
+  /// Parses an angle written by RadToHMS, e.g. "+01h 02m 03s". Returns false if it is malformed.
+  bool HMSToRad(const std::string & text, double & value);
+
   //
 }; // namespace CoordinateConversion
 
@@ -3,15 +3,92 @@
 #include "cvfits.hpp"
 #include "datetime_utilities.hpp"
 #include "coordinate_conversions.hpp"
+#include "fits_checksum.hpp"
+#include "fits_encoding.hpp"
 
 // system includes
 #include <fitsio2.h>
 #include <math.h>
+#include <stdlib.h>
 #include <algorithm>
+#include <cstring>
 #include <opencv2/core.hpp>
 
+/// Value of the CHECKSUM card while the header is summed.
+static const char * FITS_CHECKSUM_ZERO = "0000000000000000";
+static const char * CHECKSUM_COMMENT = "HDU checksum";
+static const char * DATASUM_COMMENT = "data unit checksum";
+
+/// Keywords written after the data unit, not counting streaks.
+static const int FITS_RESERVED_KEYS = 48;
+
+/// Bytes converted to FITS order and summed before they are handed to CFITSIO.
+/// Small enough that the checksum reads them back from the cache.
+static const size_t FITS_WRITE_CHUNK = 16 * FITS_BLOCK_SIZE;
+
+/// Writes the image into the data unit of the current HDU, one plane per channel,
+/// starting offset bytes into the data unit. Pixels are converted to FITS order a chunk at a time, and each chunk is
+/// added to the checksum while it is still in the cache.
+template <typename T>
+static void writePlanes(fitsfile * fptr, const cv::Mat & image, int planes, LONGLONG offset,
+                        FITSChecksum & checksum, int * status) {
+  LONGLONG headstart = 0;
+  LONGLONG datastart = 0;
+  LONGLONG dataend = 0;
+  fits_get_hduaddrll(fptr, &headstart, &datastart, &dataend, status);
+  ffmbyt(fptr, datastart + offset, IGNORE_EOF, status);
+
+  const int channels = image.channels();
+  const size_t row_bytes = image.cols * sizeof(T);
+  std::vector<uint8_t> chunk(std::max(FITS_WRITE_CHUNK, row_bytes));
+  size_t used = 0;
+
+  auto flush = [&]() {
+    checksum.update(chunk.data(), used);
+    ffpbyt(fptr, used, chunk.data(), status);
+    used = 0;
+  };
+
+  // NOTE: OpenCV stores data in BGR order.
+  for(int c = 0; c < planes && *status == 0; c++) {
+    for(int y = 0; y < image.rows; y++) {
+      if(used + row_bytes > chunk.size())
+        flush();
+
+      // Rows are whole multiples of the pixel size, so the output stays aligned.
+      encodeFITSRow(image.ptr<T>(y), image.cols, channels, c,
+                    reinterpret_cast<decltype(toFITS(T())) *>(chunk.data() + used));
+      used += row_bytes;
+    }
+  }
+  flush();
+}
+
+/// Reads a keyword that may be missing. Returns false, leaving value unchanged, if it is.
+static bool readOptionalKey(fitsfile * fptr, int datatype, const char * name, void * value, int * status) {
+  if(*status != 0)
+    return false;
+
+  fits_read_key(fptr, datatype, name, value, nullptr, status);
+  if(*status == KEY_NO_EXIST) {
+    *status = 0;
+    return false;
+  }
+
+  return *status == 0;
+}
+
+static bool readOptionalKey(fitsfile * fptr, const char * name, std::string & value, int * status) {
+  char text[FLEN_VALUE] = {0};
+  if(!readOptionalKey(fptr, TSTRING, name, text, status))
+    return false;
+
+  value = text;
+  return true;
+}
+
 CVFITS::CVFITS(std::string filename) {
-  fitsfile * fptr;
+  fitsfile * fptr = nullptr;
   int status = 0;
   int nfound = 1;
   long naxes[3] = {0, 0, 0};
@@ -29,72 +106,218 @@ CVFITS::CVFITS(std::string filename) {
 
   int nelements = width * height;
 
+  // 8-bit files stay 8-bit, floating point files such as calibration masters
+  // are read as float, everything else is read as 16-bit.
+  int bitpix = USHORT_IMG;
+  fits_get_img_equivtype(fptr, &bitpix, &status);
+  int cv_depth = CV_16U;
+  int datatype = TUSHORT;
+  if(bitpix == BYTE_IMG) {
+    cv_depth = CV_8U;
+    datatype = TBYTE;
+  } else if(bitpix == FLOAT_IMG || bitpix == DOUBLE_IMG) {
+    cv_depth = CV_32F;
+    datatype = TFLOAT;
+  }
+
   // Read in the image
-  if(naxes[2] == 1) {
+  if(status != 0) {
+    // Leave the image empty.
+  } else if(naxes[2] <= 1) {
     // single channel image
-    this->image = cv::Mat(height, width, CV_16UC1);
-    fits_read_img(fptr, TUSHORT, 1, nelements, &nullval, this->image.ptr(), &anynull, &status);
+    this->image = cv::Mat(height, width, CV_MAKETYPE(cv_depth, 1));
+    fits_read_img(fptr, datatype, 1, nelements, &nullval, this->image.ptr(), &anynull, &status);
 
   } else {
     // multi-channel image
     std::vector<cv::Mat> channels;
     for(int i = 0; i < depth; i++)
-      channels.push_back(cv::Mat(height, width, CV_16UC1));
+      channels.push_back(cv::Mat(height, width, CV_MAKETYPE(cv_depth, 1)));
 
     for(int i = 0; i < depth; i++) {
       long fpixel[3] = {1, 1, 1+i};
-      fits_read_pix(fptr, TUSHORT, fpixel, nelements, &nullval, channels[i].ptr(), &anynull, &status);
+      fits_read_pix(fptr, datatype, fpixel, nelements, &nullval, channels[i].ptr(), &anynull, &status);
     }
 
     cv::merge(channels, this->image);
   }
- }
+
+  //
+  // Read back the keywords written by writeKeys.
+  //
+  readOptionalKey(fptr, "DETNAME", detector_name, &status);
+  readOptionalKey(fptr, TDOUBLE, "TEMP", &temperature, &status);
+  readOptionalKey(fptr, "BINNING", bin_mode_name, &status);
+  readOptionalKey(fptr, TINT, "XBINNING", &xbinning, &status);
+  readOptionalKey(fptr, TINT, "YBINNING", &ybinning, &status);
+
+  std::string date;
+  if(readOptionalKey(fptr, "DATE-BEG", date, &status) || readOptionalKey(fptr, "DATE-OBS", date, &status))
+    from_iso_8601(date, exposure_start);
+  if(readOptionalKey(fptr, "DATE-END", date, &status))
+    from_iso_8601(date, exposure_end);
+
+  readOptionalKey(fptr, TDOUBLE, "EXPTIME", &exposure_duration_sec, &status);
+  readOptionalKey(fptr, "FILTER", filter_name, &status);
+  readOptionalKey(fptr, TDOUBLE, "GAIN", &gain, &status);
+  readOptionalKey(fptr, "CATALOG", catalog_name, &status);
+  readOptionalKey(fptr, "OBJECT", object_name, &status);
+
+  // writeKeys stores the latitude in TELLONG and the longitude in TELLAT.
+  if(readOptionalKey(fptr, TDOUBLE, "TELLONG", &latitude, &status))
+    latitude *= M_PI / 180.0;
+  if(readOptionalKey(fptr, TDOUBLE, "TELLAT", &longitude, &status))
+    longitude *= M_PI / 180.0;
+  readOptionalKey(fptr, TDOUBLE, "TELALT", &altitude, &status);
+
+  std::string ra_str, dec_str;
+  if(readOptionalKey(fptr, "RA", ra_str, &status) && readOptionalKey(fptr, "DEC", dec_str, &status))
+    ra_dec_set = CoordinateConversion::HMSToRad(ra_str, ra) && CoordinateConversion::DMSToRad(dec_str, dec);
+  if(!ra_dec_set && readOptionalKey(fptr, TDOUBLE, "AZM", &azm, &status) &&
+     readOptionalKey(fptr, TDOUBLE, "ALT", &alt, &status)) {
+    azm *= M_PI / 180.0;
+    alt *= M_PI / 180.0;
+    azm_alt_set = true;
+  }
+
+  star_stats_set = readOptionalKey(fptr, TINT, "NSTARS", &nstars, &status);
+  readOptionalKey(fptr, TDOUBLE, "FWHM", &fwhm, &status);
+  readOptionalKey(fptr, TDOUBLE, "BKGMEAN", &bkg_mean, &status);
+  readOptionalKey(fptr, TDOUBLE, "BKGRMS", &bkg_rms, &status);
+
+  // Carry the processing history forward.
+  int num_keys = 0;
+  fits_get_hdrspace(fptr, &num_keys, nullptr, &status);
+  for(int i = 1; i <= num_keys && status == 0; i++) {
+    char card[FLEN_CARD] = {0};
+    fits_read_record(fptr, i, card, &status);
+    if(strncmp(card, "HISTORY ", 8) == 0) {
+      std::string line(card + 8);
+      line.erase(line.find_last_not_of(' ') + 1);
+      history.push_back(line);
+    }
+  }
+
+  if(fptr) {
+    int close_status = 0;
+    fits_close_file(fptr, &close_status);
+  }
+
+  if(status != 0)
+    this->image.release();
+}
 
 void CVFITS::saveToFITS(std::string filename, bool overwrite) {
 
   fitsfile * fptr;
   int status = 0;
 
+  // open the file
+  fits_create_file(&fptr, filename.c_str(), &status);
+
+  writeHDU(fptr, &status);
+
+  // close the file
+  fits_close_file(fptr, &status);
+}
+
+size_t CVFITS::estimateFileSize() const {
+  // Reserve four header blocks, enough for every keyword we write, then pad
+  // the data unit out to a full FITS block.
+  size_t header_size = 4 * FITS_BLOCK_SIZE;
+
+  // Each streak adds seven keywords of 80 characters, each history line one.
+  size_t num_streaks = std::min(streaks.size(), FITS_MAX_STREAKS);
+  header_size += ((num_streaks * 7 + history.size()) * 80 + FITS_BLOCK_SIZE - 1) / FITS_BLOCK_SIZE * FITS_BLOCK_SIZE;
+  size_t data_size = this->image.total() * this->image.elemSize();
+  data_size = (data_size + FITS_BLOCK_SIZE - 1) / FITS_BLOCK_SIZE * FITS_BLOCK_SIZE;
+
+  return header_size + data_size;
+}
+
+size_t CVFITS::saveToMemory(void ** buffer) {
+
+  fitsfile * fptr;
+  int status = 0;
+  LONGLONG headstart = 0;
+  LONGLONG datastart = 0;
+  LONGLONG dataend = 0;
+
+  // Preallocate the buffer so CFITSIO does not need to grow it while writing.
+  size_t buffer_size = estimateFileSize();
+  *buffer = malloc(buffer_size);
+
+  fits_create_memfile(&fptr, buffer, &buffer_size, FITS_BLOCK_SIZE, realloc, &status);
+
+  writeHDU(fptr, &status);
+
+  // The memory driver reports the allocated size, the file ends at the first
+  // block boundary after the data unit.
+  fits_flush_file(fptr, &status);
+  fits_get_hduaddrll(fptr, &headstart, &datastart, &dataend, &status);
+
+  // close the file. The memory driver leaves the buffer allocated.
+  fits_close_file(fptr, &status);
+
+  if(status != 0) {
+    free(*buffer);
+    *buffer = nullptr;
+    return 0;
+  }
+
+  return (dataend + FITS_BLOCK_SIZE - 1) / FITS_BLOCK_SIZE * FITS_BLOCK_SIZE;
+}
+
+void CVFITS::writeHDU(fitsfile * fptr, int * status) {
+
+  createHDU(fptr, 0, status);
+
+  // Write the pixels, summing them on the way out.
+  FITSChecksum datasum;
+  writeData(fptr, 0, datasum, status);
+
+  writeKeys(fptr, status);
+  writeChecksum(fptr, datasum.sum(), status);
+}
+
+void CVFITS::createHDU(fitsfile * fptr, long planes, int * status) {
+
   long width = this->image.cols;
   long height = this->image.rows;
   long depth = this->image.channels();
 
+  // Pick the FITS pixel type matching the image depth.
   int bitpix = USHORT_IMG;
-  long naxis = 2;
-
-  if(depth == 3)
-    naxis = 3;
+  if(this->image.depth() == CV_8U)
+    bitpix = BYTE_IMG;
+  else if(this->image.depth() == CV_32F)
+    bitpix = FLOAT_IMG;
 
   std::vector<long> naxes;
   naxes.push_back(width);
   naxes.push_back(height);
 
-  if(naxis == 3)
+  if(depth == 3)
     naxes.push_back(depth);
 
-  int nelements = width * height;
+  if(planes > 0)
+    naxes.push_back(planes);
 
-  // open the file
-  fits_create_file(&fptr, filename.c_str(), &status);
+  fits_create_img(fptr, bitpix, naxes.size(), naxes.data(), status);
 
-  if(depth > 1) {
-    // split the image channels, write them out to the image independently.
-    std::vector<cv::Mat> channels;
-    cv::split(this->image, channels);
+  // Reserve room for the keywords written after the data. Otherwise CFITSIO
+  // moves the whole data unit whenever the header grows by a block.
+  size_t num_streaks = streaks_set ? std::min(streaks.size(), FITS_MAX_STREAKS) : 0;
+  fits_set_hdrsize(fptr, FITS_RESERVED_KEYS + 7 * (int) num_streaks + (int) history.size(), status);
 
-    // Write out each channel independently.
-    // NOTE: OpenCV stores data in BGR order.
-    fits_create_img(fptr, bitpix, naxis, naxes.data(), &status);
-    for(int i = 0; i < depth; i++) {
-      long fpixel[3] = {1, 1, 1+i};
-      fits_write_pix(fptr, TUSHORT, fpixel, nelements, channels[i].ptr(), &status);
-    }
+  // Reserve the checksum cards. They are filled in once the HDU is complete.
+  fits_write_key(fptr, TSTRING, "CHECKSUM", (void *) FITS_CHECKSUM_ZERO, CHECKSUM_COMMENT, status);
+  fits_write_key(fptr, TSTRING, "DATASUM", (void *) "0", DATASUM_COMMENT, status);
+}
 
-  } else {
-    // single channel image, write it out.
-    fits_create_img(fptr, bitpix, naxis, naxes.data(), &status);
-    fits_write_img(fptr, TUSHORT, 1, nelements, this->image.data, &status);
-  }
+void CVFITS::writeKeys(fitsfile * fptr, int * status) {
+
+  long depth = this->image.channels();
 
   //
   // Information about the detector
@@ -102,37 +325,37 @@ void CVFITS::saveToFITS(std::string filename, bool overwrite) {
   fits_write_key(fptr, TSTRING, "DETNAME",
                  (void *) detector_name.c_str(),
                  "Name of detector used to make the observation",
-                 &status);
+                 status);
 
   fits_write_key(fptr, TDOUBLE, "TEMP",
                  (void *) &temperature,
                  "Temperature of sensor in Celsius",
-                 &status);
+                 status);
 
   fits_write_key(fptr, TSTRING, "BINNING",
                  (void *) bin_mode_name.c_str(),
                  "Binning mode for the camera",
-                 &status);
+                 status);
 
   fits_write_key(fptr, TUINT, "XBINNING",
                  (void *) &xbinning,
                  "Bnning factor used on X axis",
-                 &status);
+                 status);
 
   fits_write_key(fptr, TUINT, "YBINNING",
                  (void *) &ybinning,
                  "Bnning factor used on Y axis",
-                 &status);
+                 status);
 
   // Write color channel information for tri-color images.
   if(depth == 3) {
-    fits_write_key(fptr, TSTRING, "CSPACE",  (void*) "RGB", "Colorspace of stored images", &status);
-    fits_write_key(fptr, TSTRING, "CTYPE3",  (void*) "BAND-SET", "Type of color part in 4-3 notation", &status);
-    fits_write_key(fptr, TSTRING, "CNAME3",  (void*) "Color-Space", "Description", &status);
+    fits_write_key(fptr, TSTRING, "CSPACE",  (void*) "RGB", "Colorspace of stored images", status);
+    fits_write_key(fptr, TSTRING, "CTYPE3",  (void*) "BAND-SET", "Type of color part in 4-3 notation", status);
+    fits_write_key(fptr, TSTRING, "CNAME3",  (void*) "Color-Space", "Description", status);
     // NOTE: OpenCV stores images in BGR order.
-    fits_write_key(fptr, TSTRING, "CSBAND1", (void*) "Blue", "Color Band for Channel 1", &status);
-    fits_write_key(fptr, TSTRING, "CSBAND2", (void*) "Green", "Color Band for Channel 2", &status);
-    fits_write_key(fptr, TSTRING, "CSBAND3", (void*) "Red", "Color Band for Channel 3", &status);
+    fits_write_key(fptr, TSTRING, "CSBAND1", (void*) "Blue", "Color Band for Channel 1", status);
+    fits_write_key(fptr, TSTRING, "CSBAND2", (void*) "Green", "Color Band for Channel 2", status);
+    fits_write_key(fptr, TSTRING, "CSBAND3", (void*) "Red", "Color Band for Channel 3", status);
   }
 
   //
@@ -140,38 +363,38 @@ void CVFITS::saveToFITS(std::string filename, bool overwrite) {
   //
   std::string t_start = to_iso_8601(exposure_start);
   fits_write_key(fptr, TSTRING, "DATE-OBS", (void *)t_start.c_str(),
-                 "ISO-8601 date-time for start exposure", &status);
+                 "ISO-8601 date-time for start exposure", status);
 
   fits_write_key(fptr, TSTRING, "DATE-BEG",
                  (void*)t_start.c_str(),
-                 "ISO-8601 date-time for start exposure", &status);
+                 "ISO-8601 date-time for start exposure", status);
 
   std::string t_end = to_iso_8601(exposure_end);
   fits_write_key(fptr, TSTRING, "DATE-END",
                  (void *)t_end.c_str(),
                  "ISO-8601 date-time for end exposure",
-                 &status);
+                 status);
 
   std::string t = std::to_string(exposure_duration_sec);
   fits_write_key(fptr, TDOUBLE, "EXPTIME",
                  (void*) &exposure_duration_sec,
                  "Duration of exposure in seconds",
-                 &status);
+                 status);
 
   fits_write_key(fptr, TSTRING, "FILTER",
                  (void*) filter_name.c_str(),
                  "Name of photometric filter used",
-                 &status);
+                 status);
 
   fits_write_key(fptr, TDOUBLE, "GAIN",
                  (void*) &gain,
                  "Camera Gain Setting",
-                 &status);
+                 status);
 
   fits_write_key(fptr, TDOUBLE, "EGAIN",
                  (void*) &gain,
                  "Camera Gain Setting",
-                 &status);
+                 status);
 
 
   //
@@ -180,14 +403,14 @@ void CVFITS::saveToFITS(std::string filename, bool overwrite) {
   fits_write_key(fptr, TSTRING, "CATALOG",
                  (void *) catalog_name.c_str(),
                  "Name of catalog to which the object belongs",
-                 &status);
+                 status);
 
   // Replace any underscores in the name with spaces.
   std::replace(object_name.begin(), object_name.end(), '_', ' ');
   fits_write_key(fptr, TSTRING, "OBJECT",
                  (void *) object_name.c_str(),
                  "Name of object from the catalog.",
-                 &status);
+                 status);
 
   //
   // Latitude, Longitude, and Altitude
@@ -197,16 +420,16 @@ void CVFITS::saveToFITS(std::string filename, bool overwrite) {
   fits_write_key(fptr, TDOUBLE, "TELLONG",
                  (void *) &t_latitude,
                  "Latitude of observatory (degrees).",
-                 &status);
+                 status);
   double t_longitude = longitude * 180.0 / M_PI;
   fits_write_key(fptr, TDOUBLE, "TELLAT",
                  (void *) &t_longitude,
                  "Longitude of observatory (degrees)",
-                 &status);
+                 status);
   fits_write_key(fptr, TDOUBLE, "TELALT",
                  (void *) &altitude,
                  "Altitude of observatory (meters)",
-                 &status);
+                 status);
 
   //
   // Image coordinate information.
@@ -217,12 +440,12 @@ void CVFITS::saveToFITS(std::string filename, bool overwrite) {
     fits_write_key(fptr, TSTRING, "RA",
                    (void *) ra_str.c_str(),
                    "Approximate RA of image center (HH:MM:SS.zzz)",
-                   &status);
+                   status);
 
     fits_write_key(fptr, TSTRING, "DEC",
                    (void *) dec_str.c_str(),
                    "Approximate DEC of image center (DD:MM:SS.zzz)",
-                   &status);
+                   status);
   } else if (azm_alt_set) {
 
     azm *= 180 / M_PI;
@@ -230,14 +453,113 @@ void CVFITS::saveToFITS(std::string filename, bool overwrite) {
     fits_write_key(fptr, TDOUBLE, "AZM",
                    (void *) &azm,
                    "Approximate AZM of image center (deg)",
-                   &status);
+                   status);
 
     fits_write_key(fptr, TDOUBLE, "ALT",
                    (void *) &alt,
                    "Approximate ALT of image center (deg)",
-                   &status);
+                   status);
   }
 
-  // close the file
-  fits_close_file(fptr, &status);
-}
\ No newline at end of file
+  //
+  // Image quality information.
+  //
+  if(star_stats_set) {
+    fits_write_key(fptr, TINT, "NSTARS",
+                   (void *) &nstars,
+                   "Number of stars detected",
+                   status);
+    fits_write_key(fptr, TDOUBLE, "FWHM",
+                   (void *) &fwhm,
+                   "Median FWHM of detected stars (pixels)",
+                   status);
+    fits_write_key(fptr, TDOUBLE, "BKGMEAN",
+                   (void *) &bkg_mean,
+                   "Mean sky background (ADU)",
+                   status);
+    fits_write_key(fptr, TDOUBLE, "BKGRMS",
+                   (void *) &bkg_rms,
+                   "RMS of the sky background (ADU)",
+                   status);
+  }
+
+  //
+  // Processing history
+  //
+  for(const std::string & line : history)
+    fits_write_history(fptr, line.c_str(), status);
+
+  //
+  // Streak information. The first FITS_MAX_STREAKS streaks are described
+  // by STKnX1, STKnY1, STKnX2, STKnY2, STKnLEN, STKnANG and STKnFLX.
+  //
+  if(streaks_set) {
+    int num_streaks = streaks.size();
+    fits_write_key(fptr, TINT, "NSTREAKS",
+                   (void *) &num_streaks,
+                   "Number of streaks detected",
+                   status);
+
+    for(size_t i = 0; i < streaks.size() && i < FITS_MAX_STREAKS; i++) {
+      Streak & streak = streaks[i];
+      std::string prefix = "STK" + std::to_string(i + 1);
+      fits_write_key(fptr, TDOUBLE, (prefix + "X1").c_str(), (void *) &streak.x1,
+                     "Streak first endpoint X (pixels)", status);
+      fits_write_key(fptr, TDOUBLE, (prefix + "Y1").c_str(), (void *) &streak.y1,
+                     "Streak first endpoint Y (pixels)", status);
+      fits_write_key(fptr, TDOUBLE, (prefix + "X2").c_str(), (void *) &streak.x2,
+                     "Streak second endpoint X (pixels)", status);
+      fits_write_key(fptr, TDOUBLE, (prefix + "Y2").c_str(), (void *) &streak.y2,
+                     "Streak second endpoint Y (pixels)", status);
+      fits_write_key(fptr, TDOUBLE, (prefix + "LEN").c_str(), (void *) &streak.length,
+                     "Streak length (pixels)", status);
+      fits_write_key(fptr, TDOUBLE, (prefix + "ANG").c_str(), (void *) &streak.angle,
+                     "Streak angle from +X towards +Y (deg)", status);
+      fits_write_key(fptr, TDOUBLE, (prefix + "FLX").c_str(), (void *) &streak.flux,
+                     "Streak background subtracted flux (ADU)", status);
+    }
+  }
+}
+
+void CVFITS::writeData(fitsfile * fptr, LONGLONG offset, FITSChecksum & checksum, int * status) {
+  if(*status != 0)
+    return;
+
+  // Only 3-channel images are written as cubes.
+  int planes = (this->image.channels() == 3) ? 3 : 1;
+
+  switch(this->image.depth()) {
+    case CV_8U:
+      writePlanes<uint8_t>(fptr, this->image, planes, offset, checksum, status);
+      break;
+    case CV_32F:
+      writePlanes<float>(fptr, this->image, planes, offset, checksum, status);
+      break;
+    default:
+      writePlanes<uint16_t>(fptr, this->image, planes, offset, checksum, status);
+  }
+}
+
+void CVFITS::writeChecksum(fitsfile * fptr, uint32_t datasum, int * status) {
+  LONGLONG headstart = 0;
+  LONGLONG datastart = 0;
+  LONGLONG dataend = 0;
+
+  std::string datasum_str = std::to_string(datasum);
+  fits_update_key(fptr, TSTRING, "DATASUM", (void *) datasum_str.c_str(), DATASUM_COMMENT, status);
+
+  // Close the header so its size is final, then sum it with the data.
+  // Only the header blocks are read back.
+  fits_set_hdustruc(fptr, status);
+  fits_get_hduaddrll(fptr, &headstart, &datastart, &dataend, status);
+  if(*status != 0)
+    return;
+
+  unsigned long sum = datasum;
+  ffmbyt(fptr, headstart, REPORT_EOF, status);
+  ffcsum(fptr, (long) ((datastart - headstart) / FITS_BLOCK_SIZE), &sum, status);
+
+  char checksum[FLEN_VALUE];
+  fits_encode_chksum(sum, TRUE, checksum);
+  fits_update_key(fptr, TSTRING, "CHECKSUM", (void *) checksum, CHECKSUM_COMMENT, status);
+}
@@ -3,9 +3,30 @@
 
 #include <chrono>
 #include <string>
+#include <vector>
 
+#include <fitsio.h>
 #include <opencv2/core/mat.hpp>
 
+#include "fits_checksum.hpp"
+
+/// Size of a FITS header or data block in bytes.
+const size_t FITS_BLOCK_SIZE = 2880;
+
+/// Largest number of streaks described in the FITS header.
+const size_t FITS_MAX_STREAKS = 20;
+
+/// A linear streak, such as a satellite or debris track, found in an image.
+struct Streak {
+  double x1 = 0; ///< X coordinate of the first endpoint (pixels)
+  double y1 = 0; ///< Y coordinate of the first endpoint (pixels)
+  double x2 = 0; ///< X coordinate of the second endpoint (pixels)
+  double y2 = 0; ///< Y coordinate of the second endpoint (pixels)
+  double length = 0; ///< Length of the streak (pixels)
+  double angle = 0;  ///< Angle from the +X axis towards +Y, in [0, 180) degrees
+  double flux = 0;   ///< Background subtracted flux along the streak (ADU)
+};
+
 /// A class for storing and managing image data.
 class CVFITS {
 
@@ -59,20 +80,65 @@ public:
 
   double gain = 1.0;  ///< Camera gain setting.
 
+  // image quality
+  bool star_stats_set = false; ///< Whether or not the star statistics are set.
+  int nstars      = 0; ///< Number of stars detected in the image.
+  double fwhm     = 0; ///< Median FWHM of the detected stars (pixels).
+  double bkg_mean = 0; ///< Mean sky background (ADU).
+  double bkg_rms  = 0; ///< RMS of the sky background (ADU).
+
+  bool streaks_set = false; ///< Whether or not streak detection was run on the image.
+  std::vector<Streak> streaks; ///< Streaks found in the image.
+
+  std::vector<std::string> history; ///< Processing steps, written as HISTORY cards.
+
 public:
   /// Default constructor.
   CVFITS() {}
 
+  /// Reads an image and the keywords written by saveToFITS.
+  /// \param filename Name of the FITS file. The image is left empty if it cannot be read.
   CVFITS(std::string filename);
 
   /// Default destruct.
   ~CVFITS() {}
 
-  /// Saves the file to a FITS image.
+  /// Saves the file to a FITS image. The HDU carries DATASUM and CHECKSUM
+  /// keywords, computed while the pixels are written.
   /// \param filename Name of the output file.
   /// \param overwrite Whether or not the file should overwrite an existing image.
   void saveToFITS(std::string filename, bool overwrite = false);
 
+  /// Saves the image to an in-memory FITS file.
+  /// \param buffer Returns a malloc'd buffer holding the file. The caller must free() it.
+  /// \return The size of the FITS file in bytes, or 0 on failure.
+  size_t saveToMemory(void ** buffer);
+
+  /// Estimates the size of the FITS file produced for this image, rounded up to whole blocks.
+  size_t estimateFileSize() const;
+
+protected:
+  /// Writes the image and its keywords into a new HDU of an open file.
+  /// \param fptr Open CFITSIO file.
+  /// \param status CFITSIO status variable.
+  void writeHDU(fitsfile * fptr, int * status);
+
+  /// Creates an image HDU sized for this image and reserves its header space.
+  /// \param planes If non-zero, the HDU is a cube of this many images along an extra last axis.
+  void createHDU(fitsfile * fptr, long planes, int * status);
+
+  /// Writes the exposure, site and image quality keywords.
+  void writeKeys(fitsfile * fptr, int * status);
+
+  /// Writes the pixels into the data unit of the current HDU and adds them to the checksum.
+  /// \param offset Position in the data unit, in bytes, of the first pixel.
+  void writeData(fitsfile * fptr, LONGLONG offset, FITSChecksum & checksum, int * status);
+
+  /// Fills in the reserved DATASUM and CHECKSUM cards of the current HDU.
+  /// \param datasum Checksum of the data unit, as computed while it was written.
+  static void writeChecksum(fitsfile * fptr, uint32_t datasum, int * status);
+
+  friend class FITSSequenceWriter;
   //
 };
 
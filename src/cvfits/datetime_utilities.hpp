@@ -1,7 +1,9 @@
 #ifndef DATETIME_UTILITIES_H
 #define DATETIME_UTILITIES_H
 
+#include <cctype>
 #include <chrono>
+#include <ctime>
 #include <string>
 #include <sstream>
 #include <iomanip>
@@ -35,4 +37,29 @@ inline std::string to_iso_8601(std::chrono::time_point<std::chrono::system_clock
 	return stream.str();
 }
 
+/// Parses a date-time written by to_iso_8601. The fraction and the trailing 'Z' are optional.
+/// Returns false if the text is not an ISO-8601 date-time.
+inline bool from_iso_8601(const std::string & text, std::chrono::time_point<std::chrono::system_clock> & t) {
+
+	std::tm tm = {};
+	std::istringstream stream(text);
+	stream >> std::get_time(&tm, "%Y-%m-%dT%H:%M:%S");
+	if(stream.fail())
+		return false;
+
+	// Fractional seconds, at up to microsecond resolution
+	long long delta_us = 0;
+	if(stream.peek() == '.') {
+		stream.get();
+		long long scale = 100000;
+		while(std::isdigit(stream.peek())) {
+			delta_us += (stream.get() - '0') * scale;
+			scale /= 10;
+		}
+	}
+
+	t = std::chrono::system_clock::from_time_t(timegm(&tm)) + std::chrono::microseconds(delta_us);
+	return true;
+}
+
 #endif // DATETIME_UTILITIES_H
@@ -0,0 +1,86 @@
+#include "fits_checksum.hpp"
+
+#include <cstring>
+
+/// Words summed per block. Each 16-bit lane of the block sums holds at most
+/// 256 * 255 and cannot overflow.
+const size_t CHECKSUM_BLOCK_WORDS = 256;
+
+void FITSChecksum::update(const void * data, size_t size) {
+  const uint8_t * bytes = static_cast<const uint8_t *>(data);
+
+  // Finish a word left incomplete by the previous update.
+  while(size > 0 && (mBytes % 4) != 0) {
+    switch(mBytes % 4) {
+      case 1: mHi += *bytes; break;
+      case 2: mLo += (uint64_t) *bytes << 8; break;
+      case 3: mLo += *bytes; break;
+    }
+    bytes++;
+    mBytes++;
+    size--;
+  }
+
+  // Sum whole words a block at a time. Splitting each word into its even and
+  // odd bytes keeps the inner loop to 32-bit masks, shifts and adds, which the
+  // compiler vectorizes.
+  uint64_t byte_sums[4] = {0, 0, 0, 0};
+  size_t words = size / 4;
+  while(words > 0) {
+    size_t block = (words < CHECKSUM_BLOCK_WORDS) ? words : CHECKSUM_BLOCK_WORDS;
+    uint32_t even = 0;
+    uint32_t odd = 0;
+    for(size_t i = 0; i < block; i++) {
+      uint32_t word;
+      memcpy(&word, bytes + 4 * i, 4);
+      even += word & 0x00FF00FF;
+      odd += (word >> 8) & 0x00FF00FF;
+    }
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    byte_sums[0] += odd >> 16;
+    byte_sums[1] += even >> 16;
+    byte_sums[2] += odd & 0xFFFF;
+    byte_sums[3] += even & 0xFFFF;
+#else
+    byte_sums[0] += even & 0xFFFF;
+    byte_sums[1] += odd & 0xFFFF;
+    byte_sums[2] += even >> 16;
+    byte_sums[3] += odd >> 16;
+#endif
+
+    bytes += 4 * block;
+    mBytes += 4 * block;
+    size -= 4 * block;
+    words -= block;
+  }
+  mHi += (byte_sums[0] << 8) + byte_sums[1];
+  mLo += (byte_sums[2] << 8) + byte_sums[3];
+
+  // Start the next incomplete word.
+  for(size_t i = 0; i < size; i++) {
+    switch(mBytes % 4) {
+      case 0: mHi += (uint64_t) bytes[i] << 8; break;
+      case 1: mHi += bytes[i]; break;
+      case 2: mLo += (uint64_t) bytes[i] << 8; break;
+    }
+    mBytes++;
+  }
+}
+
+uint32_t FITSChecksum::sum() const {
+  // Fold the carries back in, the high half's carry into the low half and
+  // vice versa, as ffcsum does.
+  uint64_t hi = mHi;
+  uint64_t lo = mLo;
+  uint64_t hicarry = hi >> 16;
+  uint64_t locarry = lo >> 16;
+  while(hicarry || locarry) {
+    hi = (hi & 0xFFFF) + locarry;
+    lo = (lo & 0xFFFF) + hicarry;
+    hicarry = hi >> 16;
+    locarry = lo >> 16;
+  }
+
+  return (uint32_t) ((hi << 16) + lo);
+}
@@ -0,0 +1,32 @@
+#ifndef FITS_CHECKSUM_H
+#define FITS_CHECKSUM_H
+
+#include <cstddef>
+#include <cstdint>
+
+/// Running 32-bit ones' complement sum of a FITS data unit, as used by the
+/// DATASUM and CHECKSUM keywords.
+///
+/// Bytes are added in file order, in pieces of any size, while they are
+/// written. This avoids reading the data unit back with fits_write_chksum.
+class FITSChecksum {
+
+protected:
+  uint64_t mHi = 0;     ///< Sum of the high 16-bit halves of each 32-bit word.
+  uint64_t mLo = 0;     ///< Sum of the low 16-bit halves of each 32-bit word.
+  size_t mBytes = 0;    ///< Bytes added so far.
+
+public:
+  /// Adds the next bytes of the data unit.
+  /// \param data Bytes in FITS (big-endian) order.
+  /// \param size Number of bytes.
+  void update(const void * data, size_t size);
+
+  /// \return The ones' complement sum of the bytes added so far, as written to DATASUM.
+  uint32_t sum() const;
+
+  /// \return The number of bytes added so far.
+  size_t bytes() const { return mBytes; }
+};
+
+#endif // FITS_CHECKSUM_H
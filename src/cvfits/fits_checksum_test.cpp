@@ -0,0 +1,178 @@
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <QTemporaryDir>
+
+#include <opencv2/core.hpp>
+
+#include "cvfits.hpp"
+#include "async_fits_writer.hpp"
+#include "fits_checksum.hpp"
+#include "fits_sequence_writer.hpp"
+
+// Writes FITS files through every path that fills in DATASUM and CHECKSUM
+// itself, then has CFITSIO verify them.
+
+namespace {
+int failures = 0;
+
+void check(bool condition, const std::string & what) {
+  if(!condition) {
+    std::cerr << "FAIL: " << what << std::endl;
+    failures++;
+  }
+}
+
+/// Ones' complement sum of 32-bit big-endian words, the data zero padded to a whole word.
+uint32_t referenceSum(const std::vector<uint8_t> & data) {
+  uint64_t sum = 0;
+  for(size_t i = 0; i < data.size(); i += 4) {
+    uint32_t word = 0;
+    for(size_t j = 0; j < 4; j++)
+      word = (word << 8) | (i + j < data.size() ? data[i + j] : 0);
+    sum += word;
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+  }
+  return (uint32_t) sum;
+}
+
+/// A small frame with an odd number of pixels, so no data unit is a whole number of words.
+CVFITS testFrame(int cv_type, int rows, int cols, int seed) {
+  CVFITS frame;
+  frame.image = cv::Mat(rows, cols, cv_type);
+  cv::RNG rng(seed);
+  rng.fill(frame.image, cv::RNG::UNIFORM, 0, CV_MAT_DEPTH(cv_type) == CV_8U ? 256 : 65536);
+  frame.detector_name = "test";
+  frame.filter_name = "R";
+  frame.exposure_duration_sec = 1.5 + seed;
+  return frame;
+}
+
+/// Verifies DATASUM and CHECKSUM of every HDU of a file.
+void verifyFile(const std::string & filename, int expected_hdus) {
+  fitsfile * fptr = nullptr;
+  int status = 0;
+  fits_open_file(&fptr, filename.c_str(), READONLY, &status);
+  if(status != 0) {
+    check(false, "open " + filename);
+    return;
+  }
+
+  int num_hdus = 0;
+  fits_get_num_hdus(fptr, &num_hdus, &status);
+  check(num_hdus == expected_hdus, filename + " has " + std::to_string(num_hdus) + " HDUs, expected " +
+        std::to_string(expected_hdus));
+
+  for(int hdu = 1; hdu <= num_hdus && status == 0; hdu++) {
+    int dataok = 0;
+    int hduok = 0;
+    fits_movabs_hdu(fptr, hdu, nullptr, &status);
+    fits_verify_chksum(fptr, &dataok, &hduok, &status);
+    check(status == 0 && dataok == 1, filename + " HDU " + std::to_string(hdu) + " DATASUM");
+    check(status == 0 && hduok == 1, filename + " HDU " + std::to_string(hdu) + " CHECKSUM");
+  }
+
+  fits_close_file(fptr, &status);
+  check(status == 0, "read " + filename);
+}
+
+void testRunningSum() {
+  std::vector<uint8_t> data(1031);
+  for(size_t i = 0; i < data.size(); i++)
+    data[i] = (uint8_t) (i * 37 + 11);
+
+  FITSChecksum whole;
+  whole.update(data.data(), data.size());
+  check(whole.sum() == referenceSum(data), "sum of the whole buffer");
+  check(whole.bytes() == data.size(), "bytes counted");
+
+  // Pieces that start and end in the middle of a word.
+  FITSChecksum pieces;
+  size_t offset = 0;
+  for(size_t size = 1; offset < data.size(); size = size % 7 + 1) {
+    size_t length = std::min(size, data.size() - offset);
+    pieces.update(data.data() + offset, length);
+    offset += length;
+  }
+  check(pieces.sum() == whole.sum(), "sum added in odd sized pieces");
+
+  // The end-around carry.
+  std::vector<uint8_t> ones(8, 0xFF);
+  FITSChecksum carry;
+  carry.update(ones.data(), ones.size());
+  check(carry.sum() == referenceSum(ones), "sum with carries");
+}
+
+void testSingleFiles(const QTemporaryDir & dir) {
+  const int types[] = {CV_8UC1, CV_16UC1, CV_32FC1, CV_8UC3, CV_16UC3};
+  for(int i = 0; i < 5; i++) {
+    std::string filename = dir.filePath(QString("single_%1.fits").arg(i)).toStdString();
+    CVFITS frame = testFrame(types[i], 3, 5, i);
+    if(types[i] == CV_32FC1)
+      frame.image = frame.image / 65535.0;
+    frame.saveToFITS(filename);
+    verifyFile(filename, 1);
+  }
+}
+
+void testAsyncWriter(const QTemporaryDir & dir) {
+  AsyncFITSWriter writer(AsyncFITSWriter::BACKEND_THREADS, 2, 0, AsyncFITSWriter::SYNC_NONE, 1);
+  std::vector<std::string> filenames;
+  for(int i = 0; i < 4; i++) {
+    filenames.push_back(dir.filePath(QString("async_%1.fits").arg(i)).toStdString());
+    writer.enqueue(testFrame(i % 2 ? CV_16UC1 : CV_8UC1, 7, 9, i), filenames.back());
+  }
+  writer.close();
+  check(writer.metrics().errors == 0, "asynchronous writes");
+
+  for(const std::string & filename : filenames)
+    verifyFile(filename, 1);
+}
+
+void testContainer(const QTemporaryDir & dir, FITSSequenceWriter::Layout layout, const std::string & name,
+                   int frames, int expected_hdus) {
+  std::string filename = dir.filePath(QString::fromStdString(name)).toStdString();
+  FITSSequenceWriter sequence(layout, 0, 0);
+  std::string error;
+  for(int i = 0; i < frames; i++) {
+    // The cube takes frames of different exposure times, as auto flats produce.
+    bool ok = sequence.append(testFrame(CV_8UC1, 3, 5, i), filename, error);
+    check(ok, "append to " + name + ": " + error);
+  }
+  bool ok = sequence.close(error);
+  check(ok, "close " + name + ": " + error);
+  check(sequence.filesWritten() == 1, name + " written to one file");
+
+  verifyFile(filename, expected_hdus);
+}
+}
+
+int main() {
+
+  QTemporaryDir dir;
+  if(!dir.isValid()) {
+    std::cerr << "Could not create a temporary directory" << std::endl;
+    return 1;
+  }
+
+  testRunningSum();
+  testSingleFiles(dir);
+  testAsyncWriter(dir);
+
+  // An empty primary HDU and one extension per frame.
+  testContainer(dir, FITSSequenceWriter::LAYOUT_MEF, "sequence_mef.fits", 3, 4);
+
+  // The planes, then the FRAMES table.
+  testContainer(dir, FITSSequenceWriter::LAYOUT_CUBE, "sequence_cube.fits", 3, 2);
+
+  if(failures > 0) {
+    std::cerr << failures << " checks failed" << std::endl;
+    return 1;
+  }
+
+  std::cout << "All checksum checks passed" << std::endl;
+  return 0;
+}
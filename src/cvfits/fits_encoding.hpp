@@ -0,0 +1,42 @@
+#ifndef FITS_ENCODING_H
+#define FITS_ENCODING_H
+
+#include <cstdint>
+#include <cstring>
+
+/// Converts a pixel to its big-endian FITS representation.
+inline uint8_t toFITS(uint8_t value) { return value; }
+
+/// Unsigned 16-bit pixels are stored as signed values with BZERO = 32768.
+inline uint16_t toFITS(uint16_t value) {
+  value ^= 0x8000;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  return value;
+#else
+  return __builtin_bswap16(value);
+#endif
+}
+
+inline uint32_t toFITS(float value) {
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  return bits;
+#else
+  return __builtin_bswap32(bits);
+#endif
+}
+
+/// Encodes one channel of a row of interleaved pixels as a row of a FITS plane.
+/// \param in The row, `channels` values per pixel.
+/// \param cols Pixels in the row.
+/// \param channels Channels per pixel.
+/// \param channel The channel to encode.
+/// \param out Receives `cols` encoded values.
+template <typename T>
+inline void encodeFITSRow(const T * in, int cols, int channels, int channel, decltype(toFITS(T())) * out) {
+  for(int x = 0; x < cols; x++)
+    out[x] = toFITS(in[x * channels + channel]);
+}
+
+#endif // FITS_ENCODING_H
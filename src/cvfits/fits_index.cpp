@@ -0,0 +1,518 @@
+// local includes
+#include "fits_index.hpp"
+
+// system includes
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <fstream>
+#include <limits>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+
+namespace {
+
+const size_t FITS_BLOCK = 2880;
+const size_t FITS_CARD = 80;
+
+/// Header blocks read ahead when a file is mapped. Headers written by CVFITS fit in two.
+const size_t HEADER_READAHEAD = 4 * FITS_BLOCK;
+
+const char INDEX_MAGIC[8] = {'Q', 'H', 'Y', 'F', 'I', 'D', 'X', '1'};
+const uint32_t INDEX_VERSION = 1;
+
+/// Columns that do not come from a header keyword.
+const size_t COLUMN_PATH = 0;
+const size_t COLUMN_HDU = 1;
+
+/// Structural keywords of the HDU being scanned.
+struct HDULayout {
+  bool image = false;
+  int bitpix = 0;
+  int naxis = 0;
+  uint64_t axes_product = 1;
+  uint64_t pcount = 0;
+  uint64_t gcount = 1;
+};
+
+/// @return The card keyword without trailing blanks.
+std::string cardKeyword(const char * card) {
+  size_t length = 8;
+  while(length > 0 && card[length - 1] == ' ')
+    length--;
+  return std::string(card, length);
+}
+
+/// @brief Extracts the value of a card with a value indicator.
+/// Strings lose their quotes, doubled quotes and trailing blanks. Other
+/// values lose the comment and surrounding blanks.
+std::string cardValue(const char * card) {
+  const char * p = card + 10;
+  const char * end = card + FITS_CARD;
+  while(p < end && *p == ' ')
+    p++;
+
+  std::string value;
+  if(p < end && *p == '\'') {
+    for(p++; p < end; p++) {
+      if(*p == '\'') {
+        if(p + 1 < end && p[1] == '\'') {
+          value += '\'';
+          p++;
+          continue;
+        }
+        break;
+      }
+      value += *p;
+    }
+    while(!value.empty() && value.back() == ' ')
+      value.pop_back();
+    return value;
+  }
+
+  const char * stop = p;
+  while(stop < end && *stop != '/')
+    stop++;
+  while(stop > p && stop[-1] == ' ')
+    stop--;
+  return std::string(p, stop);
+}
+
+/// @return A FITS number, allowing the Fortran D exponent.
+double parseNumber(const std::string & text) {
+  if(text.empty())
+    return std::numeric_limits<double>::quiet_NaN();
+
+  std::string number = text;
+  std::replace(number.begin(), number.end(), 'D', 'E');
+  char * end = nullptr;
+  double value = strtod(number.c_str(), &end);
+  if(end == number.c_str())
+    return std::numeric_limits<double>::quiet_NaN();
+  return value;
+}
+
+/// Records the structural keywords needed to find the next HDU.
+void readLayoutCard(const std::string & keyword, const std::string & value, HDULayout & layout) {
+  if(keyword == "SIMPLE")
+    layout.image = true;
+  else if(keyword == "XTENSION")
+    layout.image = (value == "IMAGE");
+  else if(keyword == "BITPIX")
+    layout.bitpix = atoi(value.c_str());
+  else if(keyword == "NAXIS")
+    layout.naxis = atoi(value.c_str());
+  else if(keyword.compare(0, 5, "NAXIS") == 0 && keyword.size() > 5)
+    layout.axes_product *= strtoull(value.c_str(), nullptr, 10);
+  else if(keyword == "PCOUNT")
+    layout.pcount = strtoull(value.c_str(), nullptr, 10);
+  else if(keyword == "GCOUNT")
+    layout.gcount = strtoull(value.c_str(), nullptr, 10);
+}
+
+/// @return The size of the data unit in bytes, padded to whole blocks.
+uint64_t dataUnitSize(const HDULayout & layout) {
+  if(layout.naxis == 0)
+    return 0;
+
+  uint64_t bytes = (uint64_t) std::abs(layout.bitpix) / 8 * layout.gcount * (layout.pcount + layout.axes_product);
+  return (bytes + FITS_BLOCK - 1) / FITS_BLOCK * FITS_BLOCK;
+}
+
+/// @brief Scans the header cards of a mapped file.
+/// \return false if the file is not FITS or a header is truncated.
+bool scanMapped(const char * data, uint64_t size, std::vector<FITSHeaderValues> & hdus, std::string & error) {
+  const std::vector<FITSIndexKeyword> & columns = fitsIndexColumns();
+
+  if(size < FITS_BLOCK || memcmp(data, "SIMPLE  =", 9) != 0) {
+    error = "not a FITS file";
+    return false;
+  }
+
+  uint64_t offset = 0;
+  int hdu_number = 0;
+  while(offset + FITS_BLOCK <= size) {
+    // Extensions must start with XTENSION. Anything else after the last HDU is padding or junk.
+    if(hdu_number > 0 && memcmp(data + offset, "XTENSION=", 9) != 0)
+      break;
+
+    HDULayout layout;
+    FITSHeaderValues hdu;
+    hdu.values.resize(columns.size());
+    hdu.values[COLUMN_HDU] = std::to_string(hdu_number);
+
+    bool found_end = false;
+    while(!found_end && offset + FITS_BLOCK <= size) {
+      for(const char * card = data + offset; card < data + offset + FITS_BLOCK; card += FITS_CARD) {
+        if(memcmp(card, "END     ", 8) == 0) {
+          found_end = true;
+          break;
+        }
+        if(card[8] != '=' || card[9] != ' ')
+          continue;
+
+        std::string keyword = cardKeyword(card);
+        std::string value = cardValue(card);
+        readLayoutCard(keyword, value, layout);
+        for(size_t column = COLUMN_HDU + 1; column < columns.size(); column++) {
+          if(keyword == columns[column].name) {
+            hdu.values[column] = value;
+            break;
+          }
+        }
+      }
+      offset += FITS_BLOCK;
+    }
+
+    if(!found_end) {
+      error = "header of HDU " + std::to_string(hdu_number) + " has no END card";
+      return false;
+    }
+
+    if(layout.image && layout.naxis >= 2)
+      hdus.push_back(hdu);
+
+    offset += dataUnitSize(layout);
+    hdu_number++;
+  }
+
+  return true;
+}
+
+}
+
+const std::vector<FITSIndexKeyword> & fitsIndexColumns() {
+  static const std::vector<FITSIndexKeyword> columns = {
+    {"PATH", false},
+    {"HDU", true},
+    {"DATE-OBS", false},
+    {"OBJECT", false},
+    {"FILTER", false},
+    {"EXPTIME", true},
+    {"TEMP", true},
+    {"GAIN", true},
+    {"DETNAME", false},
+    {"IMAGETYP", false},
+    {"XBINNING", true},
+    {"YBINNING", true},
+    {"NAXIS1", true},
+    {"NAXIS2", true},
+    {"NSTARS", true},
+    {"FWHM", true},
+    {"BKGMEAN", true},
+  };
+  return columns;
+}
+
+bool scanFITSHeaders(const std::string & path, std::vector<FITSHeaderValues> & hdus, std::string & error) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if(fd < 0) {
+    error = strerror(errno);
+    return false;
+  }
+
+  struct stat info;
+  if(fstat(fd, &info) != 0) {
+    error = strerror(errno);
+    close(fd);
+    return false;
+  }
+  if(info.st_size == 0) {
+    error = "empty file";
+    close(fd);
+    return false;
+  }
+
+  // Only the pages holding headers are ever touched, so most of the file is never read.
+  size_t size = info.st_size;
+  void * map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED) {
+    error = strerror(errno);
+    return false;
+  }
+
+  // Turn off read-ahead, which would pull in the data unit, and fetch the primary header.
+  madvise(map, size, MADV_RANDOM);
+  madvise(map, std::min(size, HEADER_READAHEAD), MADV_WILLNEED);
+
+  bool ok = scanMapped(static_cast<const char *>(map), size, hdus, error);
+  for(FITSHeaderValues & hdu : hdus)
+    hdu.values[COLUMN_PATH] = path;
+
+  munmap(map, size);
+  return ok;
+}
+
+FITSIndex::FITSIndex() {
+  for(const FITSIndexKeyword & keyword : fitsIndexColumns()) {
+    FITSIndexColumn column;
+    column.name = keyword.name;
+    column.numeric = keyword.numeric;
+    mColumns.push_back(column);
+  }
+}
+
+void FITSIndex::build(const std::vector<std::string> & files, int threads, std::vector<std::string> & errors) {
+  std::vector<std::vector<FITSHeaderValues>> results(files.size());
+  std::vector<std::string> file_errors(files.size());
+  std::atomic<size_t> next(0);
+
+  auto worker = [&]() {
+    for(size_t i = next++; i < files.size(); i = next++) {
+      if(!scanFITSHeaders(files[i], results[i], file_errors[i]) && file_errors[i].empty())
+        file_errors[i] = "could not be read";
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for(int i = 0; i < std::max(1, threads); i++)
+    workers.emplace_back(worker);
+  for(std::thread & thread : workers)
+    thread.join();
+
+  *this = FITSIndex();
+
+  // Text columns are dictionary encoded. PATH and DATE-OBS are nearly unique,
+  // so the entries are found through a hash table rather than a search.
+  std::vector<std::unordered_map<std::string, uint32_t>> lookups(mColumns.size());
+  for(size_t i = 0; i < files.size(); i++) {
+    if(!file_errors[i].empty())
+      errors.push_back(files[i] + ": " + file_errors[i]);
+
+    for(const FITSHeaderValues & hdu : results[i]) {
+      for(size_t c = 0; c < mColumns.size(); c++) {
+        FITSIndexColumn & column = mColumns[c];
+        const std::string & value = hdu.values[c];
+        if(column.numeric) {
+          column.numbers.push_back(parseNumber(value));
+          continue;
+        }
+
+        auto entry = lookups[c].emplace(value, column.dictionary.size());
+        if(entry.second)
+          column.dictionary.push_back(value);
+        column.codes.push_back(entry.first->second);
+      }
+      mRows++;
+    }
+  }
+}
+
+bool FITSIndex::save(const std::string & filename, std::string & error) const {
+  std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+  if(!out) {
+    error = filename + ": " + strerror(errno);
+    return false;
+  }
+
+  auto putU32 = [&](uint32_t value) { out.write((const char *) &value, sizeof(value)); };
+  auto putString = [&](const std::string & value) {
+    putU32(value.size());
+    out.write(value.data(), value.size());
+  };
+
+  // Little-endian, column after column. Numeric columns are raw doubles, text
+  // columns a dictionary followed by one code per row.
+  out.write(INDEX_MAGIC, sizeof(INDEX_MAGIC));
+  putU32(INDEX_VERSION);
+  putU32(mRows);
+  putU32(mColumns.size());
+  for(const FITSIndexColumn & column : mColumns) {
+    putString(column.name);
+    out.put(column.numeric ? 1 : 0);
+    if(column.numeric) {
+      out.write((const char *) column.numbers.data(), column.numbers.size() * sizeof(double));
+    } else {
+      putU32(column.dictionary.size());
+      for(const std::string & value : column.dictionary)
+        putString(value);
+      out.write((const char *) column.codes.data(), column.codes.size() * sizeof(uint32_t));
+    }
+  }
+
+  if(!out.flush()) {
+    error = filename + ": write failed";
+    return false;
+  }
+
+  return true;
+}
+
+bool FITSIndex::load(const std::string & filename, std::string & error) {
+  std::ifstream in(filename, std::ios::binary);
+  if(!in) {
+    error = filename + ": " + strerror(errno);
+    return false;
+  }
+
+  auto getU32 = [&]() {
+    uint32_t value = 0;
+    in.read((char *) &value, sizeof(value));
+    return value;
+  };
+  auto getString = [&]() {
+    std::string value(getU32(), '\0');
+    in.read(&value[0], value.size());
+    return value;
+  };
+
+  char magic[sizeof(INDEX_MAGIC)] = {0};
+  in.read(magic, sizeof(magic));
+  if(memcmp(magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 || getU32() != INDEX_VERSION) {
+    error = filename + " is not a FITS index";
+    return false;
+  }
+
+  size_t rows = getU32();
+  size_t num_columns = getU32();
+  std::vector<FITSIndexColumn> columns(num_columns);
+  for(FITSIndexColumn & column : columns) {
+    column.name = getString();
+    column.numeric = (in.get() == 1);
+    if(column.numeric) {
+      column.numbers.resize(rows);
+      in.read((char *) column.numbers.data(), rows * sizeof(double));
+    } else {
+      column.dictionary.resize(getU32());
+      for(std::string & value : column.dictionary)
+        value = getString();
+      column.codes.resize(rows);
+      in.read((char *) column.codes.data(), rows * sizeof(uint32_t));
+      for(uint32_t code : column.codes) {
+        if(code >= column.dictionary.size()) {
+          error = filename + " is corrupt";
+          return false;
+        }
+      }
+    }
+
+    if(!in) {
+      error = filename + " is truncated";
+      return false;
+    }
+  }
+
+  mColumns = columns;
+  mRows = rows;
+  return true;
+}
+
+std::string FITSIndex::text(size_t row, size_t column) const {
+  const FITSIndexColumn & col = mColumns[column];
+  if(!col.numeric)
+    return col.dictionary[col.codes[row]];
+
+  double value = col.numbers[row];
+  if(std::isnan(value))
+    return "";
+
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), "%.10g", value);
+  return buffer;
+}
+
+bool FITSIndex::parseCondition(const std::string & expression, FITSIndexCondition & condition, std::string & error) const {
+  // Two character operators first, so that <= is not read as <.
+  const std::vector<std::pair<std::string, FITSIndexCondition::Op>> operators = {
+    {"!=", FITSIndexCondition::OP_NE}, {"<=", FITSIndexCondition::OP_LE}, {">=", FITSIndexCondition::OP_GE},
+    {"=", FITSIndexCondition::OP_EQ}, {"<", FITSIndexCondition::OP_LT}, {">", FITSIndexCondition::OP_GT},
+  };
+
+  size_t position = std::string::npos;
+  size_t length = 0;
+  for(const auto & op : operators) {
+    size_t found = expression.find(op.first);
+    if(found != std::string::npos && (found < position || (found == position && op.first.size() > length))) {
+      position = found;
+      length = op.first.size();
+      condition.op = op.second;
+    }
+  }
+  if(position == std::string::npos) {
+    error = "No operator in \"" + expression + "\"";
+    return false;
+  }
+
+  std::string name = expression.substr(0, position);
+  std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+  auto column = std::find_if(mColumns.begin(), mColumns.end(),
+                             [&](const FITSIndexColumn & c) { return c.name == name; });
+  if(column == mColumns.end()) {
+    error = "Unknown column " + name;
+    return false;
+  }
+
+  condition.column = column - mColumns.begin();
+  condition.text = expression.substr(position + length);
+  if(column->numeric) {
+    condition.number = parseNumber(condition.text);
+    if(std::isnan(condition.number)) {
+      error = name + " is numeric, \"" + condition.text + "\" is not a number";
+      return false;
+    }
+  }
+
+  return true;
+}
+
+std::vector<size_t> FITSIndex::select(const std::vector<FITSIndexCondition> & conditions) const {
+  // Evaluate column by column: each condition narrows a row mask, and a text
+  // condition is decided once per dictionary entry rather than once per row.
+  std::vector<uint8_t> mask(mRows, 1);
+
+  for(const FITSIndexCondition & condition : conditions) {
+    const FITSIndexColumn & column = mColumns[condition.column];
+
+    auto compare = [&](int order) {
+      switch(condition.op) {
+        case FITSIndexCondition::OP_EQ: return order == 0;
+        case FITSIndexCondition::OP_NE: return order != 0;
+        case FITSIndexCondition::OP_LT: return order < 0;
+        case FITSIndexCondition::OP_LE: return order <= 0;
+        case FITSIndexCondition::OP_GT: return order > 0;
+        case FITSIndexCondition::OP_GE: return order >= 0;
+      }
+      return false;
+    };
+
+    if(column.numeric) {
+      for(size_t row = 0; row < mRows; row++) {
+        double value = column.numbers[row];
+        // A missing value only matches !=.
+        if(std::isnan(value))
+          mask[row] &= (condition.op == FITSIndexCondition::OP_NE);
+        else
+          mask[row] &= compare((value > condition.number) - (value < condition.number));
+      }
+    } else {
+      std::vector<uint8_t> matches(column.dictionary.size());
+      for(size_t code = 0; code < matches.size(); code++) {
+        // A missing value matches =, given nothing, and != anything else.
+        if(column.dictionary[code].empty())
+          matches[code] = (condition.op == FITSIndexCondition::OP_EQ && condition.text.empty())
+                       || (condition.op == FITSIndexCondition::OP_NE && !condition.text.empty());
+        else
+          matches[code] = compare(column.dictionary[code].compare(condition.text));
+      }
+      for(size_t row = 0; row < mRows; row++)
+        mask[row] &= matches[column.codes[row]];
+    }
+  }
+
+  std::vector<size_t> rows;
+  for(size_t row = 0; row < mRows; row++) {
+    if(mask[row])
+      rows.push_back(row);
+  }
+
+  return rows;
+}
@@ -0,0 +1,91 @@
+#ifndef FITS_INDEX_H
+#define FITS_INDEX_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/// A keyword recorded in the index.
+struct FITSIndexKeyword {
+  const char * name;
+  bool numeric;     ///< Compared as a number rather than as text.
+};
+
+/// @return The columns of the index: PATH and HDU, followed by the header keywords.
+const std::vector<FITSIndexKeyword> & fitsIndexColumns();
+
+/// Keyword values of one image HDU, as text, in fitsIndexColumns() order.
+struct FITSHeaderValues {
+  std::vector<std::string> values;
+};
+
+/// @brief Reads the keywords of every image HDU in a FITS file.
+///
+/// The file is memory mapped and only its header blocks are touched: the
+/// data units are skipped using the sizes in the headers. Cards are parsed
+/// by hand rather than through CFITSIO.
+/// \param path FITS file.
+/// \param hdus Receives one entry for every HDU holding an image.
+/// \param error Set to a description of the problem on failure.
+/// \return true on success.
+bool scanFITSHeaders(const std::string & path, std::vector<FITSHeaderValues> & hdus, std::string & error);
+
+/// A column of the index. Text columns are dictionary encoded.
+struct FITSIndexColumn {
+  std::string name;
+  bool numeric = false;
+  std::vector<double> numbers;              ///< Values of a numeric column, NaN if missing
+  std::vector<uint32_t> codes;              ///< Dictionary entries of a text column
+  std::vector<std::string> dictionary;      ///< Distinct values of a text column
+};
+
+/// A filter on one column, such as EXPTIME>=10 or FILTER=R.
+struct FITSIndexCondition {
+  enum Op { OP_EQ, OP_NE, OP_LT, OP_LE, OP_GT, OP_GE };
+
+  size_t column = 0;
+  Op op = OP_EQ;
+  std::string text;
+  double number = 0;
+};
+
+/// @brief A columnar index of the headers of many FITS files.
+class FITSIndex {
+
+protected:
+  std::vector<FITSIndexColumn> mColumns;
+  size_t mRows = 0;
+
+public:
+  FITSIndex();
+
+  /// @brief Scans files on several threads and replaces the contents of the index.
+  /// \param files FITS files to index.
+  /// \param threads Number of scanning threads.
+  /// \param errors Receives a description of every file that could not be read.
+  void build(const std::vector<std::string> & files, int threads, std::vector<std::string> & errors);
+
+  /// Writes the index to a file.
+  bool save(const std::string & filename, std::string & error) const;
+
+  /// Reads an index written by save().
+  bool load(const std::string & filename, std::string & error);
+
+  /// \return The number of indexed HDUs.
+  size_t rows() const { return mRows; }
+
+  /// \return The columns of the index.
+  const std::vector<FITSIndexColumn> & columns() const { return mColumns; }
+
+  /// \return The value of a cell as text. Missing values are empty.
+  std::string text(size_t row, size_t column) const;
+
+  /// @brief Parses a condition such as "EXPTIME>=10".
+  /// Operators are =, !=, <, <=, > and >=.
+  bool parseCondition(const std::string & expression, FITSIndexCondition & condition, std::string & error) const;
+
+  /// \return The rows matching every condition, in index order.
+  std::vector<size_t> select(const std::vector<FITSIndexCondition> & conditions) const;
+};
+
+#endif // FITS_INDEX_H
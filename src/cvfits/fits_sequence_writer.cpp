@@ -0,0 +1,218 @@
+// local includes
+#include "fits_sequence_writer.hpp"
+#include "datetime_utilities.hpp"
+
+// system includes
+#include <fitsio2.h>
+
+namespace {
+
+/// Describes a CFITSIO status code.
+std::string fitsError(int status) {
+  char text[FLEN_STATUS] = {0};
+  fits_get_errstatus(status, text);
+  return "CFITSIO error " + std::to_string(status) + ": " + text;
+}
+
+}
+
+FITSSequenceWriter::FITSSequenceWriter(Layout layout, size_t max_frames, size_t max_bytes)
+  : mLayout(layout), mMaxFrames(max_frames), mMaxBytes(max_bytes) {
+}
+
+FITSSequenceWriter::~FITSSequenceWriter() {
+  std::string error;
+  close(error);
+}
+
+bool FITSSequenceWriter::append(const CVFITS & image, const std::string & filename, std::string & error) {
+  std::lock_guard<std::mutex> lock(mMutex);
+
+  // writeHDU adjusts some of the metadata as it writes it.
+  CVFITS frame = image;
+  size_t frame_bytes = frame.image.total() * frame.image.elemSize();
+
+  if(mFile && !belongsInFile(frame, frame_bytes) && !closeFile(error))
+    return false;
+  if(!mFile && !openFile(frame, filename, error))
+    return false;
+
+  int status = 0;
+  if(mLayout == LAYOUT_MEF) {
+    frame.writeHDU(mFile, &status);
+  } else {
+    // Planes follow each other in the data unit, so the checksum keeps running across them.
+    frame.writeData(mFile, (LONGLONG) mFrames * mPlaneBytes, mCubeChecksum, &status);
+
+    PlaneRecord record;
+    record.date_beg = to_iso_8601(frame.exposure_start);
+    record.date_end = to_iso_8601(frame.exposure_end);
+    record.exposure_sec = frame.exposure_duration_sec;
+    record.temperature = frame.temperature;
+    record.gain = frame.gain;
+    record.filter_name = frame.filter_name;
+    mPlanes.push_back(record);
+  }
+
+  if(status != 0) {
+    error = fitsError(status) + " appending to " + mFilename;
+    return false;
+  }
+
+  mFrames++;
+  mBytes += frame_bytes;
+  mFramesWritten++;
+  mBytesWritten += frame_bytes;
+
+  return true;
+}
+
+bool FITSSequenceWriter::close(std::string & error) {
+  std::lock_guard<std::mutex> lock(mMutex);
+
+  if(!mFile)
+    return true;
+
+  return closeFile(error);
+}
+
+bool FITSSequenceWriter::belongsInFile(const CVFITS & image, size_t frame_bytes) const {
+  if(mMaxFrames > 0 && mFrames >= mMaxFrames)
+    return false;
+  if(mMaxBytes > 0 && mFrames > 0 && mBytes + frame_bytes > mMaxBytes)
+    return false;
+
+  // The cube header describes the first frame, so later frames must match it.
+  // The exposure time may change between frames, as it does for auto flats:
+  // the FRAMES table records it for every plane.
+  if(mLayout == LAYOUT_CUBE) {
+    return image.image.type() == mCubeType
+        && image.image.rows == mCubeRows
+        && image.image.cols == mCubeCols
+        && image.filter_name == mCubeFilter;
+  }
+
+  return true;
+}
+
+bool FITSSequenceWriter::openFile(CVFITS & image, const std::string & filename, std::string & error) {
+  int status = 0;
+  fits_create_file(&mFile, filename.c_str(), &status);
+
+  if(mLayout == LAYOUT_MEF) {
+    // An empty primary HDU. Every frame is an image extension.
+    fits_create_img(mFile, BYTE_IMG, 0, nullptr, &status);
+    fits_write_chksum(mFile, &status);
+  } else {
+    // The last axis is sized when the file is closed.
+    image.createHDU(mFile, 1, &status);
+    image.writeKeys(mFile, &status);
+
+    mCubeType = image.image.type();
+    mCubeRows = image.image.rows;
+    mCubeCols = image.image.cols;
+    mCubeFilter = image.filter_name;
+    mPlaneBytes = image.image.total() * image.image.elemSize();
+    mCubeChecksum = FITSChecksum();
+    mPlanes.clear();
+  }
+
+  if(status != 0) {
+    error = fitsError(status) + " creating " + filename;
+    if(mFile) {
+      int close_status = 0;
+      fits_close_file(mFile, &close_status);
+      mFile = nullptr;
+    }
+    return false;
+  }
+
+  mFilename = filename;
+  mFrames = 0;
+  mBytes = 0;
+
+  return true;
+}
+
+bool FITSSequenceWriter::closeFile(std::string & error) {
+  int status = 0;
+
+  if(mLayout == LAYOUT_CUBE) {
+    // Size the last axis now that every plane has been written.
+    int naxis = 0;
+    long planes = mFrames;
+    fits_get_img_dim(mFile, &naxis, &status);
+    std::string naxis_key = "NAXIS" + std::to_string(naxis);
+    fits_update_key(mFile, TLONG, naxis_key.c_str(), &planes, nullptr, &status);
+
+    // The header came from the first frame, the sequence ends with the last.
+    if(!mPlanes.empty())
+      fits_update_key(mFile, TSTRING, "DATE-END", (void *) mPlanes.back().date_end.c_str(), nullptr, &status);
+
+    CVFITS::writeChecksum(mFile, mCubeChecksum.sum(), &status);
+    writePlaneTable(&status);
+  }
+
+  fits_close_file(mFile, &status);
+  mFile = nullptr;
+  mFilesWritten++;
+
+  if(status != 0) {
+    error = fitsError(status) + " closing " + mFilename;
+    return false;
+  }
+
+  return true;
+}
+
+bool FITSSequenceWriter::writePlaneTable(int * status) {
+  const char * ttype[] = {"FRAME", "DATE-BEG", "DATE-END", "EXPTIME", "TEMP", "GAIN", "FILTER"};
+  const char * tform[] = {"J", "32A", "32A", "D", "D", "D", "32A"};
+  const char * tunit[] = {"", "", "", "s", "Celsius", "", ""};
+  const int ncols = 7;
+
+  fits_create_tbl(mFile, BINARY_TBL, mPlanes.size(), ncols, (char **) ttype, (char **) tform, (char **) tunit,
+                  "FRAMES", status);
+
+  std::vector<int> frame_numbers;
+  std::vector<char *> date_beg, date_end, filter_names;
+  std::vector<double> exposures, temperatures, gains;
+  for(size_t i = 0; i < mPlanes.size(); i++) {
+    frame_numbers.push_back(i + 1);
+    date_beg.push_back((char *) mPlanes[i].date_beg.c_str());
+    date_end.push_back((char *) mPlanes[i].date_end.c_str());
+    filter_names.push_back((char *) mPlanes[i].filter_name.c_str());
+    exposures.push_back(mPlanes[i].exposure_sec);
+    temperatures.push_back(mPlanes[i].temperature);
+    gains.push_back(mPlanes[i].gain);
+  }
+
+  LONGLONG rows = mPlanes.size();
+  if(rows > 0) {
+    fits_write_col(mFile, TINT, 1, 1, 1, rows, frame_numbers.data(), status);
+    fits_write_col(mFile, TSTRING, 2, 1, 1, rows, date_beg.data(), status);
+    fits_write_col(mFile, TSTRING, 3, 1, 1, rows, date_end.data(), status);
+    fits_write_col(mFile, TDOUBLE, 4, 1, 1, rows, exposures.data(), status);
+    fits_write_col(mFile, TDOUBLE, 5, 1, 1, rows, temperatures.data(), status);
+    fits_write_col(mFile, TDOUBLE, 6, 1, 1, rows, gains.data(), status);
+    fits_write_col(mFile, TSTRING, 7, 1, 1, rows, filter_names.data(), status);
+  }
+  fits_write_chksum(mFile, status);
+
+  return *status == 0;
+}
+
+size_t FITSSequenceWriter::filesWritten() const {
+  std::lock_guard<std::mutex> lock(mMutex);
+  return mFilesWritten;
+}
+
+size_t FITSSequenceWriter::framesWritten() const {
+  std::lock_guard<std::mutex> lock(mMutex);
+  return mFramesWritten;
+}
+
+size_t FITSSequenceWriter::bytesWritten() const {
+  std::lock_guard<std::mutex> lock(mMutex);
+  return mBytesWritten;
+}
@@ -0,0 +1,99 @@
+#ifndef FITS_SEQUENCE_WRITER_H
+#define FITS_SEQUENCE_WRITER_H
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "cvfits.hpp"
+#include "fits_checksum.hpp"
+
+/// Appends a sequence of frames to a few large FITS files instead of writing
+/// one file per frame.
+///
+/// Frames are either written as image extensions of a multi-extension FITS
+/// file, each with its own header, or as the planes of a single data cube. A
+/// cube takes its header from the first frame and records the timing and
+/// exposure time of every plane in a FRAMES binary table extension. A new file
+/// is started once the frame or size limit is reached, or when a frame's size,
+/// pixel type or filter does not match the current cube.
+class FITSSequenceWriter {
+
+public:
+  /// How frames are stored in a file.
+  enum Layout {
+    LAYOUT_MEF,   ///< One image extension per frame.
+    LAYOUT_CUBE,  ///< One plane of a data cube per frame.
+  };
+
+protected:
+  /// Row of the FRAMES table of a cube.
+  struct PlaneRecord {
+    std::string date_beg;
+    std::string date_end;
+    double exposure_sec = 0;
+    double temperature = 0;
+    double gain = 0;
+    std::string filter_name;
+  };
+
+  Layout mLayout = LAYOUT_MEF;
+  size_t mMaxFrames = 0;
+  size_t mMaxBytes = 0;
+
+  fitsfile * mFile = nullptr;
+  std::string mFilename;
+  size_t mFrames = 0;             ///< Frames in the current file
+  size_t mBytes = 0;              ///< Bytes in the current file
+
+  // The cube being written
+  int mCubeType = 0;
+  int mCubeRows = 0;
+  int mCubeCols = 0;
+  std::string mCubeFilter;
+  size_t mPlaneBytes = 0;
+  FITSChecksum mCubeChecksum;
+  std::vector<PlaneRecord> mPlanes;
+
+  size_t mFilesWritten = 0;
+  size_t mFramesWritten = 0;
+  size_t mBytesWritten = 0;
+
+  mutable std::mutex mMutex;
+
+  bool openFile(CVFITS & image, const std::string & filename, std::string & error);
+  bool closeFile(std::string & error);
+  bool belongsInFile(const CVFITS & image, size_t frame_bytes) const;
+  bool writePlaneTable(int * status);
+
+public:
+  /// \param layout How frames are stored.
+  /// \param max_frames Frames per file before a new one is started. 0 disables the limit.
+  /// \param max_bytes Bytes per file before a new one is started. 0 disables the limit.
+  FITSSequenceWriter(Layout layout, size_t max_frames, size_t max_bytes);
+
+  /// Closes the current file.
+  ~FITSSequenceWriter();
+
+  /// Appends a frame, starting a new file if needed.
+  /// \param image Image and metadata to write.
+  /// \param filename Name used if the frame starts a new file.
+  /// \param error Set to a description of the problem on failure.
+  /// \return true on success.
+  bool append(const CVFITS & image, const std::string & filename, std::string & error);
+
+  /// Finishes and closes the current file.
+  /// \return true on success.
+  bool close(std::string & error);
+
+  /// \return The number of files finished so far.
+  size_t filesWritten() const;
+
+  /// \return The number of frames written so far.
+  size_t framesWritten() const;
+
+  /// \return The number of image bytes written so far.
+  size_t bytesWritten() const;
+};
+
+#endif // FITS_SEQUENCE_WRITER_H
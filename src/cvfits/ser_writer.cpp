@@ -0,0 +1,268 @@
+// local includes
+#include "ser_writer.hpp"
+
+// system includes
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace {
+
+/// Offset and size alignment required for writes that bypass the page cache.
+const size_t SER_ALIGNMENT = 4096;
+
+/// SER times count 100 ns ticks from 0001-01-01. This is the Unix epoch in ticks.
+const int64_t SER_UNIX_EPOCH_TICKS = 621355968000000000LL;
+
+/// Header field offsets.
+const size_t SER_COLOR_ID = 18;
+const size_t SER_LITTLE_ENDIAN = 22;
+const size_t SER_WIDTH = 26;
+const size_t SER_HEIGHT = 30;
+const size_t SER_PIXEL_DEPTH = 34;
+const size_t SER_FRAME_COUNT = 38;
+const size_t SER_OBSERVER = 42;
+const size_t SER_INSTRUMENT = 82;
+const size_t SER_TELESCOPE = 122;
+const size_t SER_DATE_TIME = 162;
+const size_t SER_DATE_TIME_UTC = 170;
+
+/// Stores an integer in little-endian byte order.
+template <typename T>
+void putLE(uint8_t * out, T value) {
+  uint64_t bits = (uint64_t) value;
+  for(size_t i = 0; i < sizeof(T); i++)
+    out[i] = (bits >> (8 * i)) & 0xFF;
+}
+
+/// Stores a string in a fixed-size, zero-padded field.
+void putString(uint8_t * out, const std::string & value, size_t size) {
+  memset(out, 0, size);
+  memcpy(out, value.data(), std::min(size, value.size()));
+}
+
+int64_t toSERTicks(const std::chrono::time_point<std::chrono::high_resolution_clock> & t) {
+  return SER_UNIX_EPOCH_TICKS + std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count() / 100;
+}
+
+/// Writes the entire buffer at the specified offset, retrying short writes.
+bool pwriteAll(int fd, const uint8_t * data, size_t size, off_t offset, std::string & error) {
+  while(size > 0) {
+    ssize_t ret = pwrite(fd, data, size, offset);
+    if(ret < 0) {
+      if(errno == EINTR)
+        continue;
+      error = strerror(errno);
+      return false;
+    }
+    data += ret;
+    size -= ret;
+    offset += ret;
+  }
+
+  return true;
+}
+
+}
+
+SERWriter::SERWriter(size_t buffer_size) {
+  mBufferSize = std::max(SER_ALIGNMENT, (buffer_size + SER_ALIGNMENT - 1) / SER_ALIGNMENT * SER_ALIGNMENT);
+  void * buffer = nullptr;
+  if(posix_memalign(&buffer, SER_ALIGNMENT, mBufferSize) == 0)
+    mBuffer = static_cast<uint8_t *>(buffer);
+  memset(mHeader, 0, sizeof(mHeader));
+}
+
+SERWriter::~SERWriter() {
+  std::string error;
+  close(error);
+  free(mBuffer);
+}
+
+bool SERWriter::open(const std::string & filename, int rows, int cols, int cv_type, ColorID color,
+                     const std::string & instrument, size_t expected_frames, std::string & error) {
+
+  if(isOpen()) {
+    error = "SER file " + mFilename + " is still open";
+    return false;
+  }
+  if(!mBuffer) {
+    error = "Could not allocate the SER write buffer";
+    return false;
+  }
+
+  int depth = CV_MAT_DEPTH(cv_type);
+  int channels = CV_MAT_CN(cv_type);
+  bool color_frames = (color == COLOR_RGB || color == COLOR_BGR);
+  if((depth != CV_8U && depth != CV_16U) || (channels != 1 && channels != 3) || (channels == 3) != color_frames) {
+    error = "SER files hold 8 or 16-bit mono, Bayer, RGB or BGR frames";
+    return false;
+  }
+
+  // Bypass the page cache if the filesystem supports it.
+#ifdef O_DIRECT
+  mFd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+  mDirectIO = (mFd >= 0);
+#endif
+  if(mFd < 0)
+    mFd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(mFd < 0) {
+    error = filename + ": " + strerror(errno);
+    return false;
+  }
+
+  mFilename = filename;
+  mRows = rows;
+  mCols = cols;
+  mType = cv_type;
+  mFrameBytes = (size_t) rows * cols * CV_ELEM_SIZE(cv_type);
+  mTimestamps.clear();
+  mTimestamps.reserve(expected_frames);
+  mBufferUsed = 0;
+  mBufferOffset = 0;
+  mBytesWritten = 0;
+
+  // Reserve the space up front so the filesystem can lay the file out contiguously.
+  // Not every filesystem supports this, and the file still grows without it.
+  size_t expected_size = SER_HEADER_SIZE + expected_frames * (mFrameBytes + sizeof(int64_t));
+  if(expected_frames > 0)
+    posix_fallocate(mFd, 0, expected_size);
+
+  // Most capture software writes 0 in the LittleEndian field for little-endian
+  // data, and the stacking tools expect it.
+  auto now = std::chrono::high_resolution_clock::now();
+  time_t now_t = time(nullptr);
+  struct tm local;
+  localtime_r(&now_t, &local);
+  int64_t utc_ticks = toSERTicks(now);
+
+  memset(mHeader, 0, sizeof(mHeader));
+  memcpy(mHeader, "LUCAM-RECORDER", 14);
+  putLE<int32_t>(mHeader + SER_COLOR_ID, color);
+  putLE<int32_t>(mHeader + SER_LITTLE_ENDIAN, 0);
+  putLE<int32_t>(mHeader + SER_WIDTH, cols);
+  putLE<int32_t>(mHeader + SER_HEIGHT, rows);
+  putLE<int32_t>(mHeader + SER_PIXEL_DEPTH, (depth == CV_8U) ? 8 : 16);
+  putLE<int32_t>(mHeader + SER_FRAME_COUNT, 0);
+  putString(mHeader + SER_OBSERVER, "", 40);
+  putString(mHeader + SER_INSTRUMENT, instrument, 40);
+  putString(mHeader + SER_TELESCOPE, "", 40);
+  putLE<int64_t>(mHeader + SER_DATE_TIME, utc_ticks + (int64_t) local.tm_gmtoff * 10000000);
+  putLE<int64_t>(mHeader + SER_DATE_TIME_UTC, utc_ticks);
+
+  // The header is written again with the frame count on close.
+  if(!write(mHeader, SER_HEADER_SIZE, error)) {
+    release();
+    return false;
+  }
+
+  return true;
+}
+
+bool SERWriter::append(const cv::Mat & frame, const std::chrono::time_point<std::chrono::high_resolution_clock> & timestamp,
+                       std::string & error) {
+
+  if(!isOpen()) {
+    error = "No SER file is open";
+    return false;
+  }
+  if(frame.rows != mRows || frame.cols != mCols || frame.type() != mType) {
+    error = "Frame does not match the size and type of " + mFilename;
+    return false;
+  }
+
+  const size_t row_bytes = mCols * frame.elemSize();
+  if(frame.isContinuous()) {
+    if(!write(frame.data, mFrameBytes, error))
+      return false;
+  } else {
+    for(int y = 0; y < frame.rows; y++) {
+      if(!write(frame.ptr(y), row_bytes, error))
+        return false;
+    }
+  }
+
+  mTimestamps.push_back(toSERTicks(timestamp));
+  return true;
+}
+
+bool SERWriter::close(std::string & error) {
+
+  if(!isOpen())
+    return true;
+
+  // The trailer holds the UTC time of every frame.
+  bool ok = true;
+  for(int64_t ticks : mTimestamps) {
+    uint8_t bytes[sizeof(int64_t)];
+    putLE<int64_t>(bytes, ticks);
+    ok = ok && write(bytes, sizeof(bytes), error);
+  }
+  ok = ok && flushBuffer(error);
+
+  // The last write was padded to the alignment and the file may have been
+  // preallocated for more frames. Cut it back to its real size.
+  off_t file_size = SER_HEADER_SIZE + mTimestamps.size() * (mFrameBytes + sizeof(int64_t));
+  if(ok && ftruncate(mFd, file_size) != 0) {
+    error = mFilename + ": " + strerror(errno);
+    ok = false;
+  }
+
+  // Patch the frame count. This is a small unaligned write, so it goes through the page cache.
+#ifdef O_DIRECT
+  if(mDirectIO)
+    fcntl(mFd, F_SETFL, fcntl(mFd, F_GETFL) & ~O_DIRECT);
+#endif
+  putLE<int32_t>(mHeader + SER_FRAME_COUNT, mTimestamps.size());
+  ok = ok && pwriteAll(mFd, mHeader, SER_HEADER_SIZE, 0, error);
+
+  release();
+  return ok;
+}
+
+bool SERWriter::write(const void * data, size_t size, std::string & error) {
+  const uint8_t * bytes = static_cast<const uint8_t *>(data);
+
+  while(size > 0) {
+    size_t length = std::min(size, mBufferSize - mBufferUsed);
+    memcpy(mBuffer + mBufferUsed, bytes, length);
+    mBufferUsed += length;
+    bytes += length;
+    size -= length;
+
+    if(mBufferUsed == mBufferSize && !flushBuffer(error))
+      return false;
+  }
+
+  return true;
+}
+
+bool SERWriter::flushBuffer(std::string & error) {
+  if(mBufferUsed == 0)
+    return true;
+
+  // Only the final write is partial. Pad it to the alignment, close() truncates the file.
+  size_t length = (mBufferUsed + SER_ALIGNMENT - 1) / SER_ALIGNMENT * SER_ALIGNMENT;
+  memset(mBuffer + mBufferUsed, 0, length - mBufferUsed);
+
+  if(!pwriteAll(mFd, mBuffer, length, mBufferOffset, error)) {
+    error = mFilename + ": " + error;
+    return false;
+  }
+
+  mBytesWritten += mBufferUsed;
+  mBufferOffset += mBufferUsed;
+  mBufferUsed = 0;
+  return true;
+}
+
+void SERWriter::release() {
+  if(mFd >= 0)
+    ::close(mFd);
+  mFd = -1;
+  mDirectIO = false;
+}
@@ -0,0 +1,105 @@
+#ifndef SER_WRITER_H
+#define SER_WRITER_H
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <opencv2/core/mat.hpp>
+
+/// Size of the SER file header in bytes.
+const size_t SER_HEADER_SIZE = 178;
+
+/// Writes frames to a SER video file, the format read by planetary and lucky
+/// imaging tools such as AutoStakkert and PIPP.
+///
+/// Frames are copied into an aligned buffer and written in large chunks,
+/// bypassing the page cache when the filesystem allows it. The file is
+/// preallocated for the expected number of frames. The per-frame UTC
+/// timestamps are appended on close, and the frame count in the header is
+/// patched then.
+class SERWriter {
+
+public:
+  /// Pixel layout of the frames, as stored in the header ColorID field.
+  enum ColorID {
+    COLOR_MONO = 0,
+    COLOR_BAYER_RGGB = 8,
+    COLOR_BAYER_GRBG = 9,
+    COLOR_BAYER_GBRG = 10,
+    COLOR_BAYER_BGGR = 11,
+    COLOR_RGB = 100,
+    COLOR_BGR = 101,
+  };
+
+protected:
+  int mFd = -1;
+  bool mDirectIO = false;
+  std::string mFilename;
+
+  int mRows = 0;
+  int mCols = 0;
+  int mType = 0;
+  size_t mFrameBytes = 0;
+  std::vector<int64_t> mTimestamps;     ///< UTC of each frame, in SER ticks
+  uint8_t mHeader[SER_HEADER_SIZE];
+
+  uint8_t * mBuffer = nullptr;
+  size_t mBufferSize = 0;
+  size_t mBufferUsed = 0;
+  off_t mBufferOffset = 0;              ///< File offset of the start of the buffer
+  size_t mBytesWritten = 0;
+
+  bool write(const void * data, size_t size, std::string & error);
+  bool flushBuffer(std::string & error);
+  void release();
+
+public:
+  /// \param buffer_size Size of the write buffer. Rounded up to a multiple of 4 KB.
+  SERWriter(size_t buffer_size = 8 << 20);
+
+  /// Closes the file if it is still open.
+  ~SERWriter();
+
+  /// Creates a SER file.
+  /// \param filename Name of the output file. An existing file is replaced.
+  /// \param rows Frame height.
+  /// \param cols Frame width.
+  /// \param cv_type Frame type: CV_8UC1, CV_16UC1, CV_8UC3 or CV_16UC3.
+  /// \param color Pixel layout. Three channel frames must be COLOR_BGR or COLOR_RGB.
+  /// \param instrument Camera name for the header.
+  /// \param expected_frames Number of frames to preallocate space for. More may be appended.
+  /// \param error Set to a description of the problem on failure.
+  /// \return true on success.
+  bool open(const std::string & filename, int rows, int cols, int cv_type, ColorID color,
+            const std::string & instrument, size_t expected_frames, std::string & error);
+
+  /// Appends a frame.
+  /// \param frame Pixels with the size and type given to open().
+  /// \param timestamp UTC time of the frame.
+  /// \return true on success.
+  bool append(const cv::Mat & frame, const std::chrono::time_point<std::chrono::high_resolution_clock> & timestamp,
+              std::string & error);
+
+  /// Writes the timestamps, patches the header and closes the file.
+  /// \return true on success.
+  bool close(std::string & error);
+
+  /// \return true while a file is open.
+  bool isOpen() const { return mFd >= 0; }
+
+  /// \return The number of frames in the open file.
+  size_t frames() const { return mTimestamps.size(); }
+
+  /// \return The name of the open file.
+  const std::string & filename() const { return mFilename; }
+
+  /// \return The number of bytes written to the open file so far.
+  size_t bytesWritten() const { return mBytesWritten; }
+
+  /// \return True if the open file bypasses the page cache.
+  bool directIO() const { return mDirectIO; }
+};
+
+#endif // SER_WRITER_H
@@ -0,0 +1,137 @@
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDirIterator>
+#include <QFileInfo>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "fits_index.hpp"
+
+/// Name of the index written into an indexed directory.
+const char * DEFAULT_INDEX_NAME = "qhy-fits.index";
+
+/// @brief Lists the FITS files below a directory, sorted by path.
+std::vector<std::string> find_fits_files(const QString & directory, bool recursive) {
+  QDirIterator::IteratorFlags flags = recursive ? QDirIterator::Subdirectories : QDirIterator::NoIteratorFlags;
+  QDirIterator it(directory, {"*.fits", "*.fit", "*.fts", "*.FITS", "*.FIT", "*.FTS"}, QDir::Files, flags);
+
+  std::vector<std::string> files;
+  while(it.hasNext())
+    files.push_back(it.next().toStdString());
+  std::sort(files.begin(), files.end());
+
+  return files;
+}
+
+void print_rows(std::ostream & out, const FITSIndex & index, const std::vector<size_t> & rows,
+                const std::vector<size_t> & columns) {
+  for(size_t i = 0; i < columns.size(); i++)
+    out << (i ? "\t" : "") << index.columns()[columns[i]].name;
+  out << "\n";
+
+  for(size_t row : rows) {
+    for(size_t i = 0; i < columns.size(); i++)
+      out << (i ? "\t" : "") << index.text(row, columns[i]);
+    out << "\n";
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  using namespace std;
+
+  QCoreApplication app(argc, argv);
+  QCoreApplication::setApplicationName("qhy-fits-index");
+
+  QCommandLineParser parser;
+  parser.setApplicationDescription("Indexes the headers of a directory of FITS files and queries the index.\n"
+                                   "Given a directory, the index is rebuilt and written to the directory.\n"
+                                   "Given an index file, the existing index is queried.");
+  parser.addHelpOption();
+  parser.addPositionalArgument("path", "Directory to index, or index file to query");
+  parser.addOption({"index", "Index file to write. Default: <directory>/" + QString(DEFAULT_INDEX_NAME), "index"});
+  parser.addOption({"no-recursive", "Do not index subdirectories"});
+  parser.addOption({"threads", "Number of scanning threads. Default: all cores", "threads"});
+  parser.addOption({"where", "Condition on a column, such as FILTER=R or EXPTIME>=10. Repeat to combine.", "where"});
+  parser.addOption({"columns", "Comma separated columns to print. Default: all", "columns"});
+  parser.addOption({"count", "Print the number of matching rows only"});
+  parser.process(app);
+
+  if(parser.positionalArguments().size() != 1)
+    parser.showHelp(-1);
+
+  QString path = parser.positionalArguments().first();
+  FITSIndex index;
+  string error;
+
+  if(QFileInfo(path).isDir()) {
+    int threads = thread::hardware_concurrency();
+    if(parser.isSet("threads"))
+      threads = parser.value("threads").toInt();
+
+    auto start = chrono::steady_clock::now();
+    vector<string> files = find_fits_files(path, !parser.isSet("no-recursive"));
+    vector<string> errors;
+    index.build(files, max(1, threads), errors);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    for(const string & message : errors)
+      cerr << message << endl;
+
+    QString index_file = parser.value("index");
+    if(index_file.isEmpty())
+      index_file = path + "/" + DEFAULT_INDEX_NAME;
+    if(!index.save(index_file.toStdString(), error)) {
+      cerr << error << endl;
+      return -1;
+    }
+
+    cerr << "Indexed " << index.rows() << " images in " << files.size() << " files in "
+         << seconds << " s to " << index_file.toStdString() << endl;
+
+    // Building is enough unless there is something to print.
+    if(!parser.isSet("where") && !parser.isSet("columns") && !parser.isSet("count"))
+      return 0;
+  } else if(!index.load(path.toStdString(), error)) {
+    cerr << error << endl;
+    return -1;
+  }
+
+  vector<FITSIndexCondition> conditions;
+  for(const QString & expression : parser.values("where")) {
+    FITSIndexCondition condition;
+    if(!index.parseCondition(expression.toStdString(), condition, error)) {
+      cerr << error << endl;
+      return -1;
+    }
+    conditions.push_back(condition);
+  }
+
+  vector<size_t> columns;
+  if(parser.isSet("columns")) {
+    for(const QString & name : parser.value("columns").split(",", Qt::SkipEmptyParts)) {
+      auto column = find_if(index.columns().begin(), index.columns().end(),
+                            [&](const FITSIndexColumn & c) { return c.name == name.trimmed().toUpper().toStdString(); });
+      if(column == index.columns().end()) {
+        cerr << "Unknown column " << name.toStdString() << endl;
+        return -1;
+      }
+      columns.push_back(column - index.columns().begin());
+    }
+  } else {
+    for(size_t i = 0; i < index.columns().size(); i++)
+      columns.push_back(i);
+  }
+
+  vector<size_t> rows = index.select(conditions);
+  if(parser.isSet("count"))
+    cout << rows.size() << endl;
+  else
+    print_rows(cout, index, rows, columns);
+
+  return 0;
+}
@@ -0,0 +1,102 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "focus_history.hpp"
+
+namespace {
+/// Space around the plot area, in pixels.
+const int PLOT_MARGIN = 30;
+
+const cv::Scalar HFR_COLOR(255, 255, 255);
+const cv::Scalar FWHM_COLOR(0, 200, 255);
+const cv::Scalar AXIS_COLOR(128, 128, 128);
+
+/// Draws one series as connected line segments, leaving gaps for missing samples.
+void drawSeries(cv::Mat & canvas, const std::deque<double> & values, size_t capacity,
+                double y_min, double y_max, const cv::Scalar & color) {
+
+    const int width  = canvas.cols - 2 * PLOT_MARGIN;
+    const int height = canvas.rows - 2 * PLOT_MARGIN;
+
+    bool have_previous = false;
+    cv::Point previous;
+    for(size_t i = 0; i < values.size(); i++) {
+        if(!(values[i] > 0)) {
+            have_previous = false;
+            continue;
+        }
+
+        int x = PLOT_MARGIN + (int) (width * i / std::max<size_t>(capacity - 1, 1));
+        int y = PLOT_MARGIN + height - (int) (height * (values[i] - y_min) / (y_max - y_min));
+        cv::Point point(x, y);
+        if(have_previous)
+            cv::line(canvas, previous, point, color, 2);
+        else
+            cv::circle(canvas, point, 2, color, -1);
+
+        previous = point;
+        have_previous = true;
+    }
+}
+}
+
+FocusHistory::FocusHistory(size_t capacity)
+    : mCapacity(std::max<size_t>(capacity, 2)) {
+}
+
+void FocusHistory::add(double hfr, double fwhm) {
+
+    mHFR.push_back(hfr > 0 ? hfr : NAN);
+    mFWHM.push_back(fwhm > 0 ? fwhm : NAN);
+    if(mHFR.size() > mCapacity) {
+        mHFR.pop_front();
+        mFWHM.pop_front();
+    }
+
+    if(hfr > 0 && (mBestHFR == 0 || hfr < mBestHFR))
+        mBestHFR = hfr;
+
+    mSamples++;
+}
+
+cv::Mat FocusHistory::plot(int width, int height) const {
+
+    cv::Mat canvas = cv::Mat::zeros(height, width, CV_8UC3);
+
+    // Scale the vertical axis to the visible samples, starting from zero so
+    // changes are shown in proportion.
+    double y_max = 0;
+    for(size_t i = 0; i < mHFR.size(); i++) {
+        if(mHFR[i] > 0)
+            y_max = std::max(y_max, mHFR[i]);
+        if(mFWHM[i] > 0)
+            y_max = std::max(y_max, mFWHM[i]);
+    }
+    if(y_max <= 0)
+        y_max = 1;
+    y_max *= 1.1;
+
+    cv::rectangle(canvas, cv::Point(PLOT_MARGIN, PLOT_MARGIN),
+                  cv::Point(width - PLOT_MARGIN, height - PLOT_MARGIN), AXIS_COLOR, 1);
+
+    drawSeries(canvas, mFWHM, mCapacity, 0, y_max, FWHM_COLOR);
+    drawSeries(canvas, mHFR, mCapacity, 0, y_max, HFR_COLOR);
+
+    // Legend with the latest and best values.
+    char label[128];
+    double hfr  = mHFR.empty() ? NAN : mHFR.back();
+    double fwhm = mFWHM.empty() ? NAN : mFWHM.back();
+    snprintf(label, sizeof(label), "HFR %.2f (best %.2f)", hfr, mBestHFR);
+    cv::putText(canvas, label, cv::Point(PLOT_MARGIN, PLOT_MARGIN - 8), cv::FONT_HERSHEY_SIMPLEX, 0.5, HFR_COLOR, 1);
+    snprintf(label, sizeof(label), "FWHM %.2f", fwhm);
+    cv::putText(canvas, label, cv::Point(width / 2, PLOT_MARGIN - 8), cv::FONT_HERSHEY_SIMPLEX, 0.5, FWHM_COLOR, 1);
+    snprintf(label, sizeof(label), "%.1f px", y_max);
+    cv::putText(canvas, label, cv::Point(2, PLOT_MARGIN + 12), cv::FONT_HERSHEY_SIMPLEX, 0.4, AXIS_COLOR, 1);
+
+    return canvas;
+}
@@ -0,0 +1,41 @@
+#ifndef FOCUS_HISTORY_H
+#define FOCUS_HISTORY_H
+
+#include <deque>
+
+#include <opencv2/core/mat.hpp>
+
+/// @brief Keeps the recent focus metrics and draws them as a plot.
+///
+/// Frames without a measurable star are recorded as gaps.
+class FocusHistory {
+
+protected:
+    size_t mCapacity = 200;
+    std::deque<double> mHFR;
+    std::deque<double> mFWHM;
+    size_t mSamples = 0;
+    double mBestHFR = 0;
+
+public:
+    /// @brief Creates an empty history.
+    /// @param capacity Number of samples shown in the plot.
+    FocusHistory(size_t capacity);
+
+    /// @brief Adds the metrics of one frame. Pass values <= 0 if no star was measured.
+    void add(double hfr, double fwhm);
+
+    /// @brief Draws the history.
+    /// @param width Width of the plot (pixels).
+    /// @param height Height of the plot (pixels).
+    /// @return A CV_8UC3 image.
+    cv::Mat plot(int width, int height) const;
+
+    /// \return The smallest HFR seen so far, or 0 if none was measured.
+    double bestHFR() const { return mBestHFR; }
+
+    /// \return The number of samples added so far.
+    size_t samples() const { return mSamples; }
+};
+
+#endif // FOCUS_HISTORY_H
@@ -0,0 +1,192 @@
+#include <QDebug>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <sys/mman.h>
+
+#include "frame_spool.hpp"
+
+namespace {
+const size_t PAGE_SIZE_BYTES = 4096;
+const size_t HUGE_PAGE_SIZE_BYTES = 2 << 20;
+
+size_t roundUp(size_t value, size_t multiple) {
+    return (value + multiple - 1) / multiple * multiple;
+}
+}
+
+FrameSpool::FrameSpool(int rows, int cols, int type, size_t num_frames, bool use_huge_pages) {
+
+    // Page-align every slot so readouts never straddle a partially used page.
+    cv::Mat prototype(1, 1, type);
+    mFrameBytes = roundUp((size_t) rows * cols * prototype.elemSize(), PAGE_SIZE_BYTES);
+    size_t total_bytes = mFrameBytes * num_frames;
+
+    // Prefault the whole spool now so page faults do not slow down the burst.
+    if(use_huge_pages) {
+        mMappedBytes = roundUp(total_bytes, HUGE_PAGE_SIZE_BYTES);
+        void * memory = mmap(nullptr, mMappedBytes, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE | MAP_HUGETLB, -1, 0);
+        if(memory != MAP_FAILED) {
+            mMemory = (char *) memory;
+            mHugePages = true;
+        } else {
+            qWarning() << "Huge pages are not available for the burst spool, using regular pages";
+        }
+    }
+
+    if(mMemory == nullptr) {
+        mMappedBytes = roundUp(total_bytes, PAGE_SIZE_BYTES);
+        void * memory = mmap(nullptr, mMappedBytes, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+        if(memory == MAP_FAILED) {
+            qCritical() << "Unable to allocate" << mMappedBytes / (1 << 20) << "MB for the burst spool";
+            mMappedBytes = 0;
+            return;
+        }
+        mMemory = (char *) memory;
+
+        // Transparent huge pages are still worth having if the kernel allows them.
+        if(use_huge_pages)
+            madvise(mMemory, mMappedBytes, MADV_HUGEPAGE);
+    }
+
+    mSlots.resize(num_frames);
+    for(size_t i = 0; i < num_frames; i++)
+        mSlots[i].image = cv::Mat(rows, cols, type, mMemory + i * mFrameBytes);
+}
+
+FrameSpool::~FrameSpool() {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mAborting = true;
+    }
+    mDrainCondition.notify_all();
+    mSpaceCondition.notify_all();
+
+    if(mDrainThread.joinable())
+        mDrainThread.join();
+
+    mSlots.clear();
+    if(mMemory != nullptr)
+        munmap(mMemory, mMappedBytes);
+}
+
+size_t FrameSpool::availableMemory() {
+
+    // MemAvailable accounts for reclaimable page cache, unlike MemFree.
+    std::ifstream meminfo("/proc/meminfo");
+    std::string line;
+    while(std::getline(meminfo, line)) {
+        std::istringstream fields(line);
+        std::string key;
+        size_t value_kb = 0;
+        fields >> key >> value_kb;
+        if(key == "MemAvailable:")
+            return value_kb * 1024;
+    }
+
+    return 0;
+}
+
+size_t FrameSpool::maxFrames(size_t frame_bytes, double ram_fraction) {
+    size_t slot_bytes = roundUp(frame_bytes, PAGE_SIZE_BYTES);
+    if(slot_bytes == 0)
+        return 0;
+
+    return (size_t) (availableMemory() * ram_fraction) / slot_bytes;
+}
+
+size_t FrameSpool::pending() const {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mCount;
+}
+
+size_t FrameSpool::highWater() const {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mHighWater;
+}
+
+cv::Mat FrameSpool::acquire() {
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    if(mCount == mSlots.size() && mDrainPaused) {
+        qWarning() << "Burst spool is full, draining to disk during capture";
+        mDrainPaused = false;
+        mDrainCondition.notify_all();
+    }
+
+    mSpaceCondition.wait(lock, [&] { return mAborting || mCount < mSlots.size(); });
+
+    return mSlots[mHead].image;
+}
+
+void FrameSpool::commit(const CVFITS & metadata, const std::string & filename) {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        Slot & slot = mSlots[mHead];
+        cv::Mat image = slot.image;
+        slot.metadata = metadata;
+        slot.metadata.image = image;
+        slot.filename = filename;
+
+        mHead = (mHead + 1) % mSlots.size();
+        mCount++;
+        mHighWater = std::max(mHighWater, mCount);
+    }
+    mDrainCondition.notify_one();
+}
+
+void FrameSpool::startDrain(DrainFunction drain_function, bool paused) {
+    mDrainFunction = drain_function;
+    mDrainPaused = paused;
+    mDrainThread = std::thread(&FrameSpool::drainLoop, this);
+}
+
+void FrameSpool::resume() {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mDrainPaused = false;
+    }
+    mDrainCondition.notify_all();
+}
+
+void FrameSpool::finish() {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mDrainPaused = false;
+        mStopping = true;
+    }
+    mDrainCondition.notify_all();
+
+    if(mDrainThread.joinable())
+        mDrainThread.join();
+}
+
+void FrameSpool::drainLoop() {
+
+    while(true) {
+        Slot * slot = nullptr;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mDrainCondition.wait(lock, [&] {
+                return mAborting || (!mDrainPaused && mCount > 0) || (mStopping && mCount == 0);
+            });
+            if(mAborting || mCount == 0)
+                return;
+
+            slot = &mSlots[mTail];
+        }
+
+        // The producer never touches a committed slot, so it can be drained without the lock.
+        mDrainFunction(slot->image, slot->metadata, slot->filename);
+
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mTail = (mTail + 1) % mSlots.size();
+            mCount--;
+        }
+        mSpaceCondition.notify_one();
+    }
+}
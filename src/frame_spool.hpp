@@ -0,0 +1,112 @@
+#ifndef FRAME_SPOOL_H
+#define FRAME_SPOOL_H
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <opencv2/core/mat.hpp>
+
+#include "cvfits.hpp"
+
+/// @brief A preallocated in-memory ring of raw frames used for burst capture.
+///
+/// Frames are read out from the camera directly into spool slots and later
+/// handed to a drain function on a background thread, which typically
+/// debayers them and writes them to disk.
+class FrameSpool {
+
+public:
+    /// Called from the drain thread for every captured frame.
+    typedef std::function<void(const cv::Mat & raw_image, CVFITS & metadata, const std::string & filename)> DrainFunction;
+
+protected:
+    struct Slot {
+        cv::Mat image;          ///< Header over the slot memory
+        CVFITS metadata;        ///< Exposure information, without pixel data
+        std::string filename;   ///< Output file name
+    };
+
+    char * mMemory = nullptr;
+    size_t mMappedBytes = 0;
+    size_t mFrameBytes = 0;
+    bool mHugePages = false;
+
+    std::vector<Slot> mSlots;
+    size_t mHead = 0;           ///< Next slot the producer will fill
+    size_t mTail = 0;           ///< Next slot the drain thread will empty
+    size_t mCount = 0;          ///< Slots that are committed or being drained
+    size_t mHighWater = 0;      ///< Largest number of slots in use at once
+
+    std::thread mDrainThread;
+    DrainFunction mDrainFunction;
+    bool mDrainPaused = false;
+    bool mStopping = false;     ///< Drain the remaining frames, then exit
+    bool mAborting = false;     ///< Exit without draining
+
+    mutable std::mutex mMutex;
+    std::condition_variable mDrainCondition;
+    std::condition_variable mSpaceCondition;
+
+    void drainLoop();
+
+public:
+    /// @brief Allocates the spool.
+    /// @param rows Height of each frame in pixels
+    /// @param cols Width of each frame in pixels
+    /// @param type OpenCV type of each frame, e.g. CV_16U
+    /// @param num_frames Number of frames the spool can hold
+    /// @param use_huge_pages Try to back the spool with explicit huge pages.
+    FrameSpool(int rows, int cols, int type, size_t num_frames, bool use_huge_pages);
+
+    /// Stops the drain thread, discarding frames that were not drained, and releases the memory.
+    ~FrameSpool();
+
+    /// @brief Returns the memory available for new allocations as reported by the kernel.
+    static size_t availableMemory();
+
+    /// @brief Returns the number of frames that fit in a fraction of the available memory.
+    /// @param frame_bytes Size of one frame in bytes
+    /// @param ram_fraction Fraction of the available memory the spool may use.
+    static size_t maxFrames(size_t frame_bytes, double ram_fraction);
+
+    /// \return true if the spool memory was allocated.
+    bool isAllocated() const { return mMemory != nullptr; }
+
+    /// \return true if the spool is backed by explicit huge pages.
+    bool usesHugePages() const { return mHugePages; }
+
+    /// \return The number of frames the spool can hold.
+    size_t capacity() const { return mSlots.size(); }
+
+    /// \return The number of frames captured but not yet drained.
+    size_t pending() const;
+
+    /// \return The largest number of frames held at once.
+    size_t highWater() const;
+
+    /// @brief Returns the next free slot for the camera to read out into.
+    /// Blocks while the spool is full. A paused drain is resumed if the spool fills up.
+    cv::Mat acquire();
+
+    /// @brief Marks the slot returned by acquire() as holding a complete frame.
+    /// @param metadata Exposure information. The image member is ignored.
+    /// @param filename Name of the output file passed to the drain function.
+    void commit(const CVFITS & metadata, const std::string & filename);
+
+    /// @brief Starts the background drain thread.
+    /// @param drain_function Called for every committed frame, in capture order.
+    /// @param paused If true, frames are held until resume() or finish() is called.
+    void startDrain(DrainFunction drain_function, bool paused);
+
+    /// Resumes a paused drain.
+    void resume();
+
+    /// Drains every remaining frame and stops the drain thread.
+    void finish();
+};
+
+#endif // FRAME_SPOOL_H
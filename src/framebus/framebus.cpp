@@ -0,0 +1,240 @@
+#include <cstring>
+#include <new>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "framebus.hpp"
+
+namespace {
+/// The header occupies the first page so the slots start page aligned.
+const size_t HEADER_SIZE = 4096;
+
+/// Pixel data starts on a cache line boundary.
+const size_t DATA_ALIGNMENT = 64;
+
+/// Slots are whole pages.
+const size_t SLOT_ALIGNMENT = 4096;
+
+size_t roundUp(size_t value, size_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+}
+
+FrameBusPublisher::FrameBusPublisher(const std::string & name, uint32_t slot_count, size_t slot_capacity)
+    : mName(name) {
+
+    static_assert(sizeof(FrameBusHeader) <= HEADER_SIZE, "FrameBusHeader does not fit in the header page");
+
+    if(slot_count < 2)
+        slot_count = 2;
+
+    const size_t data_offset = roundUp(sizeof(FrameBusSlot), DATA_ALIGNMENT);
+    const size_t slot_stride = roundUp(data_offset + slot_capacity, SLOT_ALIGNMENT);
+    const size_t size = HEADER_SIZE + slot_stride * slot_count;
+
+    // Remove a segment left behind by a producer that did not exit cleanly.
+    shm_unlink(mName.c_str());
+
+    int fd = shm_open(mName.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    if(fd < 0)
+        return;
+
+    if(ftruncate(fd, size) != 0) {
+        close(fd);
+        shm_unlink(mName.c_str());
+        return;
+    }
+
+    void * memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(memory == MAP_FAILED) {
+        shm_unlink(mName.c_str());
+        return;
+    }
+
+    mMemory = memory;
+    mSize = size;
+
+    // Initialize the slots before the header so a reader that attaches early
+    // never sees a valid header with uninitialized slots.
+    FrameBusHeader * header = static_cast<FrameBusHeader *>(mMemory);
+    header->slot_count = slot_count;
+    header->data_offset = data_offset;
+    header->slot_stride = slot_stride;
+    header->slot_capacity = slot_capacity;
+    mHeader = header;
+    for(uint32_t i = 0; i < slot_count; i++)
+        new (slot(i + 1)) FrameBusSlot{};
+
+    new (&header->latest) std::atomic<uint64_t>(0);
+    new (&header->producer_alive) std::atomic<uint32_t>(1);
+    header->version = FRAMEBUS_VERSION;
+    std::atomic_thread_fence(std::memory_order_release);
+    header->magic = FRAMEBUS_MAGIC;
+}
+
+FrameBusPublisher::~FrameBusPublisher() {
+    if(mHeader == nullptr)
+        return;
+
+    mHeader->producer_alive.store(0, std::memory_order_release);
+    munmap(mMemory, mSize);
+    shm_unlink(mName.c_str());
+}
+
+FrameBusSlot * FrameBusPublisher::slot(uint64_t frame_number) const {
+    uint64_t index = (frame_number - 1) % mHeader->slot_count;
+    return reinterpret_cast<FrameBusSlot *>(
+        static_cast<char *>(mMemory) + HEADER_SIZE + index * mHeader->slot_stride);
+}
+
+bool FrameBusPublisher::publish(const FrameMetadata & metadata, const void * data) {
+
+    if(mHeader == nullptr || metadata.bytes > mHeader->slot_capacity)
+        return false;
+
+    const uint64_t frame_number = ++mFrameNumber;
+    FrameBusSlot * s = slot(frame_number);
+
+    // Seqlock write: an odd sequence marks the slot as being written.
+    s->sequence.store(2 * frame_number - 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    s->metadata = metadata;
+    s->metadata.frame_number = frame_number;
+    memcpy(reinterpret_cast<char *>(s) + mHeader->data_offset, data, metadata.bytes);
+
+    s->sequence.store(2 * frame_number, std::memory_order_release);
+    mHeader->latest.store(frame_number, std::memory_order_release);
+
+    return true;
+}
+
+FrameBusReader::FrameBusReader(const std::string & name) {
+
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if(fd < 0)
+        return;
+
+    struct stat info;
+    if(fstat(fd, &info) != 0 || (size_t) info.st_size < HEADER_SIZE) {
+        close(fd);
+        return;
+    }
+
+    void * memory = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(memory == MAP_FAILED)
+        return;
+
+    mMemory = memory;
+    mSize = info.st_size;
+
+    const FrameBusHeader * header = static_cast<const FrameBusHeader *>(mMemory);
+    if(header->magic != FRAMEBUS_MAGIC || header->version != FRAMEBUS_VERSION ||
+       HEADER_SIZE + header->slot_stride * header->slot_count > mSize) {
+        munmap(mMemory, mSize);
+        mMemory = nullptr;
+        return;
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    mHeader = header;
+    mNext = mHeader->latest.load(std::memory_order_acquire) + 1;
+}
+
+FrameBusReader::~FrameBusReader() {
+    if(mMemory != nullptr)
+        munmap(mMemory, mSize);
+}
+
+const FrameBusSlot * FrameBusReader::slot(uint64_t frame_number) const {
+    uint64_t index = (frame_number - 1) % mHeader->slot_count;
+    return reinterpret_cast<const FrameBusSlot *>(
+        static_cast<const char *>(mMemory) + HEADER_SIZE + index * mHeader->slot_stride);
+}
+
+bool FrameBusReader::readSlot(uint64_t frame_number, FrameView & view) const {
+
+    const FrameBusSlot * s = slot(frame_number);
+    if(s->sequence.load(std::memory_order_acquire) != 2 * frame_number)
+        return false;
+
+    view.frame_number = frame_number;
+    view.metadata = &s->metadata;
+    view.data = reinterpret_cast<const char *>(s) + mHeader->data_offset;
+
+    // The metadata must be intact; the pixels are checked by the caller.
+    return stillValid(view) && view.metadata->bytes <= mHeader->slot_capacity;
+}
+
+FrameBusReader::Status FrameBusReader::next(FrameView & view) {
+
+    if(mHeader == nullptr)
+        return BUS_CLOSED;
+
+    const uint64_t latest = mHeader->latest.load(std::memory_order_acquire);
+    if(mNext > latest)
+        return mHeader->producer_alive.load(std::memory_order_acquire) ? FRAME_NONE : BUS_CLOSED;
+
+    // Frames older than the ring have been overwritten.
+    Status status = FRAME_OK;
+    if(latest - mNext >= mHeader->slot_count) {
+        uint64_t oldest = latest - mHeader->slot_count + 1;
+        mMissed += oldest - mNext;
+        mNext = oldest;
+        status = FRAME_OVERRUN;
+    }
+
+    // The oldest slot may be overwritten while we look at it, so move forward
+    // until a complete frame is found.
+    while(mNext <= latest) {
+        uint64_t frame_number = mNext++;
+        if(readSlot(frame_number, view))
+            return status;
+
+        mMissed++;
+        status = FRAME_OVERRUN;
+    }
+
+    return FRAME_NONE;
+}
+
+FrameBusReader::Status FrameBusReader::latest(FrameView & view) {
+
+    if(mHeader == nullptr)
+        return BUS_CLOSED;
+
+    const uint64_t latest = mHeader->latest.load(std::memory_order_acquire);
+    if(mNext > latest)
+        return mHeader->producer_alive.load(std::memory_order_acquire) ? FRAME_NONE : BUS_CLOSED;
+
+    // Skipping frames on purpose is not an overrun.
+    mNext = latest;
+    return next(view) == FRAME_NONE ? FRAME_NONE : FRAME_OK;
+}
+
+bool FrameBusReader::stillValid(const FrameView & view) const {
+
+    if(mHeader == nullptr || view.metadata == nullptr)
+        return false;
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return slot(view.frame_number)->sequence.load(std::memory_order_relaxed) == 2 * view.frame_number;
+}
+
+bool FrameBusReader::copy(const FrameView & view, void * buffer) const {
+
+    if(view.metadata == nullptr)
+        return false;
+
+    const uint32_t bytes = view.metadata->bytes;
+    if(!stillValid(view))
+        return false;
+
+    memcpy(buffer, view.data, bytes);
+    return stillValid(view);
+}
@@ -0,0 +1,185 @@
+#ifndef FRAMEBUS_H
+#define FRAMEBUS_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/// Identifies a frame bus segment.
+const uint32_t FRAMEBUS_MAGIC = 0x51484246; // "QHBF"
+
+/// Layout version. Readers refuse segments with a different version.
+const uint32_t FRAMEBUS_VERSION = 1;
+
+/// Default name of the shared memory segment.
+const char FRAMEBUS_DEFAULT_NAME[] = "/qhy-framebus";
+
+/// @brief Exposure information published with every frame.
+///
+/// Mirrors the fields of CVFITS in a fixed-size, pointer-free layout so it can
+/// live in shared memory. Times are nanoseconds since the UNIX epoch (UTC).
+struct FrameMetadata {
+    uint64_t frame_number = 0;  ///< Frame counter, starting at 1
+    int32_t rows = 0;           ///< Image height (pixels)
+    int32_t cols = 0;           ///< Image width (pixels)
+    int32_t cv_type = 0;        ///< OpenCV type of the pixels, e.g. CV_16UC1 or CV_16UC3
+    uint32_t bytes = 0;         ///< Size of the pixel data
+    uint32_t stride = 0;        ///< Bytes per image row
+    int32_t aborted = 0;        ///< Whether the readout was aborted
+
+    char filter_name[32] = {0};
+    char detector_name[64] = {0};
+    char bin_mode_name[16] = {0};
+    char catalog_name[64] = {0};
+    char object_name[64] = {0};
+    int32_t xbinning = 1;
+    int32_t ybinning = 1;
+
+    int64_t exposure_start_ns = 0;
+    int64_t exposure_end_ns = 0;
+    int64_t readout_start_ns = 0;
+    int64_t readout_end_ns = 0;
+    double exposure_duration_sec = 0;
+
+    double latitude = 0;        ///< Radians
+    double longitude = 0;       ///< Radians
+    double altitude = 0;        ///< Meters
+    double temperature = 0;     ///< Sensor temperature (Celsius)
+    double gain = 0;            ///< Camera gain setting
+
+    int32_t ra_dec_set = 0;
+    int32_t azm_alt_set = 0;
+    double ra = 0;              ///< Radians
+    double dec = 0;             ///< Radians
+    double azm = 0;             ///< Radians
+    double alt = 0;             ///< Radians
+
+    int32_t star_stats_set = 0;
+    int32_t nstars = 0;
+    double fwhm = 0;            ///< Pixels
+    double bkg_mean = 0;        ///< ADU
+    double bkg_rms = 0;         ///< ADU
+};
+
+/// @brief The start of the shared memory segment.
+struct FrameBusHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slot_count;        ///< Number of frames in the ring
+    uint32_t data_offset;       ///< Offset of the pixel data from the start of a slot
+    uint64_t slot_stride;       ///< Distance between slots
+    uint64_t slot_capacity;     ///< Largest frame a slot can hold, in bytes
+    std::atomic<uint64_t> latest;       ///< Number of the newest complete frame, 0 if none
+    std::atomic<uint32_t> producer_alive; ///< Cleared when the producer closes the bus
+};
+
+/// @brief One entry of the ring.
+///
+/// `sequence` is a seqlock: it is odd while the producer writes the slot and
+/// equal to twice the frame number once the frame is complete.
+struct FrameBusSlot {
+    std::atomic<uint64_t> sequence;
+    FrameMetadata metadata;
+};
+
+/// @brief Publishes frames into a POSIX shared memory ring.
+///
+/// The producer never waits for readers. Slow readers detect that a frame was
+/// overwritten from the slot sequence numbers.
+class FrameBusPublisher {
+
+protected:
+    std::string mName;
+    void * mMemory = nullptr;
+    size_t mSize = 0;
+    FrameBusHeader * mHeader = nullptr;
+    uint64_t mFrameNumber = 0;
+
+    FrameBusSlot * slot(uint64_t frame_number) const;
+
+public:
+    /// @brief Creates the shared memory segment, replacing any stale segment with the same name.
+    /// @param name Name of the segment, e.g. "/qhy-framebus".
+    /// @param slot_count Number of frames in the ring.
+    /// @param slot_capacity Largest frame that will be published, in bytes.
+    FrameBusPublisher(const std::string & name, uint32_t slot_count, size_t slot_capacity);
+
+    /// Marks the bus closed and removes the segment. Attached readers keep their mapping.
+    ~FrameBusPublisher();
+
+    /// \return true if the segment was created.
+    bool isOpen() const { return mHeader != nullptr; }
+
+    /// @brief Copies a frame into the next slot.
+    /// @param metadata Exposure information. The frame number is assigned here.
+    /// @param data Pixel data, `metadata.rows` rows of `metadata.stride` bytes.
+    /// @return false if the frame is larger than a slot.
+    bool publish(const FrameMetadata & metadata, const void * data);
+
+    /// \return The number of the last frame published.
+    uint64_t frameNumber() const { return mFrameNumber; }
+};
+
+/// A frame in shared memory, as returned by FrameBusReader.
+struct FrameView {
+    uint64_t frame_number = 0;
+    const FrameMetadata * metadata = nullptr; ///< Points into shared memory
+    const void * data = nullptr;              ///< Points into shared memory
+};
+
+/// @brief Reads frames from a FrameBusPublisher without copying them.
+///
+/// The returned views point directly into shared memory. Because the producer
+/// never waits, call stillValid() after using a view to make sure the slot was
+/// not overwritten in the meantime, or use copy() to take a private copy.
+class FrameBusReader {
+
+public:
+    /// Result of a read.
+    enum Status {
+        FRAME_OK,       ///< The next frame was returned.
+        FRAME_OVERRUN,  ///< Frames were overwritten before they were read. The oldest available frame was returned.
+        FRAME_NONE,     ///< No new frame is available.
+        BUS_CLOSED,     ///< The producer has closed the bus.
+    };
+
+protected:
+    void * mMemory = nullptr;
+    size_t mSize = 0;
+    const FrameBusHeader * mHeader = nullptr;
+    uint64_t mNext = 1;
+    uint64_t mMissed = 0;
+
+    const FrameBusSlot * slot(uint64_t frame_number) const;
+    bool readSlot(uint64_t frame_number, FrameView & view) const;
+
+public:
+    /// @brief Attaches to an existing bus. Only frames published after this call are read.
+    /// @param name Name of the segment, e.g. "/qhy-framebus".
+    FrameBusReader(const std::string & name);
+
+    /// Detaches from the bus.
+    ~FrameBusReader();
+
+    /// \return true if the reader is attached.
+    bool isAttached() const { return mHeader != nullptr; }
+
+    /// @brief Returns the next unread frame.
+    Status next(FrameView & view);
+
+    /// @brief Returns the newest frame, skipping any unread frames.
+    Status latest(FrameView & view);
+
+    /// @brief Checks that a view has not been overwritten since it was returned.
+    bool stillValid(const FrameView & view) const;
+
+    /// @brief Copies the pixels of a view into `buffer`, which must hold `metadata->bytes` bytes.
+    /// @return false if the frame was overwritten during the copy.
+    bool copy(const FrameView & view, void * buffer) const;
+
+    /// \return The number of frames overwritten before they could be read.
+    uint64_t missed() const { return mMissed; }
+};
+
+#endif // FRAMEBUS_H
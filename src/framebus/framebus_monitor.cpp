@@ -0,0 +1,73 @@
+#include <cstdio>
+#include <string>
+
+#include <signal.h>
+#include <unistd.h>
+
+#include "framebus.hpp"
+
+/// Example consumer: prints one line per frame published on the bus.
+
+bool keep_running = true;
+
+void sig_handler(int signal) {
+    keep_running = false;
+}
+
+int main(int argc, char *argv[])
+{
+    std::string name = (argc > 1) ? argv[1] : FRAMEBUS_DEFAULT_NAME;
+
+    signal(SIGINT, sig_handler);
+    signal(SIGTERM, sig_handler);
+
+    FrameBusReader reader(name);
+    if(!reader.isAttached()) {
+        fprintf(stderr, "Could not attach to frame bus %s. Is qhy-camera-control running with --framebus?\n", name.c_str());
+        return -1;
+    }
+
+    printf("%8s %6s %6s %10s %10s %8s %s\n", "frame", "cols", "rows", "exp (s)", "mean", "missed", "object");
+
+    FrameView view;
+    while(keep_running) {
+        FrameBusReader::Status status = reader.next(view);
+        if(status == FrameBusReader::BUS_CLOSED)
+            break;
+
+        if(status == FrameBusReader::FRAME_NONE) {
+            usleep(1000);
+            continue;
+        }
+
+        // Read straight from shared memory, then confirm the slot was not
+        // overwritten while we looked at it.
+        const FrameMetadata & metadata = *view.metadata;
+        double mean = 0;
+        size_t num_values = 0;
+        if(metadata.bytes > 0 && (metadata.cv_type & 7) == 2) { // CV_16U
+            const uint16_t * pixels = static_cast<const uint16_t *>(view.data);
+            num_values = metadata.bytes / sizeof(uint16_t);
+            for(size_t i = 0; i < num_values; i++)
+                mean += pixels[i];
+            mean /= num_values;
+        } else if(metadata.bytes > 0 && (metadata.cv_type & 7) == 0) { // CV_8U
+            const uint8_t * pixels = static_cast<const uint8_t *>(view.data);
+            num_values = metadata.bytes;
+            for(size_t i = 0; i < num_values; i++)
+                mean += pixels[i];
+            mean /= num_values;
+        }
+
+        if(!reader.stillValid(view))
+            continue;
+
+        printf("%8llu %6d %6d %10.4f %10.1f %8llu %s\n",
+               (unsigned long long) view.frame_number, metadata.cols, metadata.rows,
+               metadata.exposure_duration_sec, mean, (unsigned long long) reader.missed(),
+               metadata.object_name);
+        fflush(stdout);
+    }
+
+    return 0;
+}
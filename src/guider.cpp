@@ -0,0 +1,189 @@
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "guider.hpp"
+
+namespace {
+/// Width of the ROI border used to estimate the background, in pixels.
+const int BORDER_WIDTH = 2;
+
+/// Pixels must exceed the background by this many standard deviations to enter the centroid.
+const double CENTROID_THRESHOLD = 2.0;
+
+/// Refinement steps for the centroid.
+const int CENTROID_ITERATIONS = 3;
+}
+
+GuideCentroider::GuideCentroider(int window_radius, double min_snr)
+    : mWindowRadius(std::max(window_radius, 1)), mMinSNR(min_snr) {
+}
+
+GuideCentroid GuideCentroider::measure(const uint16_t * data, int width, int height) const {
+
+    GuideCentroid result;
+    if(width < 2 * BORDER_WIDTH + 3 || height < 2 * BORDER_WIDTH + 3)
+        return result;
+
+    // Background and noise from the pixels along the ROI border.
+    double sum = 0, sum_sq = 0, n = 0;
+    for(int y = 0; y < height; y++) {
+        const uint16_t * row = data + (size_t) y * width;
+        bool border_row = (y < BORDER_WIDTH || y >= height - BORDER_WIDTH);
+        for(int x = 0; x < width; x++) {
+            if(border_row || x < BORDER_WIDTH || x >= width - BORDER_WIDTH) {
+                sum += row[x];
+                sum_sq += (double) row[x] * row[x];
+                n += 1;
+            }
+        }
+    }
+    double background = sum / n;
+    double noise = std::sqrt(std::max(sum_sq / n - background * background, 1.0));
+
+    // Peak of the 3x3 box sum, which ignores isolated hot pixels.
+    int peak_x = 0, peak_y = 0;
+    uint32_t peak_sum = 0;
+    for(int y = 1; y < height - 1; y++) {
+        const uint16_t * above = data + (size_t) (y - 1) * width;
+        const uint16_t * row   = data + (size_t) y * width;
+        const uint16_t * below = data + (size_t) (y + 1) * width;
+        for(int x = 1; x < width - 1; x++) {
+            uint32_t box = above[x - 1] + above[x] + above[x + 1]
+                         + row[x - 1]   + row[x]   + row[x + 1]
+                         + below[x - 1] + below[x] + below[x + 1];
+            if(box > peak_sum) {
+                peak_sum = box;
+                peak_x = x;
+                peak_y = y;
+            }
+        }
+    }
+
+    // Iterated centre of mass of the pixels above the threshold.
+    const double threshold = background + CENTROID_THRESHOLD * noise;
+    double cx = peak_x;
+    double cy = peak_y;
+    double flux = 0;
+    double num_pixels = 0;
+    for(int iteration = 0; iteration < CENTROID_ITERATIONS; iteration++) {
+        int x0 = std::max((int) std::lround(cx) - mWindowRadius, 0);
+        int x1 = std::min((int) std::lround(cx) + mWindowRadius + 1, width);
+        int y0 = std::max((int) std::lround(cy) - mWindowRadius, 0);
+        int y1 = std::min((int) std::lround(cy) + mWindowRadius + 1, height);
+
+        double mx = 0, my = 0;
+        flux = 0;
+        num_pixels = 0;
+        for(int y = y0; y < y1; y++) {
+            const uint16_t * row = data + (size_t) y * width;
+            for(int x = x0; x < x1; x++) {
+                if(row[x] > threshold) {
+                    double value = row[x] - background;
+                    flux += value;
+                    mx += value * x;
+                    my += value * y;
+                    num_pixels += 1;
+                }
+            }
+        }
+        if(flux <= 0)
+            return result;
+
+        cx = mx / flux;
+        cy = my / flux;
+    }
+
+    result.snr = flux / std::sqrt(flux + num_pixels * noise * noise);
+    result.valid = (result.snr >= mMinSNR);
+    result.x = cx;
+    result.y = cy;
+    result.flux = flux;
+    return result;
+}
+
+GuidePublisher::GuidePublisher(Transport transport, const std::string & path)
+    : mTransport(transport) {
+
+    memset(&mAddress, 0, sizeof(mAddress));
+
+    if(mTransport == TRANSPORT_FIFO) {
+        if(mkfifo(path.c_str(), 0666) != 0 && errno != EEXIST)
+            return;
+
+        // A reader that goes away turns writes into EPIPE instead of ending the process.
+        signal(SIGPIPE, SIG_IGN);
+
+        // Without a reader the open fails with ENXIO. It is retried on every correction.
+        mPath = path;
+        mReady = true;
+        openFIFO();
+    } else {
+        if(path.size() >= sizeof(mAddress.sun_path))
+            return;
+
+        mAddress.sun_family = AF_UNIX;
+        strncpy(mAddress.sun_path, path.c_str(), sizeof(mAddress.sun_path) - 1);
+        mFd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+        mReady = (mFd >= 0);
+    }
+}
+
+bool GuidePublisher::openFIFO() {
+    // Write-only, so the pipe holds no read end of ours and nothing queues up
+    // while no guider is attached.
+    mFd = open(mPath.c_str(), O_WRONLY | O_NONBLOCK);
+    return mFd >= 0;
+}
+
+GuidePublisher::~GuidePublisher() {
+    if(mFd >= 0)
+        close(mFd);
+}
+
+bool GuidePublisher::publish(double timestamp, double dx, double dy, bool valid) {
+
+    if(!mReady)
+        return false;
+
+    // Format into a stack buffer. Lines are shorter than PIPE_BUF, so FIFO writes are atomic.
+    char message[96];
+    int length = snprintf(message, sizeof(message), "%.6f %.3f %.3f %d\n", timestamp, dx, dy, valid ? 1 : 0);
+    if(length <= 0)
+        return false;
+
+    ssize_t written;
+    if(mTransport == TRANSPORT_FIFO) {
+        if(mFd < 0 && !openFIFO()) {
+            mDropped++;
+            return false;
+        }
+
+        // EAGAIN means the reader is behind, so this correction is dropped.
+        // EPIPE means it left, so the pipe is opened again for the next one.
+        written = write(mFd, message, length);
+        if(written < 0 && errno == EPIPE) {
+            close(mFd);
+            mFd = -1;
+        }
+    } else {
+        written = sendto(mFd, message, length, MSG_DONTWAIT,
+                         (const struct sockaddr *) &mAddress, sizeof(mAddress));
+    }
+
+    if(written != length) {
+        mDropped++;
+        return false;
+    }
+
+    mSent++;
+    return true;
+}
@@ -0,0 +1,98 @@
+#ifndef GUIDER_H
+#define GUIDER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include <sys/un.h>
+
+/// The position of a guide star within a region of interest.
+struct GuideCentroid {
+    bool valid = false; ///< Whether a star was found
+    double x = 0;       ///< Centroid, X (pixels from the ROI origin)
+    double y = 0;       ///< Centroid, Y (pixels from the ROI origin)
+    double flux = 0;    ///< Background subtracted flux (ADU)
+    double snr = 0;     ///< Signal to noise ratio of the flux
+};
+
+/// @brief Finds a guide star in a small 16-bit region of interest.
+///
+/// Works directly on the camera buffer and never allocates, so it can run
+/// in the readout loop. The background is taken from the ROI border, the star
+/// is located on the peak of a 3x3 box sum and refined with an iterated,
+/// thresholded centre of mass.
+class GuideCentroider {
+
+protected:
+    int mWindowRadius = 8;
+    double mMinSNR = 5;
+
+public:
+    /// @brief Creates a centroider.
+    /// @param window_radius Half width of the centroid window (pixels).
+    /// @param min_snr Stars fainter than this signal to noise ratio are rejected.
+    GuideCentroider(int window_radius, double min_snr);
+
+    /// @brief Measures the guide star.
+    /// @param data Row-major 16-bit pixels.
+    /// @param width Width of the ROI (pixels).
+    /// @param height Height of the ROI (pixels).
+    GuideCentroid measure(const uint16_t * data, int width, int height) const;
+};
+
+/// @brief Publishes guide corrections to a Unix datagram socket or a FIFO.
+///
+/// Each correction is one line of text, `timestamp dx dy valid`, written with
+/// a single non-blocking call. If no reader is listening the correction is
+/// dropped rather than delaying the next frame.
+class GuidePublisher {
+
+public:
+    /// How corrections leave the process.
+    enum Transport {
+        TRANSPORT_SOCKET,   ///< Datagrams sent to a socket bound by the reader
+        TRANSPORT_FIFO,     ///< Lines written to a named pipe
+    };
+
+protected:
+    Transport mTransport = TRANSPORT_SOCKET;
+    std::string mPath;
+    bool mReady = false;
+    int mFd = -1;
+    struct sockaddr_un mAddress;
+    size_t mSent = 0;
+    size_t mDropped = 0;
+
+    bool openFIFO();
+
+public:
+    /// @brief Opens the output.
+    /// @param transport How corrections leave the process.
+    /// @param path Socket or FIFO path. A missing FIFO is created. The FIFO is
+    /// opened for writing only, once a reader has it open, so corrections
+    /// made while no guider is listening are dropped rather than queued.
+    GuidePublisher(Transport transport, const std::string & path);
+
+    /// Closes the output.
+    ~GuidePublisher();
+
+    /// \return true if the socket was created, or the FIFO exists.
+    bool isOpen() const { return mReady; }
+
+    /// @brief Sends one correction.
+    /// @param timestamp UNIX time of the frame (seconds).
+    /// @param dx Offset of the star from the lock position, X (pixels).
+    /// @param dy Offset of the star from the lock position, Y (pixels).
+    /// @param valid Whether the star was measured in this frame.
+    /// @return false if the correction was dropped, e.g. because no reader is attached or the reader fell behind.
+    bool publish(double timestamp, double dx, double dy, bool valid);
+
+    /// \return The number of corrections sent.
+    size_t sent() const { return mSent; }
+
+    /// \return The number of corrections dropped.
+    size_t dropped() const { return mDropped; }
+};
+
+#endif // GUIDER_H
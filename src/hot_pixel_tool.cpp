@@ -0,0 +1,92 @@
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDir>
+#include <QDirIterator>
+#include <QFileInfo>
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+#include "cvfits.hpp"
+#include "hot_pixels.hpp"
+
+/// @brief Lists the dark frames named on the command line, expanding directories.
+std::vector<std::string> find_dark_files(const QStringList & arguments) {
+    std::vector<std::string> files;
+    for(const QString & argument : arguments) {
+        if(QFileInfo(argument).isDir()) {
+            QDirIterator it(argument, {"*.fits", "*.fit", "*.fts", "*.FITS", "*.FIT", "*.FTS"}, QDir::Files);
+            while(it.hasNext())
+                files.push_back(it.next().toStdString());
+        } else {
+            files.push_back(argument.toStdString());
+        }
+    }
+    std::sort(files.begin(), files.end());
+
+    return files;
+}
+
+int main(int argc, char *argv[])
+{
+    using namespace std;
+
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("qhy-hot-pixels");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Finds the hot pixels in a series of raw dark frames and writes a map\n"
+                                     "for the --hot-pixel-map option of the capture applications.");
+    parser.addHelpOption();
+    parser.addPositionalArgument("darks", "Dark frames, or directories of dark frames", "darks...");
+    parser.addOption({"output", "Map file to write. Default: hot_pixels.map", "output"});
+    parser.addOption({"sigma", "Detection threshold in units of the frame noise. Default: 5", "sigma"});
+    parser.addOption({"min-fraction", "Fraction of the frames a pixel must be hot in. Default: 0.5", "min-fraction"});
+    parser.addOption({"cfa", "The frames are Bayer mosaics; compare pixels of the same color only"});
+    parser.addOption({"print", "Print the x y coordinates of the hot pixels"});
+    parser.process(app);
+
+    vector<string> files = find_dark_files(parser.positionalArguments());
+    if(files.empty())
+        parser.showHelp(-1);
+
+    double sigma = parser.isSet("sigma") ? parser.value("sigma").toDouble() : 5;
+    double min_fraction = parser.isSet("min-fraction") ? parser.value("min-fraction").toDouble() : 0.5;
+    HotPixelDetector detector(sigma, min_fraction, parser.isSet("cfa"));
+
+    string error;
+    for(const string & file : files) {
+        CVFITS dark(file);
+        if(dark.image.empty()) {
+            cerr << "Skipping " << file << ": not a readable image" << endl;
+            continue;
+        }
+        if(!detector.addFrame(dark.image, error)) {
+            cerr << "Skipping " << file << ": " << error << endl;
+            continue;
+        }
+    }
+
+    if(detector.frames() == 0) {
+        cerr << "No usable dark frames" << endl;
+        return -1;
+    }
+
+    HotPixelMap map = detector.map();
+    string output = parser.isSet("output") ? parser.value("output").toStdString() : "hot_pixels.map";
+    if(!map.save(output, error)) {
+        cerr << error << endl;
+        return -1;
+    }
+
+    if(parser.isSet("print")) {
+        for(uint32_t index : map.pixels())
+            cout << index % map.cols() << " " << index / map.cols() << endl;
+    }
+
+    cerr << map.pixels().size() << " hot pixels (" << 100.0 * map.pixels().size() / ((double) map.cols() * map.rows())
+         << "%) in " << detector.frames() << " frames written to " << output << endl;
+
+    return 0;
+}
@@ -0,0 +1,225 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "hot_pixels.hpp"
+
+namespace {
+const char MAP_MAGIC[8] = {'Q', 'H', 'Y', 'H', 'O', 'T', 'P', 'X'};
+const uint32_t MAP_VERSION = 1;
+const uint32_t MAP_FLAG_CFA = 1;
+
+/// Residuals sampled to estimate the noise of a dark frame.
+const size_t NOISE_SAMPLES = 1 << 20;
+
+/// Neighbours of a pixel, in units of the colour plane spacing.
+const int NEIGHBOURS[8][2] = {{-1, -1}, {0, -1}, {1, -1}, {-1, 0}, {1, 0}, {-1, 1}, {0, 1}, {1, 1}};
+
+template <typename T>
+void repairPixels(cv::Mat & frame, const std::vector<uint32_t> & pixels, int step) {
+
+    for(uint32_t index : pixels) {
+        const int x = index % frame.cols;
+        const int y = index / frame.cols;
+
+        // Other defects are skipped, so the result does not depend on the
+        // order in which the pixels are repaired.
+        T values[8];
+        int n = 0;
+        for(const int * offset : NEIGHBOURS) {
+            const int nx = x + offset[0] * step;
+            const int ny = y + offset[1] * step;
+            if(nx < 0 || ny < 0 || nx >= frame.cols || ny >= frame.rows)
+                continue;
+            if(std::binary_search(pixels.begin(), pixels.end(), (uint32_t) ny * frame.cols + nx))
+                continue;
+            values[n++] = frame.ptr<T>(ny)[nx];
+        }
+        if(n == 0)
+            continue;
+
+        std::nth_element(values, values + n / 2, values + n);
+        int median = values[n / 2];
+        if(n % 2 == 0)
+            median = (median + *std::max_element(values, values + n / 2) + 1) / 2;
+        frame.ptr<T>(y)[x] = (T) median;
+    }
+}
+
+/// @return The pixels of one colour of a mosaic, (px, py) being the position in the 2x2 cell.
+cv::Mat extractPlane(const cv::Mat & frame, int px, int py, int step) {
+    cv::Mat plane((frame.rows - py + step - 1) / step, (frame.cols - px + step - 1) / step, CV_32F);
+    for(int y = 0; y < plane.rows; y++) {
+        const float * in = frame.ptr<float>(py + y * step) + px;
+        float * out = plane.ptr<float>(y);
+        for(int x = 0; x < plane.cols; x++)
+            out[x] = in[x * step];
+    }
+    return plane;
+}
+
+void insertPlane(const cv::Mat & plane, cv::Mat & frame, int px, int py, int step) {
+    for(int y = 0; y < plane.rows; y++) {
+        const float * in = plane.ptr<float>(y);
+        float * out = frame.ptr<float>(py + y * step) + px;
+        for(int x = 0; x < plane.cols; x++)
+            out[x * step] = in[x];
+    }
+}
+}
+
+HotPixelMap::HotPixelMap(int cols, int rows, bool cfa, std::vector<uint32_t> pixels)
+    : mCols(cols), mRows(rows), mCFA(cfa), mPixels(std::move(pixels)) {
+    std::sort(mPixels.begin(), mPixels.end());
+}
+
+bool HotPixelMap::load(const std::string & filename, std::string & error) {
+
+    std::ifstream in(filename, std::ios::binary);
+    if(!in) {
+        error = filename + ": " + strerror(errno);
+        return false;
+    }
+
+    char magic[sizeof(MAP_MAGIC)] = {0};
+    uint32_t header[5] = {0};   // version, cols, rows, flags, count
+    in.read(magic, sizeof(magic));
+    in.read((char *) header, sizeof(header));
+    if(!in || memcmp(magic, MAP_MAGIC, sizeof(MAP_MAGIC)) != 0 || header[0] != MAP_VERSION) {
+        error = filename + " is not a hot pixel map";
+        return false;
+    }
+
+    std::vector<uint32_t> pixels(header[4]);
+    in.read((char *) pixels.data(), pixels.size() * sizeof(uint32_t));
+    if(!in) {
+        error = filename + " is truncated";
+        return false;
+    }
+
+    const uint32_t frame_pixels = header[1] * header[2];
+    if(std::any_of(pixels.begin(), pixels.end(), [&](uint32_t index) { return index >= frame_pixels; })) {
+        error = filename + " lists pixels outside the frame";
+        return false;
+    }
+
+    *this = HotPixelMap(header[1], header[2], header[3] & MAP_FLAG_CFA, pixels);
+    return true;
+}
+
+bool HotPixelMap::save(const std::string & filename, std::string & error) const {
+
+    std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+    if(!out) {
+        error = filename + ": " + strerror(errno);
+        return false;
+    }
+
+    uint32_t header[5] = {MAP_VERSION, (uint32_t) mCols, (uint32_t) mRows, mCFA ? MAP_FLAG_CFA : 0,
+                          (uint32_t) mPixels.size()};
+    out.write(MAP_MAGIC, sizeof(MAP_MAGIC));
+    out.write((const char *) header, sizeof(header));
+    out.write((const char *) mPixels.data(), mPixels.size() * sizeof(uint32_t));
+
+    if(!out.flush()) {
+        error = filename + ": write failed";
+        return false;
+    }
+
+    return true;
+}
+
+bool HotPixelMap::repair(cv::Mat & frame) const {
+
+    if(frame.cols != mCols || frame.rows != mRows || frame.channels() != 1)
+        return false;
+
+    const int step = mCFA ? 2 : 1;
+    if(frame.depth() == CV_8U)
+        repairPixels<uint8_t>(frame, mPixels, step);
+    else if(frame.depth() == CV_16U)
+        repairPixels<uint16_t>(frame, mPixels, step);
+    else
+        return false;
+
+    return true;
+}
+
+HotPixelDetector::HotPixelDetector(double sigma, double min_fraction, bool cfa)
+    : mSigma(sigma), mMinFraction(min_fraction), mCFA(cfa) {
+}
+
+bool HotPixelDetector::addFrame(const cv::Mat & dark, std::string & error) {
+
+    if(dark.channels() != 1) {
+        error = "Dark frames must be single channel raw frames";
+        return false;
+    }
+    if(mFrames > 0 && dark.size() != mCounts.size()) {
+        error = "Dark frame size differs from the first frame";
+        return false;
+    }
+    if(mFrames == 0)
+        mCounts = cv::Mat::zeros(dark.size(), CV_16U);
+
+    cv::Mat frame;
+    dark.convertTo(frame, CV_32F);
+
+    // How far each pixel stands above its neighbours of the same colour.
+    const int step = mCFA ? 2 : 1;
+    cv::Mat residual(frame.size(), CV_32F);
+    for(int py = 0; py < step; py++) {
+        for(int px = 0; px < step; px++) {
+            cv::Mat plane = extractPlane(frame, px, py, step);
+            cv::Mat median;
+            cv::medianBlur(plane, median, 3);
+            insertPlane(plane - median, residual, px, py, step);
+        }
+    }
+
+    // Noise from the median absolute residual of a sample of the frame.
+    const size_t total = residual.total();
+    const size_t stride = std::max<size_t>(1, total / NOISE_SAMPLES);
+    cv::Mat continuous = residual.isContinuous() ? residual : residual.clone();
+    const float * values = continuous.ptr<float>();
+    std::vector<float> samples;
+    samples.reserve(total / stride + 1);
+    for(size_t i = 0; i < total; i += stride)
+        samples.push_back(std::abs(values[i]));
+    std::nth_element(samples.begin(), samples.begin() + samples.size() / 2, samples.end());
+
+    // Integer data can have a median residual of zero. Never go below one count.
+    const double noise = std::max(1.4826 * samples[samples.size() / 2], 1.0);
+    const float threshold = mSigma * noise;
+
+    for(int y = 0; y < residual.rows; y++) {
+        const float * r = residual.ptr<float>(y);
+        uint16_t * count = mCounts.ptr<uint16_t>(y);
+        for(int x = 0; x < residual.cols; x++) {
+            if(r[x] > threshold && count[x] < UINT16_MAX)
+                count[x]++;
+        }
+    }
+
+    mFrames++;
+    return true;
+}
+
+HotPixelMap HotPixelDetector::map() const {
+
+    std::vector<uint32_t> pixels;
+    const int min_count = std::max(1, (int) std::ceil(mMinFraction * mFrames));
+    for(int y = 0; y < mCounts.rows; y++) {
+        const uint16_t * count = mCounts.ptr<uint16_t>(y);
+        for(int x = 0; x < mCounts.cols; x++) {
+            if(count[x] >= min_count)
+                pixels.push_back((uint32_t) y * mCounts.cols + x);
+        }
+    }
+
+    return HotPixelMap(mCounts.cols, mCounts.rows, mCFA, pixels);
+}
@@ -0,0 +1,83 @@
+#ifndef HOT_PIXELS_H
+#define HOT_PIXELS_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <opencv2/core/mat.hpp>
+
+/// @brief A sparse list of defective sensor pixels.
+///
+/// Repairing a frame visits only the listed pixels, replacing each with the
+/// median of its good neighbours. On a Bayer mosaic only neighbours of the
+/// same colour, two pixels away, are used, so the repair runs on the raw
+/// frame before it is debayered.
+class HotPixelMap {
+
+protected:
+    int mCols = 0;
+    int mRows = 0;
+    bool mCFA = false;
+    std::vector<uint32_t> mPixels;      ///< y * cols + x, sorted
+
+public:
+    HotPixelMap() {}
+
+    /// @param cols Frame width.
+    /// @param rows Frame height.
+    /// @param cfa Whether the frames are Bayer mosaics.
+    /// @param pixels Indices y * cols + x of the defective pixels.
+    HotPixelMap(int cols, int rows, bool cfa, std::vector<uint32_t> pixels);
+
+    /// Reads a map written by save().
+    bool load(const std::string & filename, std::string & error);
+
+    /// Writes the map to a compact binary file.
+    bool save(const std::string & filename, std::string & error) const;
+
+    int cols() const { return mCols; }
+    int rows() const { return mRows; }
+    bool cfa() const { return mCFA; }
+
+    /// \return The indices y * cols + x of the defective pixels.
+    const std::vector<uint32_t> & pixels() const { return mPixels; }
+
+    /// @brief Repairs the listed pixels of a single channel 8 or 16-bit frame in place.
+    /// \return false if the frame does not have the size of the map.
+    bool repair(cv::Mat & frame) const;
+};
+
+/// @brief Finds hot pixels in a series of dark frames.
+///
+/// Each frame is compared with a 3x3 median of the same colour plane. A
+/// pixel is hot in a frame if it exceeds its neighbours by more than `sigma`
+/// times the robust noise of the frame, and goes into the map if it is hot in
+/// at least `min_fraction` of the frames. Cosmic rays hit different pixels in
+/// every frame and are left out.
+class HotPixelDetector {
+
+protected:
+    double mSigma = 5;
+    double mMinFraction = 0.5;
+    bool mCFA = false;
+    cv::Mat mCounts;                    ///< CV_16U, frames in which each pixel was hot
+    int mFrames = 0;
+
+public:
+    /// @param sigma Detection threshold in units of the frame noise.
+    /// @param min_fraction Fraction of the frames a pixel must be hot in.
+    /// @param cfa Whether the frames are Bayer mosaics.
+    HotPixelDetector(double sigma = 5, double min_fraction = 0.5, bool cfa = false);
+
+    /// Adds a single channel dark frame. All frames must have the same size.
+    bool addFrame(const cv::Mat & dark, std::string & error);
+
+    /// \return The number of frames added.
+    int frames() const { return mFrames; }
+
+    /// \return The pixels hot in enough of the frames.
+    HotPixelMap map() const;
+};
+
+#endif // HOT_PIXELS_H
@@ -47,11 +47,47 @@ cv::Mat scaleImageLinear_CV_16UC3(const cv::Mat & rawImage) {
     return scaledImage;
 }
 
-/// @brief Scales a single channel or multi-channel image of type CV_16UC1 or CV_16UC3
+cv::Mat scaleImageLinear_CV_8U(const cv::Mat & rawImage) {
+
+    // Same stretch as the 16-bit path, but with only 256 possible values it
+    // is a single table lookup per pixel instead of a floating point copy.
+    std::vector<cv::Mat> channels;
+    cv::split(rawImage, channels);
+    for(cv::Mat & channel : channels) {
+        double min = 0;
+        double max = 255;
+        cv::Scalar mean_s;
+        cv::Scalar stddev_s;
+
+        cv::minMaxLoc(channel, &min, &max);
+        cv::meanStdDev(channel, mean_s, stddev_s);
+
+        double minPixValue = mean_s[0] - stddev_s[0];
+        double maxPixValue = mean_s[0] + 3*stddev_s[0];
+
+        double scale = 255.0 / (double)(maxPixValue - minPixValue);
+
+        cv::Mat lut(1, 256, CV_8U);
+        for(int value = 0; value < 256; value++)
+            lut.at<uchar>(value) = cv::saturate_cast<uchar>((value - min) * scale);
+
+        cv::LUT(channel, lut, channel);
+    }
+
+    cv::Mat outputArray;
+    cv::merge(channels, outputArray);
+
+    return outputArray;
+}
+
+/// @brief Scales a single channel or multi-channel image of type CV_8U or CV_16U
 /// @param rawImage The input raw image.
 /// @return A scaled image of type CV_8UC1 or CV_8UC3
 cv::Mat scaleImageLinear(const cv::Mat & rawImage) {
 
+    if(rawImage.depth() == CV_8U)
+        return scaleImageLinear_CV_8U(rawImage);
+
     cv::Mat scaledImage;
     cv::Mat outputArray;
 
@@ -64,4 +100,19 @@ cv::Mat scaleImageLinear(const cv::Mat & rawImage) {
     }
 
     return outputArray;
-}
\ No newline at end of file
+}
+
+cv::Mat scaleImageLinear(const cv::Mat & image, const FrameStatistics & stats) {
+
+    cv::Mat scaledImage(image.rows, image.cols, CV_8UC(image.channels()));
+
+    if(image.depth() == CV_8U) {
+        PixelPipeline<StretchStage<uint8_t>, StoreStage> pipeline{StretchStage<uint8_t>(stats), StoreStage(scaledImage)};
+        pipeline.run(image);
+    } else {
+        PixelPipeline<StretchStage<uint16_t>, StoreStage> pipeline{StretchStage<uint16_t>(stats), StoreStage(scaledImage)};
+        pipeline.run(image);
+    }
+
+    return scaledImage;
+}
@@ -3,6 +3,8 @@
 
 #include <opencv2/core/mat.hpp>
 
+#include "pixel_pipeline.hpp"
+
 /// @brief Applies a linear scale to a CV_16UC1 image using the minimum, maximum, median, and standard deviation.
 /// @param rawImage the input i mage
 /// @return a cv::Mat in CV_32FC1 format.
@@ -13,9 +15,22 @@ cv::Mat scaleImageLinear_CV_16UC1(const cv::Mat & rawImage);
 /// @return a cv::Mat in CV_32FC3 format.
 cv::Mat scaleImageLinear_CV_16UC3(const cv::Mat & rawImage);
 
-/// @brief Scales a single channel or multi-channel image of type CV_16UC1 or CV_16UC3
+/// @brief Applies the same linear scale to a CV_8UC1 or CV_8UC3 image using a lookup table.
+/// @param rawImage the input image
+/// @return a cv::Mat of the same type as the input.
+cv::Mat scaleImageLinear_CV_8U(const cv::Mat & rawImage);
+
+/// @brief Scales a single channel or multi-channel image of type CV_8U or CV_16U
 /// @param rawImage The input raw image.
 /// @return A scaled image of type CV_8UC1 or CV_8UC3
 cv::Mat scaleImageLinear(const cv::Mat & rawImage);
 
+/// @brief Scales a CV_8U or CV_16U image with statistics that were measured earlier.
+///
+/// Gives the same result as scaleImageLinear in a single pass over the image.
+/// @param image The input image.
+/// @param stats Statistics of `image`, e.g. from a StatisticsStage.
+/// @return A scaled image of type CV_8UC1 or CV_8UC3
+cv::Mat scaleImageLinear(const cv::Mat & image, const FrameStatistics & stats);
+
 #endif // SCALE_IMAGE_H
\ No newline at end of file
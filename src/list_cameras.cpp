@@ -1,12 +1,36 @@
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QJsonArray>
+#include <QJsonDocument>
+
 #include <iostream>
 #include <iomanip>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 #include "version.h"
 #include "qhyccd.h"
+#include "camera_profile.hpp"
+
+/// Print the column names again after this many controls.
+const int CONTROLS_PER_HEADER = 20;
+
+/// The SDK keeps its table of open cameras in global state and does not say
+/// that opening, initializing and closing cameras is thread safe, so those
+/// calls are made one at a time. Queries on an open handle run concurrently.
+std::mutex sdk_open_mutex;
+
+/// @brief What was learned about one camera.
+struct CameraListing {
+    CameraProfile profile;
+    bool opened = false;
+    char cfw_status = 0;            ///< Current filter wheel slot, as reported by the camera
+};
 
-void print_control_header() {
+void print_control_header(std::ostream & out) {
     using namespace std;
-    cout << "\n" << "  "
+    out << "\n" << "  "
         << setw(36) << std::left << "Control Name"
         << setw(11) << std::left << "Supported?"
         << setw(8) << std::right << "Minimum"
@@ -15,248 +39,175 @@ void print_control_header() {
         << endl;
 }
 
-bool check_control(qhyccd_handle * handle, CONTROL_ID control_id, const char* control_name) {
+bool check_control(std::ostream & out, const CameraProfile & profile, const std::string & control_name) {
     using namespace std;
-    bool control_available = false;
 
-    if(IsQHYCCDControlAvailable(handle, control_id) == QHYCCD_SUCCESS) {
-        double minimum = 0, maximum = 0, step = 0;
-        GetQHYCCDParamMinMaxStep(handle, control_id, &minimum, &maximum, &step);
-
-        cout << "  "
+    auto control = profile.controls.find(control_name);
+    if(control != profile.controls.end()) {
+        out << "  "
             << setw(36) << std::left << control_name
             << setw(11) << std::left << "Yes"
-            << setw(8) << std::right << minimum
-            << setw(8) << std::right << maximum
-            << setw(8) << std::right << step
-            << endl;
-        control_available = true;
-
-    } else {
-        cout << "  "
-            << setw(36) << std::left << control_name
-            << setw(11) << std::left << "No"
-            << setw(8) << std::right << "-"
-            << setw(8) << std::right << "-"
-            << setw(8) << std::right << "-"
+            << setw(8) << std::right << control->second.min
+            << setw(8) << std::right << control->second.max
+            << setw(8) << std::right << control->second.step
             << endl;
+        return true;
     }
 
-    return control_available;
+    out << "  "
+        << setw(36) << std::left << control_name
+        << setw(11) << std::left << "No"
+        << setw(8) << std::right << "-"
+        << setw(8) << std::right << "-"
+        << setw(8) << std::right << "-"
+        << endl;
+    return false;
 }
 
-int main(int argc, char *argv[])
-{
+void print_camera(std::ostream & out, const CameraListing & listing) {
     using namespace std;
+    const CameraProfile & profile = listing.profile;
 
-    int num_cameras = 0;
-    char camera_id[CAMERA_ID_LENGTH];
-    char camera_model[64];
-    double min, max, step;
-    CONTROL_ID control_id;
-    uint32_t num_modes;
-    char read_mode_name[MAX_READMODE_NAME];
-    char cfw_status;
-    uint32_t cfw_max_filters;
-    double chip_w, chip_h, pixel_w, pixel_h;
-    uint32_t image_w, image_h, bit_depth;
-    uint8_t fw_version[16];
-    char sensor_name[256];
-
-    // Initialize the QHY Library.
-    InitQHYCCDResource();
-
-    num_cameras = ScanQHYCCD();
-
-    for(uint32_t camera_idx = 0; camera_idx < num_cameras; camera_idx++) {
-        cout << "----------------------------------------------------" << endl;
-
-        GetQHYCCDId(camera_idx, camera_id);
-        cout << "Camera ID   : " << camera_id << endl;
-
-        GetQHYCCDModel(camera_id, camera_model);
-        cout << " Camera Model: " << camera_model << endl;
-
-        qhyccd_handle * handle = OpenQHYCCD(camera_id);
-        InitQHYCCD(handle);
-
-        GetQHYCCDFWVersion(handle, fw_version);
-        cout << " Firmware Version: " << fw_version << endl;
+    out << "----------------------------------------------------" << endl;
+    out << "Camera ID   : " << profile.camera_id << endl;
+    if(!listing.opened) {
+        out << " Camera could not be opened" << endl;
+        return;
+    }
 
-        GetQHYCCDSensorName(handle, sensor_name);
-        cout << " Sensor Name: " << sensor_name << endl;
+    out << " Camera Model: " << profile.model << endl;
+    out << " Firmware Version: " << profile.firmware << endl;
+    out << " Sensor Name: " << profile.sensor << endl;
+    out << " Chip Size: " << profile.chip_width << " x " << profile.chip_height << " mm" << endl;
+    out << " Image Size: " << profile.image_width << " x " << profile.image_height << endl;
+    out << " Pixel Size: " << profile.pixel_width << " x " << profile.pixel_height << " um" << endl;
+    out << " Bit Depth: " << profile.bit_depth << endl;
+
+    // Different read modes
+    out << " Read modes: " << profile.read_modes.size() << endl;
+    for(size_t mode_idx = 0; mode_idx < profile.read_modes.size(); mode_idx++)
+        out << "  " << mode_idx << ": " << profile.read_modes[mode_idx] << endl;
+
+    // Size of the image in MB
+    out << " Image size: " << profile.mem_length / 1024 / 1024 << " MB" << endl;
+
+    if(profile.filter_wheel) {
+        out << " Filter wheel: detected" << endl;
+        out << "  Slots: " << profile.filter_wheel_slots << endl;
+        out << "  Current Slot: " << listing.cfw_status << endl;
+    } else {
+        out << " Filter wheel: not detected" << endl;
+    }
 
-        GetQHYCCDChipInfo(handle, &chip_w, &chip_h, &image_w, &image_h, &pixel_w, &pixel_h, &bit_depth);
-        cout << " Chip Size: " << chip_w << " x " << chip_h << " mm" << endl;
-        cout << " Image Size: " << image_w << " x " << image_h << endl;
-        cout << " Pixel Size: " << pixel_w << " x " << pixel_h << " um" << endl;
-        cout << " Bit Depth: " << bit_depth << endl;
+    out << " Possible Controls:" << endl;
+    int row = 0;
+    for(const std::string & control_name : profileControlNames()) {
+        if(row++ % CONTROLS_PER_HEADER == 0)
+            print_control_header(out);
 
-        // Different read modes
-        GetQHYCCDNumberOfReadModes(handle, &num_modes);
-        cout << " Read modes: " << num_modes << endl;
-        for(uint32_t mode_idx = 0; mode_idx < num_modes; mode_idx++) {
-            GetQHYCCDReadModeName(handle, mode_idx, read_mode_name);
-            cout << "  " << mode_idx << ": " << read_mode_name << endl;
-        }
-
-        // Size of the image in MB
-        int mem_size = GetQHYCCDMemLength(handle);
-        cout << " Image size: " << mem_size / 1024 / 1024 << " MB" << endl;
-
-        uint32_t has_filter_wheel = IsQHYCCDCFWPlugged(handle);
-        if(has_filter_wheel == QHYCCD_SUCCESS) {
-            cfw_max_filters = GetQHYCCDParam(handle, CONTROL_CFWSLOTSNUM);
-            GetQHYCCDCFWStatus(handle, &cfw_status);
-            cout << " Filter wheel: detected" << endl;
-            cout << "  Slots: " << cfw_max_filters << endl;
-            cout << "  Current Slot: " << cfw_status << endl;
-        } else {
-            cout << " Filter wheel: not detected" << endl;
-        }
-
-        cout << " Possible Controls:" << endl;
-        print_control_header();
-        check_control(handle, CONTROL_BRIGHTNESS, "CONTROL_BRIGHTNESS");
-        check_control(handle, CONTROL_CONTRAST, "CONTROL_CONTRAST");
-        check_control(handle, CONTROL_WBR, "CONTROL_WBR");
-        check_control(handle, CONTROL_WBB, "CONTROL_WBB");
-        check_control(handle, CONTROL_WBG, "CONTROL_WBG");
-        check_control(handle, CONTROL_GAMMA, "CONTROL_GAMMA");
-        check_control(handle, CONTROL_GAIN, "CONTROL_GAIN");
-        check_control(handle, CONTROL_OFFSET, "CONTROL_OFFSET");
-        check_control(handle, CONTROL_EXPOSURE, "CONTROL_EXPOSURE");
-        check_control(handle, CONTROL_SPEED, "CONTROL_SPEED");
-        check_control(handle, CONTROL_TRANSFERBIT, "CONTROL_TRANSFERBIT");
-        check_control(handle, CONTROL_CHANNELS, "CONTROL_CHANNELS");
-        check_control(handle, CONTROL_USBTRAFFIC, "CONTROL_USBTRAFFIC");
-        check_control(handle, CONTROL_ROWNOISERE, "CONTROL_ROWNOISERE");
-        check_control(handle, CONTROL_CURTEMP, "CONTROL_CURTEMP");
-        check_control(handle, CONTROL_CURPWM, "CONTROL_CURPWM");
-        check_control(handle, CONTROL_MANULPWM, "CONTROL_MANULPWM");
-        check_control(handle, CONTROL_CFWPORT, "CONTROL_CFWPORT");
-        check_control(handle, CONTROL_COOLER, "CONTROL_COOLER");
-        check_control(handle, CONTROL_ST4PORT, "CONTROL_ST4PORT");
-        //check_control(handle, CAM_COLOR, "CAM_COLOR"); // covered with CAM_IS_COLOR below
-        check_control(handle, CAM_BIN1X1MODE, "CAM_BIN1X1MODE");
-        check_control(handle, CAM_BIN2X2MODE, "CAM_BIN2X2MODE");
-        check_control(handle, CAM_BIN3X3MODE, "CAM_BIN3X3MODE");
-        print_control_header();
-        check_control(handle, CAM_BIN4X4MODE, "CAM_BIN4X4MODE");
-        check_control(handle, CAM_MECHANICALSHUTTER, "CAM_MECHANICALSHUTTER");
-        check_control(handle, CAM_TRIGER_INTERFACE, "CAM_TRIGER_INTERFACE");
-        check_control(handle, CAM_TECOVERPROTECT_INTERFACE, "CAM_TECOVERPROTECT_INTERFACE");
-        check_control(handle, CAM_SINGNALCLAMP_INTERFACE, "CAM_SINGNALCLAMP_INTERFACE");
-        check_control(handle, CAM_FINETONE_INTERFACE, "CAM_FINETONE_INTERFACE");
-        check_control(handle, CAM_SHUTTERMOTORHEATING_INTERFACE, "CAM_SHUTTERMOTORHEATING_INTERFACE");
-        check_control(handle, CAM_CALIBRATEFPN_INTERFACE, "CAM_CALIBRATEFPN_INTERFACE");
-        check_control(handle, CAM_CHIPTEMPERATURESENSOR_INTERFACE, "CAM_CHIPTEMPERATURESENSOR_INTERFACE");
-        check_control(handle, CAM_USBREADOUTSLOWEST_INTERFACE, "CAM_USBREADOUTSLOWEST_INTERFACE");
-
-        check_control(handle, CAM_8BITS, "CAM_8BITS");
-        check_control(handle, CAM_16BITS, "CAM_16BITS");
-        check_control(handle, CAM_GPS, "CAM_GPS");
-
-        check_control(handle, CAM_IGNOREOVERSCAN_INTERFACE, "CAM_IGNOREOVERSCAN_INTERFACE");
-
-        check_control(handle, CAM_CurveSystemGain, "CAM_CURVESYSTEMGAIN");
-        check_control(handle, CAM_CurveFullWell, "CAM_CURVEFULLWELL");
-        check_control(handle, CAM_CurveReadoutNoise, "CAM_CURVEREADOUTNOISE");
-
-        check_control(handle, QHYCCD_3A_AUTOEXPOSURE, "QHYCCD_3A_AUTOEXPOSURE");
-        check_control(handle, QHYCCD_3A_AUTOFOCUS, "QHYCCD_3A_AUTOFOCUS");
-        check_control(handle, CONTROL_AMPV, "CONTROL_AMPV");
-        check_control(handle, CONTROL_VCAM, "CONTROL_VCAM");
-        check_control(handle, CAM_VIEW_MODE, "CAM_VIEW_MODE");
-
-        print_control_header();
-        check_control(handle, CONTROL_CFWSLOTSNUM, "CONTROL_CFWSLOTSNUM");
-        check_control(handle, IS_EXPOSING_DONE, "IS_EXPOSING_DONE");
-        check_control(handle, ScreenStretchB, "SCREENSTRETCHB");
-        check_control(handle, ScreenStretchW, "SCREENSTRETCHW");
-        check_control(handle, CONTROL_DDR, "CONTROL_DDR");
-        check_control(handle, CAM_LIGHT_PERFORMANCE_MODE, "CAM_LIGHT_PERFORMANCE_MODE");
-
-        check_control(handle, CAM_QHY5II_GUIDE_MODE, "CAM_QHY5II_GUIDE_MODE");
-        check_control(handle, DDR_BUFFER_CAPACITY, "DDR_BUFFER_CAPACITY");
-        check_control(handle, DDR_BUFFER_READ_THRESHOLD, "DDR_BUFFER_READ_THRESHOLD");
-        check_control(handle, DefaultGain, "DEFAULTGAIN");
-        check_control(handle, DefaultOffset, "DEFAULTOFFSET");
-        check_control(handle, OutputDataActualBits, "OUTPUTDATAACTUALBITS");
-        check_control(handle, OutputDataAlignment, "OUTPUTDATAALIGNMENT");
-
-        check_control(handle, CAM_SINGLEFRAMEMODE, "CAM_SINGLEFRAMEMODE");
-        check_control(handle, CAM_LIVEVIDEOMODE, "CAM_LIVEVIDEOMODE");
-        bool is_color = check_control(handle, CAM_IS_COLOR, "CAM_IS_COLOR");
-        if(is_color) {
-            int bayer_order = IsQHYCCDControlAvailable(handle, CAM_COLOR);
-            switch(bayer_order) {
+        bool available = check_control(out, profile, control_name);
+        if(control_name == "CAM_IS_COLOR" && available) {
+            switch(profile.bayer_pattern) {
                 case BAYER_GB:
-                    cout << "   GBRG order" << endl;
+                    out << "   GBRG order" << endl;
                 break;
                 case BAYER_GR:
-                    cout << "   GRBG order" << endl;
+                    out << "   GRBG order" << endl;
                 break;
                 case BAYER_BG:
-                    cout << "   BGGR, order" << endl;
+                    out << "   BGGR, order" << endl;
                 break;
                 case BAYER_RG:
-                    cout << "   RGGB order" << endl;
+                    out << "   RGGB order" << endl;
                 break;
                 default:
-                    cout << "   Bayer order unknown" << endl;
+                    out << "   Bayer order unknown" << endl;
             }
         }
+    }
+}
+
+/// @brief Opens a camera, probes its capabilities, and closes it again.
+void probe_camera(CameraListing & listing) {
+
+    qhyccd_handle * handle = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(sdk_open_mutex);
+        handle = OpenQHYCCD((char*) listing.profile.camera_id.c_str());
+        if(handle == nullptr || InitQHYCCD(handle) != QHYCCD_SUCCESS) {
+            if(handle != nullptr)
+                CloseQHYCCD(handle);
+            return;
+        }
+    }
+
+    listing.profile = probeCameraProfile(handle, listing.profile.camera_id);
+    if(listing.profile.filter_wheel)
+        GetQHYCCDCFWStatus(handle, &listing.cfw_status);
+    listing.opened = true;
+
+    // Close this camera.
+    std::lock_guard<std::mutex> lock(sdk_open_mutex);
+    CloseQHYCCD(handle);
+}
+
+int main(int argc, char *argv[])
+{
+    using namespace std;
+
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("qhy-list-cameras");
 
-        check_control(handle, hasHardwareFrameCounter, "HASHARDWAREFRAMECOUNTER");
-        check_control(handle, CONTROL_MAX_ID_Error, "CONTROL_MAX_ID_ERROR");
-        check_control(handle, CAM_HUMIDITY, "CAM_HUMIDITY");
-        check_control(handle, CAM_PRESSURE, "CAM_PRESSURE");
-        check_control(handle, CONTROL_VACUUM_PUMP, "CONTROL_VACUUM_PUMP");
-        check_control(handle, CONTROL_SensorChamberCycle_PUMP, "CONTROL_SENSORCHAMBERCYCLE_PUMP");
-
-        print_control_header();
-        check_control(handle, CAM_32BITS, "CAM_32BITS");
-        check_control(handle, CAM_Sensor_ULVO_Status, "CAM_SENSOR_ULVO_STATUS");
-        check_control(handle, CAM_SensorPhaseReTrain, "CAM_SENSORPHASERETRAIN");
-        check_control(handle, CAM_InitConfigFromFlash, "CAM_INITCONFIGFROMFLASH");
-        check_control(handle, CAM_TRIGER_MODE, "CAM_TRIGER_MODE");
-        check_control(handle, CAM_TRIGER_OUT, "CAM_TRIGER_OUT");
-        check_control(handle, CAM_BURST_MODE, "CAM_BURST_MODE");
-        check_control(handle, CAM_SPEAKER_LED_ALARM, "CAM_SPEAKER_LED_ALARM");
-        check_control(handle, CAM_WATCH_DOG_FPGA, "CAM_WATCH_DOG_FPGA");
-
-        check_control(handle, CAM_BIN6X6MODE, "CAM_BIN6X6MODE");
-        check_control(handle, CAM_BIN8X8MODE, "CAM_BIN8X8MODE");
-        check_control(handle, CAM_GlobalSensorGPSLED, "CAM_GLOBALSENSORGPSLED");
-        check_control(handle, CONTROL_ImgProc, "CONTROL_IMGPROC");
-        check_control(handle, CONTROL_RemoveRBI, "CONTROL_REMOVERBI");
-        check_control(handle, CONTROL_GlobalReset, "CONTROL_GLOBALRESET");
-        check_control(handle, CONTROL_FrameDetect, "CONTROL_FRAMEDETECT");
-        check_control(handle, CAM_GainDBConversion, "CAM_GAINDBCONVERSION");
-        check_control(handle, CAM_CurveSystemGain, "CAM_CURVESYSTEMGAIN");
-        check_control(handle, CAM_CurveFullWell, "CAM_CURVEFULLWELL");
-        check_control(handle, CAM_CurveReadoutNoise, "CAM_CURVEREADOUTNOISE");
-
-        check_control(handle, CONTROL_MAX_ID, "CONTROL_MAX_ID");
-
-        check_control(handle, CONTROL_AUTOWHITEBALANCE, "CONTROL_AUTOWHITEBALANCE");
-        check_control(handle, CONTROL_AUTOEXPOSURE, "CONTROL_AUTOEXPOSURE");
-
-        print_control_header();
-        check_control(handle, CONTROL_AUTOEXPmessureValue, "CONTROL_AUTOEXPMESSUREVALUE");
-        check_control(handle, CONTROL_AUTOEXPmessureMethod, "CONTROL_AUTOEXPMESSUREMETHOD");
-        check_control(handle, CONTROL_ImageStabilization, "CONTROL_IMAGESTABILIZATION");
-        check_control(handle, CONTROL_GAINdB, "CONTROL_GAINDB");
-        check_control(handle, CONTROL_DPC, "CONTROL_DPC");
-        check_control(handle, CONTROL_DPC_value, "CONTROL_DPC_VALUE");
-
-        // Close this camera.
-        CloseQHYCCD(handle);
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Lists the connected QHYCCD cameras and their capabilities.");
+    parser.addHelpOption();
+    parser.addOption({"json", "Print the capability profiles as JSON"});
+    parser.addOption({"update-cache", "Write the capability profiles to the profile cache"});
+    parser.addOption({"profile-cache-dir", "Directory of the cached camera profiles", "profile-cache-dir"});
+    parser.process(app);
+
+    QString cache_dir = parser.value("profile-cache-dir");
+    if(cache_dir.isEmpty())
+        cache_dir = defaultProfileCacheDir();
+
+    // Initialize the QHY Library.
+    InitQHYCCDResource();
+
+    int num_cameras = ScanQHYCCD();
+    vector<CameraListing> listings(num_cameras > 0 ? num_cameras : 0);
+    for(size_t camera_idx = 0; camera_idx < listings.size(); camera_idx++) {
+        char camera_id[CAMERA_ID_LENGTH] = {0};
+        GetQHYCCDId(camera_idx, camera_id);
+        listings[camera_idx].profile.camera_id = camera_id;
     }
 
+    // Probing a camera takes many USB round trips. Cameras are on their own
+    // handles, so probe them all at once, opening them one at a time.
+    vector<thread> probes;
+    for(CameraListing & listing : listings)
+        probes.emplace_back(probe_camera, std::ref(listing));
+    for(thread & probe : probes)
+        probe.join();
+
     // Release QHYCCD SDK resources
     ReleaseQHYCCDResource();
-}
 
+    QJsonArray profiles;
+    for(const CameraListing & listing : listings) {
+        if(listing.opened && parser.isSet("update-cache") && !saveCameraProfile(listing.profile, cache_dir))
+            cerr << "Could not write the profile of " << listing.profile.camera_id << " to "
+                 << cache_dir.toStdString() << endl;
 
+        if(parser.isSet("json")) {
+            if(listing.opened)
+                profiles.append(cameraProfileToJson(listing.profile));
+        } else {
+            print_camera(cout, listing);
+        }
+    }
+
+    if(parser.isSet("json"))
+        cout << QJsonDocument(profiles).toJson().toStdString();
+
+    return 0;
+}
@@ -0,0 +1,162 @@
+#include <algorithm>
+#include <cmath>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "live_stack.hpp"
+
+namespace {
+/// Pixels are not clipped until this many frames have been accepted.
+const float MIN_CLIP_FRAMES = 3;
+
+/// Rows per task when updating the accumulators.
+const int TILE_ROWS = 32;
+}
+
+LiveStack::LiveStack(Mode mode, double sigma, int downsample, double min_response)
+    : mMode(mode), mSigma(sigma), mDownsample(std::max(downsample, 1)), mMinResponse(min_response) {
+}
+
+void LiveStack::reset() {
+    mReference.release();
+    mWindow.release();
+    mMean.release();
+    mM2.release();
+    mCount.release();
+    mFrameCount = 0;
+    mRejectedCount = 0;
+    mLastShift = cv::Point2d(0, 0);
+    mLastResponse = 0;
+}
+
+cv::Mat LiveStack::registrationImage(const cv::Mat & image) const {
+
+    cv::Mat gray;
+    if(image.channels() == 3)
+        cv::cvtColor(image, gray, cv::COLOR_BGR2GRAY);
+    else
+        gray = image;
+
+    cv::Mat small;
+    cv::resize(gray, small, cv::Size(gray.cols / mDownsample, gray.rows / mDownsample), 0, 0, cv::INTER_AREA);
+
+    cv::Mat result;
+    small.convertTo(result, CV_32F);
+    return result;
+}
+
+bool LiveStack::addFrame(const cv::Mat & image) {
+
+    cv::Mat frame;
+    image.convertTo(frame, CV_32F);
+
+    // The first frame defines the reference and seeds the accumulators.
+    if(mFrameCount == 0) {
+        mReference = registrationImage(image);
+        cv::createHanningWindow(mWindow, mReference.size(), CV_32F);
+
+        mMean = frame.clone();
+        if(mMode == MODE_SIGMA_CLIP) {
+            mM2 = cv::Mat::zeros(frame.rows, frame.cols, frame.type());
+            mCount = cv::Mat::ones(frame.rows, frame.cols, frame.type());
+        }
+
+        mFrameCount = 1;
+        mLastShift = cv::Point2d(0, 0);
+        mLastResponse = 1;
+        return true;
+    }
+
+    if(frame.size() != mMean.size() || frame.type() != mMean.type()) {
+        mRejectedCount++;
+        return false;
+    }
+
+    // Measure the translation on the downsampled copy, then undo it at full resolution.
+    cv::Mat moving = registrationImage(image);
+    double response = 0;
+    cv::Point2d shift = cv::phaseCorrelate(mReference, moving, mWindow, &response);
+    mLastResponse = response;
+    if(response < mMinResponse) {
+        mRejectedCount++;
+        return false;
+    }
+
+    mLastShift = cv::Point2d(-shift.x * mDownsample, -shift.y * mDownsample);
+
+    cv::Mat transform = cv::Mat::zeros(2, 3, CV_64F);
+    transform.at<double>(0, 0) = 1;
+    transform.at<double>(1, 1) = 1;
+    transform.at<double>(0, 2) = mLastShift.x;
+    transform.at<double>(1, 2) = mLastShift.y;
+
+    cv::Mat aligned;
+    cv::warpAffine(frame, aligned, transform, frame.size(), cv::INTER_LINEAR, cv::BORDER_REPLICATE);
+
+    if(mMode == MODE_SIGMA_CLIP)
+        accumulateSigmaClip(aligned);
+    else
+        accumulateMean(aligned);
+
+    mFrameCount++;
+    return true;
+}
+
+void LiveStack::accumulateMean(const cv::Mat & frame) {
+
+    const float weight = 1.0f / (mFrameCount + 1);
+    const int row_length = frame.cols * frame.channels();
+    const int num_tiles = (frame.rows + TILE_ROWS - 1) / TILE_ROWS;
+
+    cv::parallel_for_(cv::Range(0, num_tiles), [&](const cv::Range & range) {
+        for(int tile = range.start; tile < range.end; tile++) {
+            int row_end = std::min((tile + 1) * TILE_ROWS, frame.rows);
+            for(int y = tile * TILE_ROWS; y < row_end; y++) {
+                const float * value = frame.ptr<float>(y);
+                float * mean = mMean.ptr<float>(y);
+                for(int x = 0; x < row_length; x++)
+                    mean[x] += (value[x] - mean[x]) * weight;
+            }
+        }
+    });
+}
+
+void LiveStack::accumulateSigmaClip(const cv::Mat & frame) {
+
+    // Welford's update, skipped for pixels further than mSigma standard
+    // deviations from the running mean once enough frames are available.
+    const float sigma = mSigma;
+    const int row_length = frame.cols * frame.channels();
+    const int num_tiles = (frame.rows + TILE_ROWS - 1) / TILE_ROWS;
+
+    cv::parallel_for_(cv::Range(0, num_tiles), [&](const cv::Range & range) {
+        for(int tile = range.start; tile < range.end; tile++) {
+            int row_end = std::min((tile + 1) * TILE_ROWS, frame.rows);
+            for(int y = tile * TILE_ROWS; y < row_end; y++) {
+                const float * value = frame.ptr<float>(y);
+                float * mean  = mMean.ptr<float>(y);
+                float * m2    = mM2.ptr<float>(y);
+                float * count = mCount.ptr<float>(y);
+                for(int x = 0; x < row_length; x++) {
+                    float n = count[x];
+                    float delta = value[x] - mean[x];
+                    if(n >= MIN_CLIP_FRAMES) {
+                        float stddev = std::sqrt(m2[x] / (n - 1));
+                        if(std::fabs(delta) > sigma * stddev && stddev > 0)
+                            continue;
+                    }
+
+                    n += 1;
+                    mean[x] += delta / n;
+                    m2[x] += delta * (value[x] - mean[x]);
+                    count[x] = n;
+                }
+            }
+        }
+    });
+}
+
+cv::Mat LiveStack::result() const {
+    return mMean;
+}
@@ -0,0 +1,73 @@
+#ifndef LIVE_STACK_H
+#define LIVE_STACK_H
+
+#include <opencv2/core/mat.hpp>
+
+/// @brief Registers frames against a reference and folds them into a running stack.
+///
+/// Registration uses phase correlation on a downsampled, windowed copy of each
+/// frame. The stack is either a running mean or a running mean with per-pixel
+/// sigma clipping, updated in row tiles across all cores.
+class LiveStack {
+
+public:
+    /// How frames are combined.
+    enum Mode {
+        MODE_MEAN,          ///< Running mean of every registered frame.
+        MODE_SIGMA_CLIP,    ///< Running mean that rejects pixels far from the current mean.
+    };
+
+protected:
+    Mode mMode = MODE_MEAN;
+    double mSigma = 3.0;
+    int mDownsample = 4;
+    double mMinResponse = 0.05;
+
+    cv::Mat mReference;     ///< Downsampled registration image of the first frame
+    cv::Mat mWindow;        ///< Hanning window applied during phase correlation
+    cv::Mat mMean;          ///< Running mean, CV_32F with the frame's channel count
+    cv::Mat mM2;            ///< Running sum of squared deviations (sigma clipping only)
+    cv::Mat mCount;         ///< Per-pixel accepted frame count (sigma clipping only)
+
+    size_t mFrameCount = 0;
+    size_t mRejectedCount = 0;
+    cv::Point2d mLastShift;
+    double mLastResponse = 0;
+
+    cv::Mat registrationImage(const cv::Mat & image) const;
+    void accumulateMean(const cv::Mat & frame);
+    void accumulateSigmaClip(const cv::Mat & frame);
+
+public:
+    /// @brief Creates an empty stack.
+    /// @param mode How frames are combined.
+    /// @param sigma Rejection threshold in standard deviations for MODE_SIGMA_CLIP.
+    /// @param downsample Integer downsampling factor used for registration.
+    /// @param min_response Frames whose phase correlation peak is weaker than this are rejected.
+    LiveStack(Mode mode, double sigma, int downsample, double min_response);
+
+    /// @brief Registers a frame against the reference and adds it to the stack.
+    /// The first frame becomes the reference.
+    /// @return false if the frame could not be registered and was skipped.
+    bool addFrame(const cv::Mat & image);
+
+    /// \return The current stack as a CV_32F image.
+    cv::Mat result() const;
+
+    /// Discards the stack and the reference frame.
+    void reset();
+
+    /// \return The number of frames in the stack.
+    size_t frameCount() const { return mFrameCount; }
+
+    /// \return The number of frames rejected by registration.
+    size_t rejectedCount() const { return mRejectedCount; }
+
+    /// \return The shift applied to the most recent frame, in full resolution pixels.
+    cv::Point2d lastShift() const { return mLastShift; }
+
+    /// \return The phase correlation peak of the most recent frame.
+    double lastResponse() const { return mLastResponse; }
+};
+
+#endif // LIVE_STACK_H
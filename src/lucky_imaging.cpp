@@ -0,0 +1,252 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "lucky_imaging.hpp"
+
+namespace {
+/// Half-width of the window used to measure the brightest star, in downsampled pixels.
+const int STAR_WINDOW_RADIUS = 8;
+
+/// Conversion from a Gaussian sigma to its full width at half maximum.
+const double SIGMA_TO_FWHM = 2.354820045;
+}
+
+LuckyImaging::LuckyImaging(Metric metric, size_t keep_count, int roi_size, int downsample, bool retain_pixels)
+    : mMetric(metric), mKeepCount(std::max<size_t>(keep_count, 1)), mRoiSize(roi_size),
+      mDownsample(std::max(downsample, 1)), mRetainPixels(retain_pixels) {
+}
+
+size_t LuckyImaging::maxRetained(size_t frame_bytes, size_t budget_bytes) {
+    return std::max<size_t>(1, budget_bytes / std::max<size_t>(frame_bytes, 1));
+}
+
+cv::Mat LuckyImaging::prepareROI(const cv::Mat & image) const {
+
+    // Crop a centered region first so the remaining steps touch as little data as possible.
+    cv::Rect roi(0, 0, image.cols, image.rows);
+    if(mRoiSize > 0) {
+        int width  = std::min(mRoiSize, image.cols);
+        int height = std::min(mRoiSize, image.rows);
+        roi = cv::Rect((image.cols - width) / 2, (image.rows - height) / 2, width, height);
+    }
+    cv::Mat cropped = image(roi);
+
+    cv::Mat gray;
+    if(cropped.channels() == 3)
+        cv::cvtColor(cropped, gray, cv::COLOR_BGR2GRAY);
+    else
+        gray = cropped;
+
+    // Area averaging also removes any residual Bayer pattern.
+    cv::Mat small;
+    if(mDownsample > 1)
+        cv::resize(gray, small, cv::Size(gray.cols / mDownsample, gray.rows / mDownsample), 0, 0, cv::INTER_AREA);
+    else
+        small = gray;
+
+    cv::Mat result;
+    small.convertTo(result, CV_32F);
+    return result;
+}
+
+double LuckyImaging::laplacianVariance(const cv::Mat & roi) const {
+
+    if(roi.rows < 3 || roi.cols < 3)
+        return 0;
+
+    // Accumulate the sum and sum of squares of the 4-neighbour Laplacian in
+    // row stripes, one stripe per task.
+    const int num_stripes = std::max(1, std::min(cv::getNumThreads() * 4, roi.rows - 2));
+    std::vector<double> sums(num_stripes, 0.0);
+    std::vector<double> sums_sq(num_stripes, 0.0);
+
+    cv::parallel_for_(cv::Range(0, num_stripes), [&](const cv::Range & range) {
+        for(int stripe = range.start; stripe < range.end; stripe++) {
+            int row_begin = 1 + (roi.rows - 2) * stripe / num_stripes;
+            int row_end   = 1 + (roi.rows - 2) * (stripe + 1) / num_stripes;
+
+            double sum = 0;
+            double sum_sq = 0;
+            for(int y = row_begin; y < row_end; y++) {
+                const float * above = roi.ptr<float>(y - 1);
+                const float * row   = roi.ptr<float>(y);
+                const float * below = roi.ptr<float>(y + 1);
+                for(int x = 1; x < roi.cols - 1; x++) {
+                    float laplacian = 4 * row[x] - row[x - 1] - row[x + 1] - above[x] - below[x];
+                    sum += laplacian;
+                    sum_sq += laplacian * laplacian;
+                }
+            }
+            sums[stripe] = sum;
+            sums_sq[stripe] = sum_sq;
+        }
+    });
+
+    double sum = 0;
+    double sum_sq = 0;
+    for(int i = 0; i < num_stripes; i++) {
+        sum += sums[i];
+        sum_sq += sums_sq[i];
+    }
+
+    double n = (double) (roi.rows - 2) * (roi.cols - 2);
+    double mean = sum / n;
+    return sum_sq / n - mean * mean;
+}
+
+double LuckyImaging::starFWHM(const cv::Mat & roi, cv::Point2d & centroid) const {
+
+    // Locate the peak on a lightly smoothed copy so single hot pixels are ignored.
+    cv::Mat smoothed;
+    cv::GaussianBlur(roi, smoothed, cv::Size(3, 3), 0);
+    cv::Point peak;
+    double max_value = 0;
+    cv::minMaxLoc(smoothed, nullptr, &max_value, nullptr, &peak);
+
+    double background = cv::mean(roi)[0];
+    if(max_value <= background)
+        return -1;
+
+    // Intensity weighted first and second moments in a window around the peak.
+    int x0 = std::max(peak.x - STAR_WINDOW_RADIUS, 0);
+    int x1 = std::min(peak.x + STAR_WINDOW_RADIUS + 1, roi.cols);
+    int y0 = std::max(peak.y - STAR_WINDOW_RADIUS, 0);
+    int y1 = std::min(peak.y + STAR_WINDOW_RADIUS + 1, roi.rows);
+
+    double flux = 0, mx = 0, my = 0;
+    for(int y = y0; y < y1; y++) {
+        const float * row = roi.ptr<float>(y);
+        for(int x = x0; x < x1; x++) {
+            double value = row[x] - background;
+            if(value > 0) {
+                flux += value;
+                mx += value * x;
+                my += value * y;
+            }
+        }
+    }
+    if(flux <= 0)
+        return -1;
+
+    mx /= flux;
+    my /= flux;
+
+    double mxx = 0, myy = 0;
+    for(int y = y0; y < y1; y++) {
+        const float * row = roi.ptr<float>(y);
+        for(int x = x0; x < x1; x++) {
+            double value = row[x] - background;
+            if(value > 0) {
+                mxx += value * (x - mx) * (x - mx);
+                myy += value * (y - my) * (y - my);
+            }
+        }
+    }
+
+    centroid = cv::Point2d(mx, my);
+    double sigma = std::sqrt((mxx + myy) / (2 * flux));
+    return SIGMA_TO_FWHM * sigma * mDownsample;
+}
+
+double LuckyImaging::score(const cv::Mat & image) const {
+
+    cv::Mat roi = prepareROI(image);
+
+    if(mMetric == METRIC_FWHM) {
+        cv::Point2d centroid;
+        double fwhm = starFWHM(roi, centroid);
+        if(fwhm <= 0)
+            return -std::numeric_limits<double>::max();
+        return -fwhm;
+    }
+
+    return laplacianVariance(roi);
+}
+
+cv::Point2d LuckyImaging::brightestStar(const cv::Mat & image) const {
+
+    cv::Mat roi = prepareROI(image);
+    cv::Point2d centroid(roi.cols / 2.0, roi.rows / 2.0);
+    starFWHM(roi, centroid);
+
+    // Convert from downsampled ROI pixels to full resolution pixels.
+    int width  = (mRoiSize > 0) ? std::min(mRoiSize, image.cols) : image.cols;
+    int height = (mRoiSize > 0) ? std::min(mRoiSize, image.rows) : image.rows;
+    double origin_x = (image.cols - width) / 2;
+    double origin_y = (image.rows - height) / 2;
+
+    return cv::Point2d(origin_x + (centroid.x + 0.5) * mDownsample - 0.5,
+                       origin_y + (centroid.y + 0.5) * mDownsample - 0.5);
+}
+
+double LuckyImaging::addFrame(const cv::Mat & image, const CVFITS & metadata, const std::string & filename) {
+
+    double frame_score = score(image);
+    size_t index = mFramesScored++;
+
+    // Only copy the pixels if the frame displaces the worst retained frame.
+    if(mHeap.size() < mKeepCount || frame_score > mHeap.top().score) {
+        Candidate candidate;
+        candidate.score = frame_score;
+        candidate.index = index;
+        candidate.frame = metadata;
+        candidate.frame.image = mRetainPixels ? image.clone() : cv::Mat();
+        candidate.filename = filename;
+
+        if(mHeap.size() >= mKeepCount)
+            mHeap.pop();
+        mHeap.push(candidate);
+    }
+
+    return frame_score;
+}
+
+std::vector<LuckyImaging::Candidate> LuckyImaging::takeWinners() {
+
+    std::vector<Candidate> winners;
+    while(!mHeap.empty()) {
+        winners.push_back(mHeap.top());
+        mHeap.pop();
+    }
+
+    // The heap yields the worst frame first.
+    std::reverse(winners.begin(), winners.end());
+
+    return winners;
+}
+
+cv::Mat LuckyImaging::shiftAndAdd(const std::vector<Candidate> & winners) const {
+
+    if(winners.empty())
+        return cv::Mat();
+
+    const cv::Mat & reference = winners[0].frame.image;
+    cv::Point2d reference_star = brightestStar(reference);
+
+    cv::Mat stack = cv::Mat::zeros(reference.rows, reference.cols, CV_32FC(reference.channels()));
+    cv::Mat frame;
+    cv::Mat shifted;
+    cv::Mat transform(2, 3, CV_64F);
+
+    for(const Candidate & winner : winners) {
+        cv::Point2d star = brightestStar(winner.frame.image);
+
+        transform.at<double>(0, 0) = 1;
+        transform.at<double>(0, 1) = 0;
+        transform.at<double>(0, 2) = reference_star.x - star.x;
+        transform.at<double>(1, 0) = 0;
+        transform.at<double>(1, 1) = 1;
+        transform.at<double>(1, 2) = reference_star.y - star.y;
+
+        winner.frame.image.convertTo(frame, CV_32F);
+        cv::warpAffine(frame, shifted, transform, frame.size(), cv::INTER_LINEAR, cv::BORDER_REPLICATE);
+        stack += shifted;
+    }
+
+    stack /= (double) winners.size();
+    return stack;
+}
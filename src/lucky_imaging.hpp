@@ -0,0 +1,93 @@
+#ifndef LUCKY_IMAGING_H
+#define LUCKY_IMAGING_H
+
+#include <queue>
+#include <string>
+#include <vector>
+
+#include <opencv2/core/mat.hpp>
+
+#include "cvfits.hpp"
+
+/// @brief Scores frames by sharpness and keeps only the best ones in memory.
+///
+/// Frames are scored on a downsampled region of interest and held in a bounded
+/// min-heap, so at most `keep_count` frames are ever retained. Only the winners
+/// are written to disk and, optionally, shift-and-added into a stack. When the
+/// winners are not written, only their scores and frame numbers are kept.
+class LuckyImaging {
+
+public:
+    /// Sharpness metric used to score frames.
+    enum Metric {
+        METRIC_LAPLACIAN,   ///< Variance of the Laplacian. Fast and robust for extended objects.
+        METRIC_FWHM,        ///< Negative FWHM of the brightest star. Best for star fields.
+    };
+
+    /// A frame retained by the selector.
+    struct Candidate {
+        double score = 0;       ///< Sharpness score, larger is sharper
+        size_t index = 0;       ///< Position of the frame in the sequence, from 0
+        CVFITS frame;           ///< Exposure information, and the image if pixels are retained
+        std::string filename;   ///< Output file name
+    };
+
+protected:
+    struct CandidateOrder {
+        bool operator()(const Candidate & a, const Candidate & b) const { return a.score > b.score; }
+    };
+
+    Metric mMetric = METRIC_LAPLACIAN;
+    size_t mKeepCount = 1;
+    int mRoiSize = 512;
+    int mDownsample = 2;
+    bool mRetainPixels = true;
+
+    /// Min-heap, the worst retained frame is on top.
+    std::priority_queue<Candidate, std::vector<Candidate>, CandidateOrder> mHeap;
+    size_t mFramesScored = 0;
+
+    cv::Mat prepareROI(const cv::Mat & image) const;
+    double laplacianVariance(const cv::Mat & roi) const;
+    double starFWHM(const cv::Mat & roi, cv::Point2d & centroid) const;
+
+public:
+    /// @brief Creates a selector.
+    /// @param metric Sharpness metric.
+    /// @param keep_count Number of frames to retain.
+    /// @param roi_size Side length of the centered region used for scoring, in pixels. 0 uses the whole frame.
+    /// @param downsample Integer downsampling factor applied to the region before scoring.
+    /// @param retain_pixels Copy the pixels of the retained frames. Without them only the scores are kept.
+    LuckyImaging(Metric metric, size_t keep_count, int roi_size, int downsample, bool retain_pixels = true);
+
+    /// @brief Returns how many frames fit in a memory budget.
+    /// @param frame_bytes Size of one frame's pixels.
+    /// @param budget_bytes Memory the retained frames may use.
+    static size_t maxRetained(size_t frame_bytes, size_t budget_bytes);
+
+    /// @brief Scores a frame and retains it if it is among the best seen so far.
+    /// @param image The (debayered) frame.
+    /// @param metadata Exposure information for the frame.
+    /// @param filename Name of the file the frame would be written to.
+    /// @return The frame's score.
+    double addFrame(const cv::Mat & image, const CVFITS & metadata, const std::string & filename);
+
+    /// @brief Scores a frame without retaining it.
+    double score(const cv::Mat & image) const;
+
+    /// @brief Locates the brightest star in a frame, in full resolution pixel coordinates.
+    cv::Point2d brightestStar(const cv::Mat & image) const;
+
+    /// @brief Removes and returns the retained frames, sharpest first.
+    std::vector<Candidate> takeWinners();
+
+    /// @brief Aligns the frames on their brightest star and averages them.
+    /// @param winners Frames returned by takeWinners(). The first frame is the reference.
+    /// @return A CV_32F image with the same number of channels as the inputs.
+    cv::Mat shiftAndAdd(const std::vector<Candidate> & winners) const;
+
+    /// \return The number of frames scored so far.
+    size_t framesScored() const { return mFramesScored; }
+};
+
+#endif // LUCKY_IMAGING_H
@@ -5,12 +5,11 @@
 #include <opencv2/highgui.hpp>
 
 #include "cli_parser.hpp"
+#include "qhycapture.hpp"
 #include "WorkerThread.hpp"
 
-extern bool keep_running;
-
 void sig_handler(int signal){
-    keep_running = false;
+    stopCapture();
 
     if(signal == SIGINT)
         qDebug() << "Received SIGINT, exiting";
@@ -42,11 +41,9 @@ int main(int argc, char *argv[]) {
     WorkerThread * worker = new WorkerThread();
 
     if(enable_gui) {
-        // Create a window, initialize it with an all black background.
+        // Create the window. It is painted when the first frame arrives.
         cv::namedWindow("display_window", cv::WINDOW_NORMAL);
         cv::resizeWindow("display_window", 3856*0.3, 2180*0.3);
-        cv::Mat temp(2180, 3856, CV_16U);
-        cv::imshow("display_window", temp);
     }
 
     // Configure the worker thread
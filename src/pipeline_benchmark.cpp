@@ -0,0 +1,143 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "image_calibration.hpp"
+#include "pixel_pipeline.hpp"
+
+/// Compares the per-step frame processing of takeExposures with the fused
+/// tile pipeline on a synthetic 16-bit color frame: debayer, statistics and
+/// stretch for the preview, and conversion to FITS byte order.
+///
+/// Usage: qhy-pipeline-benchmark [width] [height] [iterations]
+
+namespace {
+size_t bytes(const cv::Mat & image) {
+    return image.total() * image.elemSize();
+}
+
+/// Memory traffic of scaleImageLinear on a multi-channel image, one term per full-frame call.
+size_t scaleImageLinearBytes(const cv::Mat & image) {
+    const size_t channel = image.total() * image.elemSize1();
+    const size_t channel_float = image.total() * sizeof(float);
+    const size_t channel_8u = image.total();
+
+    size_t moved = 2 * bytes(image);                                // split
+    moved += image.channels() * (
+        (channel + channel_float) +                                 // convertTo CV_32F
+        channel_float +                                             // minMaxLoc
+        channel_float +                                             // meanStdDev
+        2 * channel_float +                                         // subtract
+        2 * channel_float);                                         // multiply
+    moved += 2 * image.channels() * channel_float;                  // merge
+    moved += image.channels() * (channel_float + channel_8u);       // convertTo CV_8U
+    return moved;
+}
+
+/// Converts planes to FITS byte order the way cfitsio does for each written channel.
+void writeFITSPlanes(const std::vector<cv::Mat> & channels, uint16_t * output) {
+    for(const cv::Mat & channel : channels) {
+        for(int y = 0; y < channel.rows; y++) {
+            const uint16_t * in = channel.ptr<uint16_t>(y);
+            for(int x = 0; x < channel.cols; x++)
+                *output++ = toFITS(in[x]);
+        }
+    }
+}
+
+double elapsedMs(const std::chrono::steady_clock::time_point & start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+}
+
+int main(int argc, char *argv[])
+{
+    const int width = (argc > 1) ? atoi(argv[1]) : 6280;
+    const int height = (argc > 2) ? atoi(argv[2]) : 4210;
+    const int iterations = (argc > 3) ? atoi(argv[3]) : 10;
+    if(width < 2 || height < 2 || iterations < 1) {
+        fprintf(stderr, "Usage: %s [width] [height] [iterations]\n", argv[0]);
+        return -1;
+    }
+
+    // A noisy sky background with a gradient, as a 16-bit RGGB mosaic.
+    cv::Mat raw(height, width, CV_16U);
+    cv::randn(raw, 2000, 150);
+    for(int y = 0; y < height; y++) {
+        uint16_t * row = raw.ptr<uint16_t>(y);
+        for(int x = 0; x < width; x++)
+            row[x] = cv::saturate_cast<uint16_t>(row[x] + (x % 2 ? 300 : 0) + (y % 2 ? 150 : 0) + y / 8);
+    }
+
+    const int code = cv::COLOR_BayerRGGB2BGR;
+    std::vector<uint16_t> fits_unfused((size_t) width * height * 3);
+    std::vector<uint16_t> fits_fused((size_t) width * height * 3);
+
+    // Step by step, as takeExposures processed frames before the pipeline.
+    cv::Mat color, preview;
+    size_t unfused_bytes = 0;
+    double unfused_ms = 0;
+    for(int i = 0; i < iterations; i++) {
+        auto start = std::chrono::steady_clock::now();
+
+        cv::cvtColor(raw, color, code);
+        preview = scaleImageLinear(color);
+        std::vector<cv::Mat> channels;
+        cv::split(color, channels);
+        writeFITSPlanes(channels, fits_unfused.data());
+
+        unfused_ms += elapsedMs(start);
+    }
+    unfused_bytes = bytes(raw) + bytes(color)                       // cvtColor
+        + scaleImageLinearBytes(color)                              // preview stretch
+        + 2 * bytes(color)                                          // split
+        + 2 * bytes(color);                                         // FITS byte order
+
+    // Fused: debayer, measure and convert in one pass, then stretch in a second.
+    cv::Mat fused_color(height, width, CV_16UC3);
+    cv::Mat fused_preview(height, width, CV_8UC3);
+    size_t fused_bytes = 0;
+    double fused_ms = 0;
+    PipelineMetrics develop_metrics, stretch_metrics;
+    for(int i = 0; i < iterations; i++) {
+        auto start = std::chrono::steady_clock::now();
+
+        PixelPipeline<DebayerStage, StatisticsStage<uint16_t>, StoreStage, FITSByteSwapStage<uint16_t>> develop{
+            DebayerStage(code), StatisticsStage<uint16_t>(), StoreStage(fused_color),
+            FITSByteSwapStage<uint16_t>(fits_fused.data(), height, width)};
+        develop.run(raw);
+
+        PixelPipeline<StretchStage<uint16_t>, StoreStage> stretch{
+            StretchStage<uint16_t>(develop.stage<1>().statistics()), StoreStage(fused_preview)};
+        stretch.run(fused_color);
+
+        fused_ms += elapsedMs(start);
+        develop_metrics = develop.metrics();
+        stretch_metrics = stretch.metrics();
+    }
+    fused_bytes = develop_metrics.bytes_read + develop_metrics.bytes_written
+        + stretch_metrics.bytes_read + stretch_metrics.bytes_written;
+
+    // Both paths must produce the same frames.
+    bool color_match = (cv::norm(color, fused_color, cv::NORM_INF) == 0);
+    bool fits_match = (memcmp(fits_unfused.data(), fits_fused.data(), fits_fused.size() * sizeof(uint16_t)) == 0);
+    double preview_diff = cv::norm(preview, fused_preview, cv::NORM_INF);
+
+    printf("Frame: %d x %d, 16-bit RGGB, %d iterations\n", width, height, iterations);
+    printf("Tiles: %d of %d rows (%zu KB)\n", develop_metrics.tiles, develop_metrics.tile_rows,
+           pipelineTileBytes() / 1024);
+    printf("%-10s %12s %12s\n", "", "ms/frame", "MB moved");
+    printf("%-10s %12.1f %12.1f\n", "unfused", unfused_ms / iterations, unfused_bytes / 1048576.0);
+    printf("%-10s %12.1f %12.1f\n", "fused", fused_ms / iterations, fused_bytes / 1048576.0);
+    printf("Bytes moved reduced %.1fx, time reduced %.1fx\n",
+           (double) unfused_bytes / fused_bytes, unfused_ms / fused_ms);
+    printf("Color frames match: %s, FITS data match: %s, largest preview difference: %.0f\n",
+           color_match ? "yes" : "NO", fits_match ? "yes" : "NO", preview_diff);
+
+    return (color_match && fits_match && preview_diff <= 1) ? 0 : 1;
+}
@@ -0,0 +1,23 @@
+#include <unistd.h>
+
+#include "pixel_pipeline.hpp"
+
+namespace {
+/// Used when the L2 cache size cannot be determined.
+const size_t DEFAULT_L2_BYTES = 1 << 20;
+}
+
+size_t pipelineTileBytes() {
+
+    static const size_t tile_bytes = [] {
+        long l2_bytes = sysconf(_SC_LEVEL2_CACHE_SIZE);
+        if(l2_bytes <= 0)
+            l2_bytes = DEFAULT_L2_BYTES;
+
+        // A debayered tile is three times the size of the raw tile, and both
+        // must stay in the cache together with the stage output.
+        return std::max<size_t>(l2_bytes / 8, 16 << 10);
+    }();
+
+    return tile_bytes;
+}
@@ -0,0 +1,537 @@
+#ifndef PIXEL_PIPELINE_H
+#define PIXEL_PIPELINE_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "fits_encoding.hpp"
+
+/// Maximum number of channels the statistics stage measures.
+const int PIPELINE_MAX_CHANNELS = 4;
+
+/// \return The tile size that keeps a tile and its intermediates in the L2 cache (bytes).
+size_t pipelineTileBytes();
+
+/// @brief A band of frame rows travelling through a pipeline.
+///
+/// `rows` may carry `halo_top` and `halo_bottom` rows of context around the
+/// rows the tile owns. Stages that need neighbouring rows consume the halo.
+struct PipelineTile {
+    cv::Mat rows;
+    int source_row = 0;     ///< Frame row of the first row in `rows`, in this stage's coordinates
+    int halo_top = 0;
+    int halo_bottom = 0;
+    int index = 0;          ///< Tile number, for stages that keep per-tile results
+
+    /// \return The rows the tile owns, without the halo.
+    cv::Mat body() const { return rows.rowRange(halo_top, rows.rows - halo_bottom); }
+
+    /// \return Frame row of the first row the tile owns.
+    int bodyRow() const { return source_row + halo_top; }
+};
+
+/// @brief Default hooks of a pipeline stage.
+///
+/// Stages are composed at compile time, so these are hidden rather than
+/// overridden. `apply` runs concurrently on different tiles and must only
+/// write to per-tile state, its output, or thread local scratch buffers.
+struct PipelineStage {
+    /// \return Rows of context needed above and below each tile.
+    int halo() const { return 0; }
+
+    /// \return Tiles start on a multiple of this many rows.
+    int rowAlignment() const { return 1; }
+
+    /// Called before the first tile.
+    void begin(int num_tiles) {}
+
+    /// Called after the last tile.
+    void finish() {}
+
+    /// \return Bytes written outside the tile buffers during the last run.
+    size_t bytesWritten() const { return 0; }
+};
+
+/// @brief Traffic of the last pipeline run.
+struct PipelineMetrics {
+    int tiles = 0;
+    int tile_rows = 0;
+    size_t bytes_read = 0;          ///< Frame bytes read, including halo rows read twice
+    size_t bytes_written = 0;       ///< Bytes written to outputs
+};
+
+/// @brief Runs a chain of stages over a frame one cache-sized row tile at a time.
+///
+/// Every tile passes through all stages before the next one is loaded, so the
+/// frame is read from memory once and only the outputs are written back,
+/// instead of one full-frame pass per processing step. Tiles are processed
+/// in parallel.
+///
+/// Stages that need a halo must come before stages that change the number of rows.
+template <typename... Stages>
+class PixelPipeline {
+
+protected:
+    std::tuple<Stages...> mStages;
+    PipelineMetrics mMetrics;
+
+    template <size_t... I>
+    int maxHalo(std::index_sequence<I...>) const {
+        int halos[] = {0, std::get<I>(mStages).halo()...};
+        return *std::max_element(std::begin(halos), std::end(halos));
+    }
+
+    template <size_t... I>
+    int rowAlignment(std::index_sequence<I...>) const {
+        int alignment = 1;
+        int alignments[] = {1, std::get<I>(mStages).rowAlignment()...};
+        for(int a : alignments) {
+            int x = alignment, y = a;
+            while(y != 0) { int t = x % y; x = y; y = t; }
+            alignment = alignment / x * a;
+        }
+        return alignment;
+    }
+
+    template <size_t... I>
+    void begin(int num_tiles, std::index_sequence<I...>) {
+        int unused[] = {0, (std::get<I>(mStages).begin(num_tiles), 0)...};
+        (void) unused;
+    }
+
+    template <size_t... I>
+    void finish(std::index_sequence<I...>) {
+        int unused[] = {0, (std::get<I>(mStages).finish(), 0)...};
+        (void) unused;
+    }
+
+    template <size_t... I>
+    void apply(PipelineTile & tile, std::index_sequence<I...>) {
+        int unused[] = {0, (std::get<I>(mStages).apply(tile), 0)...};
+        (void) unused;
+    }
+
+    template <size_t... I>
+    size_t bytesWritten(std::index_sequence<I...>) const {
+        size_t bytes = 0;
+        size_t written[] = {0, std::get<I>(mStages).bytesWritten()...};
+        for(size_t b : written)
+            bytes += b;
+        return bytes;
+    }
+
+public:
+    explicit PixelPipeline(Stages... stages) : mStages(std::move(stages)...) {}
+
+    /// \return Stage number I, e.g. to read its results after a run.
+    template <size_t I>
+    typename std::tuple_element<I, std::tuple<Stages...>>::type & stage() { return std::get<I>(mStages); }
+
+    /// \return Traffic of the last run.
+    const PipelineMetrics & metrics() const { return mMetrics; }
+
+    /// @brief Passes a frame through every stage.
+    /// @param frame The input frame. It is never modified.
+    /// @param tile_bytes Approximate size of the input part of a tile.
+    void run(const cv::Mat & frame, size_t tile_bytes = pipelineTileBytes()) {
+        const auto indices = std::index_sequence_for<Stages...>();
+        const int halo = maxHalo(indices);
+        const int alignment = rowAlignment(indices);
+
+        const size_t row_bytes = std::max<size_t>(1, frame.cols * frame.elemSize());
+        int tile_rows = (int) std::min<size_t>(frame.rows, tile_bytes / row_bytes) / alignment * alignment;
+        tile_rows = std::max(tile_rows, alignment);
+        const int num_tiles = (frame.rows + tile_rows - 1) / tile_rows;
+
+        begin(num_tiles, indices);
+
+        std::vector<size_t> bytes_read(num_tiles, 0);
+        cv::parallel_for_(cv::Range(0, num_tiles), [&](const cv::Range & range) {
+            for(int i = range.start; i < range.end; i++) {
+                const int row_begin = i * tile_rows;
+                const int row_end = std::min(frame.rows, row_begin + tile_rows);
+
+                PipelineTile tile;
+                tile.index = i;
+                tile.halo_top = std::min(halo, row_begin);
+                tile.halo_bottom = std::min(halo, frame.rows - row_end);
+                tile.source_row = row_begin - tile.halo_top;
+                tile.rows = frame.rowRange(tile.source_row, row_end + tile.halo_bottom);
+                bytes_read[i] = tile.rows.total() * tile.rows.elemSize();
+
+                apply(tile, indices);
+            }
+        });
+
+        finish(indices);
+
+        mMetrics.tiles = num_tiles;
+        mMetrics.tile_rows = tile_rows;
+        mMetrics.bytes_read = 0;
+        for(size_t bytes : bytes_read)
+            mMetrics.bytes_read += bytes;
+        mMetrics.bytes_written = bytesWritten(indices);
+    }
+};
+
+/// @brief Subtracts a dark frame and multiplies by the inverse of a normalized flat.
+///
+/// Either calibration frame may be empty. Pixels of type T are converted to
+/// TOut, e.g. float to keep the negative noise of a dark subtracted sky.
+template <typename T, typename TOut = T>
+class CalibrateStage : public PipelineStage {
+
+protected:
+    cv::Mat mDark;          ///< CV_32F
+    cv::Mat mFlatGain;      ///< CV_32F, 1 / flat
+
+public:
+    /// @param dark Dark frame, the size of the frame. May be empty.
+    /// @param flat Flat field normalized to a mean of one, the size of the frame. May be empty.
+    CalibrateStage(const cv::Mat & dark, const cv::Mat & flat) {
+        if(!dark.empty())
+            dark.convertTo(mDark, CV_32F);
+        if(!flat.empty()) {
+            flat.convertTo(mFlatGain, CV_32F);
+            // Dead pixels in the flat are left uncorrected rather than blown up.
+            cv::Mat dead = (mFlatGain <= 0);
+            mFlatGain.setTo(1, dead);
+            cv::divide(1.0, mFlatGain, mFlatGain);
+        }
+    }
+
+    void apply(PipelineTile & tile) {
+        thread_local cv::Mat scratch;
+        scratch.create(tile.rows.rows, tile.rows.cols, CV_MAKETYPE(cv::DataType<TOut>::depth, tile.rows.channels()));
+
+        const int row_length = tile.rows.cols * tile.rows.channels();
+        for(int y = 0; y < tile.rows.rows; y++) {
+            const T * in = tile.rows.ptr<T>(y);
+            TOut * out = scratch.ptr<TOut>(y);
+            const float * dark = mDark.empty() ? nullptr : mDark.ptr<float>(tile.source_row + y);
+            const float * gain = mFlatGain.empty() ? nullptr : mFlatGain.ptr<float>(tile.source_row + y);
+            for(int x = 0; x < row_length; x++) {
+                float value = in[x];
+                if(dark)
+                    value -= dark[x];
+                if(gain)
+                    value *= gain[x];
+                out[x] = cv::saturate_cast<TOut>(value);
+            }
+        }
+
+        tile.rows = scratch;
+    }
+};
+
+/// @brief Averages factor x factor blocks of pixels, like hardware binning.
+template <typename T>
+class BinStage : public PipelineStage {
+
+protected:
+    int mFactor = 1;
+
+public:
+    BinStage(int factor) : mFactor(std::max(1, factor)) {}
+
+    int rowAlignment() const { return mFactor; }
+
+    void apply(PipelineTile & tile) {
+        CV_Assert(tile.halo_top == 0 && tile.halo_bottom == 0);
+
+        const int channels = tile.rows.channels();
+        const int out_rows = tile.rows.rows / mFactor;
+        const int out_cols = tile.rows.cols / mFactor;
+        const float norm = 1.0f / (mFactor * mFactor);
+
+        thread_local cv::Mat scratch;
+        thread_local std::vector<float> sums;
+        scratch.create(out_rows, out_cols, tile.rows.type());
+        sums.resize((size_t) out_cols * channels);
+
+        for(int y = 0; y < out_rows; y++) {
+            std::fill(sums.begin(), sums.end(), 0.0f);
+            for(int dy = 0; dy < mFactor; dy++) {
+                const T * in = tile.rows.ptr<T>(y * mFactor + dy);
+                for(int x = 0; x < out_cols; x++)
+                    for(int dx = 0; dx < mFactor; dx++)
+                        for(int c = 0; c < channels; c++)
+                            sums[x * channels + c] += in[(x * mFactor + dx) * channels + c];
+            }
+
+            T * out = scratch.ptr<T>(y);
+            for(size_t i = 0; i < sums.size(); i++)
+                out[i] = cv::saturate_cast<T>(sums[i] * norm);
+        }
+
+        tile.rows = scratch;
+        tile.source_row /= mFactor;
+    }
+};
+
+/// @brief Converts a Bayer mosaic to BGR.
+///
+/// Tiles carry two rows of halo so every tile starts on the same Bayer phase
+/// and interpolation at tile edges sees the same neighbours as a full frame.
+class DebayerStage : public PipelineStage {
+
+protected:
+    int mCode = -1;
+
+public:
+    /// @param code An OpenCV cv::COLOR_Bayer*2BGR code, or -1 to pass frames through.
+    DebayerStage(int code) : mCode(code) {}
+
+    int halo() const { return (mCode < 0) ? 0 : 2; }
+    int rowAlignment() const { return 2; }
+
+    void apply(PipelineTile & tile) {
+        if(mCode < 0)
+            return;
+
+        thread_local cv::Mat scratch;
+        cv::cvtColor(tile.rows, scratch, mCode);
+
+        tile.rows = scratch.rowRange(tile.halo_top, scratch.rows - tile.halo_bottom);
+        tile.source_row += tile.halo_top;
+        tile.halo_top = 0;
+        tile.halo_bottom = 0;
+    }
+};
+
+/// @brief Per-channel statistics of a frame.
+struct FrameStatistics {
+    int channels = 0;
+    size_t pixels = 0;
+    double mean[PIPELINE_MAX_CHANNELS] = {0};
+    double stddev[PIPELINE_MAX_CHANNELS] = {0};
+    double min[PIPELINE_MAX_CHANNELS] = {0};
+    double max[PIPELINE_MAX_CHANNELS] = {0};
+    size_t saturated[PIPELINE_MAX_CHANNELS] = {0};  ///< Pixels at or above the saturation level
+};
+
+/// @brief Measures the mean, standard deviation, range and saturation of each channel.
+template <typename T>
+class StatisticsStage : public PipelineStage {
+
+protected:
+    struct Partial {
+        double sum[PIPELINE_MAX_CHANNELS];
+        double sum_sq[PIPELINE_MAX_CHANNELS];
+        T min[PIPELINE_MAX_CHANNELS];
+        T max[PIPELINE_MAX_CHANNELS];
+        size_t saturated[PIPELINE_MAX_CHANNELS];
+        size_t pixels;
+        int channels;
+    };
+
+    double mSaturationLevel = std::numeric_limits<double>::max();
+    std::vector<Partial> mPartials;
+    FrameStatistics mStatistics;
+
+public:
+    /// @param saturation_level Pixels at or above this value are counted as saturated.
+    StatisticsStage(double saturation_level = std::numeric_limits<double>::max())
+        : mSaturationLevel(saturation_level) {}
+
+    void begin(int num_tiles) {
+        mPartials.assign(num_tiles, Partial());
+    }
+
+    void apply(PipelineTile & tile) {
+        const cv::Mat body = tile.body();
+        const int channels = std::min(body.channels(), PIPELINE_MAX_CHANNELS);
+        const int stride = body.channels();
+
+        Partial & p = mPartials[tile.index];
+        p.channels = channels;
+        p.pixels = body.total();
+        for(int c = 0; c < PIPELINE_MAX_CHANNELS; c++) {
+            p.sum[c] = 0;
+            p.sum_sq[c] = 0;
+            p.min[c] = std::numeric_limits<T>::max();
+            p.max[c] = std::numeric_limits<T>::lowest();
+            p.saturated[c] = 0;
+        }
+
+        for(int y = 0; y < body.rows; y++) {
+            const T * row = body.ptr<T>(y);
+            for(int c = 0; c < channels; c++) {
+                double sum = 0, sum_sq = 0;
+                T min = p.min[c], max = p.max[c];
+                size_t saturated = 0;
+                for(int x = 0; x < body.cols; x++) {
+                    const T value = row[x * stride + c];
+                    sum += value;
+                    sum_sq += (double) value * value;
+                    min = std::min(min, value);
+                    max = std::max(max, value);
+                    saturated += (value >= mSaturationLevel);
+                }
+                p.sum[c] += sum;
+                p.sum_sq[c] += sum_sq;
+                p.min[c] = min;
+                p.max[c] = max;
+                p.saturated[c] += saturated;
+            }
+        }
+    }
+
+    void finish() {
+        FrameStatistics s;
+        double sum[PIPELINE_MAX_CHANNELS] = {0};
+        double sum_sq[PIPELINE_MAX_CHANNELS] = {0};
+        for(int c = 0; c < PIPELINE_MAX_CHANNELS; c++) {
+            s.min[c] = std::numeric_limits<double>::max();
+            s.max[c] = std::numeric_limits<double>::lowest();
+        }
+
+        for(const Partial & p : mPartials) {
+            s.channels = p.channels;
+            s.pixels += p.pixels;
+            for(int c = 0; c < p.channels; c++) {
+                sum[c] += p.sum[c];
+                sum_sq[c] += p.sum_sq[c];
+                s.min[c] = std::min<double>(s.min[c], p.min[c]);
+                s.max[c] = std::max<double>(s.max[c], p.max[c]);
+                s.saturated[c] += p.saturated[c];
+            }
+        }
+
+        for(int c = 0; c < s.channels && s.pixels > 0; c++) {
+            s.mean[c] = sum[c] / s.pixels;
+            s.stddev[c] = std::sqrt(std::max(0.0, sum_sq[c] / s.pixels - s.mean[c] * s.mean[c]));
+        }
+        for(int c = s.channels; c < PIPELINE_MAX_CHANNELS; c++) {
+            s.min[c] = 0;
+            s.max[c] = 0;
+        }
+
+        mStatistics = s;
+    }
+
+    /// \return The statistics of the last frame.
+    const FrameStatistics & statistics() const { return mStatistics; }
+};
+
+/// @brief Maps each channel linearly to 8 bits for display.
+///
+/// Uses the same stretch as scaleImageLinear: (value - min) * 255 / (4 stddev).
+template <typename T>
+class StretchStage : public PipelineStage {
+
+protected:
+    float mOffset[PIPELINE_MAX_CHANNELS] = {0};
+    float mScale[PIPELINE_MAX_CHANNELS] = {0};
+
+public:
+    /// @param stats Statistics of the frame being stretched.
+    StretchStage(const FrameStatistics & stats) {
+        for(int c = 0; c < stats.channels; c++) {
+            double low = stats.mean[c] - stats.stddev[c];
+            double high = stats.mean[c] + 3 * stats.stddev[c];
+            mOffset[c] = stats.min[c];
+            mScale[c] = (high > low) ? 255.0 / (high - low) : 0;
+        }
+    }
+
+    void apply(PipelineTile & tile) {
+        const int channels = tile.rows.channels();
+
+        thread_local cv::Mat scratch;
+        scratch.create(tile.rows.rows, tile.rows.cols, CV_8UC(channels));
+
+        for(int y = 0; y < tile.rows.rows; y++) {
+            const T * in = tile.rows.ptr<T>(y);
+            uchar * out = scratch.ptr<uchar>(y);
+            for(int x = 0; x < tile.rows.cols; x++) {
+                for(int c = 0; c < channels; c++) {
+                    const int i = x * channels + c;
+                    out[i] = cv::saturate_cast<uchar>((in[i] - mOffset[c]) * mScale[c]);
+                }
+            }
+        }
+
+        tile.rows = scratch;
+    }
+};
+
+/// @brief Copies the tiles into a frame-sized output image.
+class StoreStage : public PipelineStage {
+
+protected:
+    cv::Mat mOutput;
+    std::vector<size_t> mBytes;
+
+public:
+    /// @param output Receives the frame. Must already have the size and type of the tiles.
+    StoreStage(cv::Mat output) : mOutput(output) {}
+
+    void begin(int num_tiles) { mBytes.assign(num_tiles, 0); }
+
+    void apply(PipelineTile & tile) {
+        const cv::Mat body = tile.body();
+        CV_Assert(body.type() == mOutput.type() && body.cols == mOutput.cols);
+        body.copyTo(mOutput.rowRange(tile.bodyRow(), tile.bodyRow() + body.rows));
+        mBytes[tile.index] = body.total() * body.elemSize();
+    }
+
+    size_t bytesWritten() const {
+        size_t bytes = 0;
+        for(size_t b : mBytes)
+            bytes += b;
+        return bytes;
+    }
+};
+
+/// @brief Writes the frame as FITS data: planar channels, big-endian, with BZERO applied.
+template <typename T>
+class FITSByteSwapStage : public PipelineStage {
+
+protected:
+    uint8_t * mOutput = nullptr;
+    int mRows = 0;
+    int mCols = 0;
+    std::vector<size_t> mBytes;
+
+public:
+    /// @param output Buffer of rows * cols * channels * sizeof(T) bytes.
+    /// @param rows Rows of the frame that reaches this stage.
+    /// @param cols Columns of the frame that reaches this stage.
+    FITSByteSwapStage(void * output, int rows, int cols)
+        : mOutput(static_cast<uint8_t *>(output)), mRows(rows), mCols(cols) {}
+
+    void begin(int num_tiles) { mBytes.assign(num_tiles, 0); }
+
+    void apply(PipelineTile & tile) {
+        typedef decltype(toFITS(T())) Encoded;
+
+        const cv::Mat body = tile.body();
+        const int channels = body.channels();
+        for(int c = 0; c < channels; c++) {
+            Encoded * plane = reinterpret_cast<Encoded *>(mOutput) + (size_t) c * mRows * mCols;
+            for(int y = 0; y < body.rows; y++)
+                encodeFITSRow(body.ptr<T>(y), body.cols, channels, c, plane + (size_t) (tile.bodyRow() + y) * mCols);
+        }
+        mBytes[tile.index] = body.total() * body.elemSize();
+    }
+
+    size_t bytesWritten() const {
+        size_t bytes = 0;
+        for(size_t b : mBytes)
+            bytes += b;
+        return bytes;
+    }
+};
+
+#endif // PIXEL_PIPELINE_H
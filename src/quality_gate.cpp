@@ -0,0 +1,91 @@
+#include <algorithm>
+#include <sstream>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "quality_gate.hpp"
+
+QualityGate::QualityGate(const QualityThresholds & thresholds, Action action)
+    : mThresholds(thresholds), mAction(action) {
+}
+
+namespace {
+/// Counts the values at or above `level`, in row stripes, one stripe per task.
+template <typename T>
+size_t countSaturated(const cv::Mat & values, int level) {
+
+    const int row_length = values.cols * values.channels();
+    const int num_stripes = std::max(1, std::min(cv::getNumThreads() * 4, values.rows));
+    std::vector<size_t> counts(num_stripes, 0);
+
+    cv::parallel_for_(cv::Range(0, num_stripes), [&](const cv::Range & range) {
+        for(int stripe = range.start; stripe < range.end; stripe++) {
+            int row_begin = values.rows * stripe / num_stripes;
+            int row_end   = values.rows * (stripe + 1) / num_stripes;
+
+            size_t count = 0;
+            for(int y = row_begin; y < row_end; y++) {
+                const T * row = values.ptr<T>(y);
+                for(int x = 0; x < row_length; x++)
+                    count += (row[x] >= level);
+            }
+            counts[stripe] = count;
+        }
+    });
+
+    size_t saturated = 0;
+    for(size_t count : counts)
+        saturated += count;
+    return saturated;
+}
+}
+
+double QualityGate::saturationFraction(const cv::Mat & image, int level) {
+
+    if(image.empty())
+        return 0;
+
+    size_t saturated = 0;
+    if(image.depth() == CV_8U) {
+        saturated = countSaturated<uchar>(image, level);
+    } else if(image.depth() == CV_16U) {
+        saturated = countSaturated<ushort>(image, level);
+    } else {
+        cv::Mat values;
+        image.convertTo(values, CV_16U);
+        saturated = countSaturated<ushort>(values, level);
+    }
+
+    return (double) saturated / ((double) image.total() * image.channels());
+}
+
+bool QualityGate::check(const cv::Mat & raw_image, const StarField & field, std::string & reason) {
+
+    std::ostringstream failures;
+
+    if(mThresholds.max_background > 0 && field.bkg_mean > mThresholds.max_background)
+        failures << "background " << field.bkg_mean << " > " << mThresholds.max_background << "; ";
+
+    if(mThresholds.min_stars > 0 && field.stars.size() < mThresholds.min_stars)
+        failures << "stars " << field.stars.size() << " < " << mThresholds.min_stars << "; ";
+
+    if(mThresholds.max_fwhm > 0 && (field.stars.empty() || field.median_fwhm > mThresholds.max_fwhm))
+        failures << "FWHM " << field.median_fwhm << " > " << mThresholds.max_fwhm << "; ";
+
+    if(mThresholds.max_saturation > 0) {
+        double saturation = saturationFraction(raw_image, mThresholds.saturation_level);
+        if(saturation > mThresholds.max_saturation)
+            failures << "saturation " << saturation << " > " << mThresholds.max_saturation << "; ";
+    }
+
+    reason = failures.str();
+    if(!reason.empty()) {
+        reason.resize(reason.size() - 2);
+        mRejected++;
+        return false;
+    }
+
+    mAccepted++;
+    return true;
+}
@@ -0,0 +1,66 @@
+#ifndef QUALITY_GATE_H
+#define QUALITY_GATE_H
+
+#include <string>
+
+#include <opencv2/core/mat.hpp>
+
+#include "star_detection.hpp"
+
+/// Limits a frame must satisfy to pass the QualityGate. A limit of zero is disabled.
+struct QualityThresholds {
+    double max_background = 0;  ///< Largest acceptable sky background (ADU)
+    size_t min_stars = 0;       ///< Smallest acceptable number of detected stars
+    double max_fwhm = 0;        ///< Largest acceptable median FWHM (pixels)
+    double max_saturation = 0;  ///< Largest acceptable fraction of saturated pixels
+    int saturation_level = 65000; ///< Pixels at or above this value are saturated
+};
+
+/// @brief Decides whether a frame is worth writing to disk.
+///
+/// Frames are judged on cheap statistics: the background level, star count and
+/// median FWHM from the StarDetector, and the fraction of saturated pixels.
+/// Rejected frames are either written to a quarantine directory or dropped.
+class QualityGate {
+
+public:
+    /// What happens to rejected frames.
+    enum Action {
+        ACTION_QUARANTINE,  ///< Write rejected frames to the quarantine directory.
+        ACTION_DROP,        ///< Do not write rejected frames.
+    };
+
+protected:
+    QualityThresholds mThresholds;
+    Action mAction = ACTION_QUARANTINE;
+
+    size_t mAccepted = 0;
+    size_t mRejected = 0;
+
+public:
+    /// @brief Creates a gate.
+    /// @param thresholds Limits a frame must satisfy.
+    /// @param action What happens to rejected frames.
+    QualityGate(const QualityThresholds & thresholds, Action action);
+
+    /// @brief Checks a frame against the thresholds and updates the counters.
+    /// @param raw_image The frame as read out from the camera.
+    /// @param field Stars detected in the frame.
+    /// @param reason Returns a description of the failed checks.
+    /// @return true if the frame passed.
+    bool check(const cv::Mat & raw_image, const StarField & field, std::string & reason);
+
+    /// @brief Returns the fraction of pixels at or above a level.
+    static double saturationFraction(const cv::Mat & image, int level);
+
+    /// \return What happens to rejected frames.
+    Action action() const { return mAction; }
+
+    /// \return The number of frames that passed.
+    size_t accepted() const { return mAccepted; }
+
+    /// \return The number of frames that failed.
+    size_t rejected() const { return mRejected; }
+};
+
+#endif // QUALITY_GATE_H
@@ -0,0 +1,116 @@
+#include <cstring>
+
+#include <sys/types.h>
+
+#include <opencv2/core.hpp>
+
+#include "session_recording.hpp"
+
+namespace {
+const SessionHeader DEFAULT_HEADER;
+const SessionFrame DEFAULT_FRAME;
+
+/// Frames are large, so use a buffer big enough to turn them into few system calls.
+const size_t FILE_BUFFER_SIZE = 4 << 20;
+}
+
+SessionRecorder::SessionRecorder(const std::string & filename, const SessionHeader & header)
+    : mHeader(header) {
+
+    mFile = fopen(filename.c_str(), "wb");
+    if(mFile == nullptr)
+        return;
+
+    setvbuf(mFile, nullptr, _IOFBF, FILE_BUFFER_SIZE);
+
+    memcpy(mHeader.magic, DEFAULT_HEADER.magic, sizeof(mHeader.magic));
+    mHeader.version = SESSION_VERSION;
+    if(fwrite(&mHeader, sizeof(mHeader), 1, mFile) != 1) {
+        fclose(mFile);
+        mFile = nullptr;
+        return;
+    }
+    mBytes = sizeof(mHeader);
+}
+
+SessionRecorder::~SessionRecorder() {
+    if(mFile != nullptr)
+        fclose(mFile);
+}
+
+bool SessionRecorder::record(const SessionFrame & frame, const cv::Mat & raw_image) {
+
+    if(mFile == nullptr || raw_image.rows != mHeader.rows || raw_image.cols != mHeader.cols ||
+       raw_image.type() != mHeader.cv_type || !raw_image.isContinuous())
+        return false;
+
+    SessionFrame entry = frame;
+    entry.magic = DEFAULT_FRAME.magic;
+    entry.bytes = raw_image.total() * raw_image.elemSize();
+
+    if(fwrite(&entry, sizeof(entry), 1, mFile) != 1 ||
+       fwrite(raw_image.ptr(), entry.bytes, 1, mFile) != 1)
+        return false;
+
+    mFrames++;
+    mBytes += sizeof(entry) + entry.bytes;
+    return true;
+}
+
+SessionReader::SessionReader(const std::string & filename) {
+
+    FILE * file = fopen(filename.c_str(), "rb");
+    if(file == nullptr)
+        return;
+
+    setvbuf(file, nullptr, _IOFBF, FILE_BUFFER_SIZE);
+
+    if(fread(&mHeader, sizeof(mHeader), 1, file) != 1 ||
+       memcmp(mHeader.magic, DEFAULT_HEADER.magic, sizeof(mHeader.magic)) != 0 ||
+       mHeader.version != SESSION_VERSION || mHeader.rows <= 0 || mHeader.cols <= 0) {
+        fclose(file);
+        return;
+    }
+
+    // Index the frames so the caller can plan the replay before reading any pixels.
+    const size_t frame_bytes = (size_t) mHeader.rows * mHeader.cols * CV_ELEM_SIZE(mHeader.cv_type);
+    fseeko(file, 0, SEEK_END);
+    const off_t file_size = ftello(file);
+    off_t offset = sizeof(mHeader);
+    SessionFrame frame;
+    while(fseeko(file, offset, SEEK_SET) == 0 && fread(&frame, sizeof(frame), 1, file) == 1) {
+        if(frame.magic != DEFAULT_FRAME.magic || frame.bytes != frame_bytes)
+            break;
+
+        off_t data_offset = offset + sizeof(frame);
+        if(data_offset + (off_t) frame.bytes > file_size)
+            break;
+
+        mFrames.push_back(frame);
+        mOffsets.push_back(data_offset);
+        offset = data_offset + frame.bytes;
+    }
+
+    mFile = file;
+}
+
+SessionReader::~SessionReader() {
+    if(mFile != nullptr)
+        fclose(mFile);
+}
+
+bool SessionReader::next(SessionFrame & frame, cv::Mat & raw_image) {
+
+    if(mFile == nullptr || mNext >= mFrames.size())
+        return false;
+
+    raw_image.create(mHeader.rows, mHeader.cols, mHeader.cv_type);
+
+    frame = mFrames[mNext];
+    if(fseeko(mFile, mOffsets[mNext], SEEK_SET) != 0 ||
+       fread(raw_image.ptr(), frame.bytes, 1, mFile) != 1)
+        return false;
+
+    mNext++;
+    return true;
+}
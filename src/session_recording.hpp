@@ -0,0 +1,118 @@
+#ifndef SESSION_RECORDING_H
+#define SESSION_RECORDING_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <opencv2/core/mat.hpp>
+
+/// Layout version of the capture file.
+const uint32_t SESSION_VERSION = 1;
+
+/// @brief Describes the camera at the start of a recorded session.
+struct SessionHeader {
+    char magic[8] = {'Q', 'H', 'Y', 'S', 'E', 'S', 'S', '\0'};
+    uint32_t version = SESSION_VERSION;
+    int32_t rows = 0;               ///< Height of the raw frames (pixels)
+    int32_t cols = 0;               ///< Width of the raw frames (pixels)
+    int32_t cv_type = 0;            ///< OpenCV type of the raw frames
+    int32_t bayer_order = 0;        ///< Bayer order of the sensor, as used by camera_control
+    int32_t xbinning = 1;
+    int32_t ybinning = 1;
+    char detector_name[64] = {0};
+    char bin_mode_name[16] = {0};
+};
+
+/// @brief Timing and settings of one recorded frame. The raw pixels follow it in the file.
+///
+/// Times are nanoseconds since the UNIX epoch (UTC).
+struct SessionFrame {
+    uint32_t magic = 0x4D415246;    ///< "FRAM", used to detect truncated files
+    uint32_t bytes = 0;             ///< Size of the raw pixels that follow
+    char filter_name[32] = {0};
+    int64_t exposure_start_ns = 0;
+    int64_t exposure_end_ns = 0;
+    int64_t readout_start_ns = 0;
+    int64_t readout_end_ns = 0;
+    double duration_sec = 0;        ///< Requested exposure duration
+    double gain = 0;
+    int32_t offset = 0;
+    int32_t aborted = 0;
+    double temperature = 0;         ///< Sensor temperature (Celsius)
+    double filter_move_sec = 0;     ///< Time spent moving the filter wheel before this frame
+};
+
+/// @brief Records the raw frames of a session and their timings to a capture file.
+///
+/// The file is a SessionHeader followed by one SessionFrame and its raw
+/// pixels per exposure, with no per-frame FITS overhead.
+class SessionRecorder {
+
+protected:
+    FILE * mFile = nullptr;
+    SessionHeader mHeader;
+    size_t mFrames = 0;
+    size_t mBytes = 0;
+
+public:
+    /// @brief Creates the capture file and writes the header.
+    SessionRecorder(const std::string & filename, const SessionHeader & header);
+
+    /// Closes the capture file.
+    ~SessionRecorder();
+
+    /// \return true if the capture file was created.
+    bool isOpen() const { return mFile != nullptr; }
+
+    /// @brief Appends one frame.
+    /// @param frame Timing and settings. The size is taken from `raw_image`.
+    /// @param raw_image The raw frame, which must match the header.
+    /// @return false if the frame could not be written.
+    bool record(const SessionFrame & frame, const cv::Mat & raw_image);
+
+    /// \return The number of frames recorded.
+    size_t frames() const { return mFrames; }
+
+    /// \return The number of bytes written.
+    size_t bytes() const { return mBytes; }
+};
+
+/// @brief Reads a capture file written by SessionRecorder.
+class SessionReader {
+
+protected:
+    FILE * mFile = nullptr;
+    SessionHeader mHeader;
+    std::vector<SessionFrame> mFrames;
+    std::vector<int64_t> mOffsets;
+    size_t mNext = 0;
+
+public:
+    /// @brief Opens a capture file and indexes its frames. A truncated last frame is ignored.
+    SessionReader(const std::string & filename);
+
+    /// Closes the capture file.
+    ~SessionReader();
+
+    /// \return true if the file is a readable capture file.
+    bool isOpen() const { return mFile != nullptr; }
+
+    /// \return The camera description.
+    const SessionHeader & header() const { return mHeader; }
+
+    /// \return The timing and settings of every frame, in recorded order.
+    const std::vector<SessionFrame> & frames() const { return mFrames; }
+
+    /// @brief Reads the next frame.
+    /// @param frame Receives the timing and settings.
+    /// @param raw_image Receives the raw pixels. Reallocated if it does not match the header.
+    /// @return false at the end of the file or on a read error.
+    bool next(SessionFrame & frame, cv::Mat & raw_image);
+
+    /// @brief Starts reading from the first frame again.
+    void rewind() { mNext = 0; }
+};
+
+#endif // SESSION_RECORDING_H
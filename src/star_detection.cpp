@@ -0,0 +1,270 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "star_detection.hpp"
+
+namespace {
+/// Conversion from a Gaussian sigma to its full width at half maximum.
+const double SIGMA_TO_FWHM = 2.354820045;
+
+/// Pixels further than this many standard deviations from the tile mean are
+/// excluded from the background estimate.
+const double BACKGROUND_CLIP = 3.0;
+
+/// Returns the median of a list of values, reordering the list.
+double median(std::vector<double> & values) {
+    if(values.empty())
+        return 0;
+
+    size_t middle = values.size() / 2;
+    std::nth_element(values.begin(), values.begin() + middle, values.end());
+    return values[middle];
+}
+}
+
+StarDetector::StarDetector(double threshold, int tile_size, int min_area, size_t max_stars, double time_budget_ms)
+    : mThreshold(threshold), mTileSize(std::max(tile_size, 8)), mMinArea(std::max(min_area, 1)),
+      mMaxStars(max_stars), mTimeBudgetMs(time_budget_ms) {
+}
+
+void StarDetector::estimateBackground(const cv::Mat & image, cv::Mat & bkg_tiles, cv::Mat & rms_tiles) const {
+
+    const int tiles_x = (image.cols + mTileSize - 1) / mTileSize;
+    const int tiles_y = (image.rows + mTileSize - 1) / mTileSize;
+    bkg_tiles.create(tiles_y, tiles_x, CV_32F);
+    rms_tiles.create(tiles_y, tiles_x, CV_32F);
+
+    cv::parallel_for_(cv::Range(0, tiles_x * tiles_y), [&](const cv::Range & range) {
+        for(int tile = range.start; tile < range.end; tile++) {
+            int tx = tile % tiles_x;
+            int ty = tile / tiles_x;
+            int x0 = tx * mTileSize;
+            int y0 = ty * mTileSize;
+            int x1 = std::min(x0 + mTileSize, image.cols);
+            int y1 = std::min(y0 + mTileSize, image.rows);
+
+            // First pass: plain mean and standard deviation.
+            double sum = 0, sum_sq = 0;
+            for(int y = y0; y < y1; y++) {
+                const float * row = image.ptr<float>(y);
+                for(int x = x0; x < x1; x++) {
+                    sum += row[x];
+                    sum_sq += (double) row[x] * row[x];
+                }
+            }
+            double n = (double) (x1 - x0) * (y1 - y0);
+            double mean = sum / n;
+            double stddev = std::sqrt(std::max(sum_sq / n - mean * mean, 0.0));
+
+            // Second pass: repeat without the stars and hot pixels.
+            double low  = mean - BACKGROUND_CLIP * stddev;
+            double high = mean + BACKGROUND_CLIP * stddev;
+            sum = 0;
+            sum_sq = 0;
+            n = 0;
+            for(int y = y0; y < y1; y++) {
+                const float * row = image.ptr<float>(y);
+                for(int x = x0; x < x1; x++) {
+                    if(row[x] >= low && row[x] <= high) {
+                        sum += row[x];
+                        sum_sq += (double) row[x] * row[x];
+                        n += 1;
+                    }
+                }
+            }
+            if(n > 0) {
+                mean = sum / n;
+                stddev = std::sqrt(std::max(sum_sq / n - mean * mean, 0.0));
+            }
+
+            bkg_tiles.at<float>(ty, tx) = mean;
+            rms_tiles.at<float>(ty, tx) = stddev;
+        }
+    });
+}
+
+cv::Mat StarDetector::thresholdImage(const cv::Mat & image, const cv::Mat & bkg_tiles, const cv::Mat & rms_tiles) const {
+
+    cv::Mat mask(image.rows, image.cols, CV_8U);
+
+    cv::parallel_for_(cv::Range(0, image.rows), [&](const cv::Range & range) {
+        for(int y = range.start; y < range.end; y++) {
+            const float * row = image.ptr<float>(y);
+            const float * bkg = bkg_tiles.ptr<float>(y / mTileSize);
+            const float * rms = rms_tiles.ptr<float>(y / mTileSize);
+            uchar * out = mask.ptr<uchar>(y);
+            for(int x = 0; x < image.cols; x++) {
+                int tx = x / mTileSize;
+                out[x] = (row[x] > bkg[tx] + mThreshold * rms[tx]) ? 255 : 0;
+            }
+        }
+    });
+
+    return mask;
+}
+
+bool StarDetector::measureStar(const cv::Mat & image, const cv::Rect & box, float background, Star & star) const {
+
+    // Measure within a square aperture around the detection, large enough to
+    // include the wings that fell below the threshold.
+    int margin = std::max(box.width, box.height) / 2 + 2;
+    cv::Rect aperture(box.x - margin, box.y - margin, box.width + 2 * margin, box.height + 2 * margin);
+    aperture &= cv::Rect(0, 0, image.cols, image.rows);
+
+    double flux = 0, mx = 0, my = 0, peak = 0;
+    for(int y = aperture.y; y < aperture.y + aperture.height; y++) {
+        const float * row = image.ptr<float>(y);
+        for(int x = aperture.x; x < aperture.x + aperture.width; x++) {
+            double value = row[x] - background;
+            if(value > 0) {
+                flux += value;
+                mx += value * x;
+                my += value * y;
+                peak = std::max(peak, value);
+            }
+        }
+    }
+    if(flux <= 0)
+        return false;
+
+    mx /= flux;
+    my /= flux;
+
+    double mxx = 0, myy = 0, radius_sum = 0;
+    for(int y = aperture.y; y < aperture.y + aperture.height; y++) {
+        const float * row = image.ptr<float>(y);
+        for(int x = aperture.x; x < aperture.x + aperture.width; x++) {
+            double value = row[x] - background;
+            if(value > 0) {
+                double dx = x - mx;
+                double dy = y - my;
+                mxx += value * dx * dx;
+                myy += value * dy * dy;
+                radius_sum += value * std::sqrt(dx * dx + dy * dy);
+            }
+        }
+    }
+
+    star.x = mx;
+    star.y = my;
+    star.flux = flux;
+    star.peak = peak;
+    star.hfr = radius_sum / flux;
+    star.fwhm = SIGMA_TO_FWHM * std::sqrt((mxx + myy) / (2 * flux));
+    return true;
+}
+
+StarField StarDetector::detect(const cv::Mat & image) const {
+
+    const auto t_start = std::chrono::steady_clock::now();
+    auto elapsed_ms = [&t_start]() {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t_start).count();
+    };
+
+    StarField field;
+
+    cv::Mat gray;
+    if(image.channels() == 3)
+        cv::cvtColor(image, gray, cv::COLOR_BGR2GRAY);
+    else
+        gray = image;
+
+    cv::Mat frame;
+    gray.convertTo(frame, CV_32F);
+
+    cv::Mat bkg_tiles;
+    cv::Mat rms_tiles;
+    estimateBackground(frame, bkg_tiles, rms_tiles);
+
+    field.bkg_mean = cv::mean(bkg_tiles)[0];
+    std::vector<double> rms_values(rms_tiles.begin<float>(), rms_tiles.end<float>());
+    field.bkg_rms = median(rms_values);
+
+    cv::Mat mask = thresholdImage(frame, bkg_tiles, rms_tiles);
+    cv::Mat labels, stats, centroids;
+    int num_labels = cv::connectedComponentsWithStats(mask, labels, stats, centroids, 8, CV_32S);
+
+    // Keep components that look like stars: large enough to not be a hot
+    // pixel, no larger than a background tile and clear of the frame edge.
+    std::vector<int> candidates;
+    const int max_area = mTileSize * mTileSize;
+    for(int label = 1; label < num_labels; label++) {
+        int area = stats.at<int>(label, cv::CC_STAT_AREA);
+        int left = stats.at<int>(label, cv::CC_STAT_LEFT);
+        int top  = stats.at<int>(label, cv::CC_STAT_TOP);
+        int width  = stats.at<int>(label, cv::CC_STAT_WIDTH);
+        int height = stats.at<int>(label, cv::CC_STAT_HEIGHT);
+        if(area < mMinArea || area > max_area)
+            continue;
+        if(left == 0 || top == 0 || left + width == frame.cols || top + height == frame.rows)
+            continue;
+        candidates.push_back(label);
+    }
+    field.candidates = candidates.size();
+
+    // Measure the largest components first so the brightest stars survive truncation.
+    std::sort(candidates.begin(), candidates.end(), [&stats](int a, int b) {
+        return stats.at<int>(a, cv::CC_STAT_AREA) > stats.at<int>(b, cv::CC_STAT_AREA);
+    });
+    if(candidates.size() > mMaxStars)
+        candidates.resize(mMaxStars);
+
+    std::vector<Star> stars(candidates.size());
+    std::vector<char> measured(candidates.size(), 0);
+    std::atomic<bool> truncated(false);
+
+    cv::parallel_for_(cv::Range(0, (int) candidates.size()), [&](const cv::Range & range) {
+        for(int i = range.start; i < range.end; i++) {
+            if(truncated || elapsed_ms() > mTimeBudgetMs) {
+                truncated = true;
+                return;
+            }
+
+            int label = candidates[i];
+            cv::Rect box(stats.at<int>(label, cv::CC_STAT_LEFT), stats.at<int>(label, cv::CC_STAT_TOP),
+                         stats.at<int>(label, cv::CC_STAT_WIDTH), stats.at<int>(label, cv::CC_STAT_HEIGHT));
+            float background = bkg_tiles.at<float>((box.y + box.height / 2) / mTileSize,
+                                                   (box.x + box.width / 2) / mTileSize);
+
+            stars[i].area = stats.at<int>(label, cv::CC_STAT_AREA);
+            measured[i] = measureStar(frame, box, background, stars[i]);
+        }
+    });
+    field.truncated = truncated;
+
+    std::vector<double> fwhms;
+    std::vector<double> hfrs;
+    for(size_t i = 0; i < stars.size(); i++) {
+        if(!measured[i])
+            continue;
+        field.stars.push_back(stars[i]);
+        fwhms.push_back(stars[i].fwhm);
+        hfrs.push_back(stars[i].hfr);
+    }
+    field.median_fwhm = median(fwhms);
+    field.median_hfr = median(hfrs);
+
+    field.elapsed_ms = elapsed_ms();
+    return field;
+}
+
+bool StarDetector::writeStarList(const StarField & field, const std::string & filename) {
+
+    std::ofstream out(filename);
+    if(!out)
+        return false;
+
+    out << "x,y,flux,peak,hfr,fwhm,area\n";
+    for(const Star & star : field.stars) {
+        out << star.x << "," << star.y << "," << star.flux << "," << star.peak << ","
+            << star.hfr << "," << star.fwhm << "," << star.area << "\n";
+    }
+
+    return out.good();
+}
@@ -0,0 +1,70 @@
+#ifndef STAR_DETECTION_H
+#define STAR_DETECTION_H
+
+#include <string>
+#include <vector>
+
+#include <opencv2/core/mat.hpp>
+
+/// A star measured by the StarDetector.
+struct Star {
+    double x = 0;       ///< Flux weighted centroid, X (pixels)
+    double y = 0;       ///< Flux weighted centroid, Y (pixels)
+    double flux = 0;    ///< Background subtracted flux within the aperture (ADU)
+    double peak = 0;    ///< Background subtracted peak value (ADU)
+    double hfr = 0;     ///< Half flux radius (pixels)
+    double fwhm = 0;    ///< FWHM from the second moments (pixels)
+    int area = 0;       ///< Number of pixels above the detection threshold
+};
+
+/// The result of running the StarDetector on a frame.
+struct StarField {
+    std::vector<Star> stars;    ///< Measured stars, largest first
+    size_t candidates = 0;      ///< Connected components above the threshold
+    double bkg_mean = 0;        ///< Mean sky background (ADU)
+    double bkg_rms = 0;         ///< Median of the per-tile background RMS (ADU)
+    double median_fwhm = 0;     ///< Median FWHM of the measured stars (pixels)
+    double median_hfr = 0;      ///< Median HFR of the measured stars (pixels)
+    bool truncated = false;     ///< Measurement stopped because the time budget ran out
+    double elapsed_ms = 0;      ///< Time spent in detect()
+};
+
+/// @brief Finds and measures stars in a frame.
+///
+/// The sky background and its RMS are estimated per tile with one round of
+/// sigma clipping. Pixels above `threshold` times the local RMS are grouped
+/// into connected components, and the largest components are measured in
+/// parallel until either `max_stars` have been measured or the time budget
+/// is exhausted.
+class StarDetector {
+
+protected:
+    double mThreshold = 5;
+    int mTileSize = 64;
+    int mMinArea = 5;
+    size_t mMaxStars = 500;
+    double mTimeBudgetMs = 250;
+
+    void estimateBackground(const cv::Mat & image, cv::Mat & bkg_tiles, cv::Mat & rms_tiles) const;
+    cv::Mat thresholdImage(const cv::Mat & image, const cv::Mat & bkg_tiles, const cv::Mat & rms_tiles) const;
+    bool measureStar(const cv::Mat & image, const cv::Rect & box, float background, Star & star) const;
+
+public:
+    /// @brief Creates a detector.
+    /// @param threshold Detection threshold in units of the background RMS.
+    /// @param tile_size Side length of the background estimation tiles (pixels).
+    /// @param min_area Smallest number of connected pixels accepted as a star.
+    /// @param max_stars Largest number of stars measured per frame.
+    /// @param time_budget_ms Time after which no further stars are measured.
+    StarDetector(double threshold, int tile_size, int min_area, size_t max_stars, double time_budget_ms);
+
+    /// @brief Detects and measures the stars in a frame.
+    /// @param image A single or three channel image of any depth.
+    StarField detect(const cv::Mat & image) const;
+
+    /// @brief Writes the measured stars to a CSV file.
+    /// @return false if the file could not be written.
+    static bool writeStarList(const StarField & field, const std::string & filename);
+};
+
+#endif // STAR_DETECTION_H
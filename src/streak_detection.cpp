@@ -0,0 +1,352 @@
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <mutex>
+#include <numeric>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "streak_detection.hpp"
+
+namespace {
+/// Components no larger than this, in binned pixels, are treated as stars and removed.
+const int STAR_MAX_EXTENT = 8;
+
+/// Side length of the background estimation cells, in binned pixels.
+const int BACKGROUND_CELL = 32;
+
+/// Overlap between neighbouring Hough tiles, in binned pixels.
+const int TILE_OVERLAP = 16;
+
+/// Largest number of Hough segments considered for merging.
+const size_t MAX_SEGMENTS = 1000;
+
+/// Segments within this angle (degrees), distance and gap (binned pixels) are merged.
+const double MERGE_ANGLE = 3.0;
+const double MERGE_DISTANCE = 3.0;
+const double MERGE_GAP = 10.0;
+
+/// Half width of the strip used to measure streak flux, in binned pixels.
+const double FLUX_HALF_WIDTH = 2.0;
+
+double segmentLength(const cv::Vec4f & s) {
+    return std::hypot(s[2] - s[0], s[3] - s[1]);
+}
+
+double segmentAngle(const cv::Vec4f & s) {
+    double angle = std::atan2(s[3] - s[1], s[2] - s[0]) * 180.0 / M_PI;
+    if(angle < 0)
+        angle += 180;
+    if(angle >= 180)
+        angle -= 180;
+    return angle;
+}
+
+/// Whether b lies along a, the longer segment, within MERGE_DISTANCE of its
+/// line and no further than MERGE_GAP beyond its ends.
+bool collinear(const cv::Vec4f & a, const cv::Vec4f & b) {
+
+    double length_a = segmentLength(a);
+    if(length_a <= 0)
+        return false;
+
+    // Unit direction and normal of segment a.
+    double dx = (a[2] - a[0]) / length_a;
+    double dy = (a[3] - a[1]) / length_a;
+
+    double d1 = std::fabs(-dy * (b[0] - a[0]) + dx * (b[1] - a[1]));
+    double d2 = std::fabs(-dy * (b[2] - a[0]) + dx * (b[3] - a[1]));
+    if(d1 > MERGE_DISTANCE || d2 > MERGE_DISTANCE)
+        return false;
+
+    // Positions of b's endpoints along a.
+    double t1 = dx * (b[0] - a[0]) + dy * (b[1] - a[1]);
+    double t2 = dx * (b[2] - a[0]) + dy * (b[3] - a[1]);
+    double gap = std::max(std::min(t1, t2) - length_a, -std::max(t1, t2));
+    return gap <= MERGE_GAP;
+}
+
+/// Returns the root of a union-find set, halving the path on the way.
+int findRoot(std::vector<int> & parent, int i) {
+    while(parent[i] != i) {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+}
+
+StreakDetector::StreakDetector(int bin, double threshold, double min_length, int tile_size, size_t max_streaks)
+    : mBin(std::max(bin, 1)), mThreshold(threshold), mMinLength(min_length),
+      mTileSize(std::max(tile_size, 2 * TILE_OVERLAP)), mMaxStreaks(max_streaks) {
+}
+
+cv::Mat StreakDetector::binnedImage(const cv::Mat & image) const {
+
+    cv::Mat gray;
+    if(image.channels() == 3)
+        cv::cvtColor(image, gray, cv::COLOR_BGR2GRAY);
+    else
+        gray = image;
+
+    cv::Mat binned;
+    if(mBin > 1)
+        cv::resize(gray, binned, cv::Size(gray.cols / mBin, gray.rows / mBin), 0, 0, cv::INTER_AREA);
+    else
+        binned = gray;
+
+    cv::Mat result;
+    binned.convertTo(result, CV_32F);
+    return result;
+}
+
+cv::Mat StreakDetector::subtractBackground(const cv::Mat & binned, double & rms) const {
+
+    // A coarse grid of cell means, interpolated back to full size, follows
+    // gradients from the moon and light pollution without following streaks.
+    cv::Mat cells;
+    cv::Size grid(std::max(binned.cols / BACKGROUND_CELL, 1), std::max(binned.rows / BACKGROUND_CELL, 1));
+    cv::resize(binned, cells, grid, 0, 0, cv::INTER_AREA);
+
+    cv::Mat background;
+    cv::resize(cells, background, binned.size(), 0, 0, cv::INTER_LINEAR);
+
+    cv::Mat residual = binned - background;
+
+    // Estimate the noise with stars and streaks clipped out.
+    cv::Scalar mean, stddev;
+    cv::meanStdDev(residual, mean, stddev);
+    cv::Mat clip_mask = cv::abs(residual) < 3 * stddev[0];
+    cv::meanStdDev(residual, mean, stddev, clip_mask);
+    rms = stddev[0];
+
+    return residual;
+}
+
+cv::Mat StreakDetector::streakMask(const cv::Mat & residual, double rms) const {
+
+    cv::Mat mask = residual > mThreshold * rms;
+
+    // Remove compact components so stars do not feed the Hough transform.
+    cv::Mat labels, stats, centroids;
+    int num_labels = cv::connectedComponentsWithStats(mask, labels, stats, centroids, 8, CV_32S);
+
+    std::vector<uchar> keep(num_labels, 0);
+    for(int label = 1; label < num_labels; label++) {
+        int extent = std::max(stats.at<int>(label, cv::CC_STAT_WIDTH), stats.at<int>(label, cv::CC_STAT_HEIGHT));
+        keep[label] = (extent > STAR_MAX_EXTENT) ? 255 : 0;
+    }
+
+    cv::parallel_for_(cv::Range(0, mask.rows), [&](const cv::Range & range) {
+        for(int y = range.start; y < range.end; y++) {
+            const int * label = labels.ptr<int>(y);
+            uchar * out = mask.ptr<uchar>(y);
+            for(int x = 0; x < mask.cols; x++)
+                out[x] = keep[label[x]];
+        }
+    });
+
+    return mask;
+}
+
+std::vector<cv::Vec4f> StreakDetector::houghSegments(const cv::Mat & mask) const {
+
+    const int tiles_x = (mask.cols + mTileSize - 1) / mTileSize;
+    const int tiles_y = (mask.rows + mTileSize - 1) / mTileSize;
+
+    // Segments crossing tile edges are cut, so accept shorter pieces within a
+    // tile and rely on the merge step to join them.
+    const double min_length = std::min(mMinLength / mBin, mTileSize / 4.0);
+    const int votes = std::max(10, (int) (min_length / 2));
+
+    std::vector<cv::Vec4f> segments;
+    std::mutex segments_mutex;
+
+    cv::parallel_for_(cv::Range(0, tiles_x * tiles_y), [&](const cv::Range & range) {
+        std::vector<cv::Vec4i> lines;
+        for(int tile = range.start; tile < range.end; tile++) {
+            int x0 = (tile % tiles_x) * mTileSize;
+            int y0 = (tile / tiles_x) * mTileSize;
+            cv::Rect roi(x0 - TILE_OVERLAP, y0 - TILE_OVERLAP, mTileSize + 2 * TILE_OVERLAP, mTileSize + 2 * TILE_OVERLAP);
+            roi &= cv::Rect(0, 0, mask.cols, mask.rows);
+
+            cv::Mat tile_mask = mask(roi);
+            if(cv::countNonZero(tile_mask) == 0)
+                continue;
+
+            lines.clear();
+            cv::HoughLinesP(tile_mask, lines, 1, CV_PI / 180, votes, min_length, 5);
+
+            std::lock_guard<std::mutex> lock(segments_mutex);
+            for(const cv::Vec4i & line : lines) {
+                segments.push_back(cv::Vec4f(line[0] + roi.x, line[1] + roi.y,
+                                             line[2] + roi.x, line[3] + roi.y));
+            }
+        }
+    });
+
+    return segments;
+}
+
+std::vector<cv::Vec4f> StreakDetector::mergeSegments(std::vector<cv::Vec4f> segments) const {
+
+    // Longest first, so a lower index is never a shorter segment.
+    std::sort(segments.begin(), segments.end(), [](const cv::Vec4f & a, const cv::Vec4f & b) {
+        return segmentLength(a) > segmentLength(b);
+    });
+    if(segments.size() > MAX_SEGMENTS)
+        segments.resize(MAX_SEGMENTS);
+    const int num_segments = segments.size();
+
+    // Sort by angle so only segments within MERGE_ANGLE of each other are
+    // compared. Segments near 0 degrees are repeated at +180 so that they pair
+    // with those just below 180.
+    std::vector<std::pair<double, int>> by_angle;
+    for(int i = 0; i < num_segments; i++) {
+        double angle = segmentAngle(segments[i]);
+        by_angle.push_back({angle, i});
+        if(angle < MERGE_ANGLE)
+            by_angle.push_back({angle + 180, i});
+    }
+    std::sort(by_angle.begin(), by_angle.end());
+
+    // Join every collinear pair. The root of a set is its longest segment.
+    std::vector<int> parent(num_segments);
+    std::iota(parent.begin(), parent.end(), 0);
+    for(size_t i = 0; i < by_angle.size(); i++) {
+        for(size_t j = i + 1; j < by_angle.size() && by_angle[j].first - by_angle[i].first <= MERGE_ANGLE; j++) {
+            int a = std::min(by_angle[i].second, by_angle[j].second);
+            int b = std::max(by_angle[i].second, by_angle[j].second);
+            if(a == b || !collinear(segments[a], segments[b]))
+                continue;
+
+            int root_a = findRoot(parent, a);
+            int root_b = findRoot(parent, b);
+            if(root_a != root_b)
+                parent[std::max(root_a, root_b)] = std::min(root_a, root_b);
+        }
+    }
+
+    // Extend each root along its own line to cover the endpoints of its set.
+    std::vector<double> t_min(num_segments, 0.0);
+    std::vector<double> t_max(num_segments);
+    for(int i = 0; i < num_segments; i++)
+        t_max[i] = segmentLength(segments[i]);
+
+    for(int i = 0; i < num_segments; i++) {
+        int root = findRoot(parent, i);
+        if(root == i)
+            continue;
+
+        const cv::Vec4f & a = segments[root];
+        const cv::Vec4f & b = segments[i];
+        double length_a = segmentLength(a);
+        double dx = (a[2] - a[0]) / length_a;
+        double dy = (a[3] - a[1]) / length_a;
+        double t1 = dx * (b[0] - a[0]) + dy * (b[1] - a[1]);
+        double t2 = dx * (b[2] - a[0]) + dy * (b[3] - a[1]);
+        t_min[root] = std::min({t_min[root], t1, t2});
+        t_max[root] = std::max({t_max[root], t1, t2});
+    }
+
+    std::vector<cv::Vec4f> merged;
+    for(int i = 0; i < num_segments; i++) {
+        if(parent[i] != i)
+            continue;
+
+        const cv::Vec4f & a = segments[i];
+        double length_a = segmentLength(a);
+        if(length_a <= 0) {
+            merged.push_back(a);
+            continue;
+        }
+        double dx = (a[2] - a[0]) / length_a;
+        double dy = (a[3] - a[1]) / length_a;
+        merged.push_back(cv::Vec4f(a[0] + t_min[i] * dx, a[1] + t_min[i] * dy,
+                                   a[0] + t_max[i] * dx, a[1] + t_max[i] * dy));
+    }
+
+    // Merging lengthened the segments, so restore the longest first order detect() truncates by.
+    std::sort(merged.begin(), merged.end(), [](const cv::Vec4f & a, const cv::Vec4f & b) {
+        return segmentLength(a) > segmentLength(b);
+    });
+
+    return merged;
+}
+
+double StreakDetector::streakFlux(const cv::Mat & residual, const cv::Vec4f & segment) const {
+
+    double length = segmentLength(segment);
+    if(length <= 0)
+        return 0;
+
+    double dx = (segment[2] - segment[0]) / length;
+    double dy = (segment[3] - segment[1]) / length;
+
+    int x0 = std::max((int) std::floor(std::min(segment[0], segment[2]) - FLUX_HALF_WIDTH), 0);
+    int x1 = std::min((int) std::ceil(std::max(segment[0], segment[2]) + FLUX_HALF_WIDTH) + 1, residual.cols);
+    int y0 = std::max((int) std::floor(std::min(segment[1], segment[3]) - FLUX_HALF_WIDTH), 0);
+    int y1 = std::min((int) std::ceil(std::max(segment[1], segment[3]) + FLUX_HALF_WIDTH) + 1, residual.rows);
+
+    double flux = 0;
+    for(int y = y0; y < y1; y++) {
+        const float * row = residual.ptr<float>(y);
+        for(int x = x0; x < x1; x++) {
+            double t = dx * (x - segment[0]) + dy * (y - segment[1]);
+            double d = -dy * (x - segment[0]) + dx * (y - segment[1]);
+            if(t >= 0 && t <= length && std::fabs(d) <= FLUX_HALF_WIDTH)
+                flux += row[x];
+        }
+    }
+
+    // Each binned pixel is the average of mBin x mBin pixels.
+    return flux * mBin * mBin;
+}
+
+std::vector<Streak> StreakDetector::detect(const cv::Mat & image) const {
+
+    cv::Mat binned = binnedImage(image);
+
+    double rms = 0;
+    cv::Mat residual = subtractBackground(binned, rms);
+    cv::Mat mask = streakMask(residual, rms);
+    std::vector<cv::Vec4f> segments = mergeSegments(houghSegments(mask));
+
+    std::vector<Streak> streaks;
+    for(const cv::Vec4f & segment : segments) {
+        double length = segmentLength(segment) * mBin;
+        if(length < mMinLength)
+            continue;
+
+        Streak streak;
+        streak.x1 = (segment[0] + 0.5) * mBin - 0.5;
+        streak.y1 = (segment[1] + 0.5) * mBin - 0.5;
+        streak.x2 = (segment[2] + 0.5) * mBin - 0.5;
+        streak.y2 = (segment[3] + 0.5) * mBin - 0.5;
+        streak.length = length;
+        streak.angle = segmentAngle(segment);
+        streak.flux = streakFlux(residual, segment);
+        streaks.push_back(streak);
+
+        if(streaks.size() >= mMaxStreaks)
+            break;
+    }
+
+    return streaks;
+}
+
+bool StreakDetector::writeStreakList(const std::vector<Streak> & streaks, const std::string & filename) {
+
+    std::ofstream out(filename);
+    if(!out)
+        return false;
+
+    out << "x1,y1,x2,y2,length,angle,flux\n";
+    for(const Streak & streak : streaks) {
+        out << streak.x1 << "," << streak.y1 << "," << streak.x2 << "," << streak.y2 << ","
+            << streak.length << "," << streak.angle << "," << streak.flux << "\n";
+    }
+
+    return out.good();
+}
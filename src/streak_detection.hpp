@@ -0,0 +1,52 @@
+#ifndef STREAK_DETECTION_H
+#define STREAK_DETECTION_H
+
+#include <string>
+#include <vector>
+
+#include <opencv2/core/mat.hpp>
+
+#include "cvfits.hpp"
+
+/// @brief Finds linear streaks, such as satellite and debris tracks, in a frame.
+///
+/// The frame is binned, background subtracted and thresholded. Compact
+/// sources are removed from the mask, the remainder is searched with a
+/// probabilistic Hough transform in parallel tiles, and segments that lie on
+/// the same line are merged across tile boundaries.
+class StreakDetector {
+
+protected:
+    int mBin = 4;
+    double mThreshold = 3;
+    double mMinLength = 100;
+    int mTileSize = 256;
+    size_t mMaxStreaks = 20;
+
+    cv::Mat binnedImage(const cv::Mat & image) const;
+    cv::Mat subtractBackground(const cv::Mat & binned, double & rms) const;
+    cv::Mat streakMask(const cv::Mat & residual, double rms) const;
+    std::vector<cv::Vec4f> houghSegments(const cv::Mat & mask) const;
+    std::vector<cv::Vec4f> mergeSegments(std::vector<cv::Vec4f> segments) const;
+    double streakFlux(const cv::Mat & residual, const cv::Vec4f & segment) const;
+
+public:
+    /// @brief Creates a detector.
+    /// @param bin Binning factor applied before the search.
+    /// @param threshold Detection threshold in units of the background RMS.
+    /// @param min_length Shortest streak reported, in full resolution pixels.
+    /// @param tile_size Side length of the Hough search tiles, in binned pixels.
+    /// @param max_streaks Largest number of streaks reported per frame.
+    StreakDetector(int bin, double threshold, double min_length, int tile_size, size_t max_streaks);
+
+    /// @brief Finds the streaks in a frame.
+    /// @param image A single or three channel image of any depth.
+    /// @return Streaks in full resolution pixel coordinates, longest first.
+    std::vector<Streak> detect(const cv::Mat & image) const;
+
+    /// @brief Writes streaks to a CSV file.
+    /// @return false if the file could not be written.
+    static bool writeStreakList(const std::vector<Streak> & streaks, const std::string & filename);
+};
+
+#endif // STREAK_DETECTION_H
@@ -0,0 +1,96 @@
+#include <QDateTime>
+#include <QDir>
+#include <QFileInfo>
+#include <QSettings>
+
+#include <algorithm>
+#include <cmath>
+
+#include "usb_tuner.hpp"
+#include "cli_parser.hpp"
+
+void USBTuningResult::addReadout(double ms, bool ok) {
+    readout_ms = (readout_ms * frames + ms) / (frames + 1);
+    readout_max_ms = std::max(readout_max_ms, ms);
+    frames++;
+    if(!ok)
+        errors++;
+}
+
+std::vector<int> usbTrafficSweep(const ControlRange & range, int max_steps) {
+    int lowest = (int) std::ceil(range.min);
+    int highest = (int) std::floor(range.max);
+    int step = std::max(1, (int) range.step);
+    if(highest < lowest || max_steps < 1)
+        return {lowest};
+
+    // Widen the step, keeping it a multiple of the control's step, until the sweep fits.
+    if(max_steps > 1) {
+        int span = highest - lowest;
+        int needed = (span + max_steps - 2) / (max_steps - 1);
+        step *= std::max(1, (needed + step - 1) / step);
+    }
+
+    std::vector<int> values;
+    for(int value = lowest; value <= highest && (int) values.size() < max_steps; value += step)
+        values.push_back(value);
+    return values;
+}
+
+int untransferredRows(const cv::Mat & frame) {
+    const size_t row_bytes = frame.cols * frame.elemSize();
+    int rows = 0;
+    for(int y = frame.rows - 1; y >= 0; y--) {
+        const uint8_t * row = frame.ptr<uint8_t>(y);
+        bool untouched = std::all_of(row, row + row_bytes, [](uint8_t b) { return b == USB_TUNER_SENTINEL; });
+        if(!untouched)
+            break;
+        rows++;
+    }
+    return rows;
+}
+
+int selectUSBTuning(const std::vector<USBTuningResult> & results) {
+    int best_stable = -1;
+    int best_any = -1;
+    for(size_t i = 0; i < results.size(); i++) {
+        if(results[i].frames == 0 || results[i].errors > 0)
+            continue;
+
+        if(best_any < 0 || results[i].fps > results[best_any].fps)
+            best_any = i;
+
+        bool stable = (i == 0 || results[i - 1].errors == 0);
+        if(stable && (best_stable < 0 || results[i].fps > results[best_stable].fps))
+            best_stable = i;
+    }
+
+    return (best_stable >= 0) ? best_stable : best_any;
+}
+
+bool saveUSBTuning(const QString & file, const QString & camera_id, const USBTuningResult & result) {
+    QDir().mkpath(QFileInfo(file).absolutePath());
+
+    QSettings settings(file, QSettings::IniFormat);
+    settings.beginGroup(usbTuningGroup(camera_id, result.transfer_bits, result.bin_mode));
+    settings.setValue("usb-traffic", result.usb_traffic);
+    settings.setValue("readout-ms", result.readout_ms);
+    settings.setValue("fps", result.fps);
+    settings.setValue("frames", result.frames);
+    settings.setValue("tuned", QDateTime::currentDateTimeUtc().toString(Qt::ISODate));
+    settings.endGroup();
+    settings.sync();
+
+    return settings.status() == QSettings::NoError;
+}
+
+bool loadUSBTuning(const QString & file, const QString & camera_id, int transfer_bits, const QString & bin_mode,
+                   int & usb_traffic) {
+    QSettings settings(file, QSettings::IniFormat);
+    QVariant tuned = settings.value(usbTuningGroup(camera_id, transfer_bits, bin_mode) + "/usb-traffic");
+    if(!tuned.isValid())
+        return false;
+
+    usb_traffic = tuned.toInt();
+    return true;
+}
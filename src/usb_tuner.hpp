@@ -0,0 +1,62 @@
+#ifndef USB_TUNER_H
+#define USB_TUNER_H
+
+#include <cstdint>
+#include <vector>
+
+#include <QString>
+
+#include <opencv2/core/mat.hpp>
+
+#include "camera_profile.hpp"
+
+/// Written to the frame buffer before every readout. Rows that still hold it
+/// afterwards were never transferred.
+const uint8_t USB_TUNER_SENTINEL = 0xA5;
+
+/// Measurements of one USB traffic setting.
+struct USBTuningResult {
+    int usb_traffic = 0;
+    int transfer_bits = 16;
+    QString bin_mode;
+    int frames = 0;             ///< Frames attempted
+    int errors = 0;             ///< Failed, mis-sized or truncated readouts
+    double readout_ms = 0;      ///< Mean duration of GetQHYCCDSingleFrame
+    double readout_max_ms = 0;  ///< Slowest GetQHYCCDSingleFrame
+    double fps = 0;             ///< Sustained frames per second, exposure included
+
+    /// Records the readout time of a frame.
+    void addReadout(double ms, bool ok);
+};
+
+/// @brief Picks the CONTROL_USBTRAFFIC values to measure.
+/// @param range The control limits from the camera profile.
+/// @param max_steps Largest number of values returned.
+/// \return Values from the lowest (fastest) to the highest traffic setting.
+std::vector<int> usbTrafficSweep(const ControlRange & range, int max_steps);
+
+/// \return The number of rows at the end of the frame that still hold the sentinel.
+int untransferredRows(const cv::Mat & frame);
+
+/// @brief Picks the fastest setting that is stable.
+///
+/// Lower traffic values read out faster until the transfer starts to fail. A
+/// setting is stable if it and the next lower value had no errors, so it is
+/// not at the edge where readouts fail once the host gets busier. The lowest
+/// value is stable if it had no errors. If no setting qualifies, the fastest
+/// error-free one is used.
+/// @param results Measurements ordered by increasing usb_traffic.
+/// \return Index into results, or -1 if every setting had errors.
+int selectUSBTuning(const std::vector<USBTuningResult> & results);
+
+/// @brief Stores a result in the tuning file under this host, camera, transfer bits and bin mode.
+bool saveUSBTuning(const QString & file, const QString & camera_id, const USBTuningResult & result);
+
+/// @brief Looks up the setting saveUSBTuning stored.
+/// @param bin_mode The bin mode setCameraBinMode applied, which may differ from the one requested.
+/// @param usb_traffic Returns the stored CONTROL_USBTRAFFIC value.
+/// \return true if a setting is stored for this host, camera, transfer bits and bin mode.
+bool loadUSBTuning(const QString & file, const QString & camera_id, int transfer_bits, const QString & bin_mode,
+                   int & usb_traffic);
+
+#endif // USB_TUNER_H